@@ -0,0 +1,126 @@
+// The two envelope encodings side by side: JSON text frames, as every
+// phi-core-ws.v1 client gets them, and the CBOR frames of phi-core-ws.v1+cbor
+// (cborcodec.h).
+//
+// Per envelope shape, the wire size of each encoding and what a frame
+// costs each way. Outbound, a text frame is the QString conversion the shard
+// makes once per event; a CBOR frame is the transcode it makes instead.
+// Inbound, both end at the same envelope scan. That the transcoder agrees with
+// QCborValue is checked by tests/test_cborcodec.
+
+#include "cborcodec.h"
+#include "inboundenvelope.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr int kTimedRounds = 2000;
+
+std::string channelEvent()
+{
+    return R"({"type":"event","topic":"event.channel.stateChanged","payload":{"deviceId":"hue-bridge-1/light-17",)"
+           R"("channelId":"brightness","value":73,"ts":1787300000123}})";
+}
+
+// A chunk of a high-rate stream: samples as numbers, which is where text
+// spends the most bytes.
+std::string streamChunk(int samples)
+{
+    std::string out = R"({"type":"event","topic":"stream.sensor.samples","payload":{"streamId":"s-4",)"
+                      R"("seq":18231,"t0":1787300000000,"dtMs":10,"values":[)";
+    for (int i = 0; i < samples; ++i) {
+        if (i > 0)
+            out += ',';
+        out += std::to_string(20.0 + (i % 37) * 0.125);
+    }
+    out += "]}}";
+    return out;
+}
+
+std::string commandFrame()
+{
+    return R"({"type":"cmd","cid":4711,"topic":"cmd.channel.set",)"
+           R"("payload":{"deviceId":"hue-bridge-1/light-17","channelId":"brightness","value":40}})";
+}
+
+template <typename Work>
+double timeUs(Work &&work)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int round = 0; round < kTimedRounds; ++round)
+        work();
+    return static_cast<double>(timer.nsecsElapsed()) / kTimedRounds / 1000.0;
+}
+
+void measure()
+{
+    struct Shape {
+        const char *name;
+        std::string json;
+    };
+    const Shape shapes[] = {
+        {"channel event", channelEvent()},
+        {"stream 64", streamChunk(64)},
+        {"stream 1024", streamChunk(1024)},
+        {"cmd frame", commandFrame()},
+    };
+
+    std::printf("%-14s %8s %8s %12s %12s %12s %12s\n",
+                "envelope", "json B", "cbor B", "text out us", "cbor out us", "text in us", "cbor in us");
+    for (const Shape &shape : shapes) {
+        std::string encoded;
+        cbor::fromJson(shape.json, &encoded);
+        const QByteArray utf8 = QByteArray::fromStdString(shape.json);
+        const QString text = QString::fromUtf8(utf8);
+        const QByteArray binary = QByteArray::fromStdString(encoded);
+        volatile qsizetype sink = 0;
+
+        const double textOutUs = timeUs([&]() { sink += QString::fromUtf8(utf8).size(); });
+        const double cborOutUs = timeUs([&]() {
+            std::string bytes;
+            cbor::fromJson(shape.json, &bytes);
+            sink += QByteArray::fromStdString(bytes).size();
+        });
+        const double textInUs = timeUs([&]() {
+            const QByteArray frame = text.toUtf8();
+            InboundEnvelope envelope;
+            scanInboundEnvelope(std::string_view(frame.constData(), static_cast<std::size_t>(frame.size())),
+                                &envelope);
+            sink += static_cast<qsizetype>(envelope.topic.size());
+        });
+        const double cborInUs = timeUs([&]() {
+            std::string json;
+            cbor::toJson(std::string_view(binary.constData(), static_cast<std::size_t>(binary.size())), &json);
+            InboundEnvelope envelope;
+            scanInboundEnvelope(json, &envelope);
+            sink += static_cast<qsizetype>(envelope.topic.size());
+        });
+
+        std::printf("%-14s %8zu %8zu %12.2f %12.2f %12.2f %12.2f\n",
+                    shape.name,
+                    shape.json.size(),
+                    encoded.size(),
+                    textOutUs,
+                    cborOutUs,
+                    textInUs,
+                    cborInUs);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    measure();
+    return 0;
+}
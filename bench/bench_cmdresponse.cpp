@@ -0,0 +1,101 @@
+// cmd.response payload assembly: the QJsonObject round trip sendCmdResponse
+// used to make for every result, against the splice that replaced it
+// (cmdresponse.h), on history-sized results. That the two agree is checked by
+// tests/test_cmdresponse.
+
+#include "cmdresponse.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QString>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::string_view kCmdTopic = "cmd.history.query";
+constexpr int kTimedRounds = 20;
+
+// sendCmdResponse as it was, minus the send. Compared as objects, not as
+// text: key order and number spelling were the old code's, not the protocol's.
+QJsonObject referenceObject(std::string_view payloadJson, const QString &cmdTopic)
+{
+    QJsonObject out =
+        QJsonDocument::fromJson(QByteArray::fromRawData(payloadJson.data(),
+                                                       static_cast<qsizetype>(payloadJson.size())))
+            .object();
+    out.insert(QStringLiteral("cmd"), cmdTopic);
+    if (!out.contains(QStringLiteral("error")))
+        out.insert(QStringLiteral("error"), QJsonValue::Null);
+    return out;
+}
+
+QByteArray referencePayload(std::string_view payloadJson, const QString &cmdTopic)
+{
+    return QJsonDocument(referenceObject(payloadJson, cmdTopic)).toJson(QJsonDocument::Compact);
+}
+
+// A history query's worth of samples.
+std::string historyResult(int samples)
+{
+    std::string out = R"({"deviceId":"hue-bridge-1/light-17","channelId":"brightness","items":[)";
+    for (int i = 0; i < samples; ++i) {
+        if (i > 0)
+            out += ',';
+        out += R"({"ts":)";
+        out += std::to_string(1787300000000LL + i * 1000LL);
+        out += R"(,"value":)";
+        out += std::to_string(i % 101);
+        out += R"(,"quality":"good"})";
+    }
+    out += R"(],"total":)";
+    out += std::to_string(samples);
+    out += '}';
+    return out;
+}
+
+void measure()
+{
+    const QString cmdTopic = QString::fromUtf8(kCmdTopic.data(), static_cast<qsizetype>(kCmdTopic.size()));
+    std::printf("%10s %12s %16s %16s %10s\n", "samples", "bytes", "parse+write us", "splice us", "speedup");
+    for (const int samples : {10, 1000, 10000, 100000}) {
+        const std::string input = historyResult(samples);
+
+        QElapsedTimer timer;
+        timer.start();
+        volatile qsizetype sink = 0;
+        for (int round = 0; round < kTimedRounds; ++round)
+            sink += referencePayload(input, cmdTopic).size();
+        const double referenceUs = static_cast<double>(timer.nsecsElapsed()) / kTimedRounds / 1000.0;
+
+        timer.restart();
+        std::string out;
+        for (int round = 0; round < kTimedRounds; ++round) {
+            spliceCmdResponsePayload(input, kCmdTopic, &out);
+            sink += static_cast<qsizetype>(out.size());
+        }
+        const double spliceUs = static_cast<double>(timer.nsecsElapsed()) / kTimedRounds / 1000.0;
+
+        std::printf("%10d %12zu %16.1f %16.1f %10.1f\n",
+                    samples,
+                    input.size(),
+                    referenceUs,
+                    spliceUs,
+                    spliceUs > 0.0 ? referenceUs / spliceUs : 0.0);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    measure();
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Event fan-out against N loopback clients: the envelope built once per
+// recipient, as broadcastEvent used to do it, against one frame built once per
+// event and shared by every socket. Only the sending side is timed - that is the
+// part that runs inside core's event callback.
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include <QString>
+#include <QUrl>
+#include <QWebSocket>
+#include <QWebSocketServer>
+
+#include <cstdio>
+#include <string_view>
+
+#include <transportinterface.h>
+
+using namespace phicore::transport;
+
+namespace {
+
+constexpr std::string_view kTopic = "event.channel.stateChanged";
+constexpr std::string_view kPayload =
+    R"({"deviceId":"hue-bridge-1/light-17","channelId":"brightness","value":73,)"
+    R"("ts":1787300000123,"quality":"good"})";
+constexpr int kEventsPerRound = 200;
+constexpr int kClientCounts[] = {1, 10, 100, 500};
+
+struct Loopback {
+    QWebSocketServer server{QStringLiteral("bench_fanout"), QWebSocketServer::NonSecureMode};
+    QList<QWebSocket *> accepted;
+    QList<QWebSocket *> clients;
+};
+
+bool connectClients(Loopback &loopback, int count)
+{
+    const QUrl url(QStringLiteral("ws://127.0.0.1:%1").arg(loopback.server.serverPort()));
+    while (loopback.clients.size() < count) {
+        auto *client = new QWebSocket;
+        client->open(url);
+        loopback.clients.append(client);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    while (loopback.accepted.size() < count && timer.elapsed() < 30000)
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    return loopback.accepted.size() >= count;
+}
+
+// Lets the sockets write out what the last round queued, so one round's
+// backlog does not show up in the next one's numbers.
+void drain(const Loopback &loopback)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        qint64 pending = 0;
+        for (const QWebSocket *socket : loopback.accepted)
+            pending += socket->bytesToWrite();
+        if (pending == 0 || timer.elapsed() > 30000)
+            return;
+    }
+}
+
+QString encode()
+{
+    const JsonText out = makeEnvelope(kEnvelopeTypeEvent, kTopic, std::nullopt, kPayload);
+    return QString::fromUtf8(out.data(), static_cast<qsizetype>(out.size()));
+}
+
+qint64 runPerRecipient(const QList<QWebSocket *> &sockets)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int event = 0; event < kEventsPerRound; ++event) {
+        for (QWebSocket *socket : sockets)
+            socket->sendTextMessage(encode());
+    }
+    return timer.nsecsElapsed();
+}
+
+qint64 runShared(const QList<QWebSocket *> &sockets)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int event = 0; event < kEventsPerRound; ++event) {
+        const QString frame = encode();
+        for (QWebSocket *socket : sockets)
+            socket->sendTextMessage(frame);
+    }
+    return timer.nsecsElapsed();
+}
+
+qint64 runEncodeOnly()
+{
+    QElapsedTimer timer;
+    timer.start();
+    qsizetype sink = 0;
+    for (int event = 0; event < kEventsPerRound; ++event)
+        sink += encode().size();
+    const qint64 elapsed = timer.nsecsElapsed();
+    return sink > 0 ? elapsed : 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    Loopback loopback;
+    QObject::connect(&loopback.server, &QWebSocketServer::newConnection, [&loopback]() {
+        while (loopback.server.hasPendingConnections())
+            loopback.accepted.append(loopback.server.nextPendingConnection());
+    });
+    if (!loopback.server.listen(QHostAddress::LocalHost, 0)) {
+        std::fprintf(stderr, "listen failed: %s\n", qPrintable(loopback.server.errorString()));
+        return 1;
+    }
+
+    const double encodeUs = static_cast<double>(runEncodeOnly()) / kEventsPerRound / 1000.0;
+    std::printf("encode: %.2f us/event\n", encodeUs);
+    std::printf("%8s %22s %22s %18s\n", "clients", "per-recipient us/evt", "shared us/evt", "encode share %");
+    for (const int count : kClientCounts) {
+        if (!connectClients(loopback, count)) {
+            std::fprintf(stderr, "only %lld of %d clients connected\n",
+                         static_cast<long long>(loopback.accepted.size()), count);
+            return 1;
+        }
+        const QList<QWebSocket *> sockets = loopback.accepted.mid(0, count);
+
+        drain(loopback);
+        const qint64 perRecipientNs = runPerRecipient(sockets);
+        drain(loopback);
+        const qint64 sharedNs = runShared(sockets);
+        drain(loopback);
+
+        const double perRecipientUs = static_cast<double>(perRecipientNs) / kEventsPerRound / 1000.0;
+        const double sharedUs = static_cast<double>(sharedNs) / kEventsPerRound / 1000.0;
+        std::printf("%8d %22.2f %22.2f %18.1f\n",
+                    count,
+                    perRecipientUs,
+                    sharedUs,
+                    sharedUs > 0.0 ? 100.0 * encodeUs / sharedUs : 0.0);
+    }
+
+    qDeleteAll(loopback.clients);
+    return 0;
+}
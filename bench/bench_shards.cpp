@@ -0,0 +1,272 @@
+// Broadcast throughput against the number of I/O shards: the same burst of
+// events published to N loopback clients with the shards on the caller's thread
+// (ioThreads=0) and on 1, 2, 4 and 8 threads of their own. Measures deliveries
+// per second, counted when the clients have read every frame, so the writing
+// side cannot hide behind Qt's socket buffers.
+//
+// The host here stands in for WsTransport: it answers the login every client
+// sends and otherwise gets out of the way. Clients run on threads of their own
+// so that reading the frames is not what is measured.
+
+#include "wsshard.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include <QString>
+#include <QTcpServer>
+#include <QThread>
+#include <QUrl>
+#include <QWebSocket>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::string_view kTopic = "event.channel.stateChanged";
+constexpr std::string_view kPayload =
+    R"({"deviceId":"hue-bridge-1/light-17","channelId":"brightness","value":73,)"
+    R"("ts":1787300000123,"quality":"good"})";
+constexpr int kDefaultClients = 400;
+constexpr int kEventsPerRound = 500;
+constexpr int kClientThreads = 4;
+constexpr int kIoThreadCounts[] = {0, 1, 2, 4, 8};
+
+// Logs every client in and answers nothing else; the commands are not what is
+// measured here. Called on the shard's thread, so it answers right there.
+class BenchHost final : public ShardHost
+{
+public:
+    QList<WsShard *> shards;
+
+    void submitCommand(ShardCommand command) override
+    {
+        ShardCommandResult result;
+        result.connectionId = command.connectionId;
+        result.cid = command.cid;
+        result.topic = command.topic;
+        result.requestClientId = command.requestClientId;
+        result.envelopeType.assign(kEnvelopeTypeResponse);
+        result.envelopeTopic = "sync.response";
+        result.payloadJson = R"({"token":"bench-token","sessionIdleSec":0})";
+        shards.at(command.shard)->completeCommand(result);
+    }
+    void submitBatch(quint64, std::vector<ShardCommand>) override {}
+    void connectionClosed(int, quint64, quint64) override {}
+    void logClientConnected(const QString &, int) override {}
+    void logClientDisconnected(const QString &, int) override {}
+    void logOriginRefused(const QString &) override {}
+    void logIdleTimeout(const QString &, qint64) override {}
+    void logSlowConsumer(const QString &, qint64, qint64, quint64) override {}
+};
+
+class Listener final : public QTcpServer
+{
+public:
+    QList<WsShard *> shards;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        WsShard *shard = shards.at(m_next++ % shards.size());
+        QMetaObject::invokeMethod(shard, [shard, socketDescriptor]() { shard->adoptConnection(socketDescriptor, {}); });
+    }
+
+private:
+    int m_next = 0;
+};
+
+struct Counters {
+    std::atomic<int> loggedIn{0};
+    std::atomic<qint64> delivered{0};
+};
+
+// Clients on one thread. The first frame a client reads is its login answer;
+// every one after that is an event.
+class ClientPool final : public QObject
+{
+public:
+    explicit ClientPool(Counters *counters)
+        : m_counters(counters)
+    {
+    }
+
+    void open(const QUrl &url, int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            auto *client = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this);
+            auto loggedIn = std::make_shared<bool>(false);
+            QObject::connect(client, &QWebSocket::connected, client, [client]() {
+                client->sendTextMessage(
+                    QStringLiteral(R"({"type":"cmd","topic":"sync.auth.login.set","cid":1,"payload":{}})"));
+            });
+            QObject::connect(client, &QWebSocket::textMessageReceived, client,
+                             [this, loggedIn](const QString &) {
+                if (!*loggedIn) {
+                    *loggedIn = true;
+                    m_counters->loggedIn.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                m_counters->delivered.fetch_add(1, std::memory_order_relaxed);
+            });
+            client->open(url);
+        }
+    }
+
+    void closeAll()
+    {
+        const QList<QWebSocket *> clients = findChildren<QWebSocket *>();
+        for (QWebSocket *client : clients)
+            client->abort();
+        qDeleteAll(clients);
+    }
+
+private:
+    Counters *m_counters;
+};
+
+bool waitFor(const std::function<bool()> &done, qint64 timeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!done()) {
+        if (timer.elapsed() > timeoutMs)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 5);
+    }
+    return true;
+}
+
+// One configuration end to end: shards up, clients in, one timed burst, down.
+// Returns deliveries per second, or a negative value when the run did not
+// complete.
+double run(int ioThreads, int clientCount)
+{
+    BenchHost host;
+    QList<QThread *> shardThreads;
+    ShardSettings settings;
+    settings.subprotocols = {QStringLiteral("phi-core-ws.v1")};
+    settings.outbound.budgetBytes = 64 * 1024 * 1024;
+    settings.outbound.maxQueuedFrames = 1000000;
+    settings.outbound.stallTimeoutMs = 600000;
+
+    const int shardCount = ioThreads == 0 ? 1 : ioThreads;
+    for (int i = 0; i < shardCount; ++i) {
+        auto *shard = new WsShard(i, 1, settings, &host);
+        if (ioThreads > 0) {
+            auto *thread = new QThread;
+            shard->moveToThread(thread);
+            QObject::connect(thread, &QThread::finished, shard, &QObject::deleteLater);
+            thread->start();
+            shardThreads.append(thread);
+            QMetaObject::invokeMethod(shard, &WsShard::open, Qt::BlockingQueuedConnection);
+        } else {
+            shard->open();
+        }
+        host.shards.append(shard);
+    }
+
+    Listener listener;
+    listener.shards = host.shards;
+    if (!listener.listen(QHostAddress::LocalHost, 0)) {
+        std::fprintf(stderr, "listen failed: %s\n", qPrintable(listener.errorString()));
+        return -1.0;
+    }
+
+    Counters counters;
+    QList<QThread *> clientThreads;
+    QList<ClientPool *> pools;
+    const QUrl url(QStringLiteral("ws://127.0.0.1:%1").arg(listener.serverPort()));
+    for (int i = 0; i < kClientThreads; ++i) {
+        auto *thread = new QThread;
+        auto *pool = new ClientPool(&counters);
+        pool->moveToThread(thread);
+        thread->start();
+        const int share = clientCount / kClientThreads + (i < clientCount % kClientThreads ? 1 : 0);
+        QMetaObject::invokeMethod(pool, [pool, url, share]() { pool->open(url, share); });
+        clientThreads.append(thread);
+        pools.append(pool);
+    }
+
+    double perSecond = -1.0;
+    if (waitFor([&]() { return counters.loggedIn.load() >= clientCount; }, 60000)) {
+        auto event = std::make_shared<SharedEvent>();
+        event->topic.assign(kTopic);
+        event->payloadJson.assign(kPayload);
+        event->envelopeJson = makeEnvelope(kEnvelopeTypeEvent, kTopic, std::nullopt, kPayload);
+        const std::shared_ptr<const SharedEvent> shared = event;
+        const qint64 expected = static_cast<qint64>(kEventsPerRound) * clientCount;
+
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < kEventsPerRound; ++i) {
+            for (WsShard *shard : std::as_const(host.shards))
+                QMetaObject::invokeMethod(shard, [shard, shared]() { shard->publishEvent(shared); });
+        }
+        if (waitFor([&]() { return counters.delivered.load() >= expected; }, 120000))
+            perSecond = static_cast<double>(expected) * 1e9 / static_cast<double>(timer.nsecsElapsed());
+    } else {
+        std::fprintf(stderr, "only %d of %d clients logged in\n", counters.loggedIn.load(), clientCount);
+    }
+
+    for (int i = 0; i < pools.size(); ++i) {
+        ClientPool *pool = pools.at(i);
+        QMetaObject::invokeMethod(pool, [pool]() { pool->closeAll(); }, Qt::BlockingQueuedConnection);
+        clientThreads.at(i)->quit();
+        clientThreads.at(i)->wait();
+        delete pool;
+        delete clientThreads.at(i);
+    }
+    listener.close();
+    for (WsShard *shard : std::as_const(host.shards)) {
+        const Qt::ConnectionType type =
+            shard->thread() == QThread::currentThread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+        QMetaObject::invokeMethod(shard, &WsShard::closeAll, type);
+    }
+    if (shardThreads.isEmpty())
+        qDeleteAll(host.shards);
+    for (QThread *thread : std::as_const(shardThreads)) {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    }
+    QCoreApplication::processEvents();
+    return perSecond;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    const int clientCount = argc > 1 ? std::atoi(argv[1]) : kDefaultClients;
+    if (clientCount < 1) {
+        std::fprintf(stderr, "usage: %s [clients]\n", argv[0]);
+        return 1;
+    }
+
+    std::printf("%d clients, %d events per round\n", clientCount, kEventsPerRound);
+    std::printf("%10s %20s %10s\n", "ioThreads", "deliveries/s", "speedup");
+    double baseline = 0.0;
+    for (const int ioThreads : kIoThreadCounts) {
+        const double perSecond = run(ioThreads, clientCount);
+        if (perSecond < 0.0) {
+            std::fprintf(stderr, "ioThreads=%d did not complete\n", ioThreads);
+            return 1;
+        }
+        if (baseline <= 0.0)
+            baseline = perSecond;
+        std::printf("%10d %20.0f %10.2f\n", ioThreads, perSecond, perSecond / baseline);
+    }
+    return 0;
+}
@@ -0,0 +1,222 @@
+// What a wss:// handshake costs the server, full and resumed (tlsengine.h).
+//
+// Generates a self-signed certificate, writes it and its key to a temporary
+// directory and loads them through tls::ServerContext, as the transport would
+// from its config. Client and server then talk through memory; nothing touches
+// the network, so the figures are CPU only.
+//
+// Checks before it measures: every configuration below must resume the
+// sessions it is offered back - by session ID, by ticket, on TLS 1.2 and 1.3 -
+// and application data must make it across both ways. Exits non-zero on the
+// first failure.
+//
+// Usage: bench_tls [handshakes]
+
+#include "tlsengine.h"
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+struct Files {
+    std::string certificate;
+    std::string privateKey;
+};
+
+// A P-256 key and a certificate for "localhost" signed with it, valid for a day.
+bool writeSelfSigned(const std::filesystem::path &directory, Files *files)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    if (!key || !certificate)
+        return false;
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 3600);
+    X509_set_pubkey(certificate, key);
+    X509_NAME *name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    const bool signedOk = X509_sign(certificate, key, EVP_sha256()) > 0;
+
+    files->certificate = (directory / "cert.pem").string();
+    files->privateKey = (directory / "key.pem").string();
+    FILE *certificateFile = std::fopen(files->certificate.c_str(), "w");
+    FILE *keyFile = std::fopen(files->privateKey.c_str(), "w");
+    const bool written = signedOk && certificateFile && keyFile && PEM_write_X509(certificateFile, certificate) == 1
+        && PEM_write_PrivateKey(keyFile, key, nullptr, nullptr, 0, nullptr, nullptr) == 1;
+    if (certificateFile)
+        std::fclose(certificateFile);
+    if (keyFile)
+        std::fclose(keyFile);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return written;
+}
+
+// Trusts exactly the generated certificate, so the client verifies the chain
+// as a real one would.
+SSL_CTX *clientContext(const Files &files, int version)
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(context, version);
+    SSL_CTX_set_max_proto_version(context, version);
+    SSL_CTX_load_verify_locations(context, files.certificate.c_str(), nullptr);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT);
+    return context;
+}
+
+// Shuttles bytes until both sides are established, then once more, so TLS 1.3
+// tickets reach the client.
+bool handshake(tls::Session &client, tls::Session &server)
+{
+    std::string wire;
+    std::string plain;
+    for (int round = 0; round < 8; ++round) {
+        client.takeOutgoing(&wire);
+        if (!server.feed(wire, &plain))
+            return false;
+        wire.clear();
+        server.takeOutgoing(&wire);
+        if (!client.feed(wire, &plain))
+            return false;
+        wire.clear();
+        if (client.isEstablished() && server.isEstablished() && server.pendingOutgoing() == 0
+            && client.pendingOutgoing() == 0) {
+            return plain.empty();
+        }
+    }
+    return false;
+}
+
+bool exchange(tls::Session &from, tls::Session &to, const std::string &message)
+{
+    std::string wire;
+    std::string plain;
+    if (!from.write(message))
+        return false;
+    from.takeOutgoing(&wire);
+    return to.feed(wire, &plain) && plain == message;
+}
+
+struct Case {
+    const char *name;
+    int version;
+    tls::ServerSettings server;
+};
+
+struct Timing {
+    std::vector<double> fullUs;
+    std::vector<double> resumedUs;
+};
+
+double medianOf(std::vector<double> values)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+bool run(const Case &testCase, const Files &files, int handshakes, Timing *timing)
+{
+    tls::ServerSettings settings = testCase.server;
+    settings.certificatePath = files.certificate;
+    settings.privateKeyPath = files.privateKey;
+    std::string error;
+    const auto server = tls::ServerContext::create(settings, &error);
+    if (!server) {
+        std::fprintf(stderr, "%s: %s\n", testCase.name, error.c_str());
+        return false;
+    }
+    SSL_CTX *client = clientContext(files, testCase.version);
+
+    bool ok = true;
+    for (int i = 0; i < handshakes && ok; ++i) {
+        // A fresh client, then the same client coming back with its session:
+        // the reconnect a dropped Wi-Fi link causes.
+        SSL_SESSION *saved = nullptr;
+        for (const bool resuming : {false, true}) {
+            tls::Session clientSide(client, tls::Session::Role::Client);
+            SSL_set_tlsext_host_name(clientSide.native(), "localhost");
+            if (resuming)
+                SSL_set_session(clientSide.native(), saved);
+            const auto started = std::chrono::steady_clock::now();
+            tls::Session serverSide(server->native(), tls::Session::Role::Server);
+            const bool shook = handshake(clientSide, serverSide);
+            const double us =
+                std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+            if (!shook || serverSide.isResumed() != resuming
+                || !exchange(clientSide, serverSide, "{\"type\":\"cmd\",\"cid\":1}")
+                || !exchange(serverSide, clientSide, "{\"type\":\"event\"}")) {
+                std::fprintf(stderr, "%s: handshake %d (%s) %s: %s\n", testCase.name, i,
+                             resuming ? "resuming" : "full",
+                             !shook ? "failed" : serverSide.isResumed() != resuming ? "resumed wrongly" : "lost data",
+                             serverSide.errorString().c_str());
+                ok = false;
+                break;
+            }
+            (resuming ? timing->resumedUs : timing->fullUs).push_back(us);
+            if (!resuming)
+                saved = SSL_get1_session(clientSide.native());
+        }
+        SSL_SESSION_free(saved);
+    }
+    SSL_CTX_free(client);
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int handshakes = argc > 1 ? std::max(1, std::atoi(argv[1])) : 500;
+
+    std::error_code ignored;
+    const std::filesystem::path directory =
+        std::filesystem::temp_directory_path() / ("bench_tls." + std::to_string(std::chrono::steady_clock::now()
+                                                                                   .time_since_epoch()
+                                                                                   .count()));
+    std::filesystem::create_directories(directory, ignored);
+    Files files;
+    if (!writeSelfSigned(directory, &files)) {
+        std::fprintf(stderr, "cannot write a self-signed certificate to %s\n", directory.string().c_str());
+        return 1;
+    }
+
+    const Case cases[] = {
+        {"tls1.3 tickets", TLS1_3_VERSION, {{}, {}, 0, 3600, true}},
+        {"tls1.3 cache", TLS1_3_VERSION, {{}, {}, 1024, 3600, false}},
+        {"tls1.2 tickets", TLS1_2_VERSION, {{}, {}, 0, 3600, true}},
+        {"tls1.2 cache", TLS1_2_VERSION, {{}, {}, 1024, 3600, false}},
+    };
+    std::printf("%-16s %8s %12s %12s\n", "case", "pairs", "full us", "resumed us");
+    int status = 0;
+    for (const Case &testCase : cases) {
+        Timing timing;
+        if (!run(testCase, files, handshakes, &timing)) {
+            status = 1;
+            break;
+        }
+        std::printf("%-16s %8d %12.1f %12.1f\n", testCase.name, handshakes, medianOf(timing.fullUs),
+                    medianOf(timing.resumedUs));
+    }
+    std::filesystem::remove_all(directory, ignored);
+    return status;
+}
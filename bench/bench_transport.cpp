@@ -0,0 +1,505 @@
+// The whole transport, in process: WsTransport with core's side scripted, driven
+// by N loopback clients at 1, 100, 1000 and 5000 connections. Per client count
+// it reports
+//   - fan-out: core events published, and deliveries per second until every
+//     client has read every event;
+//   - command round trip: p50/p99 from a client sending a frame to it reading
+//     the answer, for a sync topic and for an async cmd.* topic (to its
+//     cmd.response, through the ack);
+//   - inbound: frames per second the transport accepts and answers, with every
+//     client sending a burst at once.
+// Results go to stdout as a table and, with --json, to a file that two builds
+// can be compared by.
+//
+//   bench_transport [--clients 1,100,1000,5000] [--io-threads N] [--sync-workers N]
+//                   [--sync-delay-us N] [--json out.json]
+//
+// --sync-delay-us makes every scripted sync answer take that long, as a slow
+// core handler would; with it, --sync-workers shows what moving sync dispatch
+// off the transport thread buys.
+//
+// Clients run on threads of their own so that what is measured is the
+// transport, not the clients keeping up with it.
+
+#include "inboundenvelope.h"
+#include "wstransport.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QSysInfo>
+#include <QTcpServer>
+#include <QThread>
+#include <QUrl>
+#include <QWebSocket>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::string_view kEventTopic = "event.channel.stateChanged";
+constexpr std::string_view kEventPayload =
+    R"({"deviceId":"hue-bridge-1/light-17","channelId":"brightness","value":73,)"
+    R"("ts":1787300000123,"quality":"good"})";
+constexpr int kFanoutEvents = 200;
+// Round trips are measured from this many clients at most; more would measure
+// the queueing they cause each other rather than the path.
+constexpr int kRttClients = 50;
+constexpr int kRttCommandsPerClient = 40;
+constexpr int kInboundFramesPerClient = 20;
+constexpr int kClientThreads = 4;
+constexpr qint64 kPhaseTimeoutMs = 120000;
+
+// Core, as far as the transport can tell: a login that hands out a session,
+// sync topics answered on the spot, cmd.* topics acknowledged at once and
+// answered on the next turn of the event loop, as a real async handler would.
+class BenchTransport final : public WsTransport
+{
+public:
+    explicit BenchTransport(int syncDelayUs)
+        : m_syncDelayUs(syncDelayUs)
+    {
+    }
+
+    void publish(std::string_view topic, std::string_view payloadJson) { onCoreEvent(topic, payloadJson); }
+
+protected:
+    RoutedCommand routeCommand(const std::string &topic,
+                               std::string_view payloadJson,
+                               const CallerIdentity &caller) override
+    {
+        Q_UNUSED(payloadJson);
+        Q_UNUSED(caller);
+        RoutedCommand routed;
+        routed.envelopeType.assign(kEnvelopeTypeResponse);
+        if (topic.rfind("cmd.", 0) == 0) {
+            const CmdId cmdId = m_nextCmdId++;
+            routed.envelopeTopic = "cmd.ack";
+            routed.payloadJson = R"({"accepted":true,"cmdId":)" + std::to_string(cmdId) + "}";
+            routed.asyncCmdId = cmdId;
+            QMetaObject::invokeMethod(this, [this, cmdId]() {
+                onCoreAsyncResult(cmdId, R"({"ok":true,"result":{"state":"done"}})");
+            }, Qt::QueuedConnection);
+            return routed;
+        }
+        routed.envelopeTopic = "sync.response";
+        // Called on a worker with --sync-workers, so nothing here but the sleep
+        // may touch this object.
+        if (m_syncDelayUs > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(m_syncDelayUs));
+        if (topic == "sync.auth.login.set")
+            routed.payloadJson = R"({"token":"bench-token","sessionIdleSec":0,"error":null})";
+        else
+            routed.payloadJson = R"({"ok":true,"error":null})";
+        return routed;
+    }
+
+private:
+    const int m_syncDelayUs;
+    CmdId m_nextCmdId = 1;
+};
+
+enum class Phase {
+    Connect,
+    Fanout,
+    Rtt,
+    Inbound,
+};
+
+struct Counters {
+    std::atomic<int> loggedIn{0};
+    std::atomic<qint64> events{0};
+    std::atomic<int> rttDone{0};
+    std::atomic<qint64> answered{0};
+};
+
+// One client's side of the round-trip phase.
+struct RttState {
+    int remaining = 0;
+    quint64 cid = 0;
+    bool async = false;
+    QElapsedTimer sent;
+};
+
+// Clients on one thread. What a frame means depends on the phase the run is in.
+class ClientPool final : public QObject
+{
+public:
+    ClientPool(Counters *counters, std::atomic<Phase> *phase)
+        : m_counters(counters)
+        , m_phase(phase)
+    {
+    }
+
+    void open(const QUrl &url, int count)
+    {
+        for (int i = 0; i < count; ++i) {
+            auto *client = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this);
+            m_clients.append(client);
+            QObject::connect(client, &QWebSocket::connected, client, [client]() {
+                client->sendTextMessage(
+                    QStringLiteral(R"({"type":"cmd","topic":"sync.auth.login.set","cid":1,"payload":{}})"));
+            });
+            QObject::connect(client, &QWebSocket::textMessageReceived, client, [this, i](const QString &message) {
+                onMessage(i, message);
+            });
+            client->open(url);
+        }
+        m_rtt.resize(static_cast<std::size_t>(count));
+    }
+
+    // Starts the round-trip phase on this pool's first `count` clients.
+    void startRtt(int count)
+    {
+        m_latenciesSync.clear();
+        m_latenciesAsync.clear();
+        for (int i = 0; i < std::min<int>(count, m_clients.size()); ++i) {
+            m_rtt[static_cast<std::size_t>(i)].remaining = kRttCommandsPerClient;
+            sendNextRtt(i);
+        }
+    }
+
+    void startInbound()
+    {
+        for (QWebSocket *client : std::as_const(m_clients)) {
+            for (int k = 0; k < kInboundFramesPerClient; ++k) {
+                client->sendTextMessage(
+                    QStringLiteral(R"({"type":"cmd","topic":"sync.bench.echo.get","cid":%1,"payload":{}})").arg(k + 1000));
+            }
+        }
+    }
+
+    void takeLatencies(std::vector<qint64> *sync, std::vector<qint64> *async)
+    {
+        sync->insert(sync->end(), m_latenciesSync.begin(), m_latenciesSync.end());
+        async->insert(async->end(), m_latenciesAsync.begin(), m_latenciesAsync.end());
+    }
+
+    void closeAll()
+    {
+        for (QWebSocket *client : std::as_const(m_clients))
+            client->abort();
+        qDeleteAll(m_clients);
+        m_clients.clear();
+    }
+
+private:
+    void sendNextRtt(int index)
+    {
+        RttState &state = m_rtt[static_cast<std::size_t>(index)];
+        state.async = state.remaining % 2 == 0;
+        state.cid = static_cast<quint64>(100000 + state.remaining);
+        const QString topic = state.async ? QStringLiteral("cmd.bench.run") : QStringLiteral("sync.bench.echo.get");
+        state.sent.start();
+        m_clients.at(index)->sendTextMessage(
+            QStringLiteral(R"({"type":"cmd","topic":"%1","cid":%2,"payload":{"n":%3}})")
+                .arg(topic)
+                .arg(state.cid)
+                .arg(state.remaining));
+    }
+
+    void onMessage(int index, const QString &message)
+    {
+        switch (m_phase->load(std::memory_order_acquire)) {
+        case Phase::Connect:
+            m_counters->loggedIn.fetch_add(1, std::memory_order_relaxed);
+            return;
+        case Phase::Fanout:
+            m_counters->events.fetch_add(1, std::memory_order_relaxed);
+            return;
+        case Phase::Inbound:
+            m_counters->answered.fetch_add(1, std::memory_order_relaxed);
+            return;
+        case Phase::Rtt:
+            break;
+        }
+
+        RttState &state = m_rtt[static_cast<std::size_t>(index)];
+        if (state.remaining <= 0)
+            return;
+        const QByteArray frame = message.toUtf8();
+        InboundEnvelope envelope;
+        if (!scanInboundEnvelope(std::string_view(frame.constData(), static_cast<std::size_t>(frame.size())), &envelope))
+            return;
+        // The ack says core took it; the round trip ends at the answer.
+        if (state.async && envelope.topic != "cmd.response")
+            return;
+        const qint64 elapsed = state.sent.nsecsElapsed();
+        (state.async ? m_latenciesAsync : m_latenciesSync).push_back(elapsed);
+        if (--state.remaining > 0)
+            sendNextRtt(index);
+        else
+            m_counters->rttDone.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Counters *m_counters;
+    std::atomic<Phase> *m_phase;
+    QList<QWebSocket *> m_clients;
+    std::vector<RttState> m_rtt;
+    std::vector<qint64> m_latenciesSync;
+    std::vector<qint64> m_latenciesAsync;
+};
+
+bool waitFor(const std::function<bool()> &done, qint64 timeoutMs = kPhaseTimeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!done()) {
+        if (timer.elapsed() > timeoutMs)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 5);
+    }
+    return true;
+}
+
+double percentileUs(std::vector<qint64> samples, double fraction)
+{
+    if (samples.empty())
+        return 0.0;
+    std::sort(samples.begin(), samples.end());
+    const std::size_t at = std::min(samples.size() - 1, static_cast<std::size_t>(fraction * static_cast<double>(samples.size())));
+    return static_cast<double>(samples[at]) / 1000.0;
+}
+
+quint16 freePort()
+{
+    QTcpServer probe;
+    if (!probe.listen(QHostAddress::LocalHost, 0))
+        return 0;
+    return probe.serverPort();
+}
+
+void raiseFileLimit()
+{
+#ifdef Q_OS_UNIX
+    // Two descriptors per loopback client, one on each end.
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+QJsonObject runScenario(int clientCount, int ioThreads, int syncWorkers, int syncDelayUs)
+{
+    QJsonObject result;
+    result.insert(QStringLiteral("clients"), clientCount);
+
+    const quint16 port = freePort();
+    BenchTransport transport(syncDelayUs);
+    const std::string config = "{\"host\":\"127.0.0.1\",\"port\":" + std::to_string(port)
+        + ",\"ioThreads\":" + std::to_string(ioThreads) + ",\"syncWorkers\":" + std::to_string(syncWorkers)
+        + ",\"outboundBudgetBytes\":67108864,\"outboundMaxQueuedFrames\":1000000,\"slowConsumerTimeoutSec\":600}";
+    std::string error;
+    if (port == 0 || !transport.start(config, &error)) {
+        result.insert(QStringLiteral("error"), QString::fromStdString("start failed: " + error));
+        return result;
+    }
+
+    Counters counters;
+    std::atomic<Phase> phase{Phase::Connect};
+    QList<QThread *> threads;
+    QList<ClientPool *> pools;
+    const QUrl url(QStringLiteral("ws://127.0.0.1:%1").arg(port));
+    const int threadCount = std::min(kClientThreads, clientCount);
+    for (int i = 0; i < threadCount; ++i) {
+        auto *thread = new QThread;
+        auto *pool = new ClientPool(&counters, &phase);
+        pool->moveToThread(thread);
+        thread->start();
+        const int share = clientCount / threadCount + (i < clientCount % threadCount ? 1 : 0);
+        QMetaObject::invokeMethod(pool, [pool, url, share]() { pool->open(url, share); });
+        threads.append(thread);
+        pools.append(pool);
+    }
+    const auto shutdown = [&]() {
+        for (int i = 0; i < pools.size(); ++i) {
+            ClientPool *pool = pools.at(i);
+            QMetaObject::invokeMethod(pool, [pool]() { pool->closeAll(); }, Qt::BlockingQueuedConnection);
+            threads.at(i)->quit();
+            threads.at(i)->wait();
+            delete pool;
+            delete threads.at(i);
+        }
+        transport.stop();
+        QCoreApplication::processEvents();
+    };
+
+    if (!waitFor([&]() { return counters.loggedIn.load() >= clientCount; })) {
+        result.insert(QStringLiteral("error"),
+                      QStringLiteral("only %1 clients logged in").arg(counters.loggedIn.load()));
+        shutdown();
+        return result;
+    }
+
+    // Fan-out.
+    phase.store(Phase::Fanout, std::memory_order_release);
+    {
+        const qint64 expected = static_cast<qint64>(kFanoutEvents) * clientCount;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < kFanoutEvents; ++i)
+            transport.publish(kEventTopic, kEventPayload);
+        const qint64 publishNs = timer.nsecsElapsed();
+        const bool done = waitFor([&]() { return counters.events.load() >= expected; });
+        const double seconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+        QJsonObject fanout;
+        fanout.insert(QStringLiteral("events"), kFanoutEvents);
+        fanout.insert(QStringLiteral("complete"), done);
+        fanout.insert(QStringLiteral("publishUsPerEvent"), static_cast<double>(publishNs) / kFanoutEvents / 1000.0);
+        fanout.insert(QStringLiteral("deliveriesPerSec"), static_cast<double>(counters.events.load()) / seconds);
+        result.insert(QStringLiteral("fanout"), fanout);
+    }
+
+    // Command round trips.
+    phase.store(Phase::Rtt, std::memory_order_release);
+    {
+        const int rttClients = std::min(kRttClients, clientCount);
+        int started = 0;
+        for (int i = 0; i < pools.size(); ++i) {
+            ClientPool *pool = pools.at(i);
+            const int share = rttClients / pools.size() + (i < rttClients % pools.size() ? 1 : 0);
+            started += share;
+            QMetaObject::invokeMethod(pool, [pool, share]() { pool->startRtt(share); });
+        }
+        const bool done = waitFor([&]() { return counters.rttDone.load() >= started; });
+        std::vector<qint64> sync;
+        std::vector<qint64> async;
+        for (ClientPool *pool : std::as_const(pools)) {
+            QMetaObject::invokeMethod(pool, [pool, &sync, &async]() { pool->takeLatencies(&sync, &async); },
+                                      Qt::BlockingQueuedConnection);
+        }
+        QJsonObject rtt;
+        rtt.insert(QStringLiteral("clients"), started);
+        rtt.insert(QStringLiteral("complete"), done);
+        rtt.insert(QStringLiteral("syncSamples"), static_cast<qint64>(sync.size()));
+        rtt.insert(QStringLiteral("syncP50Us"), percentileUs(sync, 0.50));
+        rtt.insert(QStringLiteral("syncP99Us"), percentileUs(sync, 0.99));
+        rtt.insert(QStringLiteral("asyncSamples"), static_cast<qint64>(async.size()));
+        rtt.insert(QStringLiteral("asyncP50Us"), percentileUs(async, 0.50));
+        rtt.insert(QStringLiteral("asyncP99Us"), percentileUs(async, 0.99));
+        result.insert(QStringLiteral("commandRtt"), rtt);
+    }
+
+    // Inbound.
+    phase.store(Phase::Inbound, std::memory_order_release);
+    {
+        const qint64 expected = static_cast<qint64>(kInboundFramesPerClient) * clientCount;
+        QElapsedTimer timer;
+        timer.start();
+        for (ClientPool *pool : std::as_const(pools))
+            QMetaObject::invokeMethod(pool, [pool]() { pool->startInbound(); });
+        const bool done = waitFor([&]() { return counters.answered.load() >= expected; });
+        const double seconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+        QJsonObject inbound;
+        inbound.insert(QStringLiteral("frames"), expected);
+        inbound.insert(QStringLiteral("complete"), done);
+        inbound.insert(QStringLiteral("framesPerSec"), static_cast<double>(counters.answered.load()) / seconds);
+        result.insert(QStringLiteral("inbound"), inbound);
+    }
+
+    shutdown();
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QList<int> clientCounts = {1, 100, 1000, 5000};
+    int ioThreads = 0;
+    int syncWorkers = 0;
+    int syncDelayUs = 0;
+    QString jsonPath;
+    const QStringList args = app.arguments();
+    for (qsizetype i = 1; i + 1 < args.size(); i += 2) {
+        if (args.at(i) == QLatin1String("--clients")) {
+            clientCounts.clear();
+            for (const QString &count : args.at(i + 1).split(QLatin1Char(',')))
+                clientCounts.append(count.toInt());
+        } else if (args.at(i) == QLatin1String("--io-threads")) {
+            ioThreads = args.at(i + 1).toInt();
+        } else if (args.at(i) == QLatin1String("--sync-workers")) {
+            syncWorkers = args.at(i + 1).toInt();
+        } else if (args.at(i) == QLatin1String("--sync-delay-us")) {
+            syncDelayUs = args.at(i + 1).toInt();
+        } else if (args.at(i) == QLatin1String("--json")) {
+            jsonPath = args.at(i + 1);
+        } else {
+            std::fprintf(stderr,
+                         "usage: %s [--clients 1,100,1000,5000] [--io-threads N] [--sync-workers N] "
+                         "[--sync-delay-us N] [--json out.json]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+    raiseFileLimit();
+
+    QJsonArray scenarios;
+    std::printf("%8s %16s %12s %12s %12s %12s %16s\n",
+                "clients", "deliveries/s", "sync p50us", "sync p99us", "cmd p50us", "cmd p99us", "inbound fr/s");
+    for (const int clientCount : std::as_const(clientCounts)) {
+        if (clientCount < 1)
+            continue;
+        const QJsonObject scenario = runScenario(clientCount, ioThreads, syncWorkers, syncDelayUs);
+        scenarios.append(scenario);
+        if (scenario.contains(QStringLiteral("error"))) {
+            std::printf("%8d %s\n", clientCount, qPrintable(scenario.value(QStringLiteral("error")).toString()));
+            continue;
+        }
+        const QJsonObject rtt = scenario.value(QStringLiteral("commandRtt")).toObject();
+        std::printf("%8d %16.0f %12.1f %12.1f %12.1f %12.1f %16.0f\n",
+                    clientCount,
+                    scenario.value(QStringLiteral("fanout")).toObject().value(QStringLiteral("deliveriesPerSec")).toDouble(),
+                    rtt.value(QStringLiteral("syncP50Us")).toDouble(),
+                    rtt.value(QStringLiteral("syncP99Us")).toDouble(),
+                    rtt.value(QStringLiteral("asyncP50Us")).toDouble(),
+                    rtt.value(QStringLiteral("asyncP99Us")).toDouble(),
+                    scenario.value(QStringLiteral("inbound")).toObject().value(QStringLiteral("framesPerSec")).toDouble());
+    }
+
+    if (!jsonPath.isEmpty()) {
+        QJsonObject report;
+        report.insert(QStringLiteral("benchmark"), QStringLiteral("bench_transport"));
+        report.insert(QStringLiteral("version"), 1);
+        report.insert(QStringLiteral("ioThreads"), ioThreads);
+        report.insert(QStringLiteral("syncWorkers"), syncWorkers);
+        report.insert(QStringLiteral("syncDelayUs"), syncDelayUs);
+        report.insert(QStringLiteral("host"), QSysInfo::machineHostName());
+        report.insert(QStringLiteral("cpu"), QSysInfo::currentCpuArchitecture());
+        report.insert(QStringLiteral("idealThreads"), QThread::idealThreadCount());
+        report.insert(QStringLiteral("scenarios"), scenarios);
+        QFile file(jsonPath);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            std::fprintf(stderr, "cannot write %s\n", qPrintable(jsonPath));
+            return 1;
+        }
+        file.write(QJsonDocument(report).toJson(QJsonDocument::Indented));
+    }
+    return 0;
+}
@@ -0,0 +1,1045 @@
+// Load generator for soak and scaling runs: production-shaped load against a
+// running transport, for minutes or hours rather than the seconds a benchmark
+// takes. What it drives is described by a scenario file (see
+// bench/scenarios/): groups of clients with their own ramp, command rate and
+// sync/cmd mix, subscriptions, session lifetimes (login churn), reconnect
+// behaviour, and reconnect storms at given times.
+//
+// Clients speak phi-core-ws.v1: JSON text envelopes, a login first, then
+// commands. Every sample interval it prints a line - connections, logins,
+// commands and events per second, command latency, disconnects, the server's
+// resident memory - and at the end the latency histograms and the disconnects
+// by reason; --json writes all of it, samples included.
+//
+// Without a "url" in the scenario it starts a server of its own: this program
+// again, as a child process, hosting the transport with core stubbed out (the
+// scenario's "server" object says how that stub behaves). Everything stays on
+// loopback, and the memory figures are the server's alone. With a "url", the
+// server's memory is sampled when --server-pid names its process (Linux).
+//
+//   loadgen <scenario.json> [--json out.json] [--server-pid PID]
+//   loadgen --serve <scenario.json>     (the child; prints "listening <port>")
+
+#include "inboundenvelope.h"
+#include "wsmetrics.h"
+#include "wstransport.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QList>
+#include <QNetworkRequest>
+#include <QProcess>
+#include <QRandomGenerator>
+#include <QString>
+#include <QStringList>
+#include <QTcpServer>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+#include <QWebSocket>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr QLatin1String kSubprotocol("phi-core-ws.v1");
+// Commands are paced on this tick; a client's rate is met on average, with
+// whatever it owes carried to the next tick.
+constexpr int kTickMs = 10;
+// A client with this many commands unanswered sends no more until some are:
+// the point is load the server can serve, not a queue on the client.
+constexpr int kMaxInFlight = 32;
+constexpr qint64 kConnectTimeoutMs = 10000;
+constexpr qint64 kServerStartTimeoutMs = 10000;
+constexpr int kDefaultClientThreads = 4;
+
+qint64 nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct GroupSpec {
+    QString name;
+    int clients = 1;
+    // Clients open evenly over this long from the start.
+    double rampSec = 0.0;
+    // Per client, on average; 0 logs in and then only listens, which is what
+    // runs into the server's sessionIdleSec.
+    double commandsPerSec = 0.0;
+    // Of those commands, the share sent as cmdTopic rather than syncTopic.
+    double cmdShare = 0.0;
+    QString syncTopic = QStringLiteral("sync.loadgen.echo.get");
+    QString cmdTopic = QStringLiteral("cmd.loadgen.run");
+    // Sent after login when not empty, as sync.events.subscribe.set.
+    QJsonArray subscribe;
+    // Each session ends after a random time in this range and the client logs
+    // in again on a new connection; 0 keeps sessions open.
+    double lifetimeMinSec = 0.0;
+    double lifetimeMaxSec = 0.0;
+    bool reconnect = true;
+    // Before a reconnect, jittered by half either way so a storm spreads out
+    // the way real clients' backoff does.
+    int reconnectDelayMs = 1000;
+};
+
+// Aborts `fraction` of the live connections at once - of one group, or of all
+// when `group` is empty - as a network blip or a proxy restart would.
+struct StormSpec {
+    double atSec = 0.0;
+    double fraction = 1.0;
+    QString group;
+};
+
+// The stubbed core a --serve child hosts.
+struct ServerSpec {
+    // Merged over host and port; anything the transport reads.
+    QJsonObject config;
+    int sessionIdleSec = 0;
+    double eventsPerSec = 0.0;
+    // event.channel.stateChanged events cycle over this many channels.
+    int channels = 100;
+    int syncDelayUs = 0;
+    int cmdDelayMs = 0;
+};
+
+struct Scenario {
+    QString name;
+    double durationSec = 60.0;
+    double sampleSec = 5.0;
+    int clientThreads = kDefaultClientThreads;
+    QUrl url;
+    QString loginTopic = QStringLiteral("sync.auth.login.set");
+    QByteArray loginPayload = QByteArrayLiteral("{}");
+    ServerSpec server;
+    std::vector<GroupSpec> groups;
+    std::vector<StormSpec> storms;
+};
+
+bool loadScenario(const QString &path, Scenario *out, QString *error)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        *error = QStringLiteral("cannot read %1").arg(path);
+        return false;
+    }
+    QJsonParseError parseError;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if (!document.isObject()) {
+        *error = QStringLiteral("%1: %2").arg(path, parseError.errorString());
+        return false;
+    }
+    const QJsonObject root = document.object();
+    Scenario scenario;
+    scenario.name = root.value(QStringLiteral("name")).toString(path);
+    scenario.durationSec = root.value(QStringLiteral("durationSec")).toDouble(scenario.durationSec);
+    scenario.sampleSec = root.value(QStringLiteral("sampleSec")).toDouble(scenario.sampleSec);
+    scenario.clientThreads = root.value(QStringLiteral("clientThreads")).toInt(scenario.clientThreads);
+    if (root.contains(QStringLiteral("url")))
+        scenario.url = QUrl(root.value(QStringLiteral("url")).toString());
+    const QJsonObject login = root.value(QStringLiteral("login")).toObject();
+    scenario.loginTopic = login.value(QStringLiteral("topic")).toString(scenario.loginTopic);
+    if (login.value(QStringLiteral("payload")).isObject())
+        scenario.loginPayload = QJsonDocument(login.value(QStringLiteral("payload")).toObject()).toJson(QJsonDocument::Compact);
+
+    const QJsonObject server = root.value(QStringLiteral("server")).toObject();
+    scenario.server.config = server.value(QStringLiteral("config")).toObject();
+    scenario.server.sessionIdleSec = server.value(QStringLiteral("sessionIdleSec")).toInt(0);
+    scenario.server.eventsPerSec = server.value(QStringLiteral("eventsPerSec")).toDouble(0.0);
+    scenario.server.channels = std::max(1, server.value(QStringLiteral("channels")).toInt(scenario.server.channels));
+    scenario.server.syncDelayUs = server.value(QStringLiteral("syncDelayUs")).toInt(0);
+    scenario.server.cmdDelayMs = server.value(QStringLiteral("cmdDelayMs")).toInt(0);
+
+    for (const QJsonValue &value : root.value(QStringLiteral("groups")).toArray()) {
+        const QJsonObject object = value.toObject();
+        GroupSpec group;
+        group.name = object.value(QStringLiteral("name")).toString(QStringLiteral("group%1").arg(scenario.groups.size()));
+        group.clients = object.value(QStringLiteral("clients")).toInt(group.clients);
+        group.rampSec = object.value(QStringLiteral("rampSec")).toDouble(0.0);
+        group.commandsPerSec = object.value(QStringLiteral("commandsPerSec")).toDouble(0.0);
+        group.cmdShare = std::clamp(object.value(QStringLiteral("cmdShare")).toDouble(0.0), 0.0, 1.0);
+        group.syncTopic = object.value(QStringLiteral("syncTopic")).toString(group.syncTopic);
+        group.cmdTopic = object.value(QStringLiteral("cmdTopic")).toString(group.cmdTopic);
+        group.subscribe = object.value(QStringLiteral("subscribe")).toArray();
+        const QJsonArray lifetime = object.value(QStringLiteral("lifetimeSec")).toArray();
+        if (lifetime.size() == 2) {
+            group.lifetimeMinSec = lifetime.at(0).toDouble();
+            group.lifetimeMaxSec = std::max(group.lifetimeMinSec, lifetime.at(1).toDouble());
+        }
+        group.reconnect = object.value(QStringLiteral("reconnect")).toBool(true);
+        group.reconnectDelayMs = object.value(QStringLiteral("reconnectDelayMs")).toInt(group.reconnectDelayMs);
+        if (group.clients < 0 || group.commandsPerSec < 0.0 || group.rampSec < 0.0 || group.reconnectDelayMs < 0) {
+            *error = QStringLiteral("group '%1': clients, commandsPerSec, rampSec and reconnectDelayMs must not be "
+                                    "negative")
+                         .arg(group.name);
+            return false;
+        }
+        scenario.groups.push_back(group);
+    }
+    for (const QJsonValue &value : root.value(QStringLiteral("storms")).toArray()) {
+        const QJsonObject object = value.toObject();
+        StormSpec storm;
+        storm.atSec = object.value(QStringLiteral("atSec")).toDouble();
+        storm.fraction = std::clamp(object.value(QStringLiteral("fraction")).toDouble(1.0), 0.0, 1.0);
+        storm.group = object.value(QStringLiteral("group")).toString();
+        scenario.storms.push_back(storm);
+    }
+    std::sort(scenario.storms.begin(), scenario.storms.end(), [](const StormSpec &a, const StormSpec &b) {
+        return a.atSec < b.atSec;
+    });
+    if (scenario.groups.empty() || scenario.durationSec <= 0.0 || scenario.sampleSec <= 0.0
+        || scenario.clientThreads < 1) {
+        *error = QStringLiteral("%1: needs at least one group, a positive durationSec and sampleSec, and "
+                                "clientThreads of 1 or more")
+                     .arg(path);
+        return false;
+    }
+    *out = std::move(scenario);
+    return true;
+}
+
+// ---- The --serve child: the transport with core stubbed out ----------------
+
+// Core as far as the transport can tell: logins hand out a session with the
+// scenario's idle timeout, sync topics are answered (after syncDelayUs, on
+// whichever thread the transport calls from), cmd.* topics are acked at once
+// and answered cmdDelayMs later, and channel state events flow at a steady rate.
+class StubCore final : public WsTransport
+{
+public:
+    explicit StubCore(const ServerSpec &spec)
+        : m_spec(spec)
+    {
+        if (m_spec.eventsPerSec > 0.0) {
+            auto *timer = new QTimer(this);
+            timer->setInterval(kTickMs);
+            connect(timer, &QTimer::timeout, this, [this]() { publishDue(); });
+            m_eventClock.start();
+            timer->start();
+        }
+    }
+
+protected:
+    RoutedCommand routeCommand(const std::string &topic,
+                               std::string_view payloadJson,
+                               const CallerIdentity &caller) override
+    {
+        Q_UNUSED(payloadJson);
+        Q_UNUSED(caller);
+        RoutedCommand routed;
+        routed.envelopeType.assign(kEnvelopeTypeResponse);
+        if (topic.rfind("cmd.", 0) == 0) {
+            const CmdId cmdId = m_nextCmdId++;
+            routed.envelopeTopic = "cmd.ack";
+            routed.payloadJson = R"({"accepted":true,"cmdId":)" + std::to_string(cmdId) + "}";
+            routed.asyncCmdId = cmdId;
+            QTimer::singleShot(m_spec.cmdDelayMs, this, [this, cmdId]() {
+                onCoreAsyncResult(cmdId, R"({"ok":true,"result":{"state":"done"}})");
+            });
+            return routed;
+        }
+        routed.envelopeTopic = "sync.response";
+        if (m_spec.syncDelayUs > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(m_spec.syncDelayUs));
+        if (topic.rfind("sync.auth.login", 0) == 0) {
+            routed.payloadJson = R"({"token":"loadgen-)" + std::to_string(m_nextToken.fetch_add(1))
+                + R"(","sessionIdleSec":)" + std::to_string(m_spec.sessionIdleSec) + R"(,"error":null})";
+        } else {
+            routed.payloadJson = R"({"ok":true,"error":null})";
+        }
+        return routed;
+    }
+
+private:
+    void publishDue()
+    {
+        const qint64 due = static_cast<qint64>(m_eventClock.elapsed() * m_spec.eventsPerSec / 1000.0);
+        for (; m_published < due; ++m_published) {
+            const int channel = static_cast<int>(m_published % m_spec.channels);
+            const std::string payload = R"({"deviceId":"loadgen/device-)" + std::to_string(channel / 8)
+                + R"(","channelId":"ch)" + std::to_string(channel % 8) + R"(","value":)"
+                + std::to_string(m_published % 100) + "}";
+            onCoreEvent("event.channel.stateChanged", payload);
+        }
+    }
+
+    const ServerSpec m_spec;
+    CmdId m_nextCmdId = 1;
+    std::atomic<quint64> m_nextToken{1};
+    QElapsedTimer m_eventClock;
+    qint64 m_published = 0;
+};
+
+quint16 freePort()
+{
+    QTcpServer probe;
+    if (!probe.listen(QHostAddress::LocalHost, 0))
+        return 0;
+    return probe.serverPort();
+}
+
+void raiseFileLimit()
+{
+#ifdef Q_OS_UNIX
+    // Thousands of sockets; the default soft limit is usually 1024.
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+int serve(const Scenario &scenario)
+{
+    raiseFileLimit();
+    const quint16 port = freePort();
+    QJsonObject config = scenario.server.config;
+    config.insert(QStringLiteral("host"), QStringLiteral("127.0.0.1"));
+    config.insert(QStringLiteral("port"), port);
+    StubCore core(scenario.server);
+    std::string error;
+    if (port == 0 || !core.start(QJsonDocument(config).toJson(QJsonDocument::Compact).toStdString(), &error)) {
+        std::fprintf(stderr, "server start failed: %s\n", error.c_str());
+        return 1;
+    }
+    std::printf("listening %u\n", static_cast<unsigned>(port));
+    std::fflush(stdout);
+    // Runs until the driver terminates it.
+    return QCoreApplication::exec();
+}
+
+// ---- The driver ------------------------------------------------------------
+
+// Resident set size of a process in KiB, -1 when it cannot be read.
+qint64 residentKiB(qint64 pid)
+{
+#ifdef Q_OS_LINUX
+    QFile status(QStringLiteral("/proc/%1/status").arg(pid));
+    if (!status.open(QIODevice::ReadOnly))
+        return -1;
+    while (!status.atEnd()) {
+        const QByteArray line = status.readLine();
+        if (line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').value(0).toLongLong();
+    }
+#else
+    Q_UNUSED(pid);
+#endif
+    return -1;
+}
+
+// Shared by every client thread; counters only grow, except the gauge.
+struct LoadStats {
+    std::atomic<std::uint64_t> connectAttempts{0};
+    std::atomic<std::uint64_t> connectFailures{0};
+    std::atomic<std::uint64_t> logins{0};
+    std::atomic<std::uint64_t> loginFailures{0};
+    std::atomic<std::uint64_t> framesOut{0};
+    std::atomic<std::uint64_t> framesIn{0};
+    std::atomic<std::uint64_t> bytesIn{0};
+    std::atomic<std::uint64_t> events{0};
+    std::atomic<std::uint64_t> syncAnswered{0};
+    std::atomic<std::uint64_t> cmdAnswered{0};
+    std::atomic<std::uint64_t> protocolErrors{0};
+    std::atomic<std::uint64_t> disconnects{0};
+    std::atomic<std::int64_t> connected{0};
+    // Open to upgraded; login sent to session; command sent to its answer (a
+    // cmd.* to its ack and, separately, to its cmd.response).
+    LatencyHistogram connectLatency;
+    LatencyHistogram loginLatency;
+    LatencyHistogram syncLatency;
+    LatencyHistogram cmdAckLatency;
+    LatencyHistogram cmdResultLatency;
+
+    std::mutex reasonsMutex;
+    std::map<std::string, std::uint64_t> disconnectReasons;
+
+    void addReason(const std::string &reason)
+    {
+        std::lock_guard<std::mutex> lock(reasonsMutex);
+        ++disconnectReasons[reason];
+    }
+};
+
+// Clients on one thread, paced by one timer.
+class ClientPool final : public QObject
+{
+public:
+    ClientPool(const Scenario *scenario, LoadStats *stats)
+        : m_scenario(scenario)
+        , m_stats(stats)
+    {
+    }
+
+    // On the pool's thread, before start().
+    void addClient(const GroupSpec *group, qint64 openAtMs)
+    {
+        Client client;
+        client.group = group;
+        client.nextOpenMs = openAtMs;
+        m_clients.push_back(std::move(client));
+    }
+
+    void start(const QUrl &url)
+    {
+        m_url = url;
+        m_clock.start();
+        m_random.seed(static_cast<quint32>(reinterpret_cast<quintptr>(this)));
+        for (int i = 0; i < static_cast<int>(m_clients.size()); ++i)
+            createSocket(i);
+        m_timer = new QTimer(this);
+        m_timer->setInterval(kTickMs);
+        connect(m_timer, &QTimer::timeout, this, [this]() { tick(); });
+        m_timer->start();
+    }
+
+    void storm(double fraction, const QString &group)
+    {
+        for (Client &client : m_clients) {
+            if (!group.isEmpty() && client.group->name != group)
+                continue;
+            if (client.state == State::Idle || client.state == State::Connecting)
+                continue;
+            if (m_random.generateDouble() >= fraction)
+                continue;
+            client.closeCause = "client abort (storm)";
+            client.socket->abort();
+        }
+    }
+
+    void stopAll()
+    {
+        m_stopping = true;
+        if (m_timer)
+            m_timer->stop();
+        for (Client &client : m_clients) {
+            if (!client.socket)
+                continue;
+            client.closeCause = "client close (end of run)";
+            client.socket->abort();
+        }
+    }
+
+private:
+    enum class State { Idle, Connecting, LoggingIn, Active };
+    struct Pending {
+        qint64 sentNs = 0;
+        bool cmd = false;
+        bool acked = false;
+    };
+    struct Client {
+        const GroupSpec *group = nullptr;
+        QWebSocket *socket = nullptr;
+        State state = State::Idle;
+        qint64 nextOpenMs = 0;
+        qint64 closeAtMs = 0;
+        qint64 openedNs = 0;
+        qint64 loginSentNs = 0;
+        double credit = 0.0;
+        quint64 nextCid = 1;
+        quint64 loginCid = 0;
+        QHash<quint64, Pending> pending;
+        // Set when this side ends the connection, so the disconnect is counted
+        // as that rather than as whatever the socket reports.
+        std::string closeCause;
+        std::string lastError;
+    };
+
+    void createSocket(int index)
+    {
+        Client &client = m_clients[static_cast<std::size_t>(index)];
+        auto *socket = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest, this);
+        client.socket = socket;
+        connect(socket, &QWebSocket::connected, this, [this, index]() { onConnected(index); });
+        connect(socket, &QWebSocket::disconnected, this, [this, index]() { onDisconnected(index); });
+        connect(socket, &QWebSocket::textMessageReceived, this, [this, index](const QString &message) {
+            onMessage(index, message);
+        });
+        connect(socket, &QWebSocket::errorOccurred, this, [this, index](QAbstractSocket::SocketError) {
+            Client &failed = m_clients[static_cast<std::size_t>(index)];
+            failed.lastError = failed.socket->errorString().toStdString();
+            // A connect that fails never gets as far as disconnected().
+            if (failed.state == State::Connecting)
+                onDisconnected(index);
+        });
+    }
+
+    void open(Client &client)
+    {
+        client.state = State::Connecting;
+        client.closeCause.clear();
+        client.lastError.clear();
+        client.pending.clear();
+        client.credit = m_random.generateDouble();
+        client.openedNs = nowNs();
+        m_stats->connectAttempts.fetch_add(1, std::memory_order_relaxed);
+        QNetworkRequest request(m_url);
+        request.setRawHeader("Sec-WebSocket-Protocol", QByteArray(kSubprotocol.data(), kSubprotocol.size()));
+        client.socket->open(request);
+    }
+
+    void send(Client &client, const QString &topic, const QByteArray &payload, quint64 cid)
+    {
+        client.socket->sendTextMessage(QStringLiteral(R"({"type":"cmd","topic":"%1","cid":%2,"payload":%3})")
+                                           .arg(topic)
+                                           .arg(cid)
+                                           .arg(QString::fromUtf8(payload)));
+        m_stats->framesOut.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onConnected(int index)
+    {
+        Client &client = m_clients[static_cast<std::size_t>(index)];
+        m_stats->connectLatency.record((nowNs() - client.openedNs) / 1000);
+        m_stats->connected.fetch_add(1, std::memory_order_relaxed);
+        client.state = State::LoggingIn;
+        client.loginCid = client.nextCid++;
+        client.loginSentNs = nowNs();
+        send(client, m_scenario->loginTopic, m_scenario->loginPayload, client.loginCid);
+    }
+
+    void onMessage(int index, const QString &message)
+    {
+        Client &client = m_clients[static_cast<std::size_t>(index)];
+        const QByteArray frame = message.toUtf8();
+        m_stats->framesIn.fetch_add(1, std::memory_order_relaxed);
+        m_stats->bytesIn.fetch_add(static_cast<std::uint64_t>(frame.size()), std::memory_order_relaxed);
+        InboundEnvelope envelope;
+        if (!scanInboundEnvelope(std::string_view(frame.constData(), static_cast<std::size_t>(frame.size())), &envelope))
+            return;
+        if (envelope.type == "event") {
+            m_stats->events.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (envelope.topic == "protocol.error")
+            m_stats->protocolErrors.fetch_add(1, std::memory_order_relaxed);
+        if (envelope.cidKind != InboundEnvelope::CidKind::Number)
+            return;
+        const auto cid = static_cast<quint64>(envelope.cidNumber);
+
+        if (client.state == State::LoggingIn && cid == client.loginCid) {
+            // The stub answers every login; a real core may not, and a client
+            // that cannot log in has nothing else to do.
+            if (envelope.topic != "sync.response" || frame.contains("\"token\":null")
+                || !frame.contains("\"token\"")) {
+                m_stats->loginFailures.fetch_add(1, std::memory_order_relaxed);
+                client.closeCause = "client close (login refused)";
+                client.socket->close();
+                return;
+            }
+            m_stats->loginLatency.record((nowNs() - client.loginSentNs) / 1000);
+            m_stats->logins.fetch_add(1, std::memory_order_relaxed);
+            client.state = State::Active;
+            const GroupSpec &group = *client.group;
+            if (group.lifetimeMaxSec > 0.0) {
+                const double lifetime = group.lifetimeMinSec
+                    + m_random.generateDouble() * (group.lifetimeMaxSec - group.lifetimeMinSec);
+                client.closeAtMs = m_clock.elapsed() + static_cast<qint64>(lifetime * 1000.0);
+            } else {
+                client.closeAtMs = 0;
+            }
+            if (!group.subscribe.isEmpty()) {
+                QJsonObject payload;
+                payload.insert(QStringLiteral("topics"), group.subscribe);
+                send(client, QStringLiteral("sync.events.subscribe.set"),
+                     QJsonDocument(payload).toJson(QJsonDocument::Compact), client.nextCid++);
+            }
+            return;
+        }
+
+        const auto it = client.pending.find(cid);
+        if (it == client.pending.end())
+            return;
+        const qint64 us = (nowNs() - it->sentNs) / 1000;
+        if (!it->cmd) {
+            m_stats->syncLatency.record(us);
+            m_stats->syncAnswered.fetch_add(1, std::memory_order_relaxed);
+            client.pending.erase(it);
+            return;
+        }
+        if (envelope.topic == "cmd.ack" && !it->acked) {
+            m_stats->cmdAckLatency.record(us);
+            it->acked = true;
+            // A refused command gets no cmd.response.
+            if (!frame.contains("\"accepted\":false"))
+                return;
+        } else if (envelope.topic == "cmd.response") {
+            m_stats->cmdResultLatency.record(us);
+            m_stats->cmdAnswered.fetch_add(1, std::memory_order_relaxed);
+        }
+        client.pending.erase(it);
+    }
+
+    void onDisconnected(int index)
+    {
+        Client &client = m_clients[static_cast<std::size_t>(index)];
+        if (client.state == State::Idle)
+            return;
+        const bool wasConnected = client.state != State::Connecting;
+        std::string reason;
+        if (!client.closeCause.empty()) {
+            reason = client.closeCause;
+        } else if (!wasConnected) {
+            reason = "connect failed: " + (client.lastError.empty() ? std::string("unknown") : client.lastError);
+            m_stats->connectFailures.fetch_add(1, std::memory_order_relaxed);
+        } else if (!client.socket->closeReason().isEmpty()) {
+            reason = "server close " + std::to_string(static_cast<int>(client.socket->closeCode())) + ": "
+                + client.socket->closeReason().toStdString();
+        } else if (!client.lastError.empty()) {
+            reason = "error: " + client.lastError;
+        } else {
+            reason = "server close " + std::to_string(static_cast<int>(client.socket->closeCode()));
+        }
+        if (wasConnected) {
+            m_stats->connected.fetch_sub(1, std::memory_order_relaxed);
+            m_stats->disconnects.fetch_add(1, std::memory_order_relaxed);
+        }
+        m_stats->addReason(reason);
+
+        // Churn comes straight back with a new login; everything else backs
+        // off first, unless the group does not reconnect at all.
+        const bool churn = client.closeCause == "client close (lifetime)";
+        client.state = State::Idle;
+        client.pending.clear();
+        if (m_stopping || (!churn && !client.group->reconnect)) {
+            client.nextOpenMs = -1;
+            return;
+        }
+        const int delay = churn ? 0 : client.group->reconnectDelayMs;
+        client.nextOpenMs = m_clock.elapsed() + delay / 2 + static_cast<qint64>(m_random.bounded(delay + 1));
+    }
+
+    void tick()
+    {
+        const qint64 nowMs = m_clock.elapsed();
+        const double tickSec = kTickMs / 1000.0;
+        for (int i = 0; i < static_cast<int>(m_clients.size()); ++i) {
+            Client &client = m_clients[static_cast<std::size_t>(i)];
+            switch (client.state) {
+            case State::Idle:
+                if (client.nextOpenMs >= 0 && nowMs >= client.nextOpenMs)
+                    open(client);
+                break;
+            case State::Connecting:
+                if ((nowNs() - client.openedNs) / 1000000 >= kConnectTimeoutMs) {
+                    client.lastError = "timed out";
+                    client.socket->abort();
+                    onDisconnected(i);
+                }
+                break;
+            case State::LoggingIn:
+                break;
+            case State::Active: {
+                if (client.closeAtMs > 0 && nowMs >= client.closeAtMs) {
+                    client.closeCause = "client close (lifetime)";
+                    client.socket->close();
+                    break;
+                }
+                const GroupSpec &group = *client.group;
+                client.credit = std::min(client.credit + group.commandsPerSec * tickSec,
+                                         std::max(1.0, group.commandsPerSec));
+                while (client.credit >= 1.0 && client.pending.size() < kMaxInFlight) {
+                    client.credit -= 1.0;
+                    const bool cmd = m_random.generateDouble() < group.cmdShare;
+                    const quint64 cid = client.nextCid++;
+                    Pending pending;
+                    pending.sentNs = nowNs();
+                    pending.cmd = cmd;
+                    client.pending.insert(cid, pending);
+                    send(client, cmd ? group.cmdTopic : group.syncTopic, QByteArrayLiteral("{}"), cid);
+                }
+                break;
+            }
+            }
+        }
+    }
+
+    const Scenario *m_scenario;
+    LoadStats *m_stats;
+    QUrl m_url;
+    QElapsedTimer m_clock;
+    QRandomGenerator m_random;
+    QTimer *m_timer = nullptr;
+    std::vector<Client> m_clients;
+    bool m_stopping = false;
+};
+
+// The figures at one moment, to print and to diff against the next.
+struct Sample {
+    double atSec = 0.0;
+    std::int64_t connected = 0;
+    std::uint64_t connectAttempts = 0;
+    std::uint64_t logins = 0;
+    std::uint64_t framesOut = 0;
+    std::uint64_t framesIn = 0;
+    std::uint64_t events = 0;
+    std::uint64_t disconnects = 0;
+    std::uint64_t protocolErrors = 0;
+    LatencyHistogram::Snapshot sync;
+    LatencyHistogram::Snapshot cmd;
+    qint64 serverRssKiB = -1;
+};
+
+Sample takeSample(const LoadStats &stats, double atSec, qint64 serverPid)
+{
+    Sample sample;
+    sample.atSec = atSec;
+    sample.connected = stats.connected.load(std::memory_order_relaxed);
+    sample.connectAttempts = stats.connectAttempts.load(std::memory_order_relaxed);
+    sample.logins = stats.logins.load(std::memory_order_relaxed);
+    sample.framesOut = stats.framesOut.load(std::memory_order_relaxed);
+    sample.framesIn = stats.framesIn.load(std::memory_order_relaxed);
+    sample.events = stats.events.load(std::memory_order_relaxed);
+    sample.disconnects = stats.disconnects.load(std::memory_order_relaxed);
+    sample.protocolErrors = stats.protocolErrors.load(std::memory_order_relaxed);
+    sample.sync = stats.syncLatency.snapshot();
+    sample.cmd = stats.cmdResultLatency.snapshot();
+    sample.serverRssKiB = serverPid > 0 ? residentKiB(serverPid) : -1;
+    return sample;
+}
+
+// What was recorded between two snapshots of the same histogram.
+LatencyHistogram::Snapshot since(const LatencyHistogram::Snapshot &now, const LatencyHistogram::Snapshot &before)
+{
+    LatencyHistogram::Snapshot delta;
+    for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i)
+        delta.counts[i] = now.counts[i] - before.counts[i];
+    delta.count = now.count - before.count;
+    delta.sumUs = now.sumUs - before.sumUs;
+    return delta;
+}
+
+QJsonObject histogramJson(const LatencyHistogram::Snapshot &latency)
+{
+    QJsonObject out;
+    out.insert(QStringLiteral("count"), static_cast<qint64>(latency.count));
+    out.insert(QStringLiteral("meanUs"), latency.count ? static_cast<double>(latency.sumUs) / latency.count : 0.0);
+    out.insert(QStringLiteral("p50Us"), static_cast<qint64>(latency.quantileUs(0.50)));
+    out.insert(QStringLiteral("p90Us"), static_cast<qint64>(latency.quantileUs(0.90)));
+    out.insert(QStringLiteral("p99Us"), static_cast<qint64>(latency.quantileUs(0.99)));
+    QJsonArray buckets;
+    for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+        QJsonObject bucket;
+        bucket.insert(QStringLiteral("leUs"),
+                      i < LatencyHistogram::kBoundsUs.size() ? QJsonValue(static_cast<qint64>(LatencyHistogram::kBoundsUs[i]))
+                                                             : QJsonValue(QStringLiteral("+Inf")));
+        bucket.insert(QStringLiteral("count"), static_cast<qint64>(latency.counts[i]));
+        buckets.append(bucket);
+    }
+    out.insert(QStringLiteral("buckets"), buckets);
+    return out;
+}
+
+void printHistogram(const char *name, const LatencyHistogram::Snapshot &latency)
+{
+    std::printf("  %-12s n=%-10llu p50=%-8lld p90=%-8lld p99=%-8lld us\n",
+                name,
+                static_cast<unsigned long long>(latency.count),
+                static_cast<long long>(latency.quantileUs(0.50)),
+                static_cast<long long>(latency.quantileUs(0.90)),
+                static_cast<long long>(latency.quantileUs(0.99)));
+    for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+        if (latency.counts[i] == 0)
+            continue;
+        if (i < LatencyHistogram::kBoundsUs.size())
+            std::printf("    <= %8lld us  %llu\n", static_cast<long long>(LatencyHistogram::kBoundsUs[i]),
+                        static_cast<unsigned long long>(latency.counts[i]));
+        else
+            std::printf("     > %8lld us  %llu\n", static_cast<long long>(LatencyHistogram::kBoundsUs.back()),
+                        static_cast<unsigned long long>(latency.counts[i]));
+    }
+}
+
+int drive(const Scenario &scenario, const QString &scenarioPath, const QString &jsonPath, qint64 serverPid)
+{
+    raiseFileLimit();
+
+    // The stub server, unless the scenario names one.
+    QProcess server;
+    QUrl url = scenario.url;
+    if (url.isEmpty()) {
+        server.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        server.start(QCoreApplication::applicationFilePath(), {QStringLiteral("--serve"), scenarioPath});
+        QByteArray line;
+        QElapsedTimer waited;
+        waited.start();
+        while (!line.endsWith('\n') && waited.elapsed() < kServerStartTimeoutMs) {
+            if (!server.waitForReadyRead(static_cast<int>(kServerStartTimeoutMs - waited.elapsed())))
+                break;
+            line += server.readLine();
+        }
+        if (!line.startsWith("listening ")) {
+            std::fprintf(stderr, "the stub server did not start\n");
+            server.kill();
+            server.waitForFinished();
+            return 1;
+        }
+        url = QUrl(QStringLiteral("ws://127.0.0.1:%1").arg(line.mid(10).trimmed().toInt()));
+        serverPid = server.processId();
+    }
+
+    LoadStats stats;
+    QList<QThread *> threads;
+    QList<ClientPool *> pools;
+    for (int i = 0; i < scenario.clientThreads; ++i) {
+        auto *thread = new QThread;
+        thread->setObjectName(QStringLiteral("loadgen-%1").arg(i));
+        auto *pool = new ClientPool(&scenario, &stats);
+        pool->moveToThread(thread);
+        thread->start();
+        threads.append(thread);
+        pools.append(pool);
+    }
+    // Clients dealt round-robin, so every thread carries a share of every group.
+    int next = 0;
+    int totalClients = 0;
+    for (const GroupSpec &group : scenario.groups) {
+        for (int i = 0; i < group.clients; ++i) {
+            ClientPool *pool = pools.at(next++ % pools.size());
+            const qint64 openAtMs = group.clients > 1
+                ? static_cast<qint64>(group.rampSec * 1000.0 * i / (group.clients - 1))
+                : 0;
+            QMetaObject::invokeMethod(pool, [pool, &group, openAtMs]() { pool->addClient(&group, openAtMs); });
+        }
+        totalClients += group.clients;
+    }
+    for (ClientPool *pool : std::as_const(pools))
+        QMetaObject::invokeMethod(pool, [pool, url]() { pool->start(url); });
+
+    std::printf("scenario '%s': %d clients on %d threads against %s for %.0f s\n",
+                qPrintable(scenario.name), totalClients, scenario.clientThreads, qPrintable(url.toString()),
+                scenario.durationSec);
+    std::printf("%8s %8s %9s %9s %10s %10s %10s %10s %8s %8s %12s\n", "t(s)", "conns", "logins/s", "cmds/s",
+                "events/s", "sync p50", "sync p99", "cmd p99", "discon", "errors", "server RSS");
+
+    QElapsedTimer clock;
+    clock.start();
+    std::vector<Sample> samples;
+    samples.push_back(takeSample(stats, 0.0, serverPid));
+    std::size_t nextStorm = 0;
+    qint64 nextSampleMs = static_cast<qint64>(scenario.sampleSec * 1000.0);
+    const qint64 endMs = static_cast<qint64>(scenario.durationSec * 1000.0);
+    while (clock.elapsed() < endMs) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+        if (server.state() == QProcess::NotRunning && scenario.url.isEmpty()) {
+            std::fprintf(stderr, "the stub server exited\n");
+            break;
+        }
+        const double nowSec = clock.elapsed() / 1000.0;
+        while (nextStorm < scenario.storms.size() && nowSec >= scenario.storms[nextStorm].atSec) {
+            const StormSpec storm = scenario.storms[nextStorm++];
+            std::printf("-- storm: %.0f%% of %s\n", storm.fraction * 100.0,
+                        storm.group.isEmpty() ? "all clients" : qPrintable(storm.group));
+            for (ClientPool *pool : std::as_const(pools))
+                QMetaObject::invokeMethod(pool, [pool, storm]() { pool->storm(storm.fraction, storm.group); });
+        }
+        if (clock.elapsed() < nextSampleMs)
+            continue;
+        nextSampleMs += static_cast<qint64>(scenario.sampleSec * 1000.0);
+
+        const Sample now = takeSample(stats, nowSec, serverPid);
+        const Sample &before = samples.back();
+        const double seconds = std::max(1e-3, now.atSec - before.atSec);
+        const LatencyHistogram::Snapshot sync = since(now.sync, before.sync);
+        const LatencyHistogram::Snapshot cmd = since(now.cmd, before.cmd);
+        std::printf("%8.0f %8lld %9.0f %9.0f %10.0f %8.2fms %8.2fms %8.2fms %8llu %8llu %9.1fMiB\n",
+                    now.atSec,
+                    static_cast<long long>(now.connected),
+                    (now.logins - before.logins) / seconds,
+                    (now.framesOut - before.framesOut) / seconds,
+                    (now.events - before.events) / seconds,
+                    sync.quantileUs(0.50) / 1000.0,
+                    sync.quantileUs(0.99) / 1000.0,
+                    cmd.quantileUs(0.99) / 1000.0,
+                    static_cast<unsigned long long>(now.disconnects - before.disconnects),
+                    static_cast<unsigned long long>(now.protocolErrors - before.protocolErrors),
+                    now.serverRssKiB >= 0 ? now.serverRssKiB / 1024.0 : 0.0);
+        std::fflush(stdout);
+        samples.push_back(now);
+    }
+
+    // Server memory before the clients go, so the last figure is under load.
+    const Sample last = takeSample(stats, clock.elapsed() / 1000.0, serverPid);
+    for (int i = 0; i < pools.size(); ++i) {
+        ClientPool *pool = pools.at(i);
+        QMetaObject::invokeMethod(pool, [pool]() { pool->stopAll(); }, Qt::BlockingQueuedConnection);
+        threads.at(i)->quit();
+        threads.at(i)->wait();
+        delete pool;
+        delete threads.at(i);
+    }
+    if (server.state() != QProcess::NotRunning) {
+        server.terminate();
+        if (!server.waitForFinished(5000)) {
+            server.kill();
+            server.waitForFinished();
+        }
+    }
+
+    const double seconds = std::max(1e-3, last.atSec);
+    std::printf("\ntotals over %.0f s:\n", seconds);
+    std::printf("  connects %llu (%llu failed), logins %llu (%llu refused), disconnects %llu\n",
+                static_cast<unsigned long long>(stats.connectAttempts.load()),
+                static_cast<unsigned long long>(stats.connectFailures.load()),
+                static_cast<unsigned long long>(stats.logins.load()),
+                static_cast<unsigned long long>(stats.loginFailures.load()),
+                static_cast<unsigned long long>(stats.disconnects.load()));
+    std::printf("  commands sent %.0f/s, frames received %.0f/s (%.1f MiB/s), events %.0f/s, protocol errors %llu\n",
+                stats.framesOut.load() / seconds,
+                stats.framesIn.load() / seconds,
+                stats.bytesIn.load() / seconds / (1024.0 * 1024.0),
+                stats.events.load() / seconds,
+                static_cast<unsigned long long>(stats.protocolErrors.load()));
+    std::printf("latency:\n");
+    printHistogram("connect", stats.connectLatency.snapshot());
+    printHistogram("login", stats.loginLatency.snapshot());
+    printHistogram("sync", stats.syncLatency.snapshot());
+    printHistogram("cmd.ack", stats.cmdAckLatency.snapshot());
+    printHistogram("cmd.response", stats.cmdResultLatency.snapshot());
+    std::printf("disconnects by reason:\n");
+    QJsonObject reasons;
+    {
+        std::lock_guard<std::mutex> lock(stats.reasonsMutex);
+        for (const auto &[reason, count] : stats.disconnectReasons) {
+            std::printf("  %8llu  %s\n", static_cast<unsigned long long>(count), reason.c_str());
+            reasons.insert(QString::fromStdString(reason), static_cast<qint64>(count));
+        }
+    }
+    qint64 firstRss = -1;
+    qint64 peakRss = -1;
+    for (const Sample &sample : samples) {
+        if (firstRss < 0)
+            firstRss = sample.serverRssKiB;
+        peakRss = std::max(peakRss, sample.serverRssKiB);
+    }
+    peakRss = std::max(peakRss, last.serverRssKiB);
+    if (last.serverRssKiB >= 0) {
+        std::printf("server memory: %.1f MiB at start, %.1f MiB peak, %.1f MiB at end (%+.1f MiB)\n",
+                    firstRss / 1024.0, peakRss / 1024.0, last.serverRssKiB / 1024.0,
+                    (last.serverRssKiB - firstRss) / 1024.0);
+    }
+
+    if (!jsonPath.isEmpty()) {
+        QJsonObject report;
+        report.insert(QStringLiteral("benchmark"), QStringLiteral("loadgen"));
+        report.insert(QStringLiteral("version"), 1);
+        report.insert(QStringLiteral("scenario"), scenario.name);
+        report.insert(QStringLiteral("url"), url.toString());
+        report.insert(QStringLiteral("clients"), totalClients);
+        report.insert(QStringLiteral("durationSec"), seconds);
+        QJsonObject totals;
+        totals.insert(QStringLiteral("connectAttempts"), static_cast<qint64>(stats.connectAttempts.load()));
+        totals.insert(QStringLiteral("connectFailures"), static_cast<qint64>(stats.connectFailures.load()));
+        totals.insert(QStringLiteral("logins"), static_cast<qint64>(stats.logins.load()));
+        totals.insert(QStringLiteral("loginFailures"), static_cast<qint64>(stats.loginFailures.load()));
+        totals.insert(QStringLiteral("disconnects"), static_cast<qint64>(stats.disconnects.load()));
+        totals.insert(QStringLiteral("framesOut"), static_cast<qint64>(stats.framesOut.load()));
+        totals.insert(QStringLiteral("framesIn"), static_cast<qint64>(stats.framesIn.load()));
+        totals.insert(QStringLiteral("bytesIn"), static_cast<qint64>(stats.bytesIn.load()));
+        totals.insert(QStringLiteral("events"), static_cast<qint64>(stats.events.load()));
+        totals.insert(QStringLiteral("syncAnswered"), static_cast<qint64>(stats.syncAnswered.load()));
+        totals.insert(QStringLiteral("cmdAnswered"), static_cast<qint64>(stats.cmdAnswered.load()));
+        totals.insert(QStringLiteral("protocolErrors"), static_cast<qint64>(stats.protocolErrors.load()));
+        report.insert(QStringLiteral("totals"), totals);
+        QJsonObject latency;
+        latency.insert(QStringLiteral("connect"), histogramJson(stats.connectLatency.snapshot()));
+        latency.insert(QStringLiteral("login"), histogramJson(stats.loginLatency.snapshot()));
+        latency.insert(QStringLiteral("sync"), histogramJson(stats.syncLatency.snapshot()));
+        latency.insert(QStringLiteral("cmdAck"), histogramJson(stats.cmdAckLatency.snapshot()));
+        latency.insert(QStringLiteral("cmdResponse"), histogramJson(stats.cmdResultLatency.snapshot()));
+        report.insert(QStringLiteral("latency"), latency);
+        report.insert(QStringLiteral("disconnectReasons"), reasons);
+        QJsonArray series;
+        for (const Sample &sample : samples) {
+            QJsonObject point;
+            point.insert(QStringLiteral("atSec"), sample.atSec);
+            point.insert(QStringLiteral("connected"), static_cast<qint64>(sample.connected));
+            point.insert(QStringLiteral("logins"), static_cast<qint64>(sample.logins));
+            point.insert(QStringLiteral("framesOut"), static_cast<qint64>(sample.framesOut));
+            point.insert(QStringLiteral("framesIn"), static_cast<qint64>(sample.framesIn));
+            point.insert(QStringLiteral("events"), static_cast<qint64>(sample.events));
+            point.insert(QStringLiteral("disconnects"), static_cast<qint64>(sample.disconnects));
+            point.insert(QStringLiteral("serverRssKiB"), sample.serverRssKiB);
+            series.append(point);
+        }
+        report.insert(QStringLiteral("samples"), series);
+        QFile file(jsonPath);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            std::fprintf(stderr, "cannot write %s\n", qPrintable(jsonPath));
+            return 1;
+        }
+        file.write(QJsonDocument(report).toJson(QJsonDocument::Indented));
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    const QStringList args = app.arguments();
+    const auto usage = [&]() {
+        std::fprintf(stderr,
+                     "usage: %s <scenario.json> [--json out.json] [--server-pid PID]\n"
+                     "       %s --serve <scenario.json>\n",
+                     argv[0], argv[0]);
+        return 1;
+    };
+    if (args.size() == 3 && args.at(1) == QLatin1String("--serve")) {
+        Scenario scenario;
+        QString error;
+        if (!loadScenario(args.at(2), &scenario, &error)) {
+            std::fprintf(stderr, "%s\n", qPrintable(error));
+            return 1;
+        }
+        return serve(scenario);
+    }
+    if (args.size() < 2 || args.at(1).startsWith(QLatin1String("--")))
+        return usage();
+
+    const QString scenarioPath = args.at(1);
+    QString jsonPath;
+    qint64 serverPid = 0;
+    for (qsizetype i = 2; i < args.size(); i += 2) {
+        if (i + 1 >= args.size())
+            return usage();
+        if (args.at(i) == QLatin1String("--json"))
+            jsonPath = args.at(i + 1);
+        else if (args.at(i) == QLatin1String("--server-pid"))
+            serverPid = args.at(i + 1).toLongLong();
+        else
+            return usage();
+    }
+    Scenario scenario;
+    QString error;
+    if (!loadScenario(scenarioPath, &scenario, &error)) {
+        std::fprintf(stderr, "%s\n", qPrintable(error));
+        return 1;
+    }
+    return drive(scenario, scenarioPath, jsonPath, serverPid);
+}
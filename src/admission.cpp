@@ -0,0 +1,178 @@
+#include "admission.h"
+
+#include <QHostAddress>
+#include <QTcpSocket>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <utility>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// Raw address bytes in network order, an IPv4-mapped IPv6 address as IPv4
+// (a dual-stack listener sees IPv4 clients that way, and the same client is
+// the same key either way), and empty for loopback and anything not IP.
+std::string addressKey(const QHostAddress &address)
+{
+    if (address.isNull())
+        return {};
+    bool isIPv4 = false;
+    const quint32 v4 = address.toIPv4Address(&isIPv4);
+    if (isIPv4) {
+        if ((v4 >> 24) == 127)
+            return {};
+        const unsigned char bytes[4] = {static_cast<unsigned char>(v4 >> 24),
+                                        static_cast<unsigned char>(v4 >> 16),
+                                        static_cast<unsigned char>(v4 >> 8),
+                                        static_cast<unsigned char>(v4)};
+        return std::string(reinterpret_cast<const char *>(bytes), sizeof bytes);
+    }
+    if (address.isLoopback())
+        return {};
+    const Q_IPV6ADDR v6 = address.toIPv6Address();
+    return std::string(reinterpret_cast<const char *>(v6.c), sizeof v6.c);
+}
+
+} // namespace
+
+ConnectionAdmission::ConnectionAdmission(AdmissionLimits limits)
+    : m_limits(limits)
+{
+}
+
+void ConnectionAdmission::setLimits(AdmissionLimits limits)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limits = limits;
+}
+
+ConnectionAdmission::Verdict ConnectionAdmission::admit(const std::string &peerKey)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // Handshakes first: a reconnect loop shows up there before it fills any
+    // other limit.
+    if (m_limits.maxHandshakes > 0 && m_handshakes >= m_limits.maxHandshakes) {
+        m_refusedHandshakes.fetch_add(1, std::memory_order_relaxed);
+        return Verdict::TooManyHandshakes;
+    }
+    if (m_limits.maxConnections > 0 && m_connections >= m_limits.maxConnections) {
+        m_refusedConnections.fetch_add(1, std::memory_order_relaxed);
+        return Verdict::TooManyConnections;
+    }
+    if (!peerKey.empty() && m_limits.maxPerAddress > 0) {
+        const auto it = m_perAddress.find(peerKey);
+        if (it != m_perAddress.end() && it->second >= m_limits.maxPerAddress) {
+            m_refusedFromAddress.fetch_add(1, std::memory_order_relaxed);
+            return Verdict::TooManyFromAddress;
+        }
+    }
+    ++m_connections;
+    ++m_handshakes;
+    if (!peerKey.empty())
+        ++m_perAddress[peerKey];
+    return Verdict::Admitted;
+}
+
+void ConnectionAdmission::finishHandshake()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_handshakes > 0)
+        --m_handshakes;
+}
+
+void ConnectionAdmission::release(const std::string &peerKey)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_connections > 0)
+        --m_connections;
+    if (peerKey.empty())
+        return;
+    const auto it = m_perAddress.find(peerKey);
+    if (it != m_perAddress.end() && --it->second <= 0)
+        m_perAddress.erase(it);
+}
+
+int ConnectionAdmission::connections() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_connections;
+}
+
+int ConnectionAdmission::handshakes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_handshakes;
+}
+
+std::uint64_t ConnectionAdmission::refused(Verdict reason) const
+{
+    switch (reason) {
+    case Verdict::TooManyConnections:
+        return m_refusedConnections.load(std::memory_order_relaxed);
+    case Verdict::TooManyFromAddress:
+        return m_refusedFromAddress.load(std::memory_order_relaxed);
+    case Verdict::TooManyHandshakes:
+        return m_refusedHandshakes.load(std::memory_order_relaxed);
+    case Verdict::Admitted:
+        break;
+    }
+    return 0;
+}
+
+AdmissionTicket::AdmissionTicket(std::shared_ptr<ConnectionAdmission> admission, std::string peerKey)
+    : m_admission(std::move(admission))
+    , m_peerKey(std::move(peerKey))
+{
+}
+
+AdmissionTicket::~AdmissionTicket()
+{
+    finishHandshake();
+    m_admission->release(m_peerKey);
+}
+
+void AdmissionTicket::finishHandshake()
+{
+    if (!m_handshaking)
+        return;
+    m_handshaking = false;
+    m_admission->finishHandshake();
+}
+
+bool peerKeyOf(std::intptr_t socketDescriptor, std::string *key)
+{
+#ifdef Q_OS_UNIX
+    sockaddr_storage peer{};
+    socklen_t length = sizeof peer;
+    if (::getpeername(static_cast<int>(socketDescriptor), reinterpret_cast<sockaddr *>(&peer), &length) != 0)
+        return false;
+    *key = addressKey(QHostAddress(reinterpret_cast<const sockaddr *>(&peer)));
+#else
+    // The peer cannot be asked for without a socket object taking the
+    // descriptor over; nothing is counted per address here.
+    Q_UNUSED(socketDescriptor);
+    key->clear();
+#endif
+    return true;
+}
+
+void refuseSocket(std::intptr_t socketDescriptor)
+{
+#ifdef Q_OS_UNIX
+    const int fd = static_cast<int>(socketDescriptor);
+    const linger reset{1, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+    ::close(fd);
+#else
+    QTcpSocket socket;
+    if (socket.setSocketDescriptor(socketDescriptor))
+        socket.abort();
+#endif
+}
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace phicore::transport::ws {
+
+// Limits on accepted connections, checked on the bare descriptor before any
+// socket object exists. 0 is no limit.
+struct AdmissionLimits {
+    int maxConnections = 0;
+    // Per peer address; loopback peers are not limited by it, since everything
+    // behind a local reverse proxy shares one.
+    int maxPerAddress = 0;
+    // Accepted and not yet upgraded (or failed): the TLS and HTTP handshakes
+    // are where an accepted socket costs the most before it has proven anything.
+    int maxHandshakes = 0;
+};
+
+// Counts what is admitted, across every shard. The transport admits on its own
+// thread; shards report back from theirs, so every call is thread-safe. Each
+// admitted connection is released once, and finishes its handshake once -
+// whether it ended in an upgrade or not.
+class ConnectionAdmission
+{
+public:
+    enum class Verdict { Admitted, TooManyConnections, TooManyFromAddress, TooManyHandshakes };
+
+    explicit ConnectionAdmission(AdmissionLimits limits);
+
+    /// For what is admitted from now on. Connections already admitted stay,
+    /// even where they are over the new limits.
+    void setLimits(AdmissionLimits limits);
+
+    /// `peerKey` as peerKeyOf() gives it; empty is not counted per address.
+    Verdict admit(const std::string &peerKey);
+    void finishHandshake();
+    void release(const std::string &peerKey);
+
+    int connections() const;
+    int handshakes() const;
+    std::uint64_t refused(Verdict reason) const;
+
+private:
+    mutable std::mutex m_mutex;
+    AdmissionLimits m_limits;
+    int m_connections = 0;
+    int m_handshakes = 0;
+    std::unordered_map<std::string, int> m_perAddress;
+    std::atomic<std::uint64_t> m_refusedConnections{0};
+    std::atomic<std::uint64_t> m_refusedFromAddress{0};
+    std::atomic<std::uint64_t> m_refusedHandshakes{0};
+};
+
+// One admitted connection's share of the counts, given back when the last
+// reference goes: the connection is released then, and its handshake finished
+// if nothing finished it before.
+class AdmissionTicket
+{
+public:
+    AdmissionTicket(std::shared_ptr<ConnectionAdmission> admission, std::string peerKey);
+    ~AdmissionTicket();
+
+    AdmissionTicket(const AdmissionTicket &) = delete;
+    AdmissionTicket &operator=(const AdmissionTicket &) = delete;
+
+    /// Once; later calls do nothing.
+    void finishHandshake();
+
+private:
+    const std::shared_ptr<ConnectionAdmission> m_admission;
+    const std::string m_peerKey;
+    bool m_handshaking = true;
+};
+
+/// The peer of an accepted socket as an admission key: the raw address bytes,
+/// an IPv4-mapped IPv6 address as IPv4, and empty for loopback. False when the
+/// descriptor has no peer (it was reset before we got to it). Read off the bare
+/// descriptor on Unix only; elsewhere always empty, so the per-address limit
+/// does not apply.
+bool peerKeyOf(std::intptr_t socketDescriptor, std::string *key);
+
+/// Closes an accepted socket with a reset rather than a FIN: nothing is read
+/// or written, and no TIME_WAIT is left behind on this side. Outside Unix it is
+/// an ordinary close.
+void refuseSocket(std::intptr_t socketDescriptor);
+
+} // namespace phicore::transport::ws
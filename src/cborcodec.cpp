@@ -0,0 +1,437 @@
+#include "cborcodec.h"
+
+#include "jsonscan.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace phicore::transport::ws::cbor {
+
+namespace {
+
+enum Major : unsigned {
+    kUnsigned = 0,
+    kNegative = 1,
+    kBytes = 2,
+    kText = 3,
+    kArray = 4,
+    kMap = 5,
+    kTag = 6,
+    kSimple = 7,
+};
+
+constexpr unsigned kIndefinite = 31;
+constexpr unsigned char kBreak = 0xff;
+constexpr unsigned char kFalse = 0xf4;
+constexpr unsigned char kTrue = 0xf5;
+constexpr unsigned char kNull = 0xf6;
+
+void appendHead(std::string *out, unsigned major, std::uint64_t value)
+{
+    const unsigned char type = static_cast<unsigned char>(major << 5);
+    if (value < 24) {
+        out->push_back(static_cast<char>(type | value));
+        return;
+    }
+    int bytes = 8;
+    unsigned char info = 27;
+    if (value <= 0xff) {
+        bytes = 1;
+        info = 24;
+    } else if (value <= 0xffff) {
+        bytes = 2;
+        info = 25;
+    } else if (value <= 0xffffffffu) {
+        bytes = 4;
+        info = 26;
+    }
+    out->push_back(static_cast<char>(type | info));
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8)
+        out->push_back(static_cast<char>((value >> shift) & 0xff));
+}
+
+// A container's size is known only once it has been read through, so its head
+// is written afterwards over a one-byte placeholder. Most containers in an
+// envelope are small enough that the placeholder is all the head they need.
+void patchHead(std::string *out, std::size_t at, unsigned major, std::uint64_t count)
+{
+    if (count < 24) {
+        (*out)[at] = static_cast<char>((major << 5) | count);
+        return;
+    }
+    std::string head;
+    appendHead(&head, major, count);
+    (*out)[at] = head[0];
+    out->insert(at + 1, head, 1);
+}
+
+void appendText(std::string *out, std::string_view text)
+{
+    appendHead(out, kText, text.size());
+    out->append(text);
+}
+
+template <typename T>
+void appendBigEndian(std::string *out, unsigned char initial, T bits)
+{
+    out->push_back(static_cast<char>(initial));
+    for (int shift = (static_cast<int>(sizeof(T)) - 1) * 8; shift >= 0; shift -= 8)
+        out->push_back(static_cast<char>((bits >> shift) & 0xff));
+}
+
+bool appendNumber(std::string *out, std::string_view text)
+{
+    // Integers stay integers while they fit; the rest are floats, as they are to
+    // QJsonValue. The slice was validated by the scanner already.
+    const bool negative = text.front() == '-';
+    const std::string_view digits = negative ? text.substr(1) : text;
+    if (digits.find_first_of(".eE") == std::string_view::npos) {
+        std::uint64_t magnitude = 0;
+        const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), magnitude);
+        // -0 is a float in CBOR; there is no negative integer zero.
+        if (error == std::errc() && end == digits.data() + digits.size() && !(negative && magnitude == 0)) {
+            if (negative)
+                appendHead(out, kNegative, magnitude - 1);
+            else
+                appendHead(out, kUnsigned, magnitude);
+            return true;
+        }
+    }
+
+    double value = 0.0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (end != text.data() + text.size())
+        return false;
+    if (error == std::errc::result_out_of_range && text.find_first_of("eE") != std::string_view::npos
+        && text[text.find_first_of("eE") + 1] == '-') {
+        // Too small to tell from zero, which is what QJsonDocument makes of it.
+        value = negative ? -0.0 : 0.0;
+    } else if (error != std::errc() || !std::isfinite(value)) {
+        // Too large is what QJsonDocument turns into infinity, and then refuses
+        // to write. Refused here as well.
+        return false;
+    }
+    const float narrow = static_cast<float>(value);
+    if (static_cast<double>(narrow) == value) {
+        std::uint32_t bits = 0;
+        std::memcpy(&bits, &narrow, sizeof(bits));
+        appendBigEndian(out, 0xfa, bits);
+    } else {
+        std::uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(bits));
+        appendBigEndian(out, 0xfb, bits);
+    }
+    return true;
+}
+
+bool writeValue(json::Cursor &cursor, int depth, std::string *out)
+{
+    switch (cursor.peekKind()) {
+    case json::Kind::Object: {
+        const std::size_t head = out->size();
+        out->push_back('\0');
+        std::uint64_t count = 0;
+        const bool ok = cursor.readObject(depth, [&](std::string_view key, json::Cursor &member) {
+            appendText(out, key);
+            ++count;
+            return writeValue(member, depth + 1, out);
+        });
+        if (!ok)
+            return false;
+        patchHead(out, head, kMap, count);
+        return true;
+    }
+    case json::Kind::Array: {
+        const std::size_t head = out->size();
+        out->push_back('\0');
+        std::uint64_t count = 0;
+        const bool ok = cursor.readArray(depth, [&](json::Cursor &element) {
+            ++count;
+            return writeValue(element, depth + 1, out);
+        });
+        if (!ok)
+            return false;
+        patchHead(out, head, kArray, count);
+        return true;
+    }
+    case json::Kind::String: {
+        // The scanner passes bytes through as they came; CBOR text has to be
+        // UTF-8, so a string that is not has no CBOR form.
+        std::string text;
+        if (!cursor.readString(&text) || !json::isValidUtf8(text))
+            return false;
+        appendText(out, text);
+        return true;
+    }
+    case json::Kind::Number: {
+        std::string_view slice;
+        return cursor.readValue(depth, &slice) && appendNumber(out, slice);
+    }
+    case json::Kind::Bool: {
+        std::string_view slice;
+        if (!cursor.readValue(depth, &slice))
+            return false;
+        out->push_back(static_cast<char>(slice == "true" ? kTrue : kFalse));
+        return true;
+    }
+    case json::Kind::Null:
+        if (!cursor.readValue(depth))
+            return false;
+        out->push_back(static_cast<char>(kNull));
+        return true;
+    case json::Kind::Invalid:
+        break;
+    }
+    return false;
+}
+
+double halfToDouble(std::uint16_t half)
+{
+    const int exponent = (half >> 10) & 0x1f;
+    const int mantissa = half & 0x3ff;
+    double value = 0.0;
+    if (exponent == 0)
+        value = std::ldexp(mantissa, -24);
+    else if (exponent != 31)
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    else
+        value = mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+    return (half & 0x8000) ? -value : value;
+}
+
+// A forward-only reader over one CBOR item, writing JSON as it goes.
+class Reader
+{
+public:
+    explicit Reader(std::string_view data)
+        : m_data(data)
+    {
+    }
+
+    bool atEnd() const { return m_pos == m_data.size(); }
+
+    bool readItem(int depth, std::string *out)
+    {
+        if (depth > json::kMaxDepth)
+            return false;
+        unsigned major = 0;
+        unsigned info = 0;
+        std::uint64_t value = 0;
+        if (!readHead(&major, &info, &value))
+            return false;
+        switch (major) {
+        case kUnsigned:
+            appendInteger(out, value);
+            return true;
+        case kNegative:
+            // -1 - value; the one that does not fit 64 bits is spelled out.
+            if (value == std::numeric_limits<std::uint64_t>::max()) {
+                out->append("-18446744073709551616");
+            } else {
+                out->push_back('-');
+                appendInteger(out, value + 1);
+            }
+            return true;
+        case kText: {
+            std::string text;
+            if (!readText(info, value, &text))
+                return false;
+            json::appendQuoted(out, text);
+            return true;
+        }
+        case kArray:
+            return readArray(depth, info, value, out);
+        case kMap:
+            return readMap(depth, info, value, out);
+        case kTag:
+            // Tags qualify a value (a date, a big number); JSON has nowhere to
+            // put the qualifier, so the value goes on alone.
+            return readItem(depth + 1, out);
+        case kSimple:
+            return readSimple(info, value, out);
+        case kBytes:
+            break;
+        }
+        return false;
+    }
+
+private:
+    bool readHead(unsigned *major, unsigned *info, std::uint64_t *value)
+    {
+        if (m_pos >= m_data.size())
+            return false;
+        const unsigned char initial = static_cast<unsigned char>(m_data[m_pos++]);
+        *major = initial >> 5;
+        *info = initial & 0x1f;
+        if (*info < 24) {
+            *value = *info;
+            return true;
+        }
+        if (*info == kIndefinite) {
+            // Only strings and containers come in pieces; the break byte is
+            // consumed by whoever is reading the pieces.
+            return *major == kText || *major == kBytes || *major == kArray || *major == kMap;
+        }
+        if (*info > 27)
+            return false;
+        const std::size_t bytes = std::size_t{1} << (*info - 24);
+        if (m_data.size() - m_pos < bytes)
+            return false;
+        *value = 0;
+        for (std::size_t i = 0; i < bytes; ++i)
+            *value = (*value << 8) | static_cast<unsigned char>(m_data[m_pos++]);
+        return true;
+    }
+
+    bool atBreak()
+    {
+        if (m_pos < m_data.size() && static_cast<unsigned char>(m_data[m_pos]) == kBreak) {
+            ++m_pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool readText(unsigned info, std::uint64_t length, std::string *out)
+    {
+        if (info != kIndefinite) {
+            if (m_data.size() - m_pos < length)
+                return false;
+            const std::string_view text = m_data.substr(m_pos, static_cast<std::size_t>(length));
+            m_pos += static_cast<std::size_t>(length);
+            if (!json::isValidUtf8(text))
+                return false;
+            out->append(text);
+            return true;
+        }
+        // Chunks are definite text strings each, and valid UTF-8 each.
+        while (!atBreak()) {
+            unsigned major = 0;
+            unsigned chunkInfo = 0;
+            std::uint64_t chunkLength = 0;
+            if (!readHead(&major, &chunkInfo, &chunkLength) || major != kText || chunkInfo == kIndefinite)
+                return false;
+            if (!readText(chunkInfo, chunkLength, out))
+                return false;
+        }
+        return true;
+    }
+
+    bool readArray(int depth, unsigned info, std::uint64_t count, std::string *out)
+    {
+        out->push_back('[');
+        for (std::uint64_t i = 0;; ++i) {
+            if (info == kIndefinite ? atBreak() : i == count)
+                break;
+            if (i > 0)
+                out->push_back(',');
+            if (!readItem(depth + 1, out))
+                return false;
+        }
+        out->push_back(']');
+        return true;
+    }
+
+    bool readMap(int depth, unsigned info, std::uint64_t count, std::string *out)
+    {
+        out->push_back('{');
+        std::string key;
+        for (std::uint64_t i = 0;; ++i) {
+            if (info == kIndefinite ? atBreak() : i == count)
+                break;
+            if (i > 0)
+                out->push_back(',');
+            // JSON keys are strings; a map keyed by anything else has no JSON
+            // form.
+            unsigned major = 0;
+            unsigned keyInfo = 0;
+            std::uint64_t keyLength = 0;
+            key.clear();
+            if (!readHead(&major, &keyInfo, &keyLength) || major != kText || !readText(keyInfo, keyLength, &key))
+                return false;
+            json::appendQuoted(out, key);
+            out->push_back(':');
+            if (!readItem(depth + 1, out))
+                return false;
+        }
+        out->push_back('}');
+        return true;
+    }
+
+    bool readSimple(unsigned info, std::uint64_t value, std::string *out)
+    {
+        double number = 0.0;
+        switch (info) {
+        case 20:
+            out->append("false");
+            return true;
+        case 21:
+            out->append("true");
+            return true;
+        case 22:
+        case 23:
+            out->append("null");
+            return true;
+        case 25:
+            number = halfToDouble(static_cast<std::uint16_t>(value));
+            break;
+        case 26: {
+            const std::uint32_t bits = static_cast<std::uint32_t>(value);
+            float narrow = 0.0f;
+            std::memcpy(&narrow, &bits, sizeof(narrow));
+            number = narrow;
+            break;
+        }
+        case 27:
+            std::memcpy(&number, &value, sizeof(number));
+            break;
+        default:
+            return false;
+        }
+        if (!std::isfinite(number))
+            return false;
+        char buffer[32];
+        const auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), number);
+        if (error != std::errc())
+            return false;
+        out->append(buffer, end);
+        return true;
+    }
+
+    static void appendInteger(std::string *out, std::uint64_t value)
+    {
+        char buffer[24];
+        const auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out->append(buffer, end);
+    }
+
+    std::string_view m_data;
+    std::size_t m_pos = 0;
+};
+
+} // namespace
+
+bool fromJson(std::string_view json, std::string *out)
+{
+    const std::size_t start = out->size();
+    json::Cursor cursor(json);
+    if (writeValue(cursor, 1, out) && cursor.atEnd())
+        return true;
+    out->resize(start);
+    return false;
+}
+
+bool toJson(std::string_view data, std::string *out)
+{
+    const std::size_t start = out->size();
+    Reader reader(data);
+    if (reader.readItem(1, out) && reader.atEnd())
+        return true;
+    out->resize(start);
+    return false;
+}
+
+} // namespace phicore::transport::ws::cbor
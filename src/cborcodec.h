@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace phicore::transport::ws::cbor {
+
+// The envelope as CBOR (RFC 8949), for connections that negotiated
+// phi-core-ws.v1+cbor. The data model is JSON's: the transport and core deal in
+// JSON text, and these convert at the edge of the wire in one pass each way,
+// without building a tree.
+//
+// JSON to CBOR:
+// - integers that fit 64 bits become CBOR integers, every other number a float:
+//   single precision when that holds it exactly, double otherwise
+// - arrays and objects get definite lengths
+// - a string that is not valid UTF-8 makes the conversion fail
+//
+// CBOR to JSON takes what a client's encoder is likely to produce: definite or
+// indefinite lengths, any float width, and tags (which are dropped). Byte
+// strings, non-text map keys, non-finite floats and simple values other than
+// false/true/null/undefined have no JSON form and are refused. Undefined reads
+// as null.
+
+/// Appends `json` as CBOR to `out`. False when `json` is not a single JSON value.
+bool fromJson(std::string_view json, std::string *out);
+
+/// Appends the single CBOR item in `data` to `out` as compact JSON text. False
+/// when `data` is not exactly one item, or holds one with no JSON form.
+bool toJson(std::string_view data, std::string *out);
+
+} // namespace phicore::transport::ws::cbor
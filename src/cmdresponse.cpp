@@ -0,0 +1,97 @@
+#include "cmdresponse.h"
+
+#include "jsonscan.h"
+
+#include <cmath>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// A number that does not fit a double, either way, may be one QJsonDocument
+// refuses; those go the old way rather than be guessed at.
+bool readRepresentableNumber(json::Cursor &cursor)
+{
+    const std::size_t start = cursor.position();
+    double value = 0.0;
+    if (!cursor.readNumber(&value))
+        return false;
+    if (!std::isfinite(value))
+        return false;
+    if (value != 0.0)
+        return true;
+    const std::string_view digits = cursor.text().substr(start, cursor.position() - start);
+    for (const char c : digits) {
+        if (c == 'e' || c == 'E')
+            break;
+        if (c >= '1' && c <= '9')
+            return false;
+    }
+    return true;
+}
+
+bool readRepresentableValue(json::Cursor &cursor, int depth)
+{
+    switch (cursor.peekKind()) {
+    case json::Kind::Object:
+        return cursor.readObject(depth, [depth](std::string_view, json::Cursor &member) {
+            return readRepresentableValue(member, depth + 1);
+        });
+    case json::Kind::Array:
+        return cursor.readArray(depth, [depth](json::Cursor &element) {
+            return readRepresentableValue(element, depth + 1);
+        });
+    case json::Kind::Number:
+        return readRepresentableNumber(cursor);
+    default:
+        return cursor.readValue(depth);
+    }
+}
+
+} // namespace
+
+bool spliceCmdResponsePayload(std::string_view resultJson, std::string_view cmdTopic, std::string *out)
+{
+    if (!json::isValidUtf8(resultJson))
+        return false;
+
+    json::Cursor cursor(resultJson);
+    if (cursor.peekKind() != json::Kind::Object)
+        return false;
+    const std::size_t open = cursor.position();
+
+    constexpr int depth = 1;
+    bool hasError = false;
+    bool hasMembers = false;
+    const bool ok = cursor.readObject(depth, [&](std::string_view key, json::Cursor &member) {
+        // Replacing a member means cutting it out of the text, duplicates and
+        // all; rare enough to leave to the parser.
+        if (key == "cmd")
+            return false;
+        if (key == "error")
+            hasError = true;
+        hasMembers = true;
+        return readRepresentableValue(member, depth + 1);
+    });
+    if (!ok)
+        return false;
+    const std::size_t close = cursor.position() - 1;
+    if (!cursor.atEnd())
+        return false;
+
+    // Everything up to the closing brace stays as core wrote it, member order
+    // and number spelling included; the new members go in before it.
+    out->clear();
+    out->reserve(close - open + cmdTopic.size() + 32);
+    out->append(resultJson.substr(open, close - open));
+    if (hasMembers)
+        out->push_back(',');
+    out->append("\"cmd\":");
+    json::appendQuoted(out, cmdTopic);
+    if (!hasError)
+        out->append(",\"error\":null");
+    out->push_back('}');
+    return true;
+}
+
+} // namespace phicore::transport::ws
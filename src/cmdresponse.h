@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace phicore::transport::ws {
+
+// The payload of a cmd.response: core's async result with `cmd` set to the
+// command's topic and `error` added as null when the result has none. Built by
+// splicing those members into the result text, which is read once and never
+// turned into a tree - results can be whole history exports.
+//
+// False means the text is one this path does not vouch for: not a single JSON
+// object, not valid UTF-8, a number QJsonDocument would refuse, or a `cmd`
+// member of its own that would have to be replaced. The caller then takes the
+// QJsonObject route, which decides those cases as it always has.
+bool spliceCmdResponsePayload(std::string_view resultJson, std::string_view cmdTopic, std::string *out);
+
+} // namespace phicore::transport::ws
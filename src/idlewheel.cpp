@@ -0,0 +1,33 @@
+#include "idlewheel.h"
+
+#include <algorithm>
+
+namespace phicore::transport::ws {
+
+IdleWheel::IdleWheel(std::int64_t tickMs, std::size_t slotCount)
+    : m_tickMs(std::max<std::int64_t>(1, tickMs))
+    , m_slots(std::max<std::size_t>(1, slotCount))
+{
+}
+
+void IdleWheel::schedule(std::uint64_t key, std::uint64_t ticket, std::int64_t deadlineMs)
+{
+    place(Entry{key, ticket, deadlineMs});
+}
+
+std::int64_t IdleWheel::tickFor(std::int64_t deadlineMs) const
+{
+    // Rounded up, so a slot is never visited before what it holds is due.
+    return (deadlineMs + m_tickMs - 1) / m_tickMs;
+}
+
+void IdleWheel::place(const Entry &entry)
+{
+    std::int64_t tick = tickFor(entry.deadlineMs);
+    // Already due, or due in a tick that was visited: the next visit takes it.
+    tick = std::max(tick, m_cursor);
+    m_slots[static_cast<std::size_t>(tick % static_cast<std::int64_t>(m_slots.size()))].push_back(entry);
+    ++m_size;
+}
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace phicore::transport::ws {
+
+// Deadlines on a hashed timing wheel: each slot holds the entries due in one
+// tick, so advancing the clock only visits what is due in the ticks that
+// passed. Scheduling is a push into one slot.
+//
+// Meant for deadlines that move often and rarely fire, such as idle sessions.
+// An entry is not moved when its deadline moves. When its slot comes round,
+// the visitor is asked for the current deadline, and a deadline still ahead
+// puts the entry back where it now belongs. Making the deadline later costs a
+// store. A deadline beyond one turn of the wheel is handled the same way and
+// costs one visit per turn.
+//
+// An entry is a key plus a ticket. Both are the owner's: a visitor that no
+// longer recognises the pair returns 0, and the entry is gone. Not thread-safe.
+class IdleWheel
+{
+public:
+    IdleWheel(std::int64_t tickMs, std::size_t slotCount);
+
+    std::int64_t tickMs() const { return m_tickMs; }
+    bool isEmpty() const { return m_size == 0; }
+
+    void schedule(std::uint64_t key, std::uint64_t ticket, std::int64_t deadlineMs);
+
+    /// Visits every entry due at or before `nowMs`. `visit(key, ticket)` returns
+    /// the entry's current deadline: one still ahead reschedules it, 0 (or
+    /// any deadline already passed) drops it.
+    template <typename Visit>
+    void advance(std::int64_t nowMs, Visit &&visit);
+
+private:
+    struct Entry {
+        std::uint64_t key = 0;
+        std::uint64_t ticket = 0;
+        std::int64_t deadlineMs = 0;
+    };
+
+    std::int64_t tickFor(std::int64_t deadlineMs) const;
+    void place(const Entry &entry);
+
+    const std::int64_t m_tickMs;
+    std::vector<std::vector<Entry>> m_slots;
+    // The next tick to be visited, counted from the clock's epoch. Starts at
+    // the epoch, so the first advance makes one full turn and sees everything.
+    std::int64_t m_cursor = 0;
+    std::size_t m_size = 0;
+};
+
+template <typename Visit>
+void IdleWheel::advance(std::int64_t nowMs, Visit &&visit)
+{
+    if (m_size == 0)
+        return;
+    const std::int64_t nowTick = nowMs / m_tickMs;
+    // After a stall longer than a turn, one pass over every slot sees
+    // everything; later ticks would only revisit the same slots.
+    const std::int64_t slotCount = static_cast<std::int64_t>(m_slots.size());
+    std::int64_t ticks = nowTick - m_cursor + 1;
+    if (ticks <= 0)
+        return;
+    if (ticks > slotCount)
+        ticks = slotCount;
+    std::vector<Entry> due;
+    for (std::int64_t i = 0; i < ticks; ++i) {
+        due.clear();
+        due.swap(m_slots[static_cast<std::size_t>((m_cursor + i) % slotCount)]);
+        m_size -= due.size();
+        for (const Entry &entry : due) {
+            if (entry.deadlineMs > nowMs) {
+                // A later turn of the wheel.
+                place(entry);
+                continue;
+            }
+            const std::int64_t deadlineMs = visit(entry.key, entry.ticket);
+            if (deadlineMs > nowMs)
+                place(Entry{entry.key, entry.ticket, deadlineMs});
+        }
+    }
+    m_cursor = nowTick + 1;
+}
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,98 @@
+#include "inboundenvelope.h"
+
+#include "jsonscan.h"
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// Reads a member that only counts as a string; anything else is stepped over
+// and leaves the field empty.
+bool readStringMember(json::Cursor &cursor, int depth, std::string *out)
+{
+    out->clear();
+    if (cursor.peekKind() == json::Kind::String)
+        return cursor.readString(out);
+    return cursor.readValue(depth);
+}
+
+} // namespace
+
+bool scanInboundEnvelope(std::string_view frame, InboundEnvelope *out)
+{
+    *out = InboundEnvelope{};
+    json::Cursor cursor(frame);
+    if (cursor.peekKind() != json::Kind::Object)
+        return false;
+
+    constexpr int depth = 1;
+    const bool ok = cursor.readObject(depth, [out](std::string_view key, json::Cursor &member) {
+        if (key == "type")
+            return readStringMember(member, depth + 1, &out->type);
+        if (key == "topic")
+            return readStringMember(member, depth + 1, &out->topic);
+        if (key == "cid") {
+            out->cidKind = InboundEnvelope::CidKind::Absent;
+            out->cidText.clear();
+            switch (member.peekKind()) {
+            case json::Kind::Number:
+                out->cidKind = InboundEnvelope::CidKind::Number;
+                return member.readNumber(&out->cidNumber);
+            case json::Kind::String:
+                out->cidKind = InboundEnvelope::CidKind::String;
+                return member.readString(&out->cidText);
+            default:
+                return member.readValue(depth + 1);
+            }
+        }
+        if (key == "payload") {
+            out->payload = "{}";
+            out->clientId.clear();
+            out->authToken.clear();
+            if (member.peekKind() != json::Kind::Object)
+                return member.readValue(depth + 1);
+            const std::size_t start = member.position();
+            const bool payloadOk =
+                member.readObject(depth + 1, [out](std::string_view payloadKey, json::Cursor &field) {
+                    if (payloadKey == "clientId")
+                        return readStringMember(field, depth + 2, &out->clientId);
+                    if (payloadKey == "authToken")
+                        return readStringMember(field, depth + 2, &out->authToken);
+                    return field.readValue(depth + 2);
+                });
+            if (!payloadOk)
+                return false;
+            out->payload = member.text().substr(start, member.position() - start);
+            return true;
+        }
+        return member.readValue(depth + 1);
+    });
+    return ok && cursor.atEnd();
+}
+
+bool scanBatchCommands(std::string_view payload, std::vector<std::string_view> *commands)
+{
+    commands->clear();
+    json::Cursor cursor(payload);
+    bool found = false;
+    constexpr int depth = 1;
+    const bool ok = cursor.readObject(depth, [&](std::string_view key, json::Cursor &member) {
+        if (key != "commands")
+            return member.readValue(depth + 1);
+        // The last occurrence wins, as for every other key.
+        commands->clear();
+        found = member.peekKind() == json::Kind::Array;
+        if (!found)
+            return member.readValue(depth + 1);
+        return member.readArray(depth + 1, [&](json::Cursor &element) {
+            std::string_view slice;
+            if (!element.readValue(depth + 2, &slice))
+                return false;
+            commands->push_back(slice);
+            return true;
+        });
+    });
+    return ok && found;
+}
+
+} // namespace phicore::transport::ws
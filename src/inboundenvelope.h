@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace phicore::transport::ws {
+
+// The envelope fields of one client frame, read in a single pass over its text.
+// Nothing here is a parsed tree: the payload stays a slice of the frame, so core
+// receives the bytes the client sent instead of a reserialized copy.
+struct InboundEnvelope {
+    // How `cid` arrived. Which shapes count as a valid cid is still the
+    // protocol's answer (cidFromNumber / cidFromString); this only records what
+    // was there.
+    enum class CidKind {
+        Absent,
+        Number,
+        String,
+    };
+
+    // Members that are not strings read as empty, as QJsonValue::toString()
+    // made of them.
+    std::string type;
+    std::string topic;
+    CidKind cidKind = CidKind::Absent;
+    double cidNumber = 0.0;
+    std::string cidText;
+    // A payload that is missing or not an object is `{}`, as before.
+    std::string_view payload = "{}";
+    // Read from the payload on the way through; only the session gate and the
+    // auth bookkeeping look at them.
+    std::string clientId;
+    std::string authToken;
+};
+
+/// Reads one frame. False means the text is not a single JSON object - the
+/// `invalid_json` case - and leaves `out` unspecified. Duplicate keys resolve
+/// to the last occurrence, as they did through QJsonDocument.
+bool scanInboundEnvelope(std::string_view frame, InboundEnvelope *out);
+
+/// Reads the commands out of a batch frame's payload, `{"commands": [...]}`:
+/// each element as the slice of text it was sent as, whatever it is, so every
+/// one can be answered on its own. False when there is no such array.
+bool scanBatchCommands(std::string_view payload, std::vector<std::string_view> *commands);
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,367 @@
+#include "jsonscan.h"
+
+#include <charconv>
+#include <limits>
+
+namespace phicore::transport::ws::json {
+
+namespace {
+
+bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+void appendUtf8(std::string *out, unsigned codePoint)
+{
+    if (codePoint < 0x80) {
+        out->push_back(static_cast<char>(codePoint));
+    } else if (codePoint < 0x800) {
+        out->push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+        out->push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else if (codePoint < 0x10000) {
+        out->push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+        out->push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else {
+        out->push_back(static_cast<char>(0xF0 | (codePoint >> 18)));
+        out->push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        out->push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+} // namespace
+
+void Cursor::skipWhitespace()
+{
+    while (m_pos < m_text.size()) {
+        const char c = m_text[m_pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            return;
+        ++m_pos;
+    }
+}
+
+bool Cursor::atEnd()
+{
+    skipWhitespace();
+    return m_pos == m_text.size();
+}
+
+bool Cursor::consume(char c)
+{
+    skipWhitespace();
+    if (m_pos < m_text.size() && m_text[m_pos] == c) {
+        ++m_pos;
+        return true;
+    }
+    return false;
+}
+
+Kind Cursor::peekKind()
+{
+    skipWhitespace();
+    if (m_pos >= m_text.size())
+        return Kind::Invalid;
+    switch (m_text[m_pos]) {
+    case '{':
+        return Kind::Object;
+    case '[':
+        return Kind::Array;
+    case '"':
+        return Kind::String;
+    case 't':
+    case 'f':
+        return Kind::Bool;
+    case 'n':
+        return Kind::Null;
+    default:
+        return m_text[m_pos] == '-' || isDigit(m_text[m_pos]) ? Kind::Number : Kind::Invalid;
+    }
+}
+
+bool Cursor::readHex4(unsigned *out)
+{
+    if (m_text.size() - m_pos < 4)
+        return false;
+    unsigned value = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = m_text[m_pos++];
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= static_cast<unsigned>(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            value |= static_cast<unsigned>(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            value |= static_cast<unsigned>(c - 'A' + 10);
+        else
+            return false;
+    }
+    *out = value;
+    return true;
+}
+
+bool Cursor::readString(std::string *out)
+{
+    if (m_pos >= m_text.size() || m_text[m_pos] != '"')
+        return false;
+    ++m_pos;
+    std::size_t runStart = m_pos;
+    while (m_pos < m_text.size()) {
+        const char c = m_text[m_pos];
+        if (c == '"') {
+            if (out)
+                out->append(m_text.substr(runStart, m_pos - runStart));
+            ++m_pos;
+            return true;
+        }
+        if (static_cast<unsigned char>(c) < 0x20)
+            return false;
+        if (c != '\\') {
+            ++m_pos;
+            continue;
+        }
+
+        if (out)
+            out->append(m_text.substr(runStart, m_pos - runStart));
+        ++m_pos;
+        if (m_pos >= m_text.size())
+            return false;
+        const char escaped = m_text[m_pos++];
+        char plain = 0;
+        switch (escaped) {
+        case '"':
+        case '\\':
+        case '/':
+            plain = escaped;
+            break;
+        case 'b':
+            plain = '\b';
+            break;
+        case 'f':
+            plain = '\f';
+            break;
+        case 'n':
+            plain = '\n';
+            break;
+        case 'r':
+            plain = '\r';
+            break;
+        case 't':
+            plain = '\t';
+            break;
+        case 'u': {
+            unsigned codePoint = 0;
+            if (!readHex4(&codePoint))
+                return false;
+            // A high surrogate followed by its low half is one code point; a
+            // lone half becomes U+FFFD, which is what QString makes of it too.
+            if (codePoint >= 0xD800 && codePoint <= 0xDBFF
+                && m_text.substr(m_pos, 2) == "\\u") {
+                const std::size_t save = m_pos;
+                m_pos += 2;
+                unsigned low = 0;
+                if (!readHex4(&low))
+                    return false;
+                if (low >= 0xDC00 && low <= 0xDFFF)
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                else
+                    m_pos = save;
+            }
+            if (codePoint >= 0xD800 && codePoint <= 0xDFFF)
+                codePoint = 0xFFFD;
+            if (out)
+                appendUtf8(out, codePoint);
+            break;
+        }
+        default:
+            return false;
+        }
+        if (plain && out)
+            out->push_back(plain);
+        runStart = m_pos;
+    }
+    return false;
+}
+
+bool Cursor::readNumber(double *out)
+{
+    const std::size_t start = m_pos;
+    if (m_pos < m_text.size() && m_text[m_pos] == '-')
+        ++m_pos;
+    if (m_pos >= m_text.size())
+        return false;
+    if (m_text[m_pos] == '0') {
+        ++m_pos;
+    } else if (isDigit(m_text[m_pos])) {
+        while (m_pos < m_text.size() && isDigit(m_text[m_pos]))
+            ++m_pos;
+    } else {
+        return false;
+    }
+    if (m_pos < m_text.size() && m_text[m_pos] == '.') {
+        ++m_pos;
+        if (m_pos >= m_text.size() || !isDigit(m_text[m_pos]))
+            return false;
+        while (m_pos < m_text.size() && isDigit(m_text[m_pos]))
+            ++m_pos;
+    }
+    if (m_pos < m_text.size() && (m_text[m_pos] == 'e' || m_text[m_pos] == 'E')) {
+        ++m_pos;
+        if (m_pos < m_text.size() && (m_text[m_pos] == '+' || m_text[m_pos] == '-'))
+            ++m_pos;
+        if (m_pos >= m_text.size() || !isDigit(m_text[m_pos]))
+            return false;
+        while (m_pos < m_text.size() && isDigit(m_text[m_pos]))
+            ++m_pos;
+    }
+    if (!out)
+        return true;
+    // from_chars leaves out-of-range values unconverted; they are still valid
+    // numbers, and end up where strtod would put them: underflow at zero,
+    // overflow at infinity.
+    const std::string_view digits = m_text.substr(start, m_pos - start);
+    const auto result = std::from_chars(digits.data(), digits.data() + digits.size(), *out);
+    if (result.ec == std::errc::result_out_of_range) {
+        const bool underflow = digits.find("e-") != std::string_view::npos
+            || digits.find("E-") != std::string_view::npos;
+        const double magnitude = underflow ? 0.0 : std::numeric_limits<double>::infinity();
+        *out = digits.front() == '-' ? -magnitude : magnitude;
+    }
+    return true;
+}
+
+bool Cursor::readLiteral(std::string_view literal)
+{
+    if (m_text.substr(m_pos, literal.size()) != literal)
+        return false;
+    m_pos += literal.size();
+    return true;
+}
+
+bool Cursor::readValue(int depth, std::string_view *slice, Kind *kind)
+{
+    const Kind next = peekKind();
+    const std::size_t start = m_pos;
+    bool ok = false;
+    switch (next) {
+    case Kind::Object:
+        ok = readObject(depth, [depth](std::string_view, Cursor &cursor) {
+            return cursor.readValue(depth + 1);
+        });
+        break;
+    case Kind::Array:
+        ok = readArray(depth, [depth](Cursor &cursor) {
+            return cursor.readValue(depth + 1);
+        });
+        break;
+    case Kind::String:
+        ok = readString(nullptr);
+        break;
+    case Kind::Number:
+        ok = readNumber(nullptr);
+        break;
+    case Kind::Bool:
+        ok = readLiteral("true") || readLiteral("false");
+        break;
+    case Kind::Null:
+        ok = readLiteral("null");
+        break;
+    case Kind::Invalid:
+        break;
+    }
+    if (!ok)
+        return false;
+    if (slice)
+        *slice = m_text.substr(start, m_pos - start);
+    if (kind)
+        *kind = next;
+    return true;
+}
+
+bool isValid(std::string_view text)
+{
+    Cursor cursor(text);
+    return cursor.readValue(1) && cursor.atEnd();
+}
+
+bool isValidUtf8(std::string_view text)
+{
+    const auto *bytes = reinterpret_cast<const unsigned char *>(text.data());
+    const std::size_t size = text.size();
+    std::size_t i = 0;
+    while (i < size) {
+        const unsigned char lead = bytes[i];
+        if (lead < 0x80) {
+            ++i;
+            continue;
+        }
+        std::size_t length = 0;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            if (lead == 0xE0)
+                low = 0xA0;
+            else if (lead == 0xED)
+                high = 0x9F;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            if (lead == 0xF0)
+                low = 0x90;
+            else if (lead == 0xF4)
+                high = 0x8F;
+        } else {
+            return false;
+        }
+        if (size - i < length)
+            return false;
+        if (bytes[i + 1] < low || bytes[i + 1] > high)
+            return false;
+        for (std::size_t k = 2; k < length; ++k) {
+            if (bytes[i + k] < 0x80 || bytes[i + k] > 0xBF)
+                return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+void appendQuoted(std::string *out, std::string_view value)
+{
+    static constexpr char kHex[] = "0123456789abcdef";
+    out->push_back('"');
+    for (const char c : value) {
+        switch (c) {
+        case '"':
+            out->append("\\\"");
+            break;
+        case '\\':
+            out->append("\\\\");
+            break;
+        case '\n':
+            out->append("\\n");
+            break;
+        case '\r':
+            out->append("\\r");
+            break;
+        case '\t':
+            out->append("\\t");
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out->append("\\u00");
+                out->push_back(kHex[(c >> 4) & 0xF]);
+                out->push_back(kHex[c & 0xF]);
+            } else {
+                out->push_back(c);
+            }
+        }
+    }
+    out->push_back('"');
+}
+
+} // namespace phicore::transport::ws::json
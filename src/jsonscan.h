@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace phicore::transport::ws::json {
+
+// What a value turned out to be. The scanner never builds a tree; callers read
+// the few members they care about and step over the rest.
+enum class Kind {
+    Invalid,
+    Object,
+    Array,
+    String,
+    Number,
+    Bool,
+    Null,
+};
+
+// QJsonDocument gives up at this depth. Matched so a frame this scanner accepts
+// is one the parser it replaced accepted as well.
+inline constexpr int kMaxDepth = 1024;
+
+// A validating, forward-only reader over JSON text (RFC 8259). Every read
+// function checks what it passes over, so walking a document to its end is the
+// same as validating it.
+class Cursor
+{
+public:
+    explicit Cursor(std::string_view text)
+        : m_text(text)
+    {
+    }
+
+    std::string_view text() const { return m_text; }
+    std::size_t position() const { return m_pos; }
+
+    void skipWhitespace();
+    /// True once only whitespace is left.
+    bool atEnd();
+    /// Skips whitespace and consumes `c` if it is next.
+    bool consume(char c);
+    /// Skips whitespace and says what the next value is, without reading it.
+    Kind peekKind();
+
+    /// Reads a string value. With `out`, the unescaped UTF-8 lands there.
+    bool readString(std::string *out);
+    /// Reads a number value as a double, the way QJsonValue holds every number.
+    bool readNumber(double *out);
+    /// Reads any value at `depth` and reports its raw text and kind.
+    bool readValue(int depth, std::string_view *slice = nullptr, Kind *kind = nullptr);
+
+    /// Walks the object at the cursor. `member(key, cursor)` must read exactly
+    /// one value and return false to abort; the walk fails if it does.
+    template <typename Member>
+    bool readObject(int depth, Member &&member);
+    /// Walks the array at the cursor; `element(cursor)` reads one value each.
+    template <typename Element>
+    bool readArray(int depth, Element &&element);
+
+private:
+    bool readLiteral(std::string_view literal);
+    bool readHex4(unsigned *out);
+
+    std::string_view m_text;
+    std::size_t m_pos = 0;
+};
+
+template <typename Member>
+bool Cursor::readObject(int depth, Member &&member)
+{
+    if (depth > kMaxDepth || !consume('{'))
+        return false;
+    if (consume('}'))
+        return true;
+    std::string key;
+    for (;;) {
+        skipWhitespace();
+        key.clear();
+        if (!readString(&key) || !consume(':'))
+            return false;
+        skipWhitespace();
+        if (!member(std::string_view(key), *this))
+            return false;
+        if (consume(','))
+            continue;
+        return consume('}');
+    }
+}
+
+template <typename Element>
+bool Cursor::readArray(int depth, Element &&element)
+{
+    if (depth > kMaxDepth || !consume('['))
+        return false;
+    if (consume(']'))
+        return true;
+    for (;;) {
+        skipWhitespace();
+        if (!element(*this))
+            return false;
+        if (consume(','))
+            continue;
+        return consume(']');
+    }
+}
+
+/// True when `text` is exactly one JSON value, optionally padded by whitespace.
+bool isValid(std::string_view text);
+
+/// Strict UTF-8: no overlong forms, no surrogates, nothing past U+10FFFF.
+/// QJsonDocument refuses a document with anything else in it.
+bool isValidUtf8(std::string_view text);
+
+/// Appends `value` to `out` as a JSON string literal.
+void appendQuoted(std::string *out, std::string_view value);
+
+} // namespace phicore::transport::ws::json
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace phicore::transport::ws {
+
+// The latest value per key, for state that is last-value-wins (channel states).
+// Bounded by keys and by the bytes the entries account for. A full cache keeps
+// updating the keys it has and turns new ones away rather than evicting: an
+// evicted key would make every later snapshot silently incomplete, a refused
+// one is counted and makes the cache say it is incomplete. Not thread-safe.
+template <typename T>
+class LastValueCache
+{
+public:
+    LastValueCache(std::size_t maxEntries, std::size_t maxBytes)
+        : m_maxEntries(maxEntries)
+        , m_maxBytes(maxBytes)
+    {
+    }
+
+    bool isEnabled() const { return m_maxEntries > 0; }
+    std::size_t size() const { return m_entries.size(); }
+    /// Keys and values, as accounted by the caller.
+    std::size_t bytes() const { return m_bytes; }
+    /// True once a key has been turned away; the cache no longer holds every
+    /// key it was offered.
+    bool isComplete() const { return m_refused == 0; }
+    std::size_t refused() const { return m_refused; }
+
+    /// `bytes` is what the value holds on to, the key not included.
+    void update(const std::string &key, std::size_t bytes, T value)
+    {
+        if (!isEnabled())
+            return;
+        const auto it = m_entries.find(key);
+        if (it != m_entries.end()) {
+            if (m_bytes - it->second.bytes + bytes > m_maxBytes) {
+                // The new value does not fit; the old one is stale. Neither
+                // is worth keeping.
+                m_bytes -= key.size() + it->second.bytes;
+                m_entries.erase(it);
+                ++m_refused;
+                return;
+            }
+            m_bytes = m_bytes - it->second.bytes + bytes;
+            it->second = Entry{bytes, std::move(value)};
+            return;
+        }
+        if (m_entries.size() >= m_maxEntries || m_bytes + key.size() + bytes > m_maxBytes) {
+            ++m_refused;
+            return;
+        }
+        m_bytes += key.size() + bytes;
+        m_entries.emplace(key, Entry{bytes, std::move(value)});
+    }
+
+    /// Takes new bounds. A cache that no longer fits them is emptied, and what
+    /// it held counts as turned away: it cannot tell which keys to keep any
+    /// better than it can when full. 0 entries turns it off and forgets it was
+    /// ever incomplete.
+    void setLimits(std::size_t maxEntries, std::size_t maxBytes)
+    {
+        m_maxEntries = maxEntries;
+        m_maxBytes = maxBytes;
+        if (m_maxEntries == 0) {
+            m_entries.clear();
+            m_bytes = 0;
+            m_refused = 0;
+            return;
+        }
+        if (m_entries.size() > m_maxEntries || m_bytes > m_maxBytes) {
+            m_refused += m_entries.size();
+            m_entries.clear();
+            m_bytes = 0;
+        }
+    }
+
+    /// Visits every value held, in no particular order.
+    template <typename Visit>
+    void forEach(Visit &&visit) const
+    {
+        for (const auto &[key, entry] : m_entries)
+            visit(entry.value);
+    }
+
+private:
+    struct Entry {
+        std::size_t bytes = 0;
+        T value;
+    };
+
+    std::size_t m_maxEntries = 0;
+    std::size_t m_maxBytes = 0;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::size_t m_bytes = 0;
+    std::size_t m_refused = 0;
+};
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,104 @@
+#include "metricsendpoint.h"
+
+#include <QByteArray>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// A scraper's request line and headers fit in far less; anything bigger is not
+// a scraper.
+constexpr qsizetype kMaxRequestBytes = 8 * 1024;
+// Long enough for a scraper on a busy box, short enough that an idle
+// connection does not sit here.
+constexpr int kRequestTimeoutMs = 5000;
+
+constexpr char kPrometheusContentType[] = "text/plain; version=0.0.4; charset=utf-8";
+
+} // namespace
+
+MetricsEndpoint::MetricsEndpoint(Render render, QObject *parent)
+    : QObject(parent)
+    , m_render(std::move(render))
+{
+}
+
+MetricsEndpoint::~MetricsEndpoint() = default;
+
+bool MetricsEndpoint::listen(const QHostAddress &address, quint16 port, QString *errorString)
+{
+    auto *server = new QTcpServer(this);
+    if (!server->listen(address, port)) {
+        if (errorString)
+            *errorString = QStringLiteral("Metrics endpoint: %1").arg(server->errorString());
+        delete server;
+        return false;
+    }
+    connect(server, &QTcpServer::newConnection, this, &MetricsEndpoint::onNewConnection);
+    m_server = server;
+    return true;
+}
+
+void MetricsEndpoint::onNewConnection()
+{
+    while (QTcpSocket *socket = m_server->nextPendingConnection()) {
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { onReadyRead(socket); });
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        QTimer::singleShot(kRequestTimeoutMs, socket, [socket]() { socket->abort(); });
+    }
+}
+
+void MetricsEndpoint::onReadyRead(QTcpSocket *socket)
+{
+    // Nothing is read until the headers are complete; the body, if a client
+    // sends one, is of no interest.
+    if (!socket->peek(kMaxRequestBytes).contains("\r\n\r\n")) {
+        if (socket->bytesAvailable() >= kMaxRequestBytes)
+            respond(socket, "431 Request Header Fields Too Large", "text/plain", "");
+        return;
+    }
+    const QByteArray requestLine = socket->readLine(kMaxRequestBytes).trimmed();
+    socket->readAll();
+    disconnect(socket, &QTcpSocket::readyRead, this, nullptr);
+
+    const QList<QByteArray> parts = requestLine.split(' ');
+    if (parts.size() != 3 || !parts.at(2).startsWith("HTTP/1.")) {
+        respond(socket, "400 Bad Request", "text/plain", "");
+        return;
+    }
+    if (parts.at(0) != "GET") {
+        respond(socket, "405 Method Not Allowed", "text/plain", "");
+        return;
+    }
+    // Query strings are ignored, as Prometheus sends none of its own.
+    const QByteArray path = parts.at(1).left(parts.at(1).indexOf('?'));
+    if (path != "/metrics") {
+        respond(socket, "404 Not Found", "text/plain", "");
+        return;
+    }
+    respond(socket, "200 OK", kPrometheusContentType, m_render());
+}
+
+void MetricsEndpoint::respond(QTcpSocket *socket,
+                              const char *status,
+                              const std::string &contentType,
+                              const std::string &body)
+{
+    QByteArray response;
+    response.reserve(static_cast<qsizetype>(body.size()) + 128);
+    response += "HTTP/1.1 ";
+    response += status;
+    response += "\r\nContent-Type: ";
+    response += QByteArray::fromStdString(contentType);
+    response += "\r\nContent-Length: ";
+    response += QByteArray::number(static_cast<qsizetype>(body.size()));
+    response += "\r\nConnection: close\r\n\r\n";
+    response += QByteArray::fromStdString(body);
+    socket->write(response);
+    socket->disconnectFromHost();
+}
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QHostAddress>
+#include <QObject>
+#include <QString>
+
+#include <functional>
+#include <string>
+
+class QTcpServer;
+class QTcpSocket;
+
+namespace phicore::transport::ws {
+
+// A scrape target and nothing else: answers GET /metrics with whatever the
+// render function returns, in Prometheus' text format, and closes. One request
+// per connection, no keep-alive, no TLS - it is meant for loopback or a
+// management network, not for the port clients connect to.
+class MetricsEndpoint final : public QObject
+{
+    Q_OBJECT
+
+public:
+    using Render = std::function<std::string()>;
+
+    MetricsEndpoint(Render render, QObject *parent = nullptr);
+    ~MetricsEndpoint() override;
+
+    bool listen(const QHostAddress &address, quint16 port, QString *errorString);
+
+private slots:
+    void onNewConnection();
+
+private:
+    void onReadyRead(QTcpSocket *socket);
+    static void respond(QTcpSocket *socket, const char *status, const std::string &contentType, const std::string &body);
+
+    Render m_render;
+    QTcpServer *m_server = nullptr;
+};
+
+} // namespace phicore::transport::ws
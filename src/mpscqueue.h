@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace phicore::transport::ws {
+
+// Many threads push, one thread pops, and neither side takes a lock: a push is
+// an allocation, one atomic exchange and one store, and never waits for the
+// consumer or for another producer. The intrusive MPSC queue after Dmitry
+// Vyukov, with the nodes allocated here.
+//
+// A producer stopped between its exchange and its store hides what was pushed
+// after it for that moment; tryPop() then reports nothing, as if those items
+// had not arrived yet. The consumer has to come back for them once that push
+// completes - WsTransport does, because every producer schedules a drain after
+// its push.
+//
+// T must be default-constructible; the queue keeps one value-less node.
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+        : m_head(&m_stub)
+        , m_tail(&m_stub)
+    {
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while (tryPop(&value)) {
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    /// Any thread.
+    void push(T value) { pushNode(new Node{std::move(value)}); }
+
+    /// The consumer's thread only. False when nothing is there, or nothing is
+    /// there yet.
+    bool tryPop(T *value)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next)
+                return false;
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (!next) {
+            // The last node can only be taken with something behind it: a push
+            // in progress will link to it. With none, the stub goes behind it.
+            if (tail != m_head.load(std::memory_order_acquire))
+                return false;
+            pushNode(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (!next)
+                return false;
+        }
+        *value = std::move(tail->value);
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node {
+        T value;
+        std::atomic<Node *> next{nullptr};
+    };
+
+    void pushNode(Node *node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node *previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    Node m_stub;
+    // Producers and the consumer each on a cache line of their own.
+    alignas(64) std::atomic<Node *> m_head;
+    alignas(64) Node *m_tail;
+};
+
+} // namespace phicore::transport::ws
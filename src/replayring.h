@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+namespace phicore::transport::ws {
+
+// The most recent events, by sequence number, for clients that reconnect and
+// say where they left off. Bounded twice: by entries, and by the bytes the
+// entries account for, so a run of large events cannot hold on to more memory
+// than a run of small ones. The oldest entries go first.
+//
+// Sequence numbers are expected to increase; a gap between two entries is
+// taken to be events that were never pushed, and replaying across it is
+// refused like replaying from before the oldest entry. Not thread-safe.
+template <typename T>
+class ReplayRing
+{
+public:
+    ReplayRing(std::size_t maxEntries, std::size_t maxBytes)
+        : m_maxEntries(maxEntries)
+        , m_maxBytes(maxBytes)
+    {
+    }
+
+    bool isEnabled() const { return m_maxEntries > 0; }
+    std::size_t size() const { return m_entries.size(); }
+    std::size_t bytes() const { return m_bytes; }
+    /// The oldest sequence number still held; 0 when empty.
+    std::uint64_t firstSeq() const { return m_entries.empty() ? 0 : m_entries.front().seq; }
+    /// The newest sequence number ever pushed, held or not; 0 before the first.
+    std::uint64_t lastSeq() const { return m_lastSeq; }
+
+    void push(std::uint64_t seq, std::size_t bytes, T value)
+    {
+        if (!isEnabled())
+            return;
+        if (seq != m_lastSeq + 1 && m_lastSeq != 0)
+            clear();
+        m_lastSeq = seq;
+        // An entry bigger than the whole budget is not kept; everything before
+        // it is then older than what the ring can vouch for.
+        if (bytes > m_maxBytes) {
+            clear();
+            return;
+        }
+        m_entries.push_back(Entry{seq, bytes, std::move(value)});
+        m_bytes += bytes;
+        trim();
+    }
+
+    /// Takes new bounds; what no longer fits goes, oldest first. 0 entries
+    /// turns the ring off and empties it, and forgets the last sequence number:
+    /// it sees nothing while off, so once on again it vouches for nothing
+    /// before the next push.
+    void setLimits(std::size_t maxEntries, std::size_t maxBytes)
+    {
+        m_maxEntries = maxEntries;
+        m_maxBytes = maxBytes;
+        trim();
+        if (m_maxEntries == 0)
+            m_lastSeq = 0;
+    }
+
+    /// Visits every entry after `afterSeq`, oldest first, as `visit(seq, value)`.
+    /// False, visiting nothing, when some of them are no longer held - or when
+    /// `afterSeq` is ahead of anything pushed, which only a client that saw a
+    /// different sequence can claim.
+    template <typename Visit>
+    bool replayAfter(std::uint64_t afterSeq, Visit &&visit) const
+    {
+        if (afterSeq > m_lastSeq)
+            return false;
+        if (afterSeq == m_lastSeq)
+            return true;
+        if (m_entries.empty() || afterSeq + 1 < m_entries.front().seq)
+            return false;
+        const auto first = m_entries.begin() + static_cast<std::ptrdiff_t>(afterSeq + 1 - m_entries.front().seq);
+        for (auto it = first; it != m_entries.end(); ++it)
+            visit(it->seq, it->value);
+        return true;
+    }
+
+    void clear()
+    {
+        m_entries.clear();
+        m_bytes = 0;
+    }
+
+private:
+    void trim()
+    {
+        while (m_entries.size() > m_maxEntries || m_bytes > m_maxBytes) {
+            m_bytes -= m_entries.front().bytes;
+            m_entries.pop_front();
+        }
+    }
+
+    struct Entry {
+        std::uint64_t seq = 0;
+        std::size_t bytes = 0;
+        T value;
+    };
+
+    std::size_t m_maxEntries = 0;
+    std::size_t m_maxBytes = 0;
+    std::deque<Entry> m_entries;
+    std::size_t m_bytes = 0;
+    std::uint64_t m_lastSeq = 0;
+};
+
+} // namespace phicore::transport::ws
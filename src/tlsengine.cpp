@@ -0,0 +1,234 @@
+#include "tlsengine.h"
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <algorithm>
+#include <climits>
+
+namespace phicore::transport::ws::tls {
+
+namespace {
+
+// Names the sessions this context issues; OpenSSL refuses to resume a cached
+// session under a context with a different one.
+constexpr std::string_view kSessionIdContext = "phi-transport-ws";
+// What one SSL_read takes at most: one TLS record's worth.
+constexpr int kReadChunkBytes = 16 * 1024;
+
+// The oldest entry of OpenSSL's error queue for this thread, with the rest of
+// the queue cleared.
+std::string lastError(std::string_view fallback)
+{
+    const unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0)
+        return std::string(fallback);
+    char text[256];
+    ERR_error_string_n(code, text, sizeof text);
+    return text;
+}
+
+} // namespace
+
+std::shared_ptr<const ServerContext> ServerContext::create(const ServerSettings &settings, std::string *error)
+{
+    const auto refuse = [error](std::string reason) -> std::shared_ptr<const ServerContext> {
+        if (error)
+            *error = std::move(reason);
+        return nullptr;
+    };
+
+    ERR_clear_error();
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    if (!context)
+        return refuse(lastError("Cannot create a TLS context"));
+    // Owned from here, so every early return below frees it.
+    std::shared_ptr<const ServerContext> owner(new ServerContext(context));
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    // Renegotiation is a client asking for a handshake's worth of our CPU on
+    // an established connection, for nothing a WebSocket needs.
+    SSL_CTX_set_options(context, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // Idle connections are most of them; their read and write buffers go back
+    // until there is something to read or write.
+    SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(context, settings.certificatePath.c_str()) != 1)
+        return refuse("Cannot load TLS certificate '" + settings.certificatePath + "': " + lastError("unreadable"));
+    if (SSL_CTX_use_PrivateKey_file(context, settings.privateKeyPath.c_str(), SSL_FILETYPE_PEM) != 1)
+        return refuse("Cannot load TLS private key '" + settings.privateKeyPath + "': " + lastError("unreadable"));
+    if (SSL_CTX_check_private_key(context) != 1)
+        return refuse("TLS private key does not match the certificate: " + lastError("mismatch"));
+
+    SSL_CTX_set_session_id_context(context,
+                                   reinterpret_cast<const unsigned char *>(kSessionIdContext.data()),
+                                   static_cast<unsigned int>(kSessionIdContext.size()));
+    if (settings.sessionTimeoutSec > 0)
+        SSL_CTX_set_timeout(context, settings.sessionTimeoutSec);
+    if (settings.sessionCacheSize > 0) {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(context, static_cast<long>(settings.sessionCacheSize));
+    } else {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    }
+    if (!settings.sessionTickets) {
+        // With the cache on, TLS 1.3 still hands out tickets, but ones that
+        // only name a cached session; with it off, none at all.
+        SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+        if (settings.sessionCacheSize == 0)
+            SSL_CTX_set_num_tickets(context, 0);
+    }
+    return owner;
+}
+
+ServerContext::ServerContext(SSL_CTX *context)
+    : m_context(context)
+{
+}
+
+ServerContext::~ServerContext()
+{
+    SSL_CTX_free(m_context);
+}
+
+Session::Session(SSL_CTX *context, Role role)
+{
+    m_ssl = SSL_new(context);
+    m_incoming = BIO_new(BIO_s_mem());
+    m_outgoing = BIO_new(BIO_s_mem());
+    if (!m_ssl || !m_incoming || !m_outgoing) {
+        BIO_free(m_incoming);
+        BIO_free(m_outgoing);
+        m_incoming = nullptr;
+        m_outgoing = nullptr;
+        fail();
+        return;
+    }
+    // An empty buffer means "wait for more", not end of stream; the socket
+    // says when the stream ends.
+    BIO_set_mem_eof_return(m_incoming, -1);
+    SSL_set_bio(m_ssl, m_incoming, m_outgoing);
+    if (role == Role::Server)
+        SSL_set_accept_state(m_ssl);
+    else
+        SSL_set_connect_state(m_ssl);
+}
+
+Session::~Session()
+{
+    // OpenSSL forgets a session whose connection ended without close_notify,
+    // and a dropped connection - a laptop lid, a Wi-Fi handover - is the one
+    // most likely to come straight back. Established sessions are let go of as
+    // if closed cleanly, so they stay resumable.
+    if (m_ssl && m_established && !m_failed)
+        SSL_set_shutdown(m_ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    // Frees both BIOs with it.
+    SSL_free(m_ssl);
+}
+
+bool Session::isResumed() const
+{
+    return m_ssl && SSL_session_reused(m_ssl) == 1;
+}
+
+bool Session::feed(std::string_view cipher, std::string *plain)
+{
+    if (m_failed)
+        return false;
+    while (!cipher.empty()) {
+        const int chunk = static_cast<int>(std::min<std::size_t>(cipher.size(), INT_MAX));
+        if (BIO_write(m_incoming, cipher.data(), chunk) != chunk) {
+            fail();
+            return false;
+        }
+        cipher.remove_prefix(static_cast<std::size_t>(chunk));
+    }
+    return advance(plain);
+}
+
+bool Session::advance(std::string *plain)
+{
+    ERR_clear_error();
+    if (!m_established) {
+        const int result = SSL_do_handshake(m_ssl);
+        if (result != 1) {
+            const int error = SSL_get_error(m_ssl, result);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+                return true;
+            fail();
+            return false;
+        }
+        m_established = true;
+    }
+    // Also where TLS 1.3 session tickets arrive on a client, after the
+    // handshake proper.
+    char buffer[kReadChunkBytes];
+    for (;;) {
+        const int read = SSL_read(m_ssl, buffer, sizeof buffer);
+        if (read > 0) {
+            plain->append(buffer, static_cast<std::size_t>(read));
+            continue;
+        }
+        const int error = SSL_get_error(m_ssl, read);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+            return true;
+        if (error == SSL_ERROR_ZERO_RETURN) {
+            m_closedByPeer = true;
+            return true;
+        }
+        fail();
+        return false;
+    }
+}
+
+bool Session::write(std::string_view plain)
+{
+    if (m_failed || !m_established)
+        return false;
+    ERR_clear_error();
+    while (!plain.empty()) {
+        // Memory BIOs take everything, so a write is never partial.
+        const int chunk = static_cast<int>(std::min<std::size_t>(plain.size(), INT_MAX));
+        if (SSL_write(m_ssl, plain.data(), chunk) != chunk) {
+            fail();
+            return false;
+        }
+        plain.remove_prefix(static_cast<std::size_t>(chunk));
+    }
+    return true;
+}
+
+void Session::shutdown()
+{
+    if (m_failed || !m_established)
+        return;
+    ERR_clear_error();
+    SSL_shutdown(m_ssl);
+    ERR_clear_error();
+}
+
+std::size_t Session::pendingOutgoing() const
+{
+    return m_outgoing ? BIO_ctrl_pending(m_outgoing) : 0;
+}
+
+void Session::takeOutgoing(std::string *out)
+{
+    const std::size_t pending = pendingOutgoing();
+    if (pending == 0)
+        return;
+    const std::size_t start = out->size();
+    out->resize(start + pending);
+    const int read = BIO_read(m_outgoing, out->data() + start, static_cast<int>(pending));
+    out->resize(start + static_cast<std::size_t>(std::max(read, 0)));
+}
+
+void Session::fail()
+{
+    m_failed = true;
+    m_error = lastError("TLS session failed");
+}
+
+} // namespace phicore::transport::ws::tls
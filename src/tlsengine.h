@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct ssl_ctx_st;
+struct ssl_st;
+struct bio_st;
+
+namespace phicore::transport::ws::tls {
+
+// Server-side TLS for wss://, on OpenSSL directly rather than QSslSocket: Qt
+// builds a fresh OpenSSL context for every server socket, so neither its
+// session cache nor its ticket keys outlive the connection, and a client that
+// reconnects always pays for a full handshake. Here one context serves every
+// connection on every shard, and resumption works both ways a client may ask
+// for it - a session ID from the server's cache, or a session ticket sealed
+// with the context's keys.
+//
+// Qt-free; TlsServerSocket puts it under a QWebSocket.
+
+struct ServerSettings {
+    std::string certificatePath;
+    std::string privateKeyPath;
+    // Sessions kept for session-ID resumption; 0 keeps none.
+    std::size_t sessionCacheSize = 0;
+    // How long a cached session or a ticket stays good for.
+    long sessionTimeoutSec = 0;
+    bool sessionTickets = true;
+};
+
+// A certificate, its key and the session state shared by the connections that
+// use it. Safe to share across threads once created.
+class ServerContext
+{
+public:
+    /// Loads the PEM certificate chain and private key. Null, with the reason
+    /// in `error`, when either is unreadable or they do not match.
+    static std::shared_ptr<const ServerContext> create(const ServerSettings &settings, std::string *error);
+    ~ServerContext();
+
+    ServerContext(const ServerContext &) = delete;
+    ServerContext &operator=(const ServerContext &) = delete;
+
+    ssl_ctx_st *native() const { return m_context; }
+
+private:
+    explicit ServerContext(ssl_ctx_st *context);
+
+    ssl_ctx_st *m_context = nullptr;
+};
+
+// One connection's TLS state, driven by whoever owns the socket: bytes read
+// from the network go into feed(), bytes to send come out of takeOutgoing().
+// The handshake runs inside feed(). Not thread-safe.
+class Session
+{
+public:
+    enum class Role { Server, Client };
+
+    /// The context is held on to for as long as the session lives.
+    Session(ssl_ctx_st *context, Role role);
+    ~Session();
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    bool isEstablished() const { return m_established; }
+    bool hasFailed() const { return m_failed; }
+    /// The peer sent close_notify.
+    bool isClosedByPeer() const { return m_closedByPeer; }
+    /// Whether the handshake resumed an earlier session. Meaningful once
+    /// established.
+    bool isResumed() const;
+    /// OpenSSL's reason for the failure, empty before one.
+    const std::string &errorString() const { return m_error; }
+
+    /// Feeds bytes read from the network, advancing the handshake as far as
+    /// they allow, and appends what they decrypt to `plain`. False once the
+    /// session has failed; nothing more should be read or written then.
+    bool feed(std::string_view cipher, std::string *plain);
+    /// Encrypts `plain`. False when the session is not established or failed.
+    bool write(std::string_view plain);
+    /// Queues close_notify.
+    void shutdown();
+    /// Bytes waiting to go out to the network.
+    std::size_t pendingOutgoing() const;
+    /// Appends the bytes waiting to go out to `out` and forgets them.
+    void takeOutgoing(std::string *out);
+
+    ssl_st *native() const { return m_ssl; }
+
+private:
+    // Runs the handshake, then reads; false on a fatal error.
+    bool advance(std::string *plain);
+    void fail();
+
+    ssl_st *m_ssl = nullptr;
+    // Owned by m_ssl: what came in from the network, and what is to go out.
+    bio_st *m_incoming = nullptr;
+    bio_st *m_outgoing = nullptr;
+    bool m_established = false;
+    bool m_failed = false;
+    bool m_closedByPeer = false;
+    std::string m_error;
+};
+
+} // namespace phicore::transport::ws::tls
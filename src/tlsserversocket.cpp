@@ -0,0 +1,215 @@
+#include "tlsserversocket.h"
+
+#include <QTimer>
+
+#include <algorithm>
+#include <cstring>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// A peer that does not read what is left to write is not waited for longer
+// than this once the connection is closing.
+constexpr int kCloseTimeoutMs = 5000;
+
+} // namespace
+
+TlsServerSocket::TlsServerSocket(std::shared_ptr<const tls::ServerContext> context, QObject *parent)
+    : QTcpSocket(parent)
+    , m_context(std::move(context))
+    , m_session(m_context->native(), tls::Session::Role::Server)
+    , m_cipher(new QTcpSocket(this))
+    , m_deadline(new QTimer(this))
+{
+    m_deadline->setSingleShot(true);
+}
+
+TlsServerSocket::~TlsServerSocket() = default;
+
+bool TlsServerSocket::start(qintptr socketDescriptor, int handshakeTimeoutMs)
+{
+    if (m_session.hasFailed() || !m_cipher->setSocketDescriptor(socketDescriptor))
+        return false;
+    setPeerAddress(m_cipher->peerAddress());
+    setPeerPort(m_cipher->peerPort());
+    setLocalAddress(m_cipher->localAddress());
+    setLocalPort(m_cipher->localPort());
+    setSocketState(QAbstractSocket::ConnectedState);
+    // Unbuffered: the plaintext is held here, in m_incoming, and QIODevice's
+    // own buffer would only be a second copy of it.
+    QIODevice::open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+
+    connect(m_cipher, &QTcpSocket::readyRead, this, &TlsServerSocket::onCipherReadyRead);
+    connect(m_cipher, &QTcpSocket::disconnected, this, &TlsServerSocket::onCipherDisconnected);
+    connect(m_cipher, &QTcpSocket::bytesWritten, this, [this](qint64 bytes) {
+        if (isEncrypted())
+            emit bytesWritten(bytes);
+    });
+    connect(m_cipher, &QAbstractSocket::errorOccurred, this, [this](QAbstractSocket::SocketError error) {
+        if (!isEncrypted())
+            return;
+        setSocketError(error);
+        setErrorString(m_cipher->errorString());
+        emit errorOccurred(error);
+    });
+    connect(m_deadline, &QTimer::timeout, this, [this]() {
+        if (!isEncrypted()) {
+            failHandshake(QStringLiteral("TLS handshake timed out"));
+            return;
+        }
+        m_cipher->abort();
+    });
+    m_deadline->start(handshakeTimeoutMs);
+    return true;
+}
+
+qint64 TlsServerSocket::bytesAvailable() const
+{
+    // QIODevice's count is what a transaction or a peek has read ahead.
+    return m_incoming.size() - m_readOffset + QIODevice::bytesAvailable();
+}
+
+qint64 TlsServerSocket::bytesToWrite() const
+{
+    return m_cipher->bytesToWrite();
+}
+
+bool TlsServerSocket::canReadLine() const
+{
+    return m_incoming.indexOf('\n', m_readOffset) >= 0 || QIODevice::canReadLine();
+}
+
+void TlsServerSocket::disconnectFromHost()
+{
+    if (state() != QAbstractSocket::ConnectedState)
+        return;
+    m_session.shutdown();
+    flushOutgoing();
+    setSocketState(QAbstractSocket::ClosingState);
+    emit stateChanged(QAbstractSocket::ClosingState);
+    m_cipher->disconnectFromHost();
+    if (m_cipher->state() != QAbstractSocket::UnconnectedState)
+        m_deadline->start(kCloseTimeoutMs);
+}
+
+void TlsServerSocket::close()
+{
+    QIODevice::close();
+    if (state() == QAbstractSocket::UnconnectedState)
+        return;
+    m_session.shutdown();
+    flushOutgoing();
+    m_cipher->flush();
+    // Emits disconnected() through onCipherDisconnected before returning, as
+    // QTcpSocket's own abort() does.
+    m_cipher->abort();
+}
+
+void TlsServerSocket::setSocketOption(QAbstractSocket::SocketOption option, const QVariant &value)
+{
+    m_cipher->setSocketOption(option, value);
+}
+
+QVariant TlsServerSocket::socketOption(QAbstractSocket::SocketOption option)
+{
+    return m_cipher->socketOption(option);
+}
+
+qint64 TlsServerSocket::readData(char *data, qint64 maxSize)
+{
+    const qint64 count = std::min<qint64>(maxSize, m_incoming.size() - m_readOffset);
+    if (count <= 0)
+        return state() == QAbstractSocket::ConnectedState ? 0 : -1;
+    std::memcpy(data, m_incoming.constData() + m_readOffset, static_cast<std::size_t>(count));
+    m_readOffset += count;
+    if (m_readOffset == m_incoming.size()) {
+        m_incoming.clear();
+        m_readOffset = 0;
+    }
+    return count;
+}
+
+qint64 TlsServerSocket::writeData(const char *data, qint64 size)
+{
+    if (!m_session.write(std::string_view(data, static_cast<std::size_t>(size)))) {
+        setErrorString(QString::fromStdString(m_session.errorString()));
+        return -1;
+    }
+    flushOutgoing();
+    return size;
+}
+
+void TlsServerSocket::onCipherReadyRead()
+{
+    const QByteArray cipher = m_cipher->readAll();
+    const bool wasEncrypted = isEncrypted();
+    std::string plain;
+    const bool fed =
+        m_session.feed(std::string_view(cipher.constData(), static_cast<std::size_t>(cipher.size())), &plain);
+    // Handshake messages, or the alert that says why there will be none.
+    flushOutgoing();
+    if (!fed) {
+        if (!wasEncrypted) {
+            failHandshake(QString::fromStdString(m_session.errorString()));
+            return;
+        }
+        setSocketError(QAbstractSocket::SslInternalError);
+        setErrorString(QString::fromStdString(m_session.errorString()));
+        emit errorOccurred(QAbstractSocket::SslInternalError);
+        m_cipher->flush();
+        m_cipher->abort();
+        return;
+    }
+
+    if (!wasEncrypted && isEncrypted()) {
+        m_deadline->stop();
+        // Before the plaintext that came along with the last handshake
+        // message: whoever takes the socket on encrypted() reads that too.
+        emit encrypted();
+    }
+    if (!plain.empty() && openMode() != QIODevice::NotOpen) {
+        m_incoming.append(plain.data(), static_cast<qsizetype>(plain.size()));
+        emit readyRead();
+    }
+    if (m_session.isClosedByPeer())
+        disconnectFromHost();
+}
+
+void TlsServerSocket::onCipherDisconnected()
+{
+    m_deadline->stop();
+    if (state() == QAbstractSocket::UnconnectedState)
+        return;
+    setSocketState(QAbstractSocket::UnconnectedState);
+    if (!isEncrypted()) {
+        emit handshakeFailed(QStringLiteral("Connection closed during the TLS handshake"));
+        return;
+    }
+    emit stateChanged(QAbstractSocket::UnconnectedState);
+    emit readChannelFinished();
+    emit disconnected();
+}
+
+void TlsServerSocket::flushOutgoing()
+{
+    std::string outgoing;
+    m_session.takeOutgoing(&outgoing);
+    if (!outgoing.empty())
+        m_cipher->write(outgoing.data(), static_cast<qint64>(outgoing.size()));
+}
+
+void TlsServerSocket::failHandshake(const QString &reason)
+{
+    m_deadline->stop();
+    setSocketState(QAbstractSocket::UnconnectedState);
+    // The alert, if the session produced one, goes out if it can; nothing
+    // here waits for it.
+    m_cipher->disconnect(this);
+    m_cipher->flush();
+    m_cipher->abort();
+    QIODevice::close();
+    emit handshakeFailed(reason);
+}
+
+} // namespace phicore::transport::ws
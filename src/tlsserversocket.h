@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QByteArray>
+#include <QTcpSocket>
+
+#include <memory>
+#include <string>
+
+#include "tlsengine.h"
+
+class QTimer;
+
+namespace phicore::transport::ws {
+
+// A wss:// connection as QWebSocketServer sees it: a QTcpSocket it reads the
+// upgrade from and then hands to a QWebSocket, both in plaintext. Underneath,
+// the accepted socket carries TLS (tls::Session). Built the way QSslSocket is
+// - the descriptor lives in an inner socket and this one is a device over it -
+// because QSslSocket itself cannot resume sessions on the server side
+// (tlsengine.h).
+//
+// Starts in the handshake; encrypted() or handshakeFailed() ends it. Until
+// encrypted() nothing reads from it.
+class TlsServerSocket final : public QTcpSocket
+{
+    Q_OBJECT
+
+public:
+    TlsServerSocket(std::shared_ptr<const tls::ServerContext> context, QObject *parent = nullptr);
+    ~TlsServerSocket() override;
+
+    /// Takes over an accepted connection and waits for the client's hello for
+    /// at most `handshakeTimeoutMs`. False when the descriptor is unusable.
+    bool start(qintptr socketDescriptor, int handshakeTimeoutMs);
+    bool isEncrypted() const { return m_session.isEstablished(); }
+    /// Whether the handshake resumed an earlier session. Meaningful once
+    /// encrypted.
+    bool isResumed() const { return m_session.isResumed(); }
+
+    qint64 bytesAvailable() const override;
+    /// TLS records not yet taken by the kernel; a little more than the
+    /// plaintext they carry.
+    qint64 bytesToWrite() const override;
+    bool canReadLine() const override;
+    /// Sends close_notify and closes once what is queued has been written.
+    void disconnectFromHost() override;
+    /// Closes now, as abort() does; close_notify goes out only if the kernel
+    /// takes it straight away.
+    void close() override;
+    void setSocketOption(QAbstractSocket::SocketOption option, const QVariant &value) override;
+    QVariant socketOption(QAbstractSocket::SocketOption option) override;
+
+signals:
+    void encrypted();
+    /// The socket is closed by then; nothing else is emitted.
+    void handshakeFailed(const QString &reason);
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 size) override;
+
+private:
+    void onCipherReadyRead();
+    void onCipherDisconnected();
+    void flushOutgoing();
+    void failHandshake(const QString &reason);
+
+    std::shared_ptr<const tls::ServerContext> m_context;
+    tls::Session m_session;
+    QTcpSocket *m_cipher = nullptr;
+    // The handshake deadline, then the deadline for a graceful close.
+    QTimer *m_deadline = nullptr;
+    // Decrypted and not read yet, from m_readOffset on.
+    QByteArray m_incoming;
+    qsizetype m_readOffset = 0;
+};
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,36 @@
+#include "wsframing.h"
+
+#include <algorithm>
+
+namespace phicore::transport::ws::wsframe {
+
+void appendHeader(std::string *out, Opcode opcode, bool fin, std::uint64_t payloadBytes)
+{
+    out->push_back(static_cast<char>((fin ? 0x80 : 0x00) | static_cast<std::uint8_t>(opcode)));
+    if (payloadBytes < 126) {
+        out->push_back(static_cast<char>(payloadBytes));
+        return;
+    }
+    // Lengths are big-endian, in the shortest form that holds them.
+    const int lengthBytes = payloadBytes <= 0xFFFF ? 2 : 8;
+    out->push_back(static_cast<char>(lengthBytes == 2 ? 126 : 127));
+    for (int shift = (lengthBytes - 1) * 8; shift >= 0; shift -= 8)
+        out->push_back(static_cast<char>((payloadBytes >> shift) & 0xFF));
+}
+
+std::size_t utf8FragmentEnd(std::string_view text, std::size_t from, std::size_t maxBytes)
+{
+    const std::size_t end = from + std::min(maxBytes, text.size() - from);
+    if (end >= text.size())
+        return text.size();
+    // Back off over continuation bytes (10xxxxxx) to the lead byte of the
+    // sequence the cut would split; at most three of them in valid UTF-8.
+    std::size_t cut = end;
+    while (cut > from && end - cut < 4 && (static_cast<unsigned char>(text[cut]) & 0xC0) == 0x80)
+        --cut;
+    // A fragment smaller than one character, or text that is not UTF-8 at all:
+    // cut where asked rather than not at all.
+    return cut > from && (static_cast<unsigned char>(text[cut]) & 0xC0) != 0x80 ? cut : end;
+}
+
+} // namespace phicore::transport::ws::wsframe
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace phicore::transport::ws {
+
+// Server-to-client WebSocket frames (RFC 6455 section 5.2), for the messages
+// the shards write in fragments themselves rather than through QWebSocket.
+// Server frames are never masked, and no extension is negotiated here, so a
+// header is all there is to it.
+namespace wsframe {
+
+enum class Opcode : std::uint8_t {
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+};
+
+/// Largest header appendHeader() writes.
+constexpr std::size_t kMaxHeaderBytes = 10;
+
+/// Appends the header of one frame carrying `payloadBytes`. `opcode` is the
+/// message's for its first fragment and Continuation for the others; `fin`
+/// marks the last.
+void appendHeader(std::string *out, Opcode opcode, bool fin, std::uint64_t payloadBytes);
+
+/// Where the fragment of `text` starting at `from` ends when it may hold at
+/// most `maxBytes`: never inside a UTF-8 sequence, so every fragment of a text
+/// message is valid UTF-8 on its own and a client that checks fragment by
+/// fragment has nothing to complain about. Always past `from` when anything
+/// is left.
+std::size_t utf8FragmentEnd(std::string_view text, std::size_t from, std::size_t maxBytes);
+
+} // namespace wsframe
+
+} // namespace phicore::transport::ws
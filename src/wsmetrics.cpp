@@ -0,0 +1,423 @@
+#include "wsmetrics.h"
+
+#include "jsonscan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+void appendMember(std::string *out, std::string_view key, std::int64_t value)
+{
+    json::appendQuoted(out, key);
+    out->push_back(':');
+    out->append(std::to_string(value));
+}
+
+void appendMember(std::string *out, std::string_view key, std::uint64_t value)
+{
+    json::appendQuoted(out, key);
+    out->push_back(':');
+    out->append(std::to_string(value));
+}
+
+void appendLatency(std::string *out, std::string_view key, const LatencyHistogram::Snapshot &latency)
+{
+    json::appendQuoted(out, key);
+    out->append(":{");
+    appendMember(out, "count", latency.count);
+    out->push_back(',');
+    appendMember(out, "sumUs", latency.sumUs);
+    out->push_back(',');
+    appendMember(out, "p50", latency.quantileUs(0.50));
+    out->push_back(',');
+    appendMember(out, "p99", latency.quantileUs(0.99));
+    out->push_back('}');
+}
+
+// Seconds, as Prometheus wants durations, written without a trailing cloud of
+// zeros.
+std::string secondsText(std::int64_t us)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof buffer, "%.6g", static_cast<double>(us) / 1e6);
+    return buffer;
+}
+
+// Label values need \, " and newline escaped; topic families have none in
+// practice, but a topic is core's to choose.
+std::string labelValue(std::string_view value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (const char c : value) {
+        if (c == '\\' || c == '"')
+            out.push_back('\\');
+        if (c == '\n') {
+            out.append("\\n");
+            continue;
+        }
+        out.push_back(c);
+    }
+    return out;
+}
+
+class PrometheusWriter
+{
+public:
+    void family(std::string_view name, std::string_view type, std::string_view help)
+    {
+        m_out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        m_out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    template <typename Value>
+    void sample(std::string_view name, Value value, std::string_view labels = {})
+    {
+        m_out.append(name);
+        if (!labels.empty())
+            m_out.append("{").append(labels).append("}");
+        m_out.append(" ").append(std::to_string(value)).append("\n");
+    }
+
+    void histogram(std::string_view name, std::string_view mode, const LatencyHistogram::Snapshot &latency)
+    {
+        const std::string modeLabel = "mode=\"" + std::string(mode) + "\"";
+        std::uint64_t cumulative = 0;
+        const std::string bucket = std::string(name) + "_bucket";
+        for (std::size_t i = 0; i < LatencyHistogram::kBoundsUs.size(); ++i) {
+            cumulative += latency.counts[i];
+            sample(bucket, cumulative, modeLabel + ",le=\"" + secondsText(LatencyHistogram::kBoundsUs[i]) + "\"");
+        }
+        sample(bucket, latency.count, modeLabel + ",le=\"+Inf\"");
+        m_out.append(name).append("_sum{").append(modeLabel).append("} ").append(secondsText(latency.sumUs)).append("\n");
+        sample(std::string(name) + "_count", latency.count, modeLabel);
+    }
+
+    std::string take() { return std::move(m_out); }
+
+private:
+    std::string m_out;
+};
+
+} // namespace
+
+void LatencyHistogram::record(std::int64_t us)
+{
+    const auto bound = std::lower_bound(kBoundsUs.begin(), kBoundsUs.end(), us);
+    const std::size_t bucket = static_cast<std::size_t>(bound - kBoundsUs.begin());
+    m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumUs.fetch_add(us, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    Snapshot out;
+    for (std::size_t i = 0; i < kBuckets; ++i)
+        out.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    out.count = m_count.load(std::memory_order_relaxed);
+    out.sumUs = m_sumUs.load(std::memory_order_relaxed);
+    return out;
+}
+
+void LatencyHistogram::Snapshot::merge(const Snapshot &other)
+{
+    for (std::size_t i = 0; i < kBuckets; ++i)
+        counts[i] += other.counts[i];
+    count += other.count;
+    sumUs += other.sumUs;
+}
+
+std::int64_t LatencyHistogram::Snapshot::quantileUs(double fraction) const
+{
+    std::uint64_t total = 0;
+    for (const std::uint64_t bucket : counts)
+        total += bucket;
+    if (total == 0)
+        return 0;
+    // Nearest rank: the smallest sample at least `fraction` of them do not exceed.
+    const auto rank = std::max<std::uint64_t>(
+        1, static_cast<std::uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBoundsUs.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return kBoundsUs[i];
+    }
+    // Past the last bound; the last bound is all that is known about it.
+    return kBoundsUs.back();
+}
+
+void MetricsSnapshot::addShard(const ShardMetrics &shard)
+{
+    framesIn += shard.framesIn.load(std::memory_order_relaxed);
+    bytesIn += shard.bytesIn.load(std::memory_order_relaxed);
+    framesOut += shard.framesOut.load(std::memory_order_relaxed);
+    bytesOut += shard.bytesOut.load(std::memory_order_relaxed);
+    protocolErrors += shard.protocolErrors.load(std::memory_order_relaxed);
+    originRefused += shard.originRefused.load(std::memory_order_relaxed);
+    handshakeFailed += shard.handshakeFailed.load(std::memory_order_relaxed);
+    slowConsumerDrops += shard.slowConsumerDrops.load(std::memory_order_relaxed);
+    replayedEvents += shard.replayedEvents.load(std::memory_order_relaxed);
+    replayResyncs += shard.replayResyncs.load(std::memory_order_relaxed);
+    snapshotFrames += shard.snapshotFrames.load(std::memory_order_relaxed);
+    fragmentedMessages += shard.fragmentedMessages.load(std::memory_order_relaxed);
+    commandBatches += shard.commandBatches.load(std::memory_order_relaxed);
+    batchedCommands += shard.batchedCommands.load(std::memory_order_relaxed);
+    fragmentsOut += shard.fragmentsOut.load(std::memory_order_relaxed);
+    tlsFullHandshakes += shard.tlsFullHandshakes.load(std::memory_order_relaxed);
+    tlsResumedHandshakes += shard.tlsResumedHandshakes.load(std::memory_order_relaxed);
+    tlsFailedHandshakes += shard.tlsFailedHandshakes.load(std::memory_order_relaxed);
+    drainNotices += shard.drainNotices.load(std::memory_order_relaxed);
+    drainClosed += shard.drainClosed.load(std::memory_order_relaxed);
+    drainHardClosed += shard.drainHardClosed.load(std::memory_order_relaxed);
+    drainOpen += shard.drainOpen.load(std::memory_order_relaxed);
+    backlogConnections += shard.backlogConnections.load(std::memory_order_relaxed);
+    backlogBytes += shard.backlogBytes.load(std::memory_order_relaxed);
+    backlogMaxBytes = std::max(backlogMaxBytes, shard.backlogMaxBytes.load(std::memory_order_relaxed));
+    stateCacheChannels = std::max(stateCacheChannels, shard.stateCacheChannels.load(std::memory_order_relaxed));
+    stateCacheBytes = std::max(stateCacheBytes, shard.stateCacheBytes.load(std::memory_order_relaxed));
+    stateCacheRefused = std::max(stateCacheRefused, shard.stateCacheRefused.load(std::memory_order_relaxed));
+    syncLatency.merge(shard.syncLatency.snapshot());
+    asyncLatency.merge(shard.asyncLatency.snapshot());
+    eventLatency.merge(shard.eventLatency.snapshot());
+    tlsFullLatency.merge(shard.tlsFullLatency.snapshot());
+    tlsResumedLatency.merge(shard.tlsResumedLatency.snapshot());
+}
+
+std::string_view topicFamily(std::string_view topic)
+{
+    const std::size_t first = topic.find('.');
+    if (first == std::string_view::npos)
+        return topic;
+    const std::size_t second = topic.find('.', first + 1);
+    return second == std::string_view::npos ? topic : topic.substr(0, second);
+}
+
+std::string metricsToJson(const MetricsSnapshot &metrics)
+{
+    std::string out = "{";
+    appendMember(&out, "uptimeSec", metrics.uptimeSec);
+    out.push_back(',');
+    appendMember(&out, "connections", metrics.connections);
+    out.push_back(',');
+    appendMember(&out, "ioShards", metrics.ioShards);
+    out.push_back(',');
+    appendMember(&out, "pendingCommands", metrics.pendingCommands);
+    out.push_back(',');
+    appendMember(&out, "framesIn", metrics.framesIn);
+    out.push_back(',');
+    appendMember(&out, "bytesIn", metrics.bytesIn);
+    out.push_back(',');
+    appendMember(&out, "framesOut", metrics.framesOut);
+    out.push_back(',');
+    appendMember(&out, "bytesOut", metrics.bytesOut);
+    out.push_back(',');
+    appendMember(&out, "events", metrics.events);
+    out.append(",\"eventFamilies\":{");
+    for (std::size_t i = 0; i < metrics.eventFamilies.size(); ++i) {
+        if (i > 0)
+            out.push_back(',');
+        appendMember(&out, metrics.eventFamilies[i].first, metrics.eventFamilies[i].second);
+    }
+    out.append("},\"commands\":{");
+    appendMember(&out, "sync", metrics.syncCommands);
+    out.push_back(',');
+    appendMember(&out, "async", metrics.asyncCommands);
+    out.push_back(',');
+    appendMember(&out, "batches", metrics.commandBatches);
+    out.push_back(',');
+    appendMember(&out, "batched", metrics.batchedCommands);
+    out.append("},");
+    appendLatency(&out, "syncLatencyUs", metrics.syncLatency);
+    out.push_back(',');
+    appendLatency(&out, "asyncLatencyUs", metrics.asyncLatency);
+    out.append(",\"ingress\":{");
+    appendMember(&out, "depth", metrics.ingressDepth);
+    out.push_back(',');
+    appendMember(&out, "maxDepth", metrics.ingressMaxDepth);
+    out.push_back(',');
+    appendLatency(&out, "waitUs", metrics.ingressWait);
+    out.push_back(',');
+    appendLatency(&out, "eventToSendUs", metrics.eventLatency);
+    out.push_back('}');
+    out.append(",\"syncDispatch\":{");
+    appendMember(&out, "workers", metrics.syncWorkers);
+    out.push_back(',');
+    appendLatency(&out, "queueWaitUs", metrics.syncQueueWait);
+    out.push_back(',');
+    appendLatency(&out, "runUs", metrics.syncRun);
+    out.push_back('}');
+    out.append(",\"backlog\":{");
+    appendMember(&out, "connections", metrics.backlogConnections);
+    out.push_back(',');
+    appendMember(&out, "bytes", metrics.backlogBytes);
+    out.push_back(',');
+    appendMember(&out, "maxBytes", metrics.backlogMaxBytes);
+    out.append("},\"handshakeRejections\":{");
+    appendMember(&out, "origin", metrics.originRefused);
+    out.push_back(',');
+    appendMember(&out, "failed", metrics.handshakeFailed);
+    out.append("},\"admission\":{\"refused\":{");
+    appendMember(&out, "connections", metrics.admissionRefusedConnections);
+    out.push_back(',');
+    appendMember(&out, "perAddress", metrics.admissionRefusedFromAddress);
+    out.push_back(',');
+    appendMember(&out, "handshakes", metrics.admissionRefusedHandshakes);
+    out.append("},");
+    appendMember(&out, "handshakesInProgress", metrics.handshakesInProgress);
+    out.append("},\"accepts\":{");
+    appendMember(&out, "total", metrics.accepted);
+    out.push_back(',');
+    appendMember(&out, "peakPerSec", metrics.acceptPeakPerSec);
+    out.append("},\"drain\":{");
+    appendMember(&out, "active", metrics.draining);
+    out.push_back(',');
+    appendMember(&out, "open", metrics.drainOpen);
+    out.push_back(',');
+    appendMember(&out, "notified", metrics.drainNotices);
+    out.push_back(',');
+    appendMember(&out, "closed", metrics.drainClosed);
+    out.push_back(',');
+    appendMember(&out, "hardClosed", metrics.drainHardClosed);
+    out.append("},");
+    appendMember(&out, "protocolErrors", metrics.protocolErrors);
+    out.push_back(',');
+    appendMember(&out, "slowConsumerDrops", metrics.slowConsumerDrops);
+    out.append(",\"fragmented\":{");
+    appendMember(&out, "messages", metrics.fragmentedMessages);
+    out.push_back(',');
+    appendMember(&out, "fragments", metrics.fragmentsOut);
+    out.push_back('}');
+    out.append(",\"replay\":{");
+    appendMember(&out, "events", metrics.replayedEvents);
+    out.push_back(',');
+    appendMember(&out, "resyncs", metrics.replayResyncs);
+    out.append("},\"stateCache\":{");
+    appendMember(&out, "channels", metrics.stateCacheChannels);
+    out.push_back(',');
+    appendMember(&out, "bytes", metrics.stateCacheBytes);
+    out.push_back(',');
+    appendMember(&out, "refused", metrics.stateCacheRefused);
+    out.push_back(',');
+    appendMember(&out, "snapshotFrames", metrics.snapshotFrames);
+    out.append("},\"tls\":{\"handshakes\":{");
+    appendMember(&out, "full", metrics.tlsFullHandshakes);
+    out.push_back(',');
+    appendMember(&out, "resumed", metrics.tlsResumedHandshakes);
+    out.push_back(',');
+    appendMember(&out, "failed", metrics.tlsFailedHandshakes);
+    out.append("},");
+    appendLatency(&out, "fullUs", metrics.tlsFullLatency);
+    out.push_back(',');
+    appendLatency(&out, "resumedUs", metrics.tlsResumedLatency);
+    out.append("},\"error\":null}");
+    return out;
+}
+
+std::string metricsToPrometheus(const MetricsSnapshot &metrics)
+{
+    PrometheusWriter out;
+    out.family("phi_ws_uptime_seconds", "gauge", "Seconds since the transport started.");
+    out.sample("phi_ws_uptime_seconds", metrics.uptimeSec);
+    out.family("phi_ws_connections", "gauge", "Open WebSocket connections.");
+    out.sample("phi_ws_connections", metrics.connections);
+    out.family("phi_ws_pending_commands", "gauge", "Async commands waiting for core's answer.");
+    out.sample("phi_ws_pending_commands", metrics.pendingCommands);
+    out.family("phi_ws_frames_in_total", "counter", "Frames received from clients.");
+    out.sample("phi_ws_frames_in_total", metrics.framesIn);
+    out.family("phi_ws_bytes_in_total", "counter", "Bytes received from clients, as UTF-8.");
+    out.sample("phi_ws_bytes_in_total", metrics.bytesIn);
+    out.family("phi_ws_frames_out_total", "counter", "Frames written to clients.");
+    out.sample("phi_ws_frames_out_total", metrics.framesOut);
+    out.family("phi_ws_bytes_out_total", "counter", "Bytes written to clients, after compression.");
+    out.sample("phi_ws_bytes_out_total", metrics.bytesOut);
+    out.family("phi_ws_events_total", "counter", "Core events received, by topic family.");
+    for (const auto &[family, count] : metrics.eventFamilies)
+        out.sample("phi_ws_events_total", count, "family=\"" + labelValue(family) + "\"");
+    out.family("phi_ws_commands_total", "counter", "Commands handed to core.");
+    out.sample("phi_ws_commands_total", metrics.syncCommands, "mode=\"sync\"");
+    out.sample("phi_ws_commands_total", metrics.asyncCommands, "mode=\"async\"");
+    out.family("phi_ws_command_batches_total", "counter", "Batch frames received from clients.");
+    out.sample("phi_ws_command_batches_total", metrics.commandBatches);
+    out.family("phi_ws_batched_commands_total", "counter", "Commands received in batch frames.");
+    out.sample("phi_ws_batched_commands_total", metrics.batchedCommands);
+    out.family("phi_ws_command_latency_seconds", "histogram", "Frame received to answer sent.");
+    out.histogram("phi_ws_command_latency_seconds", "sync", metrics.syncLatency);
+    out.histogram("phi_ws_command_latency_seconds", "async", metrics.asyncLatency);
+    out.family("phi_ws_ingress_depth", "gauge", "Events and async results handed over by core and not yet taken.");
+    out.sample("phi_ws_ingress_depth", metrics.ingressDepth);
+    out.family("phi_ws_ingress_max_depth", "gauge", "Most events and async results waiting at once since start.");
+    out.sample("phi_ws_ingress_max_depth", metrics.ingressMaxDepth);
+    out.family("phi_ws_ingress_seconds", "histogram",
+               "From core handing over: taken by the transport, and for events written to every recipient.");
+    out.histogram("phi_ws_ingress_seconds", "wait", metrics.ingressWait);
+    out.histogram("phi_ws_ingress_seconds", "event_sent", metrics.eventLatency);
+    out.family("phi_ws_sync_workers", "gauge", "Worker threads for sync commands; 0 when they run inline.");
+    out.sample("phi_ws_sync_workers", metrics.syncWorkers);
+    out.family("phi_ws_sync_dispatch_seconds", "histogram", "Sync commands on workers: queued, then run by core.");
+    out.histogram("phi_ws_sync_dispatch_seconds", "queued", metrics.syncQueueWait);
+    out.histogram("phi_ws_sync_dispatch_seconds", "run", metrics.syncRun);
+    out.family("phi_ws_outbound_backlog_connections", "gauge", "Connections with frames queued in the transport.");
+    out.sample("phi_ws_outbound_backlog_connections", metrics.backlogConnections);
+    out.family("phi_ws_outbound_backlog_bytes", "gauge", "Bytes queued in the transport, all connections.");
+    out.sample("phi_ws_outbound_backlog_bytes", metrics.backlogBytes);
+    out.family("phi_ws_outbound_backlog_max_bytes", "gauge", "Bytes queued for the most backlogged connection.");
+    out.sample("phi_ws_outbound_backlog_max_bytes", metrics.backlogMaxBytes);
+    out.family("phi_ws_handshake_rejections_total", "counter", "WebSocket handshakes refused.");
+    out.sample("phi_ws_handshake_rejections_total", metrics.originRefused, "reason=\"origin\"");
+    out.sample("phi_ws_handshake_rejections_total", metrics.handshakeFailed, "reason=\"failed\"");
+    out.family("phi_ws_admission_refused_total", "counter", "Connections reset before the handshake, by limit.");
+    out.sample("phi_ws_admission_refused_total", metrics.admissionRefusedConnections, "reason=\"connections\"");
+    out.sample("phi_ws_admission_refused_total", metrics.admissionRefusedFromAddress, "reason=\"per_address\"");
+    out.sample("phi_ws_admission_refused_total", metrics.admissionRefusedHandshakes, "reason=\"handshakes\"");
+    out.family("phi_ws_handshakes_in_progress", "gauge", "Admitted connections not yet upgraded.");
+    out.sample("phi_ws_handshakes_in_progress", metrics.handshakesInProgress);
+    out.family("phi_ws_accepted_total", "counter", "Connections admitted.");
+    out.sample("phi_ws_accepted_total", metrics.accepted);
+    out.family("phi_ws_accept_peak_per_second", "gauge", "Most connections admitted in one second since start.");
+    out.sample("phi_ws_accept_peak_per_second", metrics.acceptPeakPerSec);
+    out.family("phi_ws_draining", "gauge", "1 while the transport drains its connections before stopping.");
+    out.sample("phi_ws_draining", metrics.draining);
+    out.family("phi_ws_drain_open_connections", "gauge", "Connections told to reconnect and not closed yet.");
+    out.sample("phi_ws_drain_open_connections", metrics.drainOpen);
+    out.family("phi_ws_drain_total", "counter",
+               "Connections told when to reconnect, and closed, by a drain; hard_closed lost queued frames.");
+    out.sample("phi_ws_drain_total", metrics.drainNotices, "action=\"notified\"");
+    out.sample("phi_ws_drain_total", metrics.drainClosed, "action=\"closed\"");
+    out.sample("phi_ws_drain_total", metrics.drainHardClosed, "action=\"hard_closed\"");
+    out.family("phi_ws_protocol_errors_total", "counter", "protocol.error frames sent.");
+    out.sample("phi_ws_protocol_errors_total", metrics.protocolErrors);
+    out.family("phi_ws_slow_consumer_drops_total", "counter", "Connections dropped for not reading.");
+    out.sample("phi_ws_slow_consumer_drops_total", metrics.slowConsumerDrops);
+    out.family("phi_ws_fragmented_messages_total", "counter", "Messages written to clients in fragments.");
+    out.sample("phi_ws_fragmented_messages_total", metrics.fragmentedMessages);
+    out.family("phi_ws_fragments_total", "counter", "Fragments of those messages written.");
+    out.sample("phi_ws_fragments_total", metrics.fragmentsOut);
+    out.family("phi_ws_replayed_events_total", "counter", "Events replayed to reconnecting clients.");
+    out.sample("phi_ws_replayed_events_total", metrics.replayedEvents);
+    out.family("phi_ws_replay_resyncs_total", "counter", "Reconnecting clients told to resync instead.");
+    out.sample("phi_ws_replay_resyncs_total", metrics.replayResyncs);
+    out.family("phi_ws_state_cache_channels", "gauge", "Channel states held for snapshots.");
+    out.sample("phi_ws_state_cache_channels", metrics.stateCacheChannels);
+    out.family("phi_ws_state_cache_bytes", "gauge", "Bytes held by the state cache, one shard.");
+    out.sample("phi_ws_state_cache_bytes", metrics.stateCacheBytes);
+    out.family("phi_ws_state_cache_refused", "gauge", "Channel states the full state cache turned away.");
+    out.sample("phi_ws_state_cache_refused", metrics.stateCacheRefused);
+    out.family("phi_ws_snapshot_frames_total", "counter", "State snapshot frames sent.");
+    out.sample("phi_ws_snapshot_frames_total", metrics.snapshotFrames);
+    out.family("phi_ws_tls_handshakes_total", "counter", "TLS handshakes on wss:// connections, by outcome.");
+    out.sample("phi_ws_tls_handshakes_total", metrics.tlsFullHandshakes, "result=\"full\"");
+    out.sample("phi_ws_tls_handshakes_total", metrics.tlsResumedHandshakes, "result=\"resumed\"");
+    out.sample("phi_ws_tls_handshakes_total", metrics.tlsFailedHandshakes, "result=\"failed\"");
+    out.family("phi_ws_tls_handshake_seconds", "histogram", "Connection accepted to TLS handshake done.");
+    out.histogram("phi_ws_tls_handshake_seconds", "full", metrics.tlsFullLatency);
+    out.histogram("phi_ws_tls_handshake_seconds", "resumed", metrics.tlsResumedLatency);
+    return out.take();
+}
+
+} // namespace phicore::transport::ws
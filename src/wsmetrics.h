@@ -0,0 +1,177 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace phicore::transport::ws {
+
+// Command latency, receive to answer, in fixed buckets. Recording is two relaxed
+// increments and an add, each a fetch_add, so any number of threads may record
+// at once: a shard records from its own thread, the sync dispatch histograms
+// from every worker in the pool. Keep them read-modify-writes; a load and a
+// store would lose samples. Readers are whoever asks for a snapshot.
+class LatencyHistogram
+{
+public:
+    // Upper bounds in microseconds; one more bucket past the last catches the rest.
+    static constexpr std::array<std::int64_t, 14> kBoundsUs = {
+        50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+    };
+    static constexpr std::size_t kBuckets = kBoundsUs.size() + 1;
+
+    struct Snapshot {
+        std::array<std::uint64_t, kBuckets> counts{};
+        std::uint64_t count = 0;
+        std::int64_t sumUs = 0;
+
+        void merge(const Snapshot &other);
+        /// Upper bound of the bucket the quantile falls in; 0 with no samples.
+        std::int64_t quantileUs(double fraction) const;
+    };
+
+    void record(std::int64_t us);
+    Snapshot snapshot() const;
+
+private:
+    std::array<std::atomic<std::uint64_t>, kBuckets> m_counts{};
+    std::atomic<std::uint64_t> m_count{0};
+    std::atomic<std::int64_t> m_sumUs{0};
+};
+
+// What one shard counts. Counters only grow; the backlog figures are gauges the
+// shard refreshes on its sweep.
+struct ShardMetrics {
+    std::atomic<std::uint64_t> framesIn{0};
+    std::atomic<std::uint64_t> bytesIn{0};
+    std::atomic<std::uint64_t> framesOut{0};
+    std::atomic<std::uint64_t> bytesOut{0};
+    std::atomic<std::uint64_t> protocolErrors{0};
+    std::atomic<std::uint64_t> originRefused{0};
+    std::atomic<std::uint64_t> handshakeFailed{0};
+    std::atomic<std::uint64_t> slowConsumerDrops{0};
+    std::atomic<std::uint64_t> replayedEvents{0};
+    std::atomic<std::uint64_t> replayResyncs{0};
+    std::atomic<std::uint64_t> snapshotFrames{0};
+    std::atomic<std::uint64_t> fragmentedMessages{0};
+    std::atomic<std::uint64_t> commandBatches{0};
+    std::atomic<std::uint64_t> batchedCommands{0};
+    std::atomic<std::uint64_t> fragmentsOut{0};
+    std::atomic<std::uint64_t> tlsFullHandshakes{0};
+    std::atomic<std::uint64_t> tlsResumedHandshakes{0};
+    std::atomic<std::uint64_t> tlsFailedHandshakes{0};
+    // While the transport drains: connections told when to reconnect, closed
+    // going away, and of those the ones closed at the deadline with frames
+    // still queued for them. drainOpen is the gauge of told and not closed yet.
+    std::atomic<std::uint64_t> drainNotices{0};
+    std::atomic<std::uint64_t> drainClosed{0};
+    std::atomic<std::uint64_t> drainHardClosed{0};
+    std::atomic<std::int64_t> drainOpen{0};
+    std::atomic<std::int64_t> backlogConnections{0};
+    std::atomic<std::int64_t> backlogBytes{0};
+    std::atomic<std::int64_t> backlogMaxBytes{0};
+    // The state cache, refreshed as it changes.
+    std::atomic<std::int64_t> stateCacheChannels{0};
+    std::atomic<std::int64_t> stateCacheBytes{0};
+    std::atomic<std::int64_t> stateCacheRefused{0};
+    LatencyHistogram syncLatency;
+    LatencyHistogram asyncLatency;
+    // Core handing an event over to the shard having written or queued it for
+    // every recipient.
+    LatencyHistogram eventLatency;
+    // Accept to handshake done, for wss://.
+    LatencyHistogram tlsFullLatency;
+    LatencyHistogram tlsResumedLatency;
+
+    static void add(std::atomic<std::uint64_t> &counter, std::uint64_t value = 1)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+};
+
+// Everything at one moment, shards summed, ready to be written out.
+struct MetricsSnapshot {
+    std::int64_t uptimeSec = 0;
+    std::int64_t connections = 0;
+    std::int64_t pendingCommands = 0;
+    std::int64_t ioShards = 0;
+    std::uint64_t framesIn = 0;
+    std::uint64_t bytesIn = 0;
+    std::uint64_t framesOut = 0;
+    std::uint64_t bytesOut = 0;
+    std::uint64_t protocolErrors = 0;
+    std::uint64_t originRefused = 0;
+    std::uint64_t handshakeFailed = 0;
+    std::uint64_t slowConsumerDrops = 0;
+    std::uint64_t replayedEvents = 0;
+    std::uint64_t replayResyncs = 0;
+    std::uint64_t snapshotFrames = 0;
+    std::uint64_t fragmentedMessages = 0;
+    std::uint64_t commandBatches = 0;
+    std::uint64_t batchedCommands = 0;
+    std::uint64_t fragmentsOut = 0;
+    std::uint64_t tlsFullHandshakes = 0;
+    std::uint64_t tlsResumedHandshakes = 0;
+    std::uint64_t tlsFailedHandshakes = 0;
+    std::uint64_t drainNotices = 0;
+    std::uint64_t drainClosed = 0;
+    std::uint64_t drainHardClosed = 0;
+    std::int64_t drainOpen = 0;
+    // 1 while the transport drains.
+    std::int64_t draining = 0;
+    // Connections admitted since start, and the most in any one second: what
+    // a restart's reconnects cost, drained or not.
+    std::uint64_t accepted = 0;
+    std::int64_t acceptPeakPerSec = 0;
+    std::int64_t backlogConnections = 0;
+    std::int64_t backlogBytes = 0;
+    std::int64_t backlogMaxBytes = 0;
+    // Every shard caches the same states, so these are one shard's figures.
+    std::int64_t stateCacheChannels = 0;
+    std::int64_t stateCacheBytes = 0;
+    std::int64_t stateCacheRefused = 0;
+    // Connection admission, counted by the transport rather than the shards.
+    std::uint64_t admissionRefusedConnections = 0;
+    std::uint64_t admissionRefusedFromAddress = 0;
+    std::uint64_t admissionRefusedHandshakes = 0;
+    std::int64_t handshakesInProgress = 0;
+    std::uint64_t events = 0;
+    // By the first two segments of the topic ("event.channel"), in the order
+    // they were first seen.
+    std::vector<std::pair<std::string, std::uint64_t>> eventFamilies;
+    std::uint64_t syncCommands = 0;
+    std::uint64_t asyncCommands = 0;
+    LatencyHistogram::Snapshot syncLatency;
+    LatencyHistogram::Snapshot asyncLatency;
+    LatencyHistogram::Snapshot tlsFullLatency;
+    LatencyHistogram::Snapshot tlsResumedLatency;
+    LatencyHistogram::Snapshot eventLatency;
+    // Core's hand-over queue: items waiting now, the most seen waiting at once
+    // since start, and how long they waited.
+    std::int64_t ingressDepth = 0;
+    std::int64_t ingressMaxDepth = 0;
+    LatencyHistogram::Snapshot ingressWait;
+    // Sync dispatch on workers, 0 and empty when it runs inline.
+    std::int64_t syncWorkers = 0;
+    LatencyHistogram::Snapshot syncQueueWait;
+    LatencyHistogram::Snapshot syncRun;
+
+    /// Adds one shard's figures; gauges add up, except the maximum and the
+    /// state cache.
+    void addShard(const ShardMetrics &shard);
+};
+
+/// "event.channel" for "event.channel.stateChanged"; the whole topic when it
+/// has fewer segments.
+std::string_view topicFamily(std::string_view topic);
+
+/// The payload the stats topic answers with.
+std::string metricsToJson(const MetricsSnapshot &metrics);
+/// Prometheus text exposition format, version 0.0.4.
+std::string metricsToPrometheus(const MetricsSnapshot &metrics);
+
+} // namespace phicore::transport::ws
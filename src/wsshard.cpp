@@ -0,0 +1,1905 @@
+#include "wsshard.h"
+
+#include "cborcodec.h"
+#include "cmdresponse.h"
+#include "inboundenvelope.h"
+#include "jsonscan.h"
+#include "wsframing.h"
+
+#ifdef PHI_TRANSPORT_WS_WITH_TLS
+#include "tlsserversocket.h"
+#endif
+
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QRandomGenerator>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUrl>
+#include <QVarLengthArray>
+#include <QWebSocket>
+#include <QWebSocketCorsAuthenticator>
+#include <QWebSocketProtocol>
+#include <QWebSocketServer>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace phicore::transport::ws {
+
+namespace {
+
+// How often stalled consumers are looked for and the backlog gauges refreshed.
+constexpr int kSweepIntervalMs = 5000;
+// A TLS handshake takes a few round trips; a connection that has not finished
+// one by then is not going to, and holds a socket until it is dropped.
+constexpr int kTlsHandshakeTimeoutMs = 10000;
+
+// Idle sessions expire on a timing wheel (idlewheel.h): a tick only visits the
+// sessions due in it, so the precision costs nothing per idle connection. The
+// budget itself comes from core; this decides how late the close may be. One
+// turn covers a little over an hour, longer budgets take a visit per turn.
+constexpr qint64 kIdleWheelTickMs = 1000;
+constexpr std::size_t kIdleWheelSlots = 4096;
+
+// Subscriptions are answered by this transport rather than core: they only
+// decide which of the frames it already forwards reach a socket.
+constexpr QLatin1String kTopicSubscribe("sync.events.subscribe.set");
+constexpr QLatin1String kTopicUnsubscribe("sync.events.unsubscribe.set");
+constexpr std::string_view kErrorCodeInvalidSubscription = "invalid_subscription";
+constexpr std::string_view kErrorCodeRateLimited = "rate_limited";
+// Several commands in one frame, answered in one frame. Bounded so one frame
+// cannot hold core's thread for longer than a burst of single frames would.
+constexpr std::string_view kEnvelopeTypeBatch = "batch";
+constexpr std::string_view kTopicBatchResponse = "batch.response";
+constexpr std::string_view kErrorCodeInvalidBatch = "invalid_batch";
+constexpr std::string_view kErrorCodeNotBatchable = "not_batchable";
+constexpr std::size_t kMaxBatchCommands = 256;
+// Enough for every topic family one at a time; a client that needs more is
+// better served by a wider prefix.
+constexpr int kMaxSubscriptionsPerClient = 256;
+
+constexpr std::string_view kTopicChannelStateChanged = "event.channel.stateChanged";
+
+// One frame carrying several events, for connections that asked for it.
+constexpr std::string_view kTopicEventBatch = "event.batch";
+// Sent instead of a replay the ring can no longer serve.
+constexpr std::string_view kTopicReplayResync = "event.transport.resync";
+// The drain notice: when to reconnect, sent regardless of subscriptions.
+constexpr std::string_view kTopicDrain = "event.transport.drain";
+constexpr std::string_view kErrorCodeDraining = "draining";
+// Cached channel states, for clients that ask at login or subscribe.
+constexpr std::string_view kTopicStateSnapshot = "event.channel.snapshot";
+// Channel payloads per snapshot frame, in bytes; one frame is the usual case,
+// and a large installation gets a few rather than one nobody can hold in a
+// single read.
+constexpr std::size_t kSnapshotFrameBytes = 256 * 1024;
+
+// A connection's queue may grow to this many budgets before it is dropped on the
+// spot rather than at the stall timeout.
+constexpr qint64 kOutboundHardLimitFactor = 4;
+
+qint64 monotonicMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+qint64 monotonicNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Receive to answer, for the latency histograms.
+std::int64_t elapsedUs(qint64 sinceNs)
+{
+    return sinceNs > 0 ? (monotonicNs() - sinceNs) / 1000 : 0;
+}
+
+// Which handshake an upgraded socket finished, as WsShard::m_handshaking is
+// keyed.
+QString handshakeKey(const QHostAddress &address, quint16 port)
+{
+    return address.toString() + QLatin1Char(':') + QString::number(port);
+}
+
+} // namespace
+
+WsShard::WsShard(int index, quint64 epoch, ShardSettings settings, ShardHost *host)
+    : m_index(index)
+    , m_epoch(epoch)
+    , m_settings(std::move(settings))
+    , m_host(host)
+    , m_replay(static_cast<std::size_t>(std::max(0, m_settings.replay.maxEvents)),
+               static_cast<std::size_t>(std::max<qint64>(0, m_settings.replay.maxBytes)))
+    , m_stateCache(static_cast<std::size_t>(std::max(0, m_settings.stateCache.maxChannels)),
+                   static_cast<std::size_t>(std::max<qint64>(0, m_settings.stateCache.maxBytes)))
+    , m_idleWheel(kIdleWheelTickMs, kIdleWheelSlots)
+{
+}
+
+WsShard::~WsShard() = default;
+
+CompressionStats WsShard::takeCompressionStats()
+{
+    CompressionStats stats;
+    stats.frames = m_compressionStats.frames.exchange(0, std::memory_order_relaxed);
+    stats.sharedFrames = m_compressionStats.sharedFrames.exchange(0, std::memory_order_relaxed);
+    stats.inputBytes = m_compressionStats.inputBytes.exchange(0, std::memory_order_relaxed);
+    stats.outputBytes = m_compressionStats.outputBytes.exchange(0, std::memory_order_relaxed);
+    stats.nsecs = m_compressionStats.nsecs.exchange(0, std::memory_order_relaxed);
+    return stats;
+}
+
+BatchStats WsShard::takeBatchStats()
+{
+    BatchStats stats;
+    stats.frames = m_batchStats.frames.exchange(0, std::memory_order_relaxed);
+    stats.events = m_batchStats.events.exchange(0, std::memory_order_relaxed);
+    stats.largest = m_batchStats.largest.exchange(0, std::memory_order_relaxed);
+    return stats;
+}
+
+void WsShard::open()
+{
+    // Never listens: the transport accepts, and hands the socket over here for
+    // the upgrade, so the handshake runs on this shard's thread too.
+    m_server = new QWebSocketServer(QStringLiteral("phi-transport-ws"),
+                                    QWebSocketServer::NonSecureMode,
+                                    this);
+    m_server->setSupportedSubprotocols(m_settings.subprotocols);
+
+    // A WebSocket handshake is not subject to the same-origin policy, so any page
+    // a browser has open can connect to this port unless the server checks the
+    // Origin itself. Without this, "bound to loopback" protected nothing against
+    // a website the user happened to visit (F-42).
+    connect(m_server, &QWebSocketServer::originAuthenticationRequired,
+            this, [this](QWebSocketCorsAuthenticator *authenticator) {
+        if (!authenticator)
+            return;
+        const QString origin = authenticator->origin().trimmed();
+        if (origin.isEmpty()) {
+            // No Origin header: not a browser. Command-line clients and services
+            // are unaffected by this check.
+            authenticator->setAllowed(true);
+            return;
+        }
+        if (isLoopbackOrigin(origin) || m_settings.allowedOrigins.contains(origin, Qt::CaseInsensitive)) {
+            authenticator->setAllowed(true);
+            return;
+        }
+        authenticator->setAllowed(false);
+        ShardMetrics::add(m_metrics.originRefused);
+        m_host->logOriginRefused(origin);
+    });
+    connect(m_server, &QWebSocketServer::newConnection,
+            this, &WsShard::onNewConnection);
+    // Upgrades that never became a connection: not HTTP, not a WebSocket
+    // request, or a version Qt does not speak.
+    connect(m_server, &QWebSocketServer::serverError,
+            this, [this](QWebSocketProtocol::CloseCode) { ShardMetrics::add(m_metrics.handshakeFailed); });
+
+    m_sweep = new QTimer(this);
+    m_sweep->setInterval(kSweepIntervalMs);
+    // A stall timeout counted in tens of seconds does not need a finer clock.
+    connect(m_sweep, &QTimer::timeout, this, &WsShard::dropStalledConsumers);
+    // And the backlog gauges are read at it: a backlog that matters lasts
+    // longer than a sweep.
+    connect(m_sweep, &QTimer::timeout, this, &WsShard::sampleOutboundBacklog);
+    m_sweep->start();
+
+    // Runs only while some session has an idle budget.
+    m_idleTimer = new QTimer(this);
+    m_idleTimer->setInterval(static_cast<int>(kIdleWheelTickMs));
+    connect(m_idleTimer, &QTimer::timeout, this, &WsShard::dropIdleSessions);
+
+    m_batchTimer = new QTimer(this);
+    m_batchTimer->setSingleShot(true);
+    m_batchTimer->setTimerType(Qt::PreciseTimer);
+    m_batchTimer->setInterval(m_settings.eventBatch.windowMs);
+    connect(m_batchTimer, &QTimer::timeout, this, &WsShard::flushBatches);
+}
+
+void WsShard::applySettings(ShardSettings settings)
+{
+    m_settings = std::move(settings);
+    m_server->setSupportedSubprotocols(m_settings.subprotocols);
+    // A batch already waiting goes out on the old window.
+    m_batchTimer->setInterval(m_settings.eventBatch.windowMs);
+    m_replay.setLimits(static_cast<std::size_t>(std::max(0, m_settings.replay.maxEvents)),
+                       static_cast<std::size_t>(std::max<qint64>(0, m_settings.replay.maxBytes)));
+    m_stateCache.setLimits(static_cast<std::size_t>(std::max(0, m_settings.stateCache.maxChannels)),
+                           static_cast<std::size_t>(std::max<qint64>(0, m_settings.stateCache.maxBytes)));
+    m_metrics.stateCacheChannels.store(static_cast<std::int64_t>(m_stateCache.size()), std::memory_order_relaxed);
+    m_metrics.stateCacheBytes.store(static_cast<std::int64_t>(m_stateCache.bytes()), std::memory_order_relaxed);
+    m_metrics.stateCacheRefused.store(static_cast<std::int64_t>(m_stateCache.refused()), std::memory_order_relaxed);
+}
+
+void WsShard::adoptConnection(qintptr socketDescriptor, const std::string &peerKey)
+{
+    // Taken before the socket exists, so a descriptor that fails below is
+    // given back as it goes out of scope.
+    std::shared_ptr<AdmissionTicket> ticket;
+    if (m_settings.admission)
+        ticket = std::make_shared<AdmissionTicket>(m_settings.admission, peerKey);
+#ifdef PHI_TRANSPORT_WS_WITH_TLS
+    if (m_settings.tls) {
+        // The handshake runs here, on the socket's own events; only a socket
+        // that finished it goes on to the upgrade. Timed from here, so what is
+        // recorded is what the client waited, round trips included.
+        auto *socket = new TlsServerSocket(m_settings.tls, m_server);
+        const qint64 acceptedNs = monotonicNs();
+        connect(socket, &TlsServerSocket::encrypted, this, [this, socket, acceptedNs]() {
+            const qint64 us = elapsedUs(acceptedNs);
+            if (socket->isResumed()) {
+                ShardMetrics::add(m_metrics.tlsResumedHandshakes);
+                m_metrics.tlsResumedLatency.record(us);
+            } else {
+                ShardMetrics::add(m_metrics.tlsFullHandshakes);
+                m_metrics.tlsFullLatency.record(us);
+            }
+            m_server->handleConnection(socket);
+        });
+        connect(socket, &TlsServerSocket::handshakeFailed, this, [this, socket](const QString &) {
+            // Scanners and clients that do not trust the certificate, mostly;
+            // counted, not logged.
+            ShardMetrics::add(m_metrics.tlsFailedHandshakes);
+            socket->deleteLater();
+        });
+        if (!socket->start(socketDescriptor, kTlsHandshakeTimeoutMs)) {
+            delete socket;
+            return;
+        }
+        trackHandshake(socket, std::move(ticket));
+        return;
+    }
+#endif
+    // Parented to the server, as QTcpServer would have; the upgrade hands it on
+    // to the QWebSocket that wraps it.
+    auto *socket = new QTcpSocket(m_server);
+    if (!socket->setSocketDescriptor(socketDescriptor)) {
+        delete socket;
+        return;
+    }
+    trackHandshake(socket, std::move(ticket));
+    m_server->handleConnection(socket);
+}
+
+void WsShard::trackHandshake(QTcpSocket *socket, std::shared_ptr<AdmissionTicket> ticket)
+{
+    const QString key = handshakeKey(socket->peerAddress(), socket->peerPort());
+    if (ticket) {
+        // No context object: the ticket has to be given back even when the
+        // socket outlives this shard, and it touches nothing of the shard's.
+        connect(socket, &QObject::destroyed, [ticket]() mutable { ticket.reset(); });
+    }
+    m_handshaking.insert(key, Handshake{socket, std::move(ticket)});
+    connect(socket, &QObject::destroyed, this, [this, key, socket]() {
+        // An upgrade took the entry already, or a later socket from the same
+        // port has it.
+        const auto it = m_handshaking.constFind(key);
+        if (it != m_handshaking.cend() && it.value().socket == socket)
+            m_handshaking.erase(it);
+    });
+}
+
+void WsShard::onNewConnection()
+{
+    while (m_server->hasPendingConnections()) {
+        QWebSocket *socket = m_server->nextPendingConnection();
+        if (!socket)
+            continue;
+        const Handshake handshake = m_handshaking.take(handshakeKey(socket->peerAddress(), socket->peerPort()));
+        if (handshake.ticket)
+            handshake.ticket->finishHandshake();
+        quint32 index = 0;
+        if (!m_freeSlots.empty()) {
+            index = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else {
+            index = static_cast<quint32>(m_slots.size());
+            m_slots.emplace_back();
+        }
+        Slot &slot = m_slots[index];
+        slot.live = true;
+        Connection &connection = slot.connection;
+        connection.socket = socket;
+        connection.wire = handshake.socket;
+        connection.id = (static_cast<quint64>(slot.generation) << 32) | index;
+        connection.deflate = socket->subprotocol() == kSubprotocolDeflate;
+        connection.cbor = socket->subprotocol() == kSubprotocolCbor;
+        m_connectionCount.fetch_add(1, std::memory_order_relaxed);
+        if (connection.deflate)
+            m_deflateConnectionCount.fetch_add(1, std::memory_order_relaxed);
+        if (connection.cbor)
+            m_cborConnectionCount.fetch_add(1, std::memory_order_relaxed);
+        m_host->logClientConnected(socket->peerAddress().toString(), socket->peerPort());
+        // The handle rides along with each signal, so nothing has to look the
+        // socket up again.
+        const quint64 id = connection.id;
+        connect(socket, &QWebSocket::textMessageReceived,
+                this, [this, id](const QString &message) { onTextMessageReceived(id, message); });
+        // Binary client frames mean something only under CBOR; elsewhere they
+        // go unread, as they always have.
+        if (connection.cbor) {
+            connect(socket, &QWebSocket::binaryMessageReceived,
+                    this, [this, id](const QByteArray &message) { onBinaryMessageReceived(id, message); });
+        }
+        connect(socket, &QWebSocket::disconnected,
+                this, [this, id]() { onSocketDisconnected(id); });
+        connect(socket, &QWebSocket::bytesWritten,
+                this, [this, id]() { onSocketBytesWritten(id); });
+        // A handshake that was under way when the drain began.
+        if (m_draining)
+            sendDrainNotice(connection);
+    }
+}
+
+WsShard::Connection *WsShard::connection(quint64 id)
+{
+    const quint32 index = slotIndex(id);
+    if (index >= m_slots.size())
+        return nullptr;
+    Slot &slot = m_slots[index];
+    if (!slot.live || slot.generation != static_cast<quint32>(id >> 32))
+        return nullptr;
+    return &slot.connection;
+}
+
+void WsShard::listInsert(DenseList &list, int Connection::*position, Connection &connection)
+{
+    if (connection.*position >= 0)
+        return;
+    connection.*position = static_cast<int>(list.size());
+    list.push_back(slotIndex(connection.id));
+}
+
+void WsShard::listRemove(DenseList &list, int Connection::*position, Connection &connection)
+{
+    const int at = connection.*position;
+    if (at < 0)
+        return;
+    const quint32 last = list.back();
+    list[static_cast<std::size_t>(at)] = last;
+    connectionAt(last).*position = at;
+    list.pop_back();
+    connection.*position = -1;
+}
+
+void WsShard::onSocketDisconnected(quint64 id)
+{
+    Connection *connection = this->connection(id);
+    if (!connection)
+        return;
+    QWebSocket *socket = connection->socket;
+
+    listRemove(m_authenticated, &Connection::authenticatedAt, *connection);
+    listRemove(m_backlogged, &Connection::backloggedAt, *connection);
+    listRemove(m_batched, &Connection::batchedAt, *connection);
+    if (connection->drainWave >= 0)
+        m_metrics.drainOpen.fetch_sub(1, std::memory_order_relaxed);
+    const quint32 index = slotIndex(id);
+    for (const QString &key : std::as_const(connection->subscriptions))
+        removeSubscriber(key, index);
+    m_connectionCount.fetch_sub(1, std::memory_order_relaxed);
+    if (connection->deflate)
+        m_deflateConnectionCount.fetch_sub(1, std::memory_order_relaxed);
+    if (connection->cbor)
+        m_cborConnectionCount.fetch_sub(1, std::memory_order_relaxed);
+
+    // The slot is free for the next connection; handles to this one no longer
+    // resolve.
+    Slot &slot = m_slots[index];
+    slot.connection = Connection{};
+    slot.live = false;
+    ++slot.generation;
+    m_freeSlots.push_back(index);
+
+    m_host->logClientDisconnected(socket->peerAddress().toString(), socket->peerPort());
+    // Core may still answer commands this socket sent; they are dropped where
+    // they are kept.
+    m_host->connectionClosed(m_index, m_epoch, id);
+
+    socket->deleteLater();
+}
+
+void WsShard::onTextMessageReceived(quint64 id, const QString &message)
+{
+    Connection *connection = this->connection(id);
+    if (!connection)
+        return;
+    // QWebSocket hands text frames over as QString; one conversion gets back the
+    // UTF-8 the client sent, and from there the envelope is read in a single pass
+    // without building a document (inboundenvelope.h).
+    const QByteArray frame = message.toUtf8();
+    ShardMetrics::add(m_metrics.framesIn);
+    ShardMetrics::add(m_metrics.bytesIn, static_cast<quint64>(frame.size()));
+    if (connection->authPending) {
+        connection->heldFrames.append(frame);
+        return;
+    }
+    handleFrame(*connection, frame);
+}
+
+void WsShard::onBinaryMessageReceived(quint64 id, const QByteArray &message)
+{
+    Connection *connection = this->connection(id);
+    if (!connection)
+        return;
+    ShardMetrics::add(m_metrics.framesIn);
+    ShardMetrics::add(m_metrics.bytesIn, static_cast<quint64>(message.size()));
+    // Turned into the JSON text everything behind this point speaks, in one
+    // pass; from there a CBOR frame is handled exactly as a text frame is.
+    std::string json;
+    if (!cbor::toJson(std::string_view(message.constData(), static_cast<std::size_t>(message.size())), &json)) {
+        sendProtocolError(*connection, std::nullopt, kErrorCodeInvalidJson,
+                          "Frame is not a single CBOR item with a JSON form.");
+        return;
+    }
+    QByteArray frame = QByteArray::fromStdString(json);
+    if (connection->authPending) {
+        connection->heldFrames.append(frame);
+        return;
+    }
+    handleFrame(*connection, frame);
+}
+
+void WsShard::handleFrame(Connection &connection, const QByteArray &frame)
+{
+    const qint64 receivedNs = monotonicNs();
+    InboundEnvelope envelope;
+    if (!scanInboundEnvelope(std::string_view(frame.constData(), static_cast<std::size_t>(frame.size())),
+                             &envelope)) {
+        sendProtocolError(connection, std::nullopt, kErrorCodeInvalidJson, kMessageInvalidJson);
+        return;
+    }
+
+    const std::optional<CmdId> cid = readCid(envelope);
+    if (!cid.has_value()) {
+        sendProtocolError(connection, std::nullopt, kErrorCodeMissingCid, kMessageMissingCid);
+        return;
+    }
+
+    // Past the drain notice, nothing new goes to core; what is already there is
+    // still answered.
+    if (m_draining) {
+        sendProtocolError(connection, cid, kErrorCodeDraining,
+                          "The server is shutting down; reconnect after the delay it sent.");
+        return;
+    }
+
+    if (envelope.type == kEnvelopeTypeBatch) {
+        handleBatch(connection, frame, envelope, *cid, receivedNs);
+        return;
+    }
+
+    // Checked once the cid is known, so the refusal can say which frame it
+    // refused; the scan is all a refused frame costs.
+    if (!admitFrame(connection, receivedNs)) {
+        sendProtocolError(connection, cid, kErrorCodeRateLimited, "Too many frames; slow down.");
+        return;
+    }
+    handleEnvelope(connection, frame, envelope, *cid, receivedNs);
+}
+
+void WsShard::handleEnvelope(Connection &connection,
+                             const QByteArray &frame,
+                             const InboundEnvelope &envelope,
+                             CmdId cid,
+                             qint64 receivedNs)
+{
+    if (envelope.type != kEnvelopeTypeCmd) {
+        sendProtocolError(connection, cid, kErrorCodeInvalidType, kMessageInvalidType);
+        return;
+    }
+
+    const QString topic =
+        QString::fromUtf8(envelope.topic.data(), static_cast<qsizetype>(envelope.topic.size()));
+    if (topic.trimmed().isEmpty()) {
+        sendProtocolError(connection, cid, kErrorCodeMissingTopic, kMessageMissingTopic);
+        return;
+    }
+
+    // A connection that has not authenticated gets the handshake and the login,
+    // and nothing else. Core would refuse the rest anyway, but a socket that
+    // answers to anyone should not be able to make it do the refusing (F-42).
+    const QString requestClientId =
+        QString::fromUtf8(envelope.clientId.data(), static_cast<qsizetype>(envelope.clientId.size()));
+    if (!connection.isAuthenticated() && !isPreAuthTopic(topic)) {
+        sendProtocolError(connection, cid, "unauthenticated",
+                          "Authenticate with sync.auth.login.set before sending this topic.");
+        return;
+    }
+    // What counts as activity is what core counts: a call it authorizes, which
+    // is where it touches the session. The pre-auth topics are not that - a
+    // heartbeat says the socket is open, not that anyone is still using it, and
+    // letting it extend the session would make the timeout decorative.
+    if (!isPreAuthTopic(topic))
+        connection.lastActivityMs = receivedNs / 1000000;
+
+    // Only used to remember a session the client already held when it said hello.
+    const QString requestAuthToken =
+        QString::fromUtf8(envelope.authToken.data(), static_cast<qsizetype>(envelope.authToken.size()))
+            .trimmed();
+
+    if (topic == kTopicSubscribe || topic == kTopicUnsubscribe) {
+        handleSubscription(connection, cid, topic, envelope.payload);
+        return;
+    }
+
+    // Batching is settled at hello, which still goes on to core as before; a
+    // later hello without the flag turns it off again.
+    if (topic == QLatin1String("sync.hello.get")) {
+        if (wantsEventBatch(envelope.payload)) {
+            connection.batching = true;
+        } else {
+            flushBatch(connection);
+            connection.batching = false;
+        }
+    }
+
+    // Routing is the protocol's decision, made once in TransportPluginBase on the
+    // transport's thread. What travels there is what only this shard knows:
+    // which connection asked, and with which session.
+    //
+    // The identity comes from the connection, not from the frame: a client cannot
+    // hand itself a session by putting a token in a payload (F-42, F-60).
+    ShardCommand command;
+    command.shard = m_index;
+    command.epoch = m_epoch;
+    command.connectionId = connection.id;
+    command.cid = cid;
+    command.topic = topic;
+    command.requestClientId = requestClientId;
+    command.requestAuthToken = requestAuthToken;
+    command.sessionToken = connection.token;
+    command.sessionClientId = connection.clientId;
+    // The API takes the payload as text, and the scanner left it as the slice of
+    // the frame the client sent: no parse, rebuild and reserialize in between.
+    // The frame goes along so the slice stays valid on the other thread.
+    command.payloadJson = envelope.payload;
+    command.frame = frame;
+    command.receivedNs = receivedNs;
+    // A pre-auth command may establish the session the next frame is judged
+    // by, and its answer comes back from the transport's thread. Until it has,
+    // this connection's later frames wait rather than race it.
+    if (isSessionTopic(topic)) {
+        connection.authPending = true;
+        connection.resume = resumeRequestFrom(envelope.payload);
+    }
+    if (BatchReply *reply = connection.collecting) {
+        reply->commandSlots.push_back(reply->current);
+        reply->commands.push_back(std::move(command));
+        return;
+    }
+    m_host->submitCommand(std::move(command));
+}
+
+void WsShard::handleBatch(Connection &connection,
+                          const QByteArray &frame,
+                          const InboundEnvelope &envelope,
+                          CmdId cid,
+                          qint64 receivedNs)
+{
+    std::vector<std::string_view> entries;
+    if (!scanBatchCommands(envelope.payload, &entries) || entries.empty() || entries.size() > kMaxBatchCommands) {
+        // Counted as one frame against the rate, as it is answered as one.
+        if (admitFrame(connection, receivedNs))
+            sendProtocolError(connection, cid, kErrorCodeInvalidBatch,
+                              "A batch needs a payload of {\"commands\": [...]} with 1.."
+                                  + std::to_string(kMaxBatchCommands) + " commands.");
+        else
+            sendProtocolError(connection, cid, kErrorCodeRateLimited, "Too many frames; slow down.");
+        return;
+    }
+    ShardMetrics::add(m_metrics.commandBatches);
+    ShardMetrics::add(m_metrics.batchedCommands, entries.size());
+
+    // Every command is judged as if it had come in a frame of its own - rate
+    // limit, validation, session gate - and whatever would have been sent for
+    // it lands in its place in the reply instead (see send()). Only what core
+    // answers leaves this pass, together.
+    BatchReply reply;
+    reply.cid = cid;
+    reply.answers.resize(entries.size());
+    connection.collecting = &reply;
+    InboundEnvelope entry;
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        reply.current = i;
+        if (!scanInboundEnvelope(entries[i], &entry)) {
+            sendProtocolError(connection, std::nullopt, kErrorCodeInvalidJson, kMessageInvalidJson);
+            continue;
+        }
+        const std::optional<CmdId> entryCid = readCid(entry);
+        if (!entryCid.has_value()) {
+            sendProtocolError(connection, std::nullopt, kErrorCodeMissingCid, kMessageMissingCid);
+            continue;
+        }
+        if (!admitFrame(connection, receivedNs)) {
+            sendProtocolError(connection, entryCid, kErrorCodeRateLimited, "Too many frames; slow down.");
+            continue;
+        }
+        // A command that may change the session decides how every later one
+        // is judged, and its answer comes back after this pass is over.
+        const QString entryTopic =
+            QString::fromUtf8(entry.topic.data(), static_cast<qsizetype>(entry.topic.size()));
+        if (isSessionTopic(entryTopic)) {
+            sendProtocolError(connection, entryCid, kErrorCodeNotBatchable,
+                              "Send sync.hello.get and sync.auth.* in frames of their own.");
+            continue;
+        }
+        handleEnvelope(connection, frame, entry, *entryCid, receivedNs);
+    }
+    connection.collecting = nullptr;
+
+    if (reply.commands.empty()) {
+        sendBatchReply(connection, reply);
+        return;
+    }
+    const quint64 batchId = ++connection.nextBatchId;
+    std::vector<ShardCommand> commands = std::move(reply.commands);
+    reply.commands.clear();
+    connection.pendingBatches.insert(batchId, std::move(reply));
+    m_host->submitBatch(batchId, std::move(commands));
+}
+
+void WsShard::sendBatchReply(Connection &connection, const BatchReply &reply)
+{
+    // The answers are the envelopes each command would have had on its own,
+    // so a client reads them as it reads single frames.
+    std::size_t size = 16;
+    for (const std::string &answer : reply.answers)
+        size += answer.size() + 1;
+    std::string payload;
+    payload.reserve(size);
+    payload += R"({"results":[)";
+    for (std::size_t i = 0; i < reply.answers.size(); ++i) {
+        if (i > 0)
+            payload += ',';
+        payload += reply.answers[i].empty() ? std::string_view("null") : std::string_view(reply.answers[i]);
+    }
+    payload += "]}";
+    send(connection, kEnvelopeTypeResponse, kTopicBatchResponse, reply.cid, payload);
+    if (reply.snapshotAfter)
+        sendStateSnapshot(connection);
+}
+
+bool WsShard::admitFrame(Connection &connection, qint64 receivedNs)
+{
+    InboundBudget &budget = connection.inbound;
+    if (budget.refilledNs == 0) {
+        budget.tokens = m_settings.inbound.burst;
+        budget.refilledNs = receivedNs;
+    }
+
+    const double elapsedSec = static_cast<double>(receivedNs - budget.refilledNs) / 1e9;
+    budget.tokens = std::min(m_settings.inbound.burst, budget.tokens + elapsedSec * m_settings.inbound.framesPerSec);
+    budget.refilledNs = receivedNs;
+    if (budget.tokens >= 1.0) {
+        budget.tokens -= 1.0;
+        budget.refused = 0;
+        return true;
+    }
+
+    // A client that reads its errors backs off. One that sends another whole
+    // burst into them is not listening, and answering it costs as much as
+    // serving it would.
+    if (++budget.refused == static_cast<int>(m_settings.inbound.burst) + 1) {
+        QMetaObject::invokeMethod(this, [this, id = connection.id]() {
+            if (Connection *connection = this->connection(id))
+                closeConnection(*connection, QWebSocketProtocol::CloseCodePolicyViolated,
+                                QStringLiteral("Rate limit exceeded"));
+        }, Qt::QueuedConnection);
+    }
+    return false;
+}
+
+std::optional<CmdId> WsShard::readCid(const InboundEnvelope &envelope)
+{
+    switch (envelope.cidKind) {
+    case InboundEnvelope::CidKind::Number:
+        return cidFromNumber(envelope.cidNumber);
+    case InboundEnvelope::CidKind::String:
+        return cidFromString(envelope.cidText);
+    case InboundEnvelope::CidKind::Absent:
+        break;
+    }
+    return std::nullopt;
+}
+
+bool WsShard::isLoopbackOrigin(const QString &origin)
+{
+    // A UI served from the same machine keeps working out of the box, whichever
+    // port a dev server or the packaged UI happens to use. Anything else has to
+    // be named. That is the line between "the operator's own page" and
+    // "whatever site the browser happens to have open".
+    const QUrl url(origin);
+    if (!url.isValid())
+        return false;
+    const QString scheme = url.scheme().toLower();
+    if (scheme != QStringLiteral("http") && scheme != QStringLiteral("https"))
+        return false;
+
+    const QString host = url.host().toLower();
+    if (host == QStringLiteral("localhost") || host == QStringLiteral("::1"))
+        return true;
+    const QHostAddress address(host);
+    return !address.isNull() && address.isLoopback();
+}
+
+bool WsShard::isPreAuthTopic(const QString &topic)
+{
+    // The handshake, the way in, and the way out. Core owns the authoritative
+    // table and refuses anything else anyway; this list exists so an
+    // unauthenticated flood never reaches it in the first place.
+    return topic == QLatin1String("sync.hello.get")
+        || topic == QLatin1String("sync.ping.get")
+        || topic.startsWith(QLatin1String("sync.auth."));
+}
+
+bool WsShard::isSessionTopic(const QString &topic)
+{
+    // What trackAuthOutcome() looks at. A ping is pre-auth but changes nothing,
+    // so it does not hold up the frames behind it.
+    return topic == QLatin1String("sync.hello.get") || topic.startsWith(QLatin1String("sync.auth."));
+}
+
+void WsShard::trackAuthOutcome(Connection &connection,
+                               const QString &topic,
+                               const QString &requestClientId,
+                               const QString &requestAuthToken,
+                               std::string_view responsePayloadJson)
+{
+    if (topic == QLatin1String("sync.auth.logout.set")) {
+        forgetSession(connection);
+        return;
+    }
+
+    const bool isLogin = topic == QLatin1String("sync.auth.login.set")
+        || topic == QLatin1String("sync.auth.bootstrap.set")
+        || topic == QLatin1String("sync.hello.get");
+    if (!isLogin)
+        return;
+
+    // The only place this transport looks inside a payload: the session core
+    // just issued is what it has to remember, and it is in the answer.
+    const QJsonObject response =
+        QJsonDocument::fromJson(QByteArray::fromRawData(responsePayloadJson.data(),
+                                                       static_cast<qsizetype>(responsePayloadJson.size())))
+            .object();
+
+    // How long this session may sit idle is core's decision, and it states it in
+    // the same answer that hands out the token (F-42). 0 or absent means core
+    // does not expire sessions, so neither does this transport.
+    const qint64 idleBudgetMs =
+        static_cast<qint64>(response.value(QStringLiteral("sessionIdleSec")).toDouble(0.0)) * 1000;
+    const QString token = response.value(QStringLiteral("token")).toString().trimmed();
+    if (!token.isEmpty()) {
+        rememberSession(connection, token.toStdString(), requestClientId.toStdString(), idleBudgetMs);
+        return;
+    }
+
+    // hello with an authToken core accepted: the client already had a session.
+    if (topic == QLatin1String("sync.hello.get")
+        && response.value(QStringLiteral("authAccepted")).toBool(false) && !requestAuthToken.isEmpty()) {
+        rememberSession(connection, requestAuthToken.toStdString(), requestClientId.toStdString(), idleBudgetMs);
+    }
+}
+
+void WsShard::rememberSession(Connection &connection, std::string token, std::string clientId, qint64 idleBudgetMs)
+{
+    connection.token = std::move(token);
+    connection.clientId = std::move(clientId);
+    connection.idleBudgetMs = idleBudgetMs;
+    connection.lastActivityMs = monotonicMs();
+    connection.wheelTicket = m_nextWheelTicket++;
+    listInsert(m_authenticated, &Connection::authenticatedAt, connection);
+    if (idleBudgetMs > 0) {
+        m_idleWheel.schedule(connection.id, connection.wheelTicket, connection.lastActivityMs + idleBudgetMs);
+        if (!m_idleTimer->isActive())
+            m_idleTimer->start();
+    }
+}
+
+void WsShard::forgetSession(Connection &connection)
+{
+    // The wheel entry stays behind and is dropped when its slot comes round:
+    // the ticket no longer matches.
+    connection.token.clear();
+    connection.clientId.clear();
+    connection.idleBudgetMs = 0;
+    connection.wheelTicket = 0;
+    listRemove(m_authenticated, &Connection::authenticatedAt, connection);
+}
+
+void WsShard::dropIdleSessions()
+{
+    const qint64 nowMs = monotonicMs();
+    QList<quint64> expired;
+    m_idleWheel.advance(nowMs, [&](quint64 id, quint64 ticket) -> qint64 {
+        // A connection that closed, or a session that was replaced or logged
+        // out, leaves its entry behind; this is where it is dropped.
+        const Connection *connection = this->connection(id);
+        if (!connection || connection->wheelTicket != ticket)
+            return 0;
+        const qint64 deadlineMs = connection->lastActivityMs + connection->idleBudgetMs;
+        if (deadlineMs > nowMs)
+            return deadlineMs;
+        expired.append(id);
+        return 0;
+    });
+    if (m_idleWheel.isEmpty())
+        m_idleTimer->stop();
+
+    // Closed after the wheel has moved on: a close may report the disconnect
+    // before it returns.
+    for (const quint64 id : std::as_const(expired)) {
+        Connection *connection = this->connection(id);
+        if (!connection)
+            continue;
+        const QString clientId = QString::fromStdString(connection->clientId);
+        const qint64 idleSec = (nowMs - connection->lastActivityMs) / 1000;
+        forgetSession(*connection);
+        m_host->logIdleTimeout(clientId, idleSec);
+        // Core drops the token on the same clock; this closes the pipe that
+        // would otherwise keep pushing events at a session nobody is watching.
+        closeConnection(*connection, QWebSocketProtocol::CloseCodeNormal, QStringLiteral("Session idle timeout"));
+    }
+}
+
+void WsShard::beginDrain(const DrainSettings &settings)
+{
+    m_draining = true;
+    m_drainWaveClosed = -1;
+    m_drain = settings;
+    m_drain.waves = std::max(1, m_drain.waves);
+    for (Slot &slot : m_slots) {
+        if (slot.live)
+            sendDrainNotice(slot.connection);
+    }
+}
+
+void WsShard::sendDrainNotice(Connection &connection)
+{
+    if (connection.drainWave >= 0)
+        return;
+    // Drawn per connection rather than per shard, so every shard's clients
+    // spread over the whole window.
+    const qint64 windowMs = m_drain.reconnectWindowMs;
+    const qint64 delayMs = windowMs > 0 ? QRandomGenerator::global()->bounded(windowMs) : 0;
+    connection.drainWave = windowMs > 0 ? static_cast<int>(delayMs * m_drain.waves / windowMs) : 0;
+    // Whatever events it has batched go ahead of the notice.
+    flushBatch(connection);
+    send(connection, kEnvelopeTypeEvent, kTopicDrain, std::nullopt,
+         "{\"reconnectAfterMs\":" + std::to_string(delayMs) + ",\"reconnectWindowMs\":"
+             + std::to_string(windowMs) + "}");
+    ShardMetrics::add(m_metrics.drainNotices);
+    m_metrics.drainOpen.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WsShard::closeDrained(Connection &connection)
+{
+    connection.drainWave = -1;
+    m_metrics.drainOpen.fetch_sub(1, std::memory_order_relaxed);
+    ShardMetrics::add(m_metrics.drainClosed);
+    closeConnection(connection, QWebSocketProtocol::CloseCodeGoingAway, QStringLiteral("Server restarting"));
+}
+
+void WsShard::closeDrainWave(int wave)
+{
+    m_drainWaveClosed = std::max(m_drainWaveClosed, wave);
+    // Collected first: a socket may report its disconnect from inside close().
+    // What is still queued for a connection - a cmd.response, perhaps - goes
+    // first; flushOutbound() closes it once that is written.
+    QList<quint64> closing;
+    for (const Slot &slot : m_slots) {
+        const Connection &connection = slot.connection;
+        if (slot.live && connection.drainWave >= 0 && connection.drainWave <= wave && !connection.outbound)
+            closing.append(connection.id);
+    }
+    for (const quint64 id : std::as_const(closing)) {
+        if (Connection *connection = this->connection(id))
+            closeDrained(*connection);
+    }
+}
+
+void WsShard::closeDrainLeftovers()
+{
+    QList<quint64> closing;
+    for (const Slot &slot : m_slots) {
+        if (slot.live && slot.connection.drainWave >= 0)
+            closing.append(slot.connection.id);
+    }
+    for (const quint64 id : std::as_const(closing)) {
+        Connection *connection = this->connection(id);
+        if (!connection)
+            continue;
+        if (connection->outbound)
+            ShardMetrics::add(m_metrics.drainHardClosed);
+        closeDrained(*connection);
+    }
+}
+
+void WsShard::closeAll()
+{
+    if (m_sweep)
+        m_sweep->stop();
+    if (m_idleTimer)
+        m_idleTimer->stop();
+    if (m_batchTimer)
+        m_batchTimer->stop();
+    // The table is emptied first, so a disconnect reported from inside close()
+    // finds no connection to clean up after.
+    QList<QWebSocket *> clients;
+    for (Slot &slot : m_slots) {
+        if (!slot.live)
+            continue;
+        finishFragmentedMessage(slot.connection);
+        clients.append(slot.connection.socket);
+    }
+    m_slots.clear();
+    m_freeSlots.clear();
+    m_metrics.drainOpen.store(0, std::memory_order_relaxed);
+    m_authenticated.clear();
+    m_backlogged.clear();
+    m_batched.clear();
+    m_subscribers.clear();
+    m_connectionCount.store(0, std::memory_order_relaxed);
+    m_deflateConnectionCount.store(0, std::memory_order_relaxed);
+    m_cborConnectionCount.store(0, std::memory_order_relaxed);
+    for (QWebSocket *client : std::as_const(clients)) {
+        client->close();
+        client->deleteLater();
+    }
+}
+
+WsShard::EncodedEnvelope WsShard::encodeEnvelope(std::string_view type,
+                                                         std::string_view topic,
+                                                         std::optional<CmdId> cid,
+                                                         std::string_view payloadJson)
+{
+    // The envelope shape comes from the shared header; the payload is spliced as
+    // text, so an event that core serialized once travels straight to the wire.
+    EncodedEnvelope envelope;
+    envelope.json = makeEnvelope(type, topic, cid, payloadJson);
+    return envelope;
+}
+
+WsShard::WireFrame WsShard::wireFrameFor(const Connection &connection, EncodedEnvelope &envelope)
+{
+    // Each wire form is built the first time a socket needs it and shared by
+    // every socket after that. QWebSocket takes text frames as QString, so that
+    // conversion happens here as well - once per frame, not once per socket.
+    const qsizetype jsonSize = static_cast<qsizetype>(envelope.json.size());
+    if (connection.cbor) {
+        if (envelope.cbor.isNull()) {
+            std::string bytes;
+            if (cbor::fromJson(std::string_view(envelope.json.data(), envelope.json.size()), &bytes)) {
+                envelope.cbor.binary = QByteArray::fromStdString(bytes);
+            } else {
+                // Nothing core produces, but if it did: a CBOR client still
+                // reads the JSON it would have got, rather than nothing.
+                envelope.cbor.text = QString::fromUtf8(envelope.json.data(), jsonSize);
+            }
+        }
+        return envelope.cbor;
+    }
+    if (connection.deflate && jsonSize >= m_settings.compression.minFrameBytes) {
+        if (envelope.deflated.isNull()) {
+            QElapsedTimer timer;
+            timer.start();
+            // qCompress writes a zlib stream behind a 4-byte length of its own;
+            // the stream alone is what a client's inflate (DecompressionStream
+            // "deflate") expects.
+            envelope.deflated.binary =
+                qCompress(reinterpret_cast<const uchar *>(envelope.json.data()), jsonSize, m_settings.compression.level)
+                    .sliced(4);
+            m_compressionStats.nsecs.fetch_add(timer.nsecsElapsed(), std::memory_order_relaxed);
+            m_compressionStats.frames.fetch_add(1, std::memory_order_relaxed);
+            m_compressionStats.inputBytes.fetch_add(static_cast<quint64>(jsonSize), std::memory_order_relaxed);
+            m_compressionStats.outputBytes.fetch_add(static_cast<quint64>(envelope.deflated.binary.size()),
+                                                     std::memory_order_relaxed);
+        } else {
+            m_compressionStats.sharedFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+        return envelope.deflated;
+    }
+    if (envelope.text.isNull()) {
+        if (m_settings.fragmentation.fragmentBytes > 0 && jsonSize >= m_settings.fragmentation.minMessageBytes)
+            envelope.text.fragmentedText = QByteArray(envelope.json.data(), jsonSize);
+        else
+            envelope.text.text = QString::fromUtf8(envelope.json.data(), jsonSize);
+    }
+    return envelope.text;
+}
+
+void WsShard::writeFrame(QWebSocket *socket, const WireFrame &frame)
+{
+    ShardMetrics::add(m_metrics.framesOut);
+    ShardMetrics::add(m_metrics.bytesOut, static_cast<quint64>(frame.size()));
+    // Text kept for fragments reaches here only on a connection with no socket
+    // of its own to fragment on.
+    if (!frame.binary.isNull())
+        socket->sendBinaryMessage(frame.binary);
+    else if (!frame.fragmentedText.isNull())
+        socket->sendTextMessage(QString::fromUtf8(frame.fragmentedText));
+    else
+        socket->sendTextMessage(frame.text);
+}
+
+bool WsShard::isFragmented(const Connection &connection, const WireFrame &frame) const
+{
+    if (m_settings.fragmentation.fragmentBytes <= 0 || !connection.wire)
+        return false;
+    return !frame.fragmentedText.isNull() || frame.binary.size() >= m_settings.fragmentation.minMessageBytes;
+}
+
+void WsShard::writeFragment(Connection &connection, OutboundQueue &queue, bool rest)
+{
+    const bool text = !queue.fragmenting.fragmentedText.isNull();
+    const QByteArray &bytes = text ? queue.fragmenting.fragmentedText : queue.fragmenting.binary;
+    const std::string_view message(bytes.constData(), static_cast<std::size_t>(bytes.size()));
+    const std::size_t from = static_cast<std::size_t>(queue.fragmentOffset);
+    QTcpSocket *wire = connection.wire;
+    if (!wire) {
+        // Gone with its QWebSocket; the disconnect cleans up after it.
+        queue.fragmentBytes -= static_cast<qint64>(message.size() - from);
+        queue.fragmenting = WireFrame{};
+        queue.fragmentOffset = 0;
+        return;
+    }
+
+    const std::size_t maxBytes =
+        rest ? message.size() - from : static_cast<std::size_t>(m_settings.fragmentation.fragmentBytes);
+    const std::size_t to = text ? wsframe::utf8FragmentEnd(message, from, maxBytes)
+                                : from + std::min(maxBytes, message.size() - from);
+    const bool last = to == message.size();
+    const wsframe::Opcode opcode = from > 0 ? wsframe::Opcode::Continuation
+        : text                              ? wsframe::Opcode::Text
+                                            : wsframe::Opcode::Binary;
+    std::string header;
+    header.reserve(wsframe::kMaxHeaderBytes);
+    wsframe::appendHeader(&header, opcode, last, to - from);
+    wire->write(header.data(), static_cast<qint64>(header.size()));
+    wire->write(bytes.constData() + from, static_cast<qint64>(to - from));
+    ShardMetrics::add(m_metrics.fragmentsOut);
+    ShardMetrics::add(m_metrics.bytesOut, static_cast<quint64>(to - from));
+    queue.fragmentBytes -= static_cast<qint64>(to - from);
+    // A long message on a slow link is behind for as long as it takes, and
+    // that is not a stall: the stall clock runs from the last fragment.
+    queue.overBudgetSinceMs = monotonicMs();
+    if (last) {
+        queue.fragmenting = WireFrame{};
+        queue.fragmentOffset = 0;
+    } else {
+        queue.fragmentOffset = static_cast<qint64>(to);
+    }
+}
+
+void WsShard::finishFragmentedMessage(Connection &connection)
+{
+    if (!connection.outbound)
+        return;
+    OutboundQueue &queue = *connection.outbound;
+    // One not started yet is simply not sent; one started cannot be taken back
+    // short of its final fragment, so the client gets all of it. Whatever is
+    // queued behind it stays there: the connection is on its way out.
+    if (!queue.fragmenting.isNull() && queue.fragmentOffset > 0)
+        writeFragment(connection, queue, true);
+    queue.fragmentBytes = 0;
+    queue.fragmenting = WireFrame{};
+    queue.fragmentOffset = 0;
+    queue.dropping = true;
+}
+
+void WsShard::closeConnection(Connection &connection, QWebSocketProtocol::CloseCode code, const QString &reason)
+{
+    finishFragmentedMessage(connection);
+    connection.socket->close(code, reason);
+}
+
+void WsShard::sendFrame(Connection &connection, const WireFrame &frame, const QString &coalesceKey)
+{
+    QWebSocket *socket = connection.socket;
+    if (!socket || socket->state() != QAbstractSocket::ConnectedState)
+        return;
+
+    // Qt buffers whatever it is given, without limit. While the socket keeps up,
+    // frames go straight through; once it holds a budget's worth, further frames
+    // wait here, where they can be counted, coalesced and eventually refused.
+    // A message that goes out in fragments always comes through here: the
+    // queue is what writes it, a fragment at a time as the socket drains.
+    const bool fragmented = isFragmented(connection, frame);
+    if (!connection.outbound) {
+        if (!fragmented && socket->bytesToWrite() < m_settings.outbound.budgetBytes) {
+            writeFrame(socket, frame);
+            return;
+        }
+        connection.outbound = std::make_unique<OutboundQueue>();
+        connection.outbound->overBudgetSinceMs = monotonicMs();
+        listInsert(m_backlogged, &Connection::backloggedAt, connection);
+    }
+    OutboundQueue &queue = *connection.outbound;
+    if (queue.dropping)
+        return;
+
+    if (fragmented) {
+        // Never coalesced, and its bytes are not held against the hard limit:
+        // only a fragment's worth at a time reaches the socket's buffer, and
+        // the message itself is mostly an event envelope every recipient on
+        // the shard shares.
+        queue.frames.push_back(OutboundFrame{frame, QString(), false, true});
+        queue.fragmentBytes += frame.size();
+        if (queue.frames.size() > static_cast<std::size_t>(m_settings.outbound.maxQueuedFrames)) {
+            dropSlowConsumer(connection);
+            return;
+        }
+        flushOutbound(connection);
+        return;
+    }
+
+    // A newer state for the same channel makes the queued one worthless. The old
+    // frame is retired and the new one goes to the back, so nothing else in the
+    // queue changes its order - responses and errors never carry a key.
+    const quint64 sequence = queue.firstSequence + queue.frames.size();
+    if (!coalesceKey.isEmpty()) {
+        const auto latest = queue.latestByKey.find(coalesceKey);
+        if (latest != queue.latestByKey.end()) {
+            OutboundFrame &superseded = queue.frames[latest.value() - queue.firstSequence];
+            queue.queuedBytes -= superseded.frame.size();
+            superseded.frame = WireFrame{};
+            superseded.superseded = true;
+            ++queue.coalescedFrames;
+            latest.value() = sequence;
+        } else {
+            queue.latestByKey.insert(coalesceKey, sequence);
+        }
+    }
+    queue.frames.push_back(OutboundFrame{frame, coalesceKey, false, false});
+    queue.queuedBytes += frame.size();
+
+    // Beyond the hard ceiling there is no waiting for the stall timeout: the
+    // memory is being spent now.
+    if (queue.frames.size() > static_cast<std::size_t>(m_settings.outbound.maxQueuedFrames)
+        || queue.queuedBytes > m_settings.outbound.budgetBytes * kOutboundHardLimitFactor) {
+        dropSlowConsumer(connection);
+    }
+}
+
+void WsShard::flushOutbound(Connection &connection)
+{
+    if (!connection.outbound || connection.outbound->dropping)
+        return;
+    OutboundQueue &queue = *connection.outbound;
+    QWebSocket *socket = connection.socket;
+
+    while (socket->bytesToWrite() < m_settings.outbound.budgetBytes) {
+        if (!queue.fragmenting.isNull()) {
+            writeFragment(connection, queue);
+            continue;
+        }
+        if (queue.frames.empty())
+            break;
+        OutboundFrame next = std::move(queue.frames.front());
+        const quint64 sequence = queue.firstSequence++;
+        queue.frames.pop_front();
+        if (next.superseded)
+            continue;
+        if (!next.coalesceKey.isEmpty()) {
+            const auto latest = queue.latestByKey.find(next.coalesceKey);
+            if (latest != queue.latestByKey.end() && latest.value() == sequence)
+                queue.latestByKey.erase(latest);
+        }
+        if (next.fragmented) {
+            // Counted as one frame out, as it is one message to the client.
+            ShardMetrics::add(m_metrics.framesOut);
+            ShardMetrics::add(m_metrics.fragmentedMessages);
+            queue.fragmenting = std::move(next.frame);
+            queue.fragmentOffset = 0;
+            continue;
+        }
+        queue.queuedBytes -= next.frame.size();
+        writeFrame(socket, next.frame);
+    }
+
+    // Caught up: the socket is back to writing straight through, and the stall
+    // clock starts over the next time it falls behind.
+    if (queue.frames.empty() && queue.fragmenting.isNull()) {
+        connection.outbound.reset();
+        listRemove(m_backlogged, &Connection::backloggedAt, connection);
+        // A drain wave passed it by while it was behind. Closed from the event
+        // loop: whoever wrote the frame that got here may still hold it.
+        if (connection.drainWave >= 0 && connection.drainWave <= m_drainWaveClosed) {
+            QMetaObject::invokeMethod(this, [this, id = connection.id]() {
+                Connection *connection = this->connection(id);
+                if (connection && connection->drainWave >= 0 && !connection->outbound)
+                    closeDrained(*connection);
+            }, Qt::QueuedConnection);
+        }
+    }
+}
+
+void WsShard::dropSlowConsumer(Connection &connection)
+{
+    OutboundQueue &queue = *connection.outbound;
+    QWebSocket *socket = connection.socket;
+    queue.dropping = true;
+    ShardMetrics::add(m_metrics.slowConsumerDrops);
+    m_host->logSlowConsumer(socket->peerAddress().toString(),
+                            socket->bytesToWrite() + queue.queuedBytes + queue.fragmentBytes,
+                            static_cast<qint64>(queue.frames.size()),
+                            queue.coalescedFrames);
+    // Not closed here: this runs from inside a fan-out over the connection
+    // lists, and abort() reports the disconnect synchronously. A close
+    // handshake would only queue behind the backlog that got it here.
+    QMetaObject::invokeMethod(socket, &QWebSocket::abort, Qt::QueuedConnection);
+}
+
+void WsShard::dropStalledConsumers()
+{
+    const qint64 nowMs = monotonicMs();
+    for (const quint32 index : std::as_const(m_backlogged)) {
+        Connection &connection = connectionAt(index);
+        if (connection.outbound && !connection.outbound->dropping
+            && nowMs - connection.outbound->overBudgetSinceMs > m_settings.outbound.stallTimeoutMs) {
+            dropSlowConsumer(connection);
+        }
+    }
+}
+
+void WsShard::sampleOutboundBacklog()
+{
+    qint64 bytes = 0;
+    qint64 largest = 0;
+    for (const quint32 index : std::as_const(m_backlogged)) {
+        const Connection &connection = connectionAt(index);
+        const qint64 backlog = connection.socket->bytesToWrite() + connection.outbound->queuedBytes
+            + connection.outbound->fragmentBytes;
+        bytes += backlog;
+        largest = std::max(largest, backlog);
+    }
+    m_metrics.backlogConnections.store(static_cast<qint64>(m_backlogged.size()), std::memory_order_relaxed);
+    m_metrics.backlogBytes.store(bytes, std::memory_order_relaxed);
+    m_metrics.backlogMaxBytes.store(largest, std::memory_order_relaxed);
+}
+
+void WsShard::onSocketBytesWritten(quint64 id)
+{
+    if (Connection *connection = this->connection(id))
+        flushOutbound(*connection);
+}
+
+void WsShard::send(Connection &connection,
+                   std::string_view type,
+                   std::string_view topic,
+                   std::optional<CmdId> cid,
+                   std::string_view payloadJson)
+{
+    if (!connection.socket || connection.socket->state() != QAbstractSocket::ConnectedState)
+        return;
+    if (BatchReply *reply = connection.collecting) {
+        const JsonText json = makeEnvelope(type, topic, cid, payloadJson);
+        reply->answers[reply->current].assign(json.data(), json.size());
+        return;
+    }
+    // Events the socket is still holding happened before this; they go first.
+    flushBatch(connection);
+    EncodedEnvelope envelope = encodeEnvelope(type, topic, cid, payloadJson);
+    sendFrame(connection, wireFrameFor(connection, envelope));
+}
+
+void WsShard::sendProtocolError(Connection &connection,
+                                std::optional<CmdId> cid,
+                                std::string_view code,
+                                std::string_view message)
+{
+    ShardMetrics::add(m_metrics.protocolErrors);
+    send(connection, kEnvelopeTypeError, kTopicProtocolError, cid, makeProtocolErrorPayload(code, message));
+}
+
+void WsShard::sendCmdResponse(Connection &connection,
+                              CmdId cid,
+                              const QString &cmdTopic,
+                              std::string_view payloadJson)
+{
+    // `cmd` and a default `error` go into core's text as it stands; the scan
+    // that finds out whether `error` is there reads members, not substrings
+    // (cmdresponse.h). Results can be whole exports, and parsing them into a
+    // tree only to write them out again was most of what answering them cost.
+    const QByteArray topicBytes = cmdTopic.toUtf8();
+    std::string spliced;
+    if (spliceCmdResponsePayload(payloadJson,
+                                 std::string_view(topicBytes.constData(), static_cast<std::size_t>(topicBytes.size())),
+                                 &spliced)) {
+        send(connection, kEnvelopeTypeResponse, kTopicCmdResponse, cid, spliced);
+        return;
+    }
+
+    // What the splice does not vouch for - malformed results among them - is
+    // decided by the parser, as it always was.
+    QJsonObject out =
+        QJsonDocument::fromJson(QByteArray::fromRawData(payloadJson.data(),
+                                                       static_cast<qsizetype>(payloadJson.size())))
+            .object();
+    out.insert(QStringLiteral("cmd"), cmdTopic);
+    if (!out.contains(QStringLiteral("error")))
+        out.insert(QStringLiteral("error"), QJsonValue::Null);
+    const QByteArray bytes = QJsonDocument(out).toJson(QJsonDocument::Compact);
+    send(connection,
+         kEnvelopeTypeResponse,
+         kTopicCmdResponse,
+         cid,
+         std::string_view(bytes.constData(), static_cast<std::size_t>(bytes.size())));
+}
+
+void WsShard::publishEvent(const std::shared_ptr<const SharedEvent> &event)
+{
+    const std::string_view topic = event->topic;
+    const std::string_view payloadJson = event->payloadJson;
+    if (event->seq != 0) {
+        m_replay.push(event->seq,
+                      event->topic.size() + event->payloadJson.size() + event->envelopeJson.size(),
+                      event);
+    }
+
+    // No cid on events; otherwise the same envelope as everything else.
+    //
+    // Events carry live state - channel values, adapter status - so they go only
+    // to sockets that logged in. Otherwise anything that can open a connection
+    // would read the house without ever authenticating, which is the same leak
+    // the command gate closes (F-42).
+    //
+    // Every recipient gets the same bytes: the transport built the envelope once
+    // for all shards, and each wire form of it is built once per shard, on the
+    // first socket that needs it (see wireFrameFor). A burst to a few hundred
+    // dashboards used to serialize and convert the same envelope a few hundred
+    // times.
+    // Which channel a state event is about: the cache needs it always, the
+    // coalescing only while some socket is backed up - everyone else writes
+    // straight through and never looks at the key.
+    const std::string channelKey =
+        m_stateCache.isEnabled() || !m_backlogged.empty() ? channelKeyFor(topic, payloadJson) : std::string();
+    if (m_stateCache.isEnabled() && !channelKey.empty()) {
+        m_stateCache.update(channelKey, event->topic.size() + event->payloadJson.size() + event->envelopeJson.size(),
+                            event);
+        m_metrics.stateCacheChannels.store(static_cast<std::int64_t>(m_stateCache.size()), std::memory_order_relaxed);
+        m_metrics.stateCacheBytes.store(static_cast<std::int64_t>(m_stateCache.bytes()), std::memory_order_relaxed);
+        m_metrics.stateCacheRefused.store(static_cast<std::int64_t>(m_stateCache.refused()),
+                                          std::memory_order_relaxed);
+    }
+
+    EncodedEnvelope envelope;
+    const QString coalesceKey = m_backlogged.empty()
+        ? QString()
+        : QString::fromUtf8(channelKey.data(), static_cast<qsizetype>(channelKey.size()));
+    // Tags this event, so a connection found again through another bucket is
+    // recognised as served without keeping a set of who was.
+    const quint64 serial = ++m_eventSerial;
+    std::size_t delivered = 0;
+    const auto deliver = [&](Connection &connection) {
+        connection.lastEventSerial = serial;
+        deliverEvent(connection, *event, envelope, coalesceKey);
+        ++delivered;
+    };
+    // Core handing the event over to this shard's last copy written or queued;
+    // a shard that had nobody to send it to has nothing to say about that.
+    const auto recordLatency = [&]() {
+        if (event->producedNs != 0 && delivered > 0)
+            m_metrics.eventLatency.record(elapsedUs(event->producedNs));
+    };
+
+    // The logged-in connections sit next to each other, so the common case - no
+    // subscriptions anywhere - is one pass over a flat array.
+    for (const quint32 index : std::as_const(m_authenticated)) {
+        Connection &connection = connectionAt(index);
+        if (!connection.filtered)
+            deliver(connection);
+    }
+    if (m_subscribers.isEmpty()) {
+        recordLatency();
+        return;
+    }
+
+    // Connections that subscribed are found through the index: one lookup per
+    // segment boundary of the topic, so the cost follows the number of
+    // interested connections rather than the number of connected ones.
+    const QString topicText = QString::fromUtf8(topic.data(), static_cast<qsizetype>(topic.size()));
+    QVarLengthArray<const QSet<quint32> *, 8> buckets;
+    const auto collect = [&](const QString &key) {
+        const auto bucket = m_subscribers.constFind(key);
+        if (bucket != m_subscribers.constEnd())
+            buckets.append(&bucket.value());
+    };
+    collect(QString());
+    for (qsizetype dot = topicText.indexOf(QLatin1Char('.')); dot >= 0;
+         dot = topicText.indexOf(QLatin1Char('.'), dot + 1)) {
+        collect(topicText.left(dot + 1));
+    }
+    collect(topicText);
+
+    // A connection whose patterns overlap sits in several buckets and still
+    // gets the event once. One that subscribed before logging in is indexed
+    // already, and gets nothing until it has.
+    QVarLengthArray<quint32, 64> recipients;
+    for (const QSet<quint32> *bucket : buckets) {
+        for (const quint32 index : *bucket)
+            recipients.append(index);
+    }
+    for (const quint32 index : recipients) {
+        const Slot &slot = m_slots[index];
+        if (!slot.live)
+            continue;
+        Connection &connection = connectionAt(index);
+        if (!connection.isAuthenticated() || connection.lastEventSerial == serial)
+            continue;
+        deliver(connection);
+    }
+    recordLatency();
+}
+
+void WsShard::deliverEvent(Connection &connection,
+                           const SharedEvent &event,
+                           EncodedEnvelope &envelope,
+                           const QString &coalesceKey)
+{
+    if (connection.batching) {
+        appendToBatch(connection, event.envelopeJson);
+        return;
+    }
+    if (envelope.json.empty())
+        envelope.json = event.envelopeJson;
+    sendFrame(connection, wireFrameFor(connection, envelope), coalesceKey);
+}
+
+bool WsShard::isSubscribed(const Connection &connection, const QString &topic)
+{
+    if (!connection.filtered)
+        return true;
+    // The same keys the index is looked up by in publishEvent().
+    if (connection.subscriptions.contains(QString()) || connection.subscriptions.contains(topic))
+        return true;
+    for (qsizetype dot = topic.indexOf(QLatin1Char('.')); dot >= 0; dot = topic.indexOf(QLatin1Char('.'), dot + 1)) {
+        if (connection.subscriptions.contains(topic.left(dot + 1)))
+            return true;
+    }
+    return false;
+}
+
+WsShard::ResumeRequest WsShard::resumeRequestFrom(std::string_view payloadJson)
+{
+    // Read from the payload on the way through, as the cid is; core sees the
+    // payload as the client sent it and ignores what it does not know.
+    ResumeRequest request;
+    json::Cursor cursor(payloadJson);
+    const bool scanned = cursor.readObject(1, [&request](std::string_view key, json::Cursor &value) {
+        if (key != "lastEventSeq" && key != "stateSnapshot")
+            return value.readValue(2);
+        std::string_view slice;
+        json::Kind kind = json::Kind::Invalid;
+        if (!value.readValue(2, &slice, &kind))
+            return false;
+        if (key == "stateSnapshot") {
+            request.snapshot = slice == "true";
+            return true;
+        }
+        quint64 parsed = 0;
+        const auto [end, error] = std::from_chars(slice.data(), slice.data() + slice.size(), parsed);
+        const bool isCount = kind == json::Kind::Number && error == std::errc() && end == slice.data() + slice.size();
+        request.afterSeq = isCount ? parsed : 0;
+        return true;
+    });
+    return scanned ? request : ResumeRequest{};
+}
+
+bool WsShard::replayEvents(Connection &connection, quint64 afterSeq)
+{
+    if (!m_replay.isEnabled())
+        return false;
+    // Runs where the connection turns authenticated, before any live event can
+    // reach it, so what it missed and what comes next arrive in order.
+    quint64 replayed = 0;
+    const bool held = m_replay.replayAfter(afterSeq, [&](quint64, const std::shared_ptr<const SharedEvent> &event) {
+        const QString topic = QString::fromUtf8(event->topic.data(), static_cast<qsizetype>(event->topic.size()));
+        if (!isSubscribed(connection, topic))
+            return;
+        EncodedEnvelope envelope;
+        QString coalesceKey;
+        if (!m_backlogged.empty()) {
+            const std::string channelKey = channelKeyFor(event->topic, event->payloadJson);
+            coalesceKey = QString::fromUtf8(channelKey.data(), static_cast<qsizetype>(channelKey.size()));
+        }
+        deliverEvent(connection, *event, envelope, coalesceKey);
+        ++replayed;
+    });
+    if (held) {
+        ShardMetrics::add(m_metrics.replayedEvents, replayed);
+        return true;
+    }
+
+    // Gone from the ring, or from a sequence this transport never issued: the
+    // client has to fetch state again, and has to be told so. Not subject to
+    // subscriptions - it is about the connection, not about a topic.
+    ShardMetrics::add(m_metrics.replayResyncs);
+    std::string payload = "{\"lastEventSeq\":" + std::to_string(afterSeq);
+    payload += ",\"oldestEventSeq\":" + std::to_string(m_replay.firstSeq());
+    payload += ",\"latestEventSeq\":" + std::to_string(m_replay.lastSeq()) + "}";
+    send(connection, kEnvelopeTypeEvent, kTopicReplayResync, std::nullopt, payload);
+    return false;
+}
+
+void WsShard::sendStateSnapshot(Connection &connection)
+{
+    if (!m_stateCache.isEnabled()
+        || !isSubscribed(connection, QString::fromUtf8(kTopicChannelStateChanged.data(),
+                                                       static_cast<qsizetype>(kTopicChannelStateChanged.size())))) {
+        return;
+    }
+    // The payloads go in as core sent them, the same objects a client gets in
+    // event.channel.stateChanged, so one handler serves both.
+    std::vector<std::string> parts(1);
+    m_stateCache.forEach([&parts](const std::shared_ptr<const SharedEvent> &event) {
+        std::string *part = &parts.back();
+        if (!part->empty() && part->size() + event->payloadJson.size() > kSnapshotFrameBytes)
+            part = &parts.emplace_back();
+        if (!part->empty())
+            part->push_back(',');
+        part->append(event->payloadJson);
+    });
+
+    // The seq is where the snapshot stands in the event sequence: a client that
+    // keeps it can resume from there with lastEventSeq later.
+    std::string tail = ",\"parts\":" + std::to_string(parts.size());
+    tail += ",\"complete\":";
+    tail += m_stateCache.isComplete() ? "true" : "false";
+    if (m_replay.isEnabled())
+        tail += ",\"seq\":" + std::to_string(m_replay.lastSeq());
+    tail += '}';
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        std::string payload;
+        payload.reserve(parts[i].size() + tail.size() + 32);
+        payload += "{\"channels\":[";
+        payload += parts[i];
+        payload += "],\"part\":" + std::to_string(i + 1);
+        payload += tail;
+        send(connection, kEnvelopeTypeEvent, kTopicStateSnapshot, std::nullopt, payload);
+    }
+    ShardMetrics::add(m_metrics.snapshotFrames, parts.size());
+}
+
+std::string WsShard::channelKeyFor(std::string_view topic, std::string_view payloadJson)
+{
+    // Only channel state is last-value-wins. Everything else - adapter status,
+    // stream chunks - may mean something in sequence, so it is never merged.
+    if (topic != kTopicChannelStateChanged)
+        return std::string();
+
+    std::string_view deviceId;
+    std::string_view channelId;
+    json::Cursor cursor(payloadJson);
+    const bool ok = cursor.readObject(1, [&](std::string_view key, json::Cursor &member) {
+        if (key == "deviceId")
+            return member.readValue(2, &deviceId);
+        if (key == "channelId")
+            return member.readValue(2, &channelId);
+        return member.readValue(2);
+    });
+    if (!ok || deviceId.empty() || channelId.empty())
+        return std::string();
+    // Raw JSON text on both sides, so the separator cannot appear unquoted in
+    // either half.
+    std::string key;
+    key.reserve(deviceId.size() + channelId.size() + 1);
+    key.append(deviceId).append(1, ':').append(channelId);
+    return key;
+}
+
+QString WsShard::subscriptionKey(const QString &pattern)
+{
+    // "*" is everything, "event.channel.*" every topic below that prefix, and
+    // anything else one exact topic. Prefixes end at a segment boundary, so
+    // "event.chan*" is not a pattern: the index is looked up per segment.
+    const QString trimmed = pattern.trimmed();
+    if (trimmed == QLatin1String("*"))
+        return QStringLiteral("");
+    const bool isPrefix = trimmed.endsWith(QLatin1String(".*"));
+    const QString name = isPrefix ? trimmed.chopped(2) : trimmed;
+    const QStringList segments = name.split(QLatin1Char('.'));
+    if (segments.front() != QLatin1String("event") && segments.front() != QLatin1String("stream"))
+        return QString();
+    for (const QString &segment : segments) {
+        if (segment.isEmpty() || segment.contains(QLatin1Char('*')))
+            return QString();
+    }
+    return isPrefix ? name + QLatin1Char('.') : name;
+}
+
+QString WsShard::subscriptionPattern(const QString &key)
+{
+    if (key.isEmpty())
+        return QStringLiteral("*");
+    if (key.endsWith(QLatin1Char('.')))
+        return key + QLatin1Char('*');
+    return key;
+}
+
+void WsShard::removeSubscriber(const QString &key, quint32 index)
+{
+    auto bucket = m_subscribers.find(key);
+    if (bucket == m_subscribers.end())
+        return;
+    bucket->remove(index);
+    if (bucket->isEmpty())
+        m_subscribers.erase(bucket);
+}
+
+void WsShard::handleSubscription(Connection &connection,
+                                 CmdId cid,
+                                 const QString &topic,
+                                 std::string_view payloadJson)
+{
+    // {"topics": ["event.channel.*", "stream.*"], "snapshot": true}. Every
+    // entry has to be a pattern; a request with one bad entry changes nothing.
+    QStringList keys;
+    bool patternsValid = true;
+    bool snapshotWanted = false;
+    json::Cursor cursor(payloadJson);
+    const bool payloadOk = cursor.readObject(1, [&](std::string_view key, json::Cursor &member) {
+        if (key == "snapshot") {
+            std::string_view slice;
+            if (!member.readValue(2, &slice))
+                return false;
+            snapshotWanted = slice == "true";
+            return true;
+        }
+        if (key != "topics" || member.peekKind() != json::Kind::Array)
+            return member.readValue(2);
+        keys.clear();
+        return member.readArray(2, [&](json::Cursor &element) {
+            std::string pattern;
+            if (element.peekKind() != json::Kind::String) {
+                patternsValid = false;
+                return element.readValue(3);
+            }
+            if (!element.readString(&pattern))
+                return false;
+            const QString subscriptionKeyText =
+                subscriptionKey(QString::fromUtf8(pattern.data(), static_cast<qsizetype>(pattern.size())));
+            if (subscriptionKeyText.isNull())
+                patternsValid = false;
+            else
+                keys.append(subscriptionKeyText);
+            return true;
+        });
+    });
+    if (!payloadOk || !patternsValid || keys.isEmpty()) {
+        sendProtocolError(connection, cid, kErrorCodeInvalidSubscription,
+                          "Expected {\"topics\": [...]} with \"*\", \"event.*\"-style prefixes or exact event/stream topics.");
+        return;
+    }
+
+    if (topic == kTopicSubscribe) {
+        // The first subscribe turns the connection from "everything" to "what it
+        // asked for", and it stays filtered after that even with nothing left:
+        // unsubscribing the last topic should not open the floodgates.
+        connection.filtered = true;
+        for (const QString &key : std::as_const(keys)) {
+            if (connection.subscriptions.contains(key))
+                continue;
+            if (connection.subscriptions.size() >= kMaxSubscriptionsPerClient) {
+                sendProtocolError(connection, cid, kErrorCodeInvalidSubscription,
+                                  "Too many subscriptions on this connection; subscribe to a wider prefix.");
+                return;
+            }
+            connection.subscriptions.insert(key);
+            m_subscribers[key].insert(slotIndex(connection.id));
+        }
+    } else {
+        for (const QString &key : std::as_const(keys)) {
+            if (connection.subscriptions.remove(key))
+                removeSubscriber(key, slotIndex(connection.id));
+        }
+    }
+
+    // The answer is the connection's subscriptions as they stand now, so a
+    // client never has to track what its requests added up to.
+    std::string topics = "[";
+    for (const QString &key : std::as_const(connection.subscriptions)) {
+        if (topics.size() > 1)
+            topics += ',';
+        json::appendQuoted(&topics, subscriptionPattern(key).toStdString());
+    }
+    topics += ']';
+    const std::string payload = "{\"topics\":" + topics + ",\"error\":null}";
+    send(connection, kEnvelopeTypeResponse, kTopicSyncResponse, cid, payload);
+    // After the response, so a client knows its subscription took before the
+    // states arrive; sendStateSnapshot sends nothing unless it now covers them.
+    if (snapshotWanted && topic == kTopicSubscribe) {
+        if (connection.collecting)
+            connection.collecting->snapshotAfter = true;
+        else
+            sendStateSnapshot(connection);
+    }
+}
+
+bool WsShard::wantsEventBatch(std::string_view helloPayloadJson)
+{
+    // Only `"eventBatch": true` asks; anything else, or a payload that does not
+    // scan, leaves the connection on one frame per event.
+    bool wanted = false;
+    json::Cursor cursor(helloPayloadJson);
+    const bool scanned = cursor.readObject(1, [&wanted](std::string_view key, json::Cursor &value) {
+        if (key != "eventBatch")
+            return value.readValue(2);
+        std::string_view slice;
+        if (!value.readValue(2, &slice))
+            return false;
+        wanted = slice == "true";
+        return true;
+    });
+    return scanned && wanted;
+}
+
+void WsShard::appendToBatch(Connection &connection, std::string_view envelopeJson)
+{
+    // The envelopes go in exactly as they would have gone out on their own, so
+    // a client unpacks a batch by handing each entry to its usual event path.
+    EventBatch &batch = connection.batch;
+    if (batch.count == 0)
+        listInsert(m_batched, &Connection::batchedAt, connection);
+    else
+        batch.envelopes += ',';
+    batch.envelopes += envelopeJson;
+    ++batch.count;
+    if (batch.count >= m_settings.eventBatch.maxEvents
+        || static_cast<qint64>(batch.envelopes.size()) >= m_settings.eventBatch.maxBytes) {
+        flushBatch(connection);
+        return;
+    }
+    if (!m_batchTimer->isActive())
+        m_batchTimer->start();
+}
+
+void WsShard::flushBatch(Connection &connection)
+{
+    listRemove(m_batched, &Connection::batchedAt, connection);
+    if (connection.batch.count == 0)
+        return;
+    const EventBatch batch = std::exchange(connection.batch, EventBatch{});
+
+    EncodedEnvelope envelope;
+    if (batch.count == 1) {
+        // Nothing to save by wrapping a lone event; it goes out as it came.
+        envelope.json = batch.envelopes;
+    } else {
+        std::string payload;
+        payload.reserve(batch.envelopes.size() + 14);
+        payload += R"({"events":[)";
+        payload += batch.envelopes;
+        payload += "]}";
+        envelope = encodeEnvelope(kEnvelopeTypeEvent, kTopicEventBatch, std::nullopt, payload);
+    }
+    m_batchStats.frames.fetch_add(1, std::memory_order_relaxed);
+    m_batchStats.events.fetch_add(static_cast<quint64>(batch.count), std::memory_order_relaxed);
+    const quint64 size = static_cast<quint64>(batch.count);
+    quint64 largest = m_batchStats.largest.load(std::memory_order_relaxed);
+    while (size > largest
+           && !m_batchStats.largest.compare_exchange_weak(largest, size, std::memory_order_relaxed)) {
+    }
+    sendFrame(connection, wireFrameFor(connection, envelope));
+}
+
+void WsShard::flushBatches()
+{
+    // Every flush takes its connection off the list; the last one first, so
+    // nothing moves under the walk.
+    while (!m_batched.empty())
+        flushBatch(connectionAt(m_batched.back()));
+}
+
+void WsShard::completeCommand(const ShardCommandResult &result)
+{
+    Connection *connection = this->connection(result.connectionId);
+    if (!connection)
+        return;
+    if (!result.errorCode.empty()) {
+        // Refused by the transport; never a session topic, so nothing waits on
+        // it either.
+        sendProtocolError(*connection, result.cid, result.errorCode, result.errorMessage);
+        return;
+    }
+
+    // A login, a bootstrap or a hello that core accepted establishes the session
+    // this connection speaks with from now on.
+    const bool wasAuthenticated = connection->isAuthenticated();
+    trackAuthOutcome(*connection, result.topic, result.requestClientId, result.requestAuthToken, result.payloadJson);
+    send(*connection, result.envelopeType, result.envelopeTopic, result.cid, result.payloadJson);
+    if (isSessionTopic(result.topic)) {
+        const ResumeRequest resume = std::exchange(connection->resume, ResumeRequest{});
+        if (!wasAuthenticated && connection->isAuthenticated()) {
+            // A gap replayed in full leaves the client current; a snapshot on
+            // top would only repeat it.
+            const bool replayed = resume.afterSeq != 0 && replayEvents(*connection, resume.afterSeq);
+            if (resume.snapshot && !replayed)
+                sendStateSnapshot(*connection);
+        }
+    }
+    // Core's first answer, whether that is the result or the ack of a command
+    // it finishes later.
+    m_metrics.syncLatency.record(elapsedUs(result.receivedNs));
+
+    if (!connection->authPending)
+        return;
+    connection->authPending = false;
+    // Replayed in arrival order; one of them may be another pre-auth command,
+    // and then the rest wait again. Looked up again after every frame: one may
+    // get the connection dropped.
+    const quint64 id = connection->id;
+    const QList<QByteArray> held = std::exchange(connection->heldFrames, {});
+    for (qsizetype i = 0; i < held.size(); ++i) {
+        connection = this->connection(id);
+        if (!connection)
+            return;
+        if (connection->authPending) {
+            connection->heldFrames.append(held.mid(i));
+            return;
+        }
+        handleFrame(*connection, held.at(i));
+    }
+}
+
+void WsShard::completeBatch(quint64 connectionId, quint64 batchId, const std::vector<ShardCommandResult> &results)
+{
+    Connection *connection = this->connection(connectionId);
+    if (!connection)
+        return;
+    const auto it = connection->pendingBatches.find(batchId);
+    if (it == connection->pendingBatches.end())
+        return;
+    BatchReply reply = std::move(it.value());
+    connection->pendingBatches.erase(it);
+
+    connection->collecting = &reply;
+    for (std::size_t i = 0; i < results.size() && i < reply.commandSlots.size(); ++i) {
+        const ShardCommandResult &result = results[i];
+        reply.current = reply.commandSlots[i];
+        if (!result.errorCode.empty()) {
+            sendProtocolError(*connection, result.cid, result.errorCode, result.errorMessage);
+            continue;
+        }
+        send(*connection, result.envelopeType, result.envelopeTopic, result.cid, result.payloadJson);
+        m_metrics.syncLatency.record(elapsedUs(result.receivedNs));
+    }
+    connection->collecting = nullptr;
+    sendBatchReply(*connection, reply);
+}
+
+void WsShard::completeAsyncCommand(quint64 connectionId,
+                                   CmdId cid,
+                                   const QString &cmdTopic,
+                                   const std::string &payloadJson,
+                                   qint64 receivedNs)
+{
+    Connection *connection = this->connection(connectionId);
+    if (!connection || connection->socket->state() != QAbstractSocket::ConnectedState)
+        return;
+    sendCmdResponse(*connection, cid, cmdTopic, payloadJson);
+    m_metrics.asyncLatency.record(elapsedUs(receivedNs));
+}
+
+void WsShard::failCommand(quint64 connectionId, CmdId cid, const std::string &code, const std::string &message)
+{
+    if (Connection *connection = this->connection(connectionId))
+        sendProtocolError(*connection, cid, code, message);
+}
+
+} // namespace phicore::transport::ws
@@ -0,0 +1,675 @@
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QWebSocketProtocol>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <transportinterface.h>
+
+#include "admission.h"
+#include "idlewheel.h"
+#include "lastvaluecache.h"
+#include "replayring.h"
+#include "tlsengine.h"
+#include "wsmetrics.h"
+
+class QTcpSocket;
+class QTimer;
+class QWebSocket;
+class QWebSocketServer;
+
+namespace phicore::transport::ws {
+
+struct InboundEnvelope;
+
+// How much one connection may have waiting to be written (see WsShard::sendFrame).
+struct OutboundLimits {
+    qint64 budgetBytes = 0;
+    int maxQueuedFrames = 0;
+    qint64 stallTimeoutMs = 0;
+};
+
+// How fast one connection may send frames: a token bucket refilled at
+// `framesPerSec` and holding at most `burst`.
+struct InboundLimits {
+    double framesPerSec = 0.0;
+    double burst = 0.0;
+};
+
+struct CompressionSettings {
+    bool enabled = false;
+    int minFrameBytes = 0;
+    int level = 0;
+};
+
+// How events are packed for a connection that asked for batches at hello. A
+// batch goes out when the window since its first event has passed, or at once
+// when it reaches either cap.
+struct EventBatchSettings {
+    int windowMs = 0;
+    int maxEvents = 0;
+    qint64 maxBytes = 0;
+};
+
+// How many recent events a shard keeps for clients that reconnect (see
+// WsShard::replayEvents). maxEvents 0 keeps none.
+struct ReplaySettings {
+    int maxEvents = 0;
+    qint64 maxBytes = 0;
+};
+
+// How many channel states a shard keeps for snapshots (see
+// WsShard::sendStateSnapshot). maxChannels 0 keeps none.
+struct StateCacheSettings {
+    int maxChannels = 0;
+    qint64 maxBytes = 0;
+};
+
+// How large messages are written: one of at least minMessageBytes goes out as
+// WebSocket fragments of at most fragmentBytes, each written only once the
+// socket has drained below its budget (see WsShard::flushOutbound).
+// fragmentBytes 0 writes every message whole.
+struct FragmentSettings {
+    qint64 minMessageBytes = 0;
+    qint64 fragmentBytes = 0;
+};
+
+// How a shard lets its connections go when the transport drains (see
+// WsShard::beginDrain).
+struct DrainSettings {
+    // Each connection is told to come back after a delay drawn evenly from
+    // this window, so the reconnects after a restart arrive spread over it.
+    qint64 reconnectWindowMs = 0;
+    // Connections close in this many waves, those told the shortest delays
+    // first.
+    int waves = 1;
+};
+
+// Batch frames sent since the stats were last taken.
+struct BatchStats {
+    quint64 frames = 0;
+    quint64 events = 0;
+    quint64 largest = 0;
+};
+
+// Deflate work since the stats were last taken.
+struct CompressionStats {
+    quint64 frames = 0;
+    quint64 sharedFrames = 0;
+    quint64 inputBytes = 0;
+    quint64 outputBytes = 0;
+    qint64 nsecs = 0;
+};
+
+// The plain subprotocol, the one that adds compressed binary frames, and the
+// one that carries the envelope as CBOR. The transport offers them
+// (ShardSettings::subprotocols); a shard reads back which one was agreed.
+inline constexpr QLatin1String kSubprotocolJson("phi-core-ws.v1");
+inline constexpr QLatin1String kSubprotocolDeflate("phi-core-ws.v1+deflate");
+inline constexpr QLatin1String kSubprotocolCbor("phi-core-ws.v1+cbor");
+// What a sync command is answered under, whether the shard answers it or the
+// transport does on core's behalf.
+inline constexpr std::string_view kTopicSyncResponse = "sync.response";
+
+// Everything a shard is told up front, and again whenever the transport is
+// reconfigured (WsShard::applySettings). The transport reads it out of its
+// config; shards never look at the config themselves.
+struct ShardSettings {
+    QStringList subprotocols;
+    QStringList allowedOrigins;
+    OutboundLimits outbound;
+    InboundLimits inbound;
+    CompressionSettings compression;
+    EventBatchSettings eventBatch;
+    ReplaySettings replay;
+    StateCacheSettings stateCache;
+    FragmentSettings fragmentation;
+    // Set for wss://: every accepted connection does its TLS handshake under
+    // this before the upgrade. Shared by every shard, and so is its session
+    // cache - a client resumes on whichever shard it lands.
+    std::shared_ptr<const tls::ServerContext> tls;
+    // The transport's connection limits, shared by every shard: a connection
+    // it admitted is handed back here once its handshake ends and again once
+    // it is gone. Unset, nothing is counted.
+    std::shared_ptr<ConnectionAdmission> admission;
+};
+
+// A frame a shard cannot answer itself, on its way to core. The frame travels
+// along, so the payload view stays valid on whichever thread dispatches it.
+struct ShardCommand {
+    int shard = 0;
+    quint64 epoch = 0;
+    quint64 connectionId = 0;
+    CmdId cid = 0;
+    QString topic;
+    QString requestClientId;
+    QString requestAuthToken;
+    // The connection's session, empty when it has none. Read on the shard, where
+    // the session lives, so core sees the identity the frame arrived under.
+    std::string sessionToken;
+    std::string sessionClientId;
+    QByteArray frame;
+    std::string_view payloadJson;
+    // When the frame arrived, on the steady clock; the latency histograms
+    // measure from here.
+    qint64 receivedNs = 0;
+};
+
+// Core's immediate answer to a ShardCommand, on its way back.
+struct ShardCommandResult {
+    quint64 connectionId = 0;
+    CmdId cid = 0;
+    QString topic;
+    QString requestClientId;
+    QString requestAuthToken;
+    std::string envelopeType;
+    std::string envelopeTopic;
+    std::string payloadJson;
+    qint64 receivedNs = 0;
+    // Set when the transport refused the command without asking core; the
+    // answer is then protocol.error with this code.
+    std::string errorCode;
+    std::string errorMessage;
+};
+
+// One core event. Built once by the transport and shared by every shard.
+struct SharedEvent {
+    std::string topic;
+    std::string payloadJson;
+    JsonText envelopeJson;
+    // Its place in the transport's event sequence, also in the envelope; 0 when
+    // replay is off and events are not numbered.
+    quint64 seq = 0;
+    // When core handed it over, on the steady clock; 0 when unknown.
+    qint64 producedNs = 0;
+};
+
+// What a shard needs from its owner. Called on the shard's thread; getting back
+// onto the owner's thread is the owner's business.
+class ShardHost
+{
+public:
+    virtual ~ShardHost() = default;
+
+    virtual void submitCommand(ShardCommand command) = 0;
+    /// The commands of one batch frame, in order; answered all at once with
+    /// WsShard::completeBatch.
+    virtual void submitBatch(quint64 batchId, std::vector<ShardCommand> commands) = 0;
+    virtual void connectionClosed(int shard, quint64 epoch, quint64 connectionId) = 0;
+
+    virtual void logClientConnected(const QString &peerAddress, int peerPort) = 0;
+    virtual void logClientDisconnected(const QString &peerAddress, int peerPort) = 0;
+    virtual void logOriginRefused(const QString &origin) = 0;
+    virtual void logIdleTimeout(const QString &clientId, qint64 idleSec) = 0;
+    virtual void logSlowConsumer(const QString &peerAddress,
+                                 qint64 backlogBytes,
+                                 qint64 queuedFrames,
+                                 quint64 coalescedFrames) = 0;
+};
+
+// One slice of the transport's connections, with everything they have
+// established: sessions, subscriptions, outbound queues. A shard lives on one
+// thread - its own I/O thread, or the transport's when no I/O threads are
+// configured - and nothing outside that thread touches its state. The transport
+// reaches it with QMetaObject::invokeMethod; the few reads that are safe from
+// anywhere say so.
+class WsShard final : public QObject
+{
+    Q_OBJECT
+
+public:
+    WsShard(int index, quint64 epoch, ShardSettings settings, ShardHost *host);
+    ~WsShard() override;
+
+    int index() const { return m_index; }
+    /// Safe from any thread.
+    int connectionCount() const { return m_connectionCount.load(std::memory_order_relaxed); }
+    /// Safe from any thread.
+    int deflateConnectionCount() const { return m_deflateConnectionCount.load(std::memory_order_relaxed); }
+    int cborConnectionCount() const { return m_cborConnectionCount.load(std::memory_order_relaxed); }
+    /// Safe from any thread; resets the counters.
+    CompressionStats takeCompressionStats();
+    /// Safe from any thread; resets the counters.
+    BatchStats takeBatchStats();
+    /// Safe from any thread; never reset.
+    const ShardMetrics &metrics() const { return m_metrics; }
+
+    // On the shard's thread from here on.
+
+    /// Creates the handshake server and the sweep timer. Called once, first.
+    void open();
+    /// Takes new settings without touching a connection: limits apply from the
+    /// next frame on, origins, subprotocols and TLS from the next handshake. A
+    /// connection keeps the subprotocol it negotiated. The replay ring and the
+    /// state cache keep what still fits.
+    void applySettings(ShardSettings settings);
+    /// Upgrades an accepted TCP connection, origin check and all; under TLS
+    /// once its handshake is done. `peerKey` is what the transport admitted it
+    /// under (peerKeyOf).
+    void adoptConnection(qintptr socketDescriptor, const std::string &peerKey);
+    void publishEvent(const std::shared_ptr<const SharedEvent> &event);
+    void completeCommand(const ShardCommandResult &result);
+    /// Core's answers to a batch's commands, in the order they were submitted.
+    void completeBatch(quint64 connectionId, quint64 batchId, const std::vector<ShardCommandResult> &results);
+    void completeAsyncCommand(quint64 connectionId,
+                              CmdId cid,
+                              const QString &cmdTopic,
+                              const std::string &payloadJson,
+                              qint64 receivedNs);
+    /// Answers a command with protocol.error on the transport's behalf.
+    void failCommand(quint64 connectionId, CmdId cid, const std::string &code, const std::string &message);
+    /// Stops taking commands and tells every connection - and every one that
+    /// finishes its handshake from now on - when to reconnect. Answers to what
+    /// is already at core still go out.
+    void beginDrain(const DrainSettings &settings);
+    /// Closes, going away, the connections drawn into waves up to `wave`. One
+    /// with frames still queued for it is closed once they are written.
+    void closeDrainWave(int wave);
+    /// Closes, going away, whatever the waves have not: the drain's deadline.
+    /// Frames still queued are dropped, and those connections counted as hard
+    /// closes.
+    void closeDrainLeftovers();
+    void closeAll();
+
+private slots:
+    void onNewConnection();
+
+private:
+    // A frame as one connection receives it: JSON text, or a binary message -
+    // that text deflated, or the envelope as CBOR - on a connection that
+    // negotiated one of those.
+    struct WireFrame {
+        QString text;
+        QByteArray binary;
+        // A text message large enough to go out in fragments, kept as the
+        // UTF-8 it is written as: never converted to UTF-16 for QWebSocket.
+        QByteArray fragmentedText;
+
+        bool isNull() const { return text.isNull() && binary.isNull() && fragmentedText.isNull(); }
+        qint64 size() const
+        {
+            if (!binary.isNull())
+                return binary.size();
+            return fragmentedText.isNull() ? text.size() : fragmentedText.size();
+        }
+    };
+    // One envelope and the wire forms built from it so far.
+    struct EncodedEnvelope {
+        JsonText json;
+        WireFrame text;
+        WireFrame deflated;
+        WireFrame cbor;
+    };
+    struct OutboundFrame {
+        WireFrame frame;
+        QString coalesceKey;
+        bool superseded = false;
+        // Goes out in fragments (see OutboundQueue).
+        bool fragmented = false;
+    };
+    // Frames a socket could not take yet, oldest first. Sequence numbers are
+    // positions counted from the first frame ever queued, so a coalesced entry
+    // can be found again in O(1) while the front keeps moving.
+    //
+    // A message written in fragments is taken off the front whole and goes
+    // out from `fragmenting`; nothing behind it is written until its last
+    // fragment is, since WebSocket lets only control frames into the middle of
+    // a fragmented message.
+    struct OutboundQueue {
+        std::deque<OutboundFrame> frames;
+        QHash<QString, quint64> latestByKey;
+        quint64 firstSequence = 0;
+        // Whole frames only; fragmented messages are counted in fragmentBytes.
+        qint64 queuedBytes = 0;
+        WireFrame fragmenting;
+        qint64 fragmentOffset = 0;
+        // Of fragmented messages, queued or going out, what is not written yet.
+        qint64 fragmentBytes = 0;
+        qint64 overBudgetSinceMs = 0;
+        quint64 coalescedFrames = 0;
+        bool dropping = false;
+    };
+
+    // What a connection may still send right now (see InboundLimits).
+    struct InboundBudget {
+        double tokens = 0.0;
+        qint64 refilledNs = 0;
+        // Frames refused since the last one let through.
+        int refused = 0;
+    };
+
+    // Events held for a batching connection: their envelopes, already joined
+    // with commas in arrival order.
+    struct EventBatch {
+        std::string envelopes;
+        int count = 0;
+    };
+
+    // The answers to one batch frame, one envelope per command in the order
+    // the client sent them; empty until that command is answered. The
+    // commands core has to answer travel to it together, and the answers come
+    // back the same way.
+    struct BatchReply {
+        CmdId cid = 0;
+        std::vector<std::string> answers;
+        // Which command is being read, while handleBatch() runs.
+        std::size_t current = 0;
+        std::vector<ShardCommand> commands;
+        // For each of `commands`, its place in `answers`.
+        std::vector<std::size_t> commandSlots;
+        // A subscription asked for a snapshot; it follows the reply, as it
+        // follows a subscription's own answer.
+        bool snapshotAfter = false;
+    };
+
+    // What a client that authenticates asks to be sent before live events:
+    // the events after lastEventSeq, and a snapshot of channel states.
+    struct ResumeRequest {
+        quint64 afterSeq = 0;
+        bool snapshot = false;
+    };
+
+    // Everything one connection has established, in one record. A socket
+    // starts unauthenticated and may only reach the pre-auth topics until it
+    // logs in (F-42); after that the identity comes from here rather than from
+    // whatever a frame claims.
+    struct Connection {
+        QWebSocket *socket = nullptr;
+        // The TCP (or TLS) socket underneath, which fragments are written to
+        // directly; QWebSocket writes a message whole or not at all.
+        QPointer<QTcpSocket> wire;
+        // Its handle (see connection()).
+        quint64 id = 0;
+        // Negotiated phi-core-ws.v1+deflate.
+        bool deflate = false;
+        // Negotiated phi-core-ws.v1+cbor: binary frames both ways.
+        bool cbor = false;
+        // Asked for batched events at hello.
+        bool batching = false;
+        // Has subscribed at least once, so only its subscriptions reach it.
+        bool filtered = false;
+        // A pre-auth command is at core; later frames wait in heldFrames.
+        bool authPending = false;
+
+        // The session, as core handed it out. Kept as the UTF-8 core deals in,
+        // so passing it on with every command is a copy, not a conversion.
+        std::string token;
+        std::string clientId;
+        // The clock this connection is judged by: core states the budget when it
+        // hands out the session, and every frame the client sends resets it.
+        // Server pushes do not count - they say nothing about whoever logged in
+        // still being there.
+        //
+        // Both on the steady clock: a wall-clock step would expire every session
+        // at once, or none of them.
+        qint64 idleBudgetMs = 0;
+        qint64 lastActivityMs = 0;
+        // Which entry in m_idleWheel is this session's; an older session's entry
+        // is recognised as stale by it.
+        quint64 wheelTicket = 0;
+
+        InboundBudget inbound;
+        // Only while the socket is behind.
+        std::unique_ptr<OutboundQueue> outbound;
+        // As UTF-8 JSON, whichever encoding they arrived in.
+        QList<QByteArray> heldFrames;
+        // subscriptionKey()s, mirrored in m_subscribers.
+        QSet<QString> subscriptions;
+        EventBatch batch;
+        // The event it last received, so overlapping subscriptions deliver once.
+        quint64 lastEventSerial = 0;
+        // What a session topic asked for, acted on once core's answer
+        // authenticates the connection.
+        ResumeRequest resume;
+        // Set while a batch frame is read: what would be sent goes in there.
+        BatchReply *collecting = nullptr;
+        // Batches waiting for core, by the id they went to it under.
+        QHash<quint64, BatchReply> pendingBatches;
+        quint64 nextBatchId = 0;
+
+        // The drain wave that closes it: -1 before the drain notice, and again
+        // once it has been closed. Counted in ShardMetrics::drainOpen while set.
+        int drainWave = -1;
+
+        // Positions in the dense lists below, -1 when not in them.
+        int authenticatedAt = -1;
+        int backloggedAt = -1;
+        int batchedAt = -1;
+
+        bool isAuthenticated() const { return !token.empty(); }
+    };
+    // A slot is reused after its connection closes; the generation tells a
+    // handle to the old connection from one to the new.
+    struct Slot {
+        Connection connection;
+        quint32 generation = 1;
+        bool live = false;
+    };
+    // Connections listed by slot index. Order means nothing; removal swaps the
+    // last entry into the gap, and the record keeps its own position. Walked in
+    // place: nothing a pass does takes a connection off the list it walks - a
+    // drop inside one is deferred (dropSlowConsumer) - except flushBatches(),
+    // which walks m_batched from the back for that reason.
+    using DenseList = std::vector<quint32>;
+
+    /// The live connection a handle names, or null once it has closed.
+    Connection *connection(quint64 id);
+    Connection &connectionAt(quint32 index) { return m_slots[index].connection; }
+    static quint32 slotIndex(quint64 id) { return static_cast<quint32>(id); }
+    void listInsert(DenseList &list, int Connection::*position, Connection &connection);
+    void listRemove(DenseList &list, int Connection::*position, Connection &connection);
+
+    void onSocketDisconnected(quint64 id);
+    void onTextMessageReceived(quint64 id, const QString &message);
+    void onBinaryMessageReceived(quint64 id, const QByteArray &message);
+    void onSocketBytesWritten(quint64 id);
+
+    /// Takes one client frame as UTF-8 JSON.
+    void handleFrame(Connection &connection, const QByteArray &frame);
+    /// A command the frame scan and the rate limit let through; `frame` keeps
+    /// the envelope's slices valid.
+    void handleEnvelope(Connection &connection,
+                        const QByteArray &frame,
+                        const InboundEnvelope &envelope,
+                        CmdId cid,
+                        qint64 receivedNs);
+    /// Reads every command of a batch frame in one pass and answers them in
+    /// one frame once core has answered its share.
+    void handleBatch(Connection &connection,
+                     const QByteArray &frame,
+                     const InboundEnvelope &envelope,
+                     CmdId cid,
+                     qint64 receivedNs);
+    void sendBatchReply(Connection &connection, const BatchReply &reply);
+    // Which JSON shapes a cid may arrive in; what counts as a valid one is the
+    // protocol's answer and lives in the shared header.
+    static std::optional<CmdId> readCid(const InboundEnvelope &envelope);
+    /// Takes a token for one frame. False when the connection is over its rate;
+    /// one that stays over it is closed as well.
+    bool admitFrame(Connection &connection, qint64 receivedNs);
+    static bool isLoopbackOrigin(const QString &origin);
+    /// True when a socket that has not authenticated may send this topic.
+    static bool isPreAuthTopic(const QString &topic);
+    /// True for the topics whose answer may change the connection's session.
+    static bool isSessionTopic(const QString &topic);
+    /// Closes the connections whose session has sat idle past its budget.
+    void dropIdleSessions();
+    /// Reads a session out of an auth response and remembers or forgets it.
+    void trackAuthOutcome(Connection &connection,
+                          const QString &topic,
+                          const QString &requestClientId,
+                          const QString &requestAuthToken,
+                          std::string_view responsePayloadJson);
+    /// Starts the session the connection speaks with from now on, and its idle
+    /// clock.
+    void rememberSession(Connection &connection, std::string token, std::string clientId, qint64 idleBudgetMs);
+    void forgetSession(Connection &connection);
+
+    // Envelope and payload shapes come from envelope.h; this builds one
+    // envelope, and wireFrameFor() the form a given socket receives it in, so
+    // both can be built once and shared.
+    static EncodedEnvelope encodeEnvelope(std::string_view type,
+                                          std::string_view topic,
+                                          std::optional<CmdId> cid,
+                                          std::string_view payloadJson);
+    WireFrame wireFrameFor(const Connection &connection, EncodedEnvelope &envelope);
+    void writeFrame(QWebSocket *socket, const WireFrame &frame);
+    /// Whether this frame goes out to this connection in fragments.
+    bool isFragmented(const Connection &connection, const WireFrame &frame) const;
+    /// Writes the next fragment of queue.fragmenting; with `rest`, everything
+    /// left of it as the final one.
+    void writeFragment(Connection &connection, OutboundQueue &queue, bool rest = false);
+    /// Ends a fragmented message that is part way out on the wire by writing
+    /// the rest of it, and takes nothing more from the connection's queue.
+    void finishFragmentedMessage(Connection &connection);
+    /// The only way a shard closes a connection with a close frame: QWebSocket
+    /// knows nothing of a message written in fragments beneath it, and its
+    /// close frame must not land in the middle of one.
+    void closeConnection(Connection &connection, QWebSocketProtocol::CloseCode code, const QString &reason);
+    // The one outbound primitive: puts an assembled frame on a socket, or queues
+    // it behind the socket's backlog. Frames with the same non-empty
+    // `coalesceKey` replace each other while they wait.
+    void sendFrame(Connection &connection, const WireFrame &frame, const QString &coalesceKey = QString());
+    void flushOutbound(Connection &connection);
+    void dropSlowConsumer(Connection &connection);
+    /// Drops the connections that have stayed over budget past the stall timeout.
+    void dropStalledConsumers();
+    /// Refreshes the backlog gauges in m_metrics.
+    void sampleOutboundBacklog();
+    /// Which channel a state event is about, or empty for events that are not
+    /// last-value-wins. Keys the state cache and the outbound coalescing.
+    static std::string channelKeyFor(std::string_view topic, std::string_view payloadJson);
+    void send(Connection &connection,
+              std::string_view type,
+              std::string_view topic,
+              std::optional<CmdId> cid,
+              std::string_view payloadJson);
+    void sendProtocolError(Connection &connection,
+                           std::optional<CmdId> cid,
+                           std::string_view code,
+                           std::string_view message);
+    void sendCmdResponse(Connection &connection,
+                         CmdId cid,
+                         const QString &cmdTopic,
+                         std::string_view payloadJson);
+    /// Index key for a subscription pattern: "" for "*", "a.b." for "a.b.*",
+    /// the topic itself for an exact one. Null when the pattern is not valid.
+    static QString subscriptionKey(const QString &pattern);
+    static QString subscriptionPattern(const QString &key);
+    void removeSubscriber(const QString &key, quint32 index);
+    /// Reads the batching request out of a hello payload.
+    static bool wantsEventBatch(std::string_view helloPayloadJson);
+    /// True when the connection's subscriptions, if any, take this topic.
+    static bool isSubscribed(const Connection &connection, const QString &topic);
+    void deliverEvent(Connection &connection,
+                      const SharedEvent &event,
+                      EncodedEnvelope &envelope,
+                      const QString &coalesceKey);
+    static ResumeRequest resumeRequestFrom(std::string_view payloadJson);
+    /// Sends a connection that just authenticated what it missed after
+    /// `afterSeq`, or tells it to resync when the ring no longer has it. False
+    /// for the latter.
+    bool replayEvents(Connection &connection, quint64 afterSeq);
+    /// The cached channel states, in as few frames as the frame cap allows.
+    void sendStateSnapshot(Connection &connection);
+    void appendToBatch(Connection &connection, std::string_view envelopeJson);
+    /// Sends what the connection has batched, if anything.
+    void flushBatch(Connection &connection);
+    void flushBatches();
+    /// Remembers an accepted socket until its upgrade, and ties an admitted
+    /// connection's ticket to it: the socket lives as long as the connection
+    /// does, upgraded or not.
+    void trackHandshake(QTcpSocket *socket, std::shared_ptr<AdmissionTicket> ticket);
+    void handleSubscription(Connection &connection,
+                            CmdId cid,
+                            const QString &topic,
+                            std::string_view payloadJson);
+    /// Tells one connection when to reconnect, and draws its close wave.
+    void sendDrainNotice(Connection &connection);
+    /// Closes a connection the drain told to reconnect, going away.
+    void closeDrained(Connection &connection);
+
+    const int m_index;
+    const quint64 m_epoch;
+    ShardSettings m_settings;
+    ShardHost *const m_host;
+
+    // The connection table. A deque, so a record stays where it is while the
+    // table grows; freed slots are reused before new ones are added.
+    std::deque<Slot> m_slots;
+    std::vector<quint32> m_freeSlots;
+    // Logged in, so events may reach them (F-42). What a broadcast walks.
+    DenseList m_authenticated;
+    // Over their outbound budget, so what the stall sweep walks.
+    DenseList m_backlogged;
+    // Holding a batch, so what the batch timer flushes.
+    DenseList m_batched;
+    // Which subscribed connections an event topic reaches, keyed by
+    // subscriptionKey(). A connection that never subscribed is not in here and
+    // gets every event, as before subscriptions existed.
+    QHash<QString, QSet<quint32>> m_subscribers;
+    // Every event, whether anyone here wanted it or not: a client may come back
+    // on a different shard from the one it left.
+    ReplayRing<std::shared_ptr<const SharedEvent>> m_replay;
+    // The latest event.channel.stateChanged per channel, for the same reason.
+    LastValueCache<std::shared_ptr<const SharedEvent>> m_stateCache;
+    quint64 m_eventSerial = 0;
+
+    // Idle deadlines, keyed by connection handle. Activity only moves
+    // lastActivityMs; the wheel finds out when the session's slot comes round.
+    IdleWheel m_idleWheel;
+    QTimer *m_idleTimer = nullptr;
+    quint64 m_nextWheelTicket = 1;
+    QTimer *m_sweep = nullptr;
+    QWebSocketServer *m_server = nullptr;
+    // Accepted sockets still in their handshake, by "address:port" - all an
+    // upgraded QWebSocket says about the socket it came from.
+    struct Handshake {
+        QTcpSocket *socket = nullptr;
+        std::shared_ptr<AdmissionTicket> ticket;
+    };
+    QHash<QString, Handshake> m_handshaking;
+
+    std::atomic<int> m_connectionCount{0};
+    std::atomic<int> m_deflateConnectionCount{0};
+    std::atomic<int> m_cborConnectionCount{0};
+    // One timer serves every batching connection: it starts with the first
+    // event any of them holds and flushes every batch when it fires.
+    QTimer *m_batchTimer = nullptr;
+    // Set once the transport drains; never cleared, the shard goes next.
+    bool m_draining = false;
+    DrainSettings m_drain;
+    // The last wave closed so far, -1 before the first; a connection in it or
+    // an earlier one that was still backlogged closes once it catches up.
+    int m_drainWaveClosed = -1;
+
+    struct {
+        std::atomic<quint64> frames{0};
+        std::atomic<quint64> sharedFrames{0};
+        std::atomic<quint64> inputBytes{0};
+        std::atomic<quint64> outputBytes{0};
+        std::atomic<qint64> nsecs{0};
+    } m_compressionStats;
+    struct {
+        std::atomic<quint64> frames{0};
+        std::atomic<quint64> events{0};
+        std::atomic<quint64> largest{0};
+    } m_batchStats;
+    ShardMetrics m_metrics;
+};
+
+} // namespace phicore::transport::ws
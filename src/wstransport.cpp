@@ -1,17 +1,22 @@
 #include "wstransport.h"
 
+#include "metricsendpoint.h"
+
 #include <QDateTime>
 #include <QHostAddress>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
-#include <QJsonParseError>
 #include <QJsonValue>
-#include <QUrl>
-#include <QWebSocket>
-#include <QWebSocketCorsAuthenticator>
-#include <QWebSocketProtocol>
-#include <QWebSocketServer>
+#include <QTcpServer>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
 
 namespace phicore::transport::ws {
 
@@ -22,18 +27,188 @@ namespace {
 // is how the wire drifts.
 constexpr quint16 kDefaultPort = 5040;
 
-// How often idle sessions are looked at. The budget itself comes from core; this
-// only decides how late the close may be, and a few seconds on a timeout counted
-// in minutes is not worth a timer per connection.
-constexpr int kIdleSweepIntervalMs = 5000;
+// Below this a deflated frame is barely smaller and costs more to produce than
+// it saves on the wire.
+constexpr int kDefaultCompressionMinFrameBytes = 512;
+constexpr int kDefaultCompressionLevel = 6;
+
+// Outbound backlog per connection. The budget is what Qt may hold for a socket
+// before frames queue here instead; the queue may then grow to a few budgets'
+// worth, but not for longer than the stall timeout.
+constexpr qint64 kDefaultOutboundBudgetBytes = 1024 * 1024;
+constexpr int kDefaultOutboundMaxQueuedFrames = 20000;
+constexpr qint64 kDefaultSlowConsumerTimeoutSec = 30;
+
+// Inbound admission per connection. A UI sends a handful of frames per user
+// action; these leave it room for a burst of lookups and still keep one client
+// from taking core's thread for itself.
+constexpr double kDefaultInboundFramesPerSec = 200.0;
+constexpr double kDefaultInboundBurst = 400.0;
+constexpr int kDefaultMaxPendingCommands = 64;
+constexpr std::string_view kErrorCodeTooManyPending = "too_many_pending";
+constexpr std::string_view kErrorCodeCommandTimeout = "command_timeout";
+// Command timeouts are counted in seconds; so is their precision.
+constexpr qint64 kCommandDeadlineTickMs = 1000;
+constexpr std::size_t kCommandDeadlineSlots = 512;
+
+// Event batching, for connections that ask for it at hello. A few milliseconds
+// is below what a UI can show, and long enough to catch a scene change whole.
+constexpr int kDefaultEventBatchWindowMs = 5;
+constexpr int kMaxEventBatchWindowMs = 1000;
+constexpr int kDefaultEventBatchMaxEvents = 256;
+constexpr qint64 kDefaultEventBatchMaxBytes = 64 * 1024;
+
+// Event replay for reconnecting clients. Enough for a Wi-Fi blip on a busy
+// installation; the byte cap keeps a burst of large events from pinning more
+// than that.
+constexpr int kDefaultReplayMaxEvents = 4096;
+constexpr qint64 kDefaultReplayMaxBytes = 4 * 1024 * 1024;
+constexpr int kMaxReplayEvents = 1000000;
+// The channel state cache, off unless configured. A configured cache with no
+// figures holds a large installation's channels a few times over.
+constexpr int kDefaultStateCacheMaxChannels = 20000;
+constexpr qint64 kDefaultStateCacheMaxBytes = 16 * 1024 * 1024;
+constexpr int kMaxStateCacheChannels = 1000000;
+// Messages from this size on go out in fragments of the second, paced by the
+// socket; a fragment is a TLS record's worth. Below it, writing a message whole
+// costs less than keeping track of its fragments.
+constexpr qint64 kDefaultFragmentMinMessageBytes = 64 * 1024;
+constexpr qint64 kDefaultFragmentBytes = 16 * 1024;
+constexpr qint64 kMinFragmentBytes = 1024;
+constexpr qint64 kMaxFragmentBytes = 16 * 1024 * 1024;
+// Connection admission, checked before a socket object exists. Per address
+// it is well above what one browser or app opens, and well below what a client
+// stuck in a reconnect loop gets to; the handshake cap bounds what a connect
+// storm costs before the upgrade, TLS included. Total connections are not
+// capped unless configured.
+constexpr int kDefaultAdmissionMaxConnections = 0;
+constexpr int kDefaultAdmissionMaxPerAddress = 64;
+constexpr int kDefaultAdmissionMaxHandshakes = 256;
+constexpr int kMaxAdmissionLimit = 1000000;
+// Sequence numbers start at the wall-clock start time in this many per
+// millisecond, so every run begins above where any earlier run can have got
+// to, and a number from before a restart reads as too old rather than as a
+// position in this run's sequence. Stays below 2^53 for JavaScript clients
+// for another two centuries.
+constexpr qint64 kEventSeqPerMs = 1024;
+
+// Draining, once stop() or drain() starts it. Clients are told to come back spread over
+// half a minute, which is what keeps a restart from being a reconnect storm;
+// the grace period covers a slow cmd.* and the close waves a second or two, so
+// a drain is over in seconds either way.
+constexpr int kDefaultDrainReconnectWindowSec = 30;
+constexpr int kMaxDrainReconnectWindowSec = 3600;
+constexpr double kDefaultDrainGraceSec = 5.0;
+constexpr double kDefaultDrainCloseWindowSec = 2.0;
+constexpr double kMaxDrainWaitSec = 300.0;
+constexpr int kDefaultDrainWaves = 10;
+constexpr int kMaxDrainWaves = 1000;
+// How often the grace period looks for commands still at core, and the flush
+// for connections still behind on their frames.
+constexpr int kDrainPollMs = 50;
+// How long after the last wave a connection still writing out what was queued
+// for it gets before it is closed regardless.
+constexpr int kDrainFlushTimeoutMs = 5000;
+
+// Past a few dozen, threads only add contention: the work per frame is small and
+// core's callbacks still arrive on one thread.
+constexpr int kMaxIoThreads = 64;
+// Sync dispatch on worker threads, off unless asked for; only worth it when
+// core has sync handlers slow enough to hold up everyone else. Each connection
+// runs one command at a time either way, so the workers never hold more than
+// one command per connection, and a connection may queue this many behind it.
+constexpr int kMaxSyncWorkers = 64;
+constexpr std::size_t kMaxQueuedCommands = 256;
+
+// Answered here from the counters, never by core.
+constexpr QLatin1String kTopicTransportStats("sync.transport.stats.get");
+constexpr QLatin1String kSyncTopicPrefix("sync.");
+// What core hands over is taken off the ingress queue this many at a time
+// before the sockets get a turn: enough to amortise the wake-up, few enough
+// that a burst of events does not keep frames from being read.
+constexpr int kIngressDrainBatch = 256;
+// Core's topics are its own to choose; past this many families the rest are
+// counted together, so a scrape stays a bounded size.
+constexpr std::size_t kMaxEventFamilies = 64;
+constexpr std::string_view kOtherEventFamily = "other";
+constexpr int kStatsLogIntervalMs = 5000;
+constexpr QLatin1String kDefaultMetricsHost("127.0.0.1");
+
+// wss:// session resumption. A cache entry is a few hundred bytes; this many
+// covers every client of a large installation reconnecting at once. An hour
+// spans any network blip worth resuming across, and TLS 1.3 caps ticket
+// lifetimes at a week.
+constexpr int kDefaultTlsSessionCacheSize = 20480;
+constexpr int kMaxTlsSessionCacheSize = 1000000;
+constexpr int kDefaultTlsSessionTimeoutSec = 3600;
+constexpr int kMaxTlsSessionTimeoutSec = 7 * 24 * 3600;
+
+// Accepts TCP connections and hands the descriptor on, so the WebSocket upgrade
+// and everything after it happen on whichever shard takes the connection.
+class ConnectionListener final : public QTcpServer
+{
+public:
+    using Handler = std::function<void(qintptr)>;
+
+    ConnectionListener(Handler handler, QObject *parent)
+        : QTcpServer(parent)
+        , m_handler(std::move(handler))
+    {
+    }
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override { m_handler(socketDescriptor); }
+
+private:
+    Handler m_handler;
+};
+
+// Sync topics are what core answers while the caller waits; the stats topic
+// is answered here, from counters, and never needs a worker.
+bool runsOnWorker(const QString &topic)
+{
+    return topic.startsWith(kSyncTopicPrefix) && topic != kTopicTransportStats;
+}
+
+// Loads the tls object's certificate and key; null, with the reason, when they
+// do not load or the plugin was built without TLS.
+std::shared_ptr<const tls::ServerContext> createTlsContext(const tls::ServerSettings &settings, QString *error)
+{
+#ifdef PHI_TRANSPORT_WS_WITH_TLS
+    std::string tlsError;
+    std::shared_ptr<const tls::ServerContext> context = tls::ServerContext::create(settings, &tlsError);
+    if (!context && error)
+        *error = QString::fromStdString(tlsError);
+    return context;
+#else
+    Q_UNUSED(settings);
+    if (error)
+        *error = QStringLiteral("Built without TLS support");
+    return nullptr;
+#endif
+}
+
+// The shards' clock: receivedNs and the dispatch timings are all on it.
+qint64 steadyNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
 
 } // namespace
 
 WsTransport::WsTransport(QObject *parent)
     : QObject(parent)
+    , m_commandDeadlines(kCommandDeadlineTickMs, kCommandDeadlineSlots)
 {
 }
 
+WsTransport::~WsTransport()
+{
+    // Never drains: a subclass's routeCommand() is already gone.
+    shutdown();
+}
+
 std::string WsTransport::pluginType() const
 {
     return "ws";
@@ -67,268 +242,681 @@ bool WsTransport::start(std::string_view configJson, std::string *errorString)
             .object();
     if (!isConfigValid(config, &localError))
         return reportError();
+    // A restart right behind a stop() that began draining: what the drain has
+    // not closed yet is closed now, and this start begins from a stopped
+    // transport.
+    if (m_draining)
+        endDrain(true);
+
+    if (m_running) {
+        // In place, so connected clients keep their sessions through a change
+        // of origins or limits. Only the shard count cannot change under live
+        // connections.
+        if (ioThreadsFromConfig(config) == ioThreadsFromConfig(m_config)) {
+            if (!reconfigure(config, &localError))
+                return reportError();
+            return true;
+        }
+        writeLog(LogLevel::Warn,
+                 makeCategory(LogCategory::Transport),
+                 "WS transport restarting: ioThreads changed from %1 to %2; clients reconnect",
+                 {Scalar{static_cast<std::int64_t>(ioThreadsFromConfig(m_config))},
+                  Scalar{static_cast<std::int64_t>(ioThreadsFromConfig(config))}},
+                 "ws.restart",
+                 jsonObject({{"reason", jsonQuoted("ioThreads")},
+                             {"connections", std::to_string(totalConnections())}}));
+        // Clients reconnect right away; a restart never drains.
+        shutdown();
+    }
 
-    if (m_running)
-        stop();
+    // Loaded before anything binds, so a certificate that does not load leaves
+    // the port free rather than serving plain ws:// on it.
+    std::shared_ptr<const tls::ServerContext> tlsContext;
+    if (config.contains(QStringLiteral("tls"))) {
+        tlsContext = createTlsContext(tlsFromConfig(config), &localError);
+        if (!tlsContext)
+            return reportError();
+    }
+    m_tlsContext = std::move(tlsContext);
 
     const QString host = hostFromConfig(config);
     const quint16 port = portFromConfig(config);
     if (!startServer(host, port, &localError))
         return reportError();
+    if (!startMetricsEndpoint(config, &localError)) {
+        shutdown();
+        return reportError();
+    }
 
     m_config = config;
-    m_allowedOrigins = allowedOriginsFromConfig(config);
-    if (!m_idleSweep) {
-        m_idleSweep = new QTimer(this);
-        m_idleSweep->setInterval(kIdleSweepIntervalMs);
-        connect(m_idleSweep, &QTimer::timeout, this, &WsTransport::dropIdleSessions);
+    m_maxPendingCommands = maxPendingCommandsFromConfig(config);
+    m_commandTimeoutMs = commandTimeoutMsFromConfig(config);
+    const int syncWorkers = syncWorkersFromConfig(config);
+    applySyncWorkers(syncWorkers);
+    if (!m_commandTimer) {
+        m_commandTimer = new QTimer(this);
+        m_commandTimer->setInterval(static_cast<int>(kCommandDeadlineTickMs));
+        connect(m_commandTimer, &QTimer::timeout, this, &WsTransport::expireCommands);
+    }
+    m_events = 0;
+    m_channelEvents = 0;
+    m_eventFamilies.clear();
+    m_syncCommands = 0;
+    m_asyncCommands = 0;
+    m_eventsAtLastLog = 0;
+    m_channelEventsAtLastLog = 0;
+    m_refusedAtLastLog = 0;
+    m_accepted = 0;
+    m_acceptSecond = -1;
+    m_acceptsThisSecond = 0;
+    m_acceptPeakPerSec = 0;
+    m_ingressMetrics = std::make_unique<IngressMetrics>();
+    m_uptime.start();
+    startShards(config);
+    if (!m_statsTimer) {
+        m_statsTimer = new QTimer(this);
+        m_statsTimer->setInterval(kStatsLogIntervalMs);
+        connect(m_statsTimer, &QTimer::timeout, this, &WsTransport::logBroadcastStats);
     }
-    m_idleSweep->start();
+    m_statsTimer->start();
     m_running = true;
     const std::string hostText = host.toStdString();
+    const int ioThreads = ioThreadsFromConfig(config);
     writeLog(LogLevel::Info,
              makeCategory(LogCategory::Transport),
-             "WS transport started on %1:%2",
-             {Scalar{hostText}, Scalar{static_cast<std::int64_t>(port)}},
+             "WS transport started on %1:%2 ioThreads=%3 syncWorkers=%4 tls=%5",
+             {Scalar{hostText},
+              Scalar{static_cast<std::int64_t>(port)},
+              Scalar{static_cast<std::int64_t>(ioThreads)},
+              Scalar{static_cast<std::int64_t>(syncWorkers)},
+              Scalar{std::string(m_tlsContext ? "on" : "off")}},
              "ws.start",
              jsonObject({{"host", jsonQuoted(hostText)},
-                         {"port", std::to_string(port)}}));
+                         {"port", std::to_string(port)},
+                         {"ioThreads", std::to_string(ioThreads)},
+                         {"syncWorkers", std::to_string(syncWorkers)},
+                         {"tls", m_tlsContext ? "true" : "false"}}));
     return true;
 }
 
 void WsTransport::stop()
 {
-    if (!m_running && !m_server)
+    // A second stop() is the way to have it over at once.
+    if (m_draining) {
+        endDrain(true);
         return;
+    }
+    if (m_running && m_config.value(QStringLiteral("drain")).isObject() && drain())
+        return;
+    shutdown();
+}
 
-    if (m_idleSweep)
-        m_idleSweep->stop();
-    closeAllClients();
-    m_clients.clear();
-    m_sessions.clear();
-    m_pendingCommands.clear();
+void WsTransport::shutdown()
+{
+    if (!m_running && !m_server)
+        return;
 
     if (m_server) {
         m_server->close();
         m_server->deleteLater();
         m_server = nullptr;
     }
+    // Now rather than later: a restart binds the same port again right after.
+    delete m_metricsEndpoint;
+    m_metricsEndpoint = nullptr;
+    if (m_statsTimer)
+        m_statsTimer->stop();
+    if (m_commandTimer)
+        m_commandTimer->stop();
+    if (m_drainTimer)
+        m_drainTimer->stop();
+    stopShards();
+    if (m_syncPool) {
+        // What the workers still run is answered into the void: the answers
+        // are posted here and find no queue to go to.
+        m_syncPool->waitForDone();
+        delete m_syncPool;
+        m_syncPool = nullptr;
+        m_syncMetrics.reset();
+    }
+    m_syncWorkers = 0;
+    m_commandQueues.clear();
+    m_tlsContext.reset();
+    m_admission.reset();
+    m_pendingCommands.clear();
+    m_pendingByConnection.clear();
 
+    m_draining = false;
     m_running = false;
 }
 
 void WsTransport::onCoreAsyncResult(CmdId cmdId, std::string_view payloadJson)
+{
+    CoreIngress item;
+    item.cmdId = cmdId;
+    item.payloadJson.assign(payloadJson);
+    pushIngress(std::move(item));
+}
+
+void WsTransport::onCoreEvent(std::string_view topic, std::string_view payloadJson)
+{
+    // Copied out of core's buffer once, here; the shards share this copy.
+    CoreIngress item;
+    item.topic.assign(topic);
+    item.payloadJson.assign(payloadJson);
+    pushIngress(std::move(item));
+}
+
+void WsTransport::pushIngress(CoreIngress item)
+{
+    // Core's thread, whichever that is. Counted before it is visible, so the
+    // depth never reads below what is really there.
+    item.producedNs = steadyNowNs();
+    m_ingressDepth.fetch_add(1, std::memory_order_relaxed);
+    m_ingress.push(std::move(item));
+    // One drain posted for however many pushes land before it runs.
+    if (!m_ingressDrainPosted.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, &WsTransport::drainIngress, Qt::QueuedConnection);
+}
+
+void WsTransport::drainIngress()
+{
+    // Cleared before popping: a push this drain misses finds it clear and posts
+    // the next one.
+    m_ingressDrainPosted.exchange(false, std::memory_order_acq_rel);
+    const std::int64_t depth = m_ingressDepth.load(std::memory_order_relaxed);
+    m_ingressMetrics->maxDepth = std::max(m_ingressMetrics->maxDepth, depth);
+
+    CoreIngress item;
+    for (int taken = 0; taken < kIngressDrainBatch; ++taken) {
+        if (!m_ingress.tryPop(&item))
+            return;
+        m_ingressDepth.fetch_sub(1, std::memory_order_relaxed);
+        m_ingressMetrics->wait.record((steadyNowNs() - item.producedNs) / 1000);
+        if (item.cmdId != 0)
+            handleCoreAsyncResult(item.cmdId, std::move(item.payloadJson));
+        else
+            handleCoreEvent(std::move(item.topic), std::move(item.payloadJson), item.producedNs);
+    }
+    // More than one batch: let the sockets have a turn before the next one.
+    if (!m_ingressDrainPosted.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, &WsTransport::drainIngress, Qt::QueuedConnection);
+}
+
+void WsTransport::handleCoreAsyncResult(CmdId cmdId, std::string payloadJson)
 {
     auto it = m_pendingCommands.find(cmdId);
     if (it == m_pendingCommands.end())
         return;
 
-    const PendingCommand pending = it.value();
-    m_pendingCommands.erase(it);
-
-    QWebSocket *socket = pending.socket.data();
-    if (!socket || socket->state() != QAbstractSocket::ConnectedState)
+    const PendingCommand pending = takePendingCommand(it);
+    if (pending.epoch != m_epoch || pending.shard < 0 || pending.shard >= m_shards.size())
         return;
 
-    sendCmdResponse(socket, pending.cid, pending.cmdTopic, payloadJson);
+    WsShard *shard = m_shards.at(pending.shard);
+    QMetaObject::invokeMethod(shard, [shard, pending, payload = std::move(payloadJson)]() {
+        shard->completeAsyncCommand(pending.connectionId, pending.cid, pending.cmdTopic, payload, pending.receivedNs);
+    });
 }
 
-void WsTransport::onCoreEvent(std::string_view topic, std::string_view payloadJson)
+void WsTransport::handleCoreEvent(std::string topic, std::string payloadJson, qint64 producedNs)
 {
     const QString topicText = QString::fromUtf8(topic.data(), static_cast<qsizetype>(topic.size()));
     if (topicText.trimmed().isEmpty())
         return;
-    static qint64 s_lastStatsLogMs = 0;
-    static quint64 s_eventsSinceLast = 0;
-    static quint64 s_channelEventsSinceLast = 0;
-    ++s_eventsSinceLast;
-    if (topic == std::string_view("event.channel.stateChanged"))
-        ++s_channelEventsSinceLast;
-    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
-    if (s_lastStatsLogMs <= 0 || (nowMs - s_lastStatsLogMs) >= 5000) {
-        QJsonObject fields;
-        const std::string clients = std::to_string(m_clients.size());
-        const std::string events = std::to_string(s_eventsSinceLast);
-        const std::string channelEvents = std::to_string(s_channelEventsSinceLast);
-        writeLog(LogLevel::Debug,
-                 makeCategory(LogCategory::Transport),
-                 "WS broadcast stats: clients=%1 events=%2 channelEvents=%3",
-                 {Scalar{static_cast<std::int64_t>(m_clients.size())},
-                  Scalar{static_cast<std::int64_t>(s_eventsSinceLast)},
-                  Scalar{static_cast<std::int64_t>(s_channelEventsSinceLast)}},
-                 "ws.broadcastStats",
-                 jsonObject({{"clients", clients},
-                             {"events", events},
-                             {"channelEvents", channelEvents}}));
-        s_eventsSinceLast = 0;
-        s_channelEventsSinceLast = 0;
-        s_lastStatsLogMs = nowMs;
+    countEvent(topic);
+
+    // Numbered here, on the one thread events are taken on, so the sequence has
+    // no gaps and no ties. Taken whether or not anyone is connected, and while
+    // replay is off too: a client that reconnects has to see the events it
+    // missed counted as missed, those from a stretch with replay off included.
+    const quint64 next = m_nextEventSeq++;
+    const quint64 seq = m_replayEnabled ? next : 0;
+
+    // The envelope is built once here and shared by every shard; each shard
+    // then builds the wire forms it needs once for its own sockets. Shards with
+    // nobody connected are not woken at all unless they keep events for replay
+    // or for the state cache.
+    std::shared_ptr<const SharedEvent> event;
+    for (WsShard *shard : std::as_const(m_shards)) {
+        if (shard->connectionCount() == 0 && !m_replayEnabled && !m_stateCacheEnabled)
+            continue;
+        if (!event) {
+            auto built = std::make_shared<SharedEvent>();
+            built->envelopeJson = makeEnvelope(kEnvelopeTypeEvent, topic, std::nullopt, payloadJson);
+            built->topic = std::move(topic);
+            built->payloadJson = std::move(payloadJson);
+            built->producedNs = producedNs;
+            if (seq != 0) {
+                // First member of the envelope, so a client finds it without
+                // looking into the payload.
+                built->envelopeJson.insert(1, "\"seq\":" + std::to_string(seq) + ',');
+                built->seq = seq;
+            }
+            event = std::move(built);
+        }
+        QMetaObject::invokeMethod(shard, [shard, event]() { shard->publishEvent(event); });
     }
-    broadcastEvent(topic, payloadJson);
 }
 
-void WsTransport::onNewConnection()
+void WsTransport::countEvent(std::string_view topic)
 {
-    if (!m_server)
+    ++m_events;
+    if (topic == std::string_view("event.channel.stateChanged"))
+        ++m_channelEvents;
+    // A handful of families in practice, so a scan beats hashing the topic.
+    const auto bump = [this](std::string_view family) {
+        for (auto &[name, count] : m_eventFamilies) {
+            if (name == family) {
+                ++count;
+                return true;
+            }
+        }
+        return false;
+    };
+    const std::string_view family = topicFamily(topic);
+    if (bump(family))
         return;
+    if (m_eventFamilies.size() < kMaxEventFamilies)
+        m_eventFamilies.emplace_back(std::string(family), 1);
+    else if (!bump(kOtherEventFamily))
+        m_eventFamilies.emplace_back(std::string(kOtherEventFamily), 1);
+}
 
-    while (m_server->hasPendingConnections()) {
-        QWebSocket *socket = m_server->nextPendingConnection();
-        if (!socket)
-            continue;
-        m_clients.insert(socket);
-        const QString peerAddress = socket->peerAddress().toString();
-        const int peerPort = socket->peerPort();
-        const std::string peerText = peerAddress.toStdString();
-        const std::string portText = std::to_string(peerPort);
-        const std::string countText = std::to_string(m_clients.size());
-        writeLog(LogLevel::Info,
-                 makeCategory(LogCategory::Transport),
-                 "WS client connected: %1:%2 total=%3",
-                 {Scalar{peerText},
-                  Scalar{static_cast<std::int64_t>(peerPort)},
-                  Scalar{static_cast<std::int64_t>(m_clients.size())}},
-                 "ws.clientConnected",
-                 jsonObject({{"peerAddress", jsonQuoted(peerText)},
-                             {"peerPort", portText},
-                             {"clientCount", countText}}));
-        connect(socket, &QWebSocket::textMessageReceived,
-                this, &WsTransport::onTextMessageReceived);
-        connect(socket, &QWebSocket::disconnected,
-                this, &WsTransport::onSocketDisconnected);
+MetricsSnapshot WsTransport::metricsSnapshot() const
+{
+    MetricsSnapshot metrics;
+    metrics.uptimeSec = m_uptime.isValid() ? m_uptime.elapsed() / 1000 : 0;
+    metrics.pendingCommands = m_pendingCommands.size();
+    metrics.ioShards = m_shards.size();
+    for (const WsShard *shard : m_shards) {
+        metrics.connections += shard->connectionCount();
+        metrics.addShard(shard->metrics());
     }
+    metrics.events = m_events;
+    metrics.eventFamilies = m_eventFamilies;
+    metrics.syncCommands = m_syncCommands;
+    metrics.asyncCommands = m_asyncCommands;
+    metrics.ingressDepth = std::max<std::int64_t>(0, m_ingressDepth.load(std::memory_order_relaxed));
+    metrics.ingressMaxDepth = std::max(m_ingressMetrics->maxDepth, metrics.ingressDepth);
+    metrics.ingressWait = m_ingressMetrics->wait.snapshot();
+    metrics.draining = m_draining ? 1 : 0;
+    metrics.accepted = m_accepted;
+    metrics.acceptPeakPerSec = m_acceptPeakPerSec;
+    if (m_syncPool) {
+        metrics.syncWorkers = m_syncWorkers;
+        metrics.syncQueueWait = m_syncMetrics->queueWait.snapshot();
+        metrics.syncRun = m_syncMetrics->run.snapshot();
+    }
+    if (m_admission) {
+        metrics.admissionRefusedConnections =
+            m_admission->refused(ConnectionAdmission::Verdict::TooManyConnections);
+        metrics.admissionRefusedFromAddress =
+            m_admission->refused(ConnectionAdmission::Verdict::TooManyFromAddress);
+        metrics.admissionRefusedHandshakes = m_admission->refused(ConnectionAdmission::Verdict::TooManyHandshakes);
+        metrics.handshakesInProgress = m_admission->handshakes();
+    }
+    return metrics;
 }
 
-void WsTransport::onSocketDisconnected()
+void WsTransport::logBroadcastStats()
 {
-    auto *socket = qobject_cast<QWebSocket *>(sender());
-    if (!socket)
+    int clientCount = 0;
+    int deflateClientCount = 0;
+    int cborClientCount = 0;
+    CompressionStats deflate;
+    BatchStats batches;
+    for (WsShard *shard : std::as_const(m_shards)) {
+        const BatchStats batchStats = shard->takeBatchStats();
+        batches.frames += batchStats.frames;
+        batches.events += batchStats.events;
+        batches.largest = std::max(batches.largest, batchStats.largest);
+        clientCount += shard->connectionCount();
+        deflateClientCount += shard->deflateConnectionCount();
+        cborClientCount += shard->cborConnectionCount();
+        const CompressionStats stats = shard->takeCompressionStats();
+        deflate.frames += stats.frames;
+        deflate.sharedFrames += stats.sharedFrames;
+        deflate.inputBytes += stats.inputBytes;
+        deflate.outputBytes += stats.outputBytes;
+        deflate.nsecs += stats.nsecs;
+    }
+    logAdmissionRefusals();
+    const quint64 eventsSinceLast = m_events - m_eventsAtLastLog;
+    const quint64 channelEventsSinceLast = m_channelEvents - m_channelEventsAtLastLog;
+    m_eventsAtLastLog = m_events;
+    m_channelEventsAtLastLog = m_channelEvents;
+    // A quiet interval says nothing the last line did not.
+    if (eventsSinceLast == 0 && deflate.frames == 0 && deflate.sharedFrames == 0 && batches.frames == 0)
         return;
 
-    m_clients.remove(socket);
-    m_sessions.remove(socket);
-    const QString peerAddress = socket->peerAddress().toString();
-    const int peerPort = socket->peerPort();
-    QJsonObject fields;
-    const std::string peerText = peerAddress.toStdString();
-    const std::string portText = std::to_string(peerPort);
-    const std::string countText = std::to_string(m_clients.size());
-    writeLog(LogLevel::Info,
+    const std::string clients = std::to_string(clientCount);
+    const std::string events = std::to_string(eventsSinceLast);
+    const std::string channelEvents = std::to_string(channelEventsSinceLast);
+    // Ratio is wire bytes per 100 input bytes, so lower is better; CPU time is
+    // what deflating cost, shared frames are the ones that cost nothing.
+    const std::int64_t deflatePercent = deflate.inputBytes > 0
+        ? static_cast<std::int64_t>(deflate.outputBytes * 100 / deflate.inputBytes)
+        : 0;
+    const std::int64_t deflateUs = deflate.nsecs / 1000;
+    // Events per batch frame, rounded down; 0 when nobody batches.
+    const std::int64_t batchAverage = batches.frames > 0
+        ? static_cast<std::int64_t>(batches.events / batches.frames)
+        : 0;
+    writeLog(LogLevel::Debug,
              makeCategory(LogCategory::Transport),
-             "WS client disconnected: %1:%2 total=%3",
-             {Scalar{peerText},
-              Scalar{static_cast<std::int64_t>(peerPort)},
-              Scalar{static_cast<std::int64_t>(m_clients.size())}},
-             "ws.clientDisconnected",
-             jsonObject({{"peerAddress", jsonQuoted(peerText)},
-                         {"peerPort", portText},
-                         {"clientCount", countText}}));
-
-    for (auto it = m_pendingCommands.begin(); it != m_pendingCommands.end();) {
-        if (it.value().socket == socket)
-            it = m_pendingCommands.erase(it);
-        else
-            ++it;
-    }
-
-    socket->deleteLater();
+             "WS broadcast stats: clients=%1 events=%2 channelEvents=%3 deflated=%4 deflatePercent=%5 deflateUs=%6 batches=%7 batchAvg=%8 batchMax=%9",
+             {Scalar{static_cast<std::int64_t>(clientCount)},
+              Scalar{static_cast<std::int64_t>(eventsSinceLast)},
+              Scalar{static_cast<std::int64_t>(channelEventsSinceLast)},
+              Scalar{static_cast<std::int64_t>(deflate.frames)},
+              Scalar{deflatePercent},
+              Scalar{deflateUs},
+              Scalar{static_cast<std::int64_t>(batches.frames)},
+              Scalar{batchAverage},
+              Scalar{static_cast<std::int64_t>(batches.largest)}},
+             "ws.broadcastStats",
+             jsonObject({{"clients", clients},
+                         {"events", events},
+                         {"channelEvents", channelEvents},
+                         {"ioShards", std::to_string(m_shards.size())},
+                         {"deflateClients", std::to_string(deflateClientCount)},
+                         {"cborClients", std::to_string(cborClientCount)},
+                         {"deflatedFrames", std::to_string(deflate.frames)},
+                         {"deflateSharedFrames", std::to_string(deflate.sharedFrames)},
+                         {"deflateInputBytes", std::to_string(deflate.inputBytes)},
+                         {"deflateOutputBytes", std::to_string(deflate.outputBytes)},
+                         {"deflateRatioPercent", std::to_string(deflatePercent)},
+                         {"deflateCpuUs", std::to_string(deflateUs)},
+                         {"batchFrames", std::to_string(batches.frames)},
+                         {"batchedEvents", std::to_string(batches.events)},
+                         {"batchAvgEvents", std::to_string(batchAverage)},
+                         {"batchMaxEvents", std::to_string(batches.largest)}}));
 }
 
-void WsTransport::onTextMessageReceived(const QString &message)
+void WsTransport::logAdmissionRefusals()
 {
-    auto *socket = qobject_cast<QWebSocket *>(sender());
-    if (!socket)
+    // A reconnect loop is refused thousands of times a second; one line per
+    // stats interval says so without becoming the problem itself.
+    if (!m_admission)
         return;
+    const quint64 connections = m_admission->refused(ConnectionAdmission::Verdict::TooManyConnections);
+    const quint64 perAddress = m_admission->refused(ConnectionAdmission::Verdict::TooManyFromAddress);
+    const quint64 handshakes = m_admission->refused(ConnectionAdmission::Verdict::TooManyHandshakes);
+    const quint64 total = connections + perAddress + handshakes;
+    const quint64 sinceLast = total - m_refusedAtLastLog;
+    m_refusedAtLastLog = total;
+    if (sinceLast == 0)
+        return;
+    writeLog(LogLevel::Warn,
+             makeCategory(LogCategory::Transport),
+             "WS refused %1 connections before the upgrade (%2 in total: connections=%3 perAddress=%4 handshakes=%5)",
+             {Scalar{static_cast<std::int64_t>(sinceLast)},
+              Scalar{static_cast<std::int64_t>(total)},
+              Scalar{static_cast<std::int64_t>(connections)},
+              Scalar{static_cast<std::int64_t>(perAddress)},
+              Scalar{static_cast<std::int64_t>(handshakes)}},
+             "ws.admissionRefused",
+             jsonObject({{"refused", std::to_string(sinceLast)},
+                         {"refusedTotal", std::to_string(total)},
+                         {"maxConnections", std::to_string(connections)},
+                         {"maxPerAddress", std::to_string(perAddress)},
+                         {"maxHandshakes", std::to_string(handshakes)},
+                         {"handshakesInProgress", std::to_string(m_admission->handshakes())}}));
+}
 
+bool WsTransport::isConfigValid(const QJsonObject &config, QString *errorString)
+{
+    const int port = static_cast<int>(portFromConfig(config));
+    if (port < 1 || port > 65535) {
+        if (errorString)
+            *errorString = QStringLiteral("Invalid 'port' value; expected 1..65535.");
+        return false;
+    }
 
-    QJsonParseError parseError;
-    const QJsonDocument doc = QJsonDocument::fromJson(message.toUtf8(), &parseError);
-    if (parseError.error != QJsonParseError::NoError || !doc.isObject()) {
-        sendProtocolError(socket, std::nullopt, kErrorCodeInvalidJson, kMessageInvalidJson);
-        return;
+    const QString host = hostFromConfig(config).trimmed();
+    if (host.isEmpty()) {
+        if (errorString)
+            *errorString = QStringLiteral("Invalid 'host' value.");
+        return false;
     }
 
-    const QJsonObject obj = doc.object();
-    const QString type = obj.value(QStringLiteral("type")).toString();
-    const QString topic = obj.value(QStringLiteral("topic")).toString();
-    const QJsonObject payload = obj.value(QStringLiteral("payload")).toObject();
+    const QJsonValue compression = config.value(QStringLiteral("compression"));
+    if (!compression.isUndefined()) {
+        const QJsonObject settings = compression.toObject();
+        const int level = settings.value(QStringLiteral("level")).toInt(kDefaultCompressionLevel);
+        const int minFrameBytes =
+            settings.value(QStringLiteral("minFrameBytes")).toInt(kDefaultCompressionMinFrameBytes);
+        if (!compression.isObject() || level < 1 || level > 9 || minFrameBytes < 0) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'compression' value; expected "
+                                              "{\"enabled\": bool, \"level\": 1..9, \"minFrameBytes\": >= 0}.");
+            return false;
+        }
+    }
 
-    const std::optional<CmdId> cid = readCid(obj.value(QStringLiteral("cid")));
-    if (!cid.has_value()) {
-        sendProtocolError(socket, std::nullopt, kErrorCodeMissingCid, kMessageMissingCid);
-        return;
+    for (const QLatin1String key : {QLatin1String("outboundBudgetBytes"),
+                                    QLatin1String("outboundMaxQueuedFrames"),
+                                    QLatin1String("slowConsumerTimeoutSec")}) {
+        const QJsonValue value = config.value(key);
+        if (!value.isUndefined() && (!value.isDouble() || value.toDouble() < 1.0)) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid '%1' value; expected a positive number.").arg(key);
+            return false;
+        }
     }
 
-    if (type.toStdString() != kEnvelopeTypeCmd) {
-        sendProtocolError(socket, cid, kErrorCodeInvalidType, kMessageInvalidType);
-        return;
+    const QJsonValue inboundRateLimit = config.value(QStringLiteral("inboundRateLimit"));
+    if (!inboundRateLimit.isUndefined()) {
+        const QJsonObject settings = inboundRateLimit.toObject();
+        const double framesPerSec = settings.value(QStringLiteral("framesPerSec")).toDouble(kDefaultInboundFramesPerSec);
+        const double burst = settings.value(QStringLiteral("burst")).toDouble(kDefaultInboundBurst);
+        if (!inboundRateLimit.isObject() || framesPerSec <= 0.0 || burst < 1.0) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'inboundRateLimit' value; expected "
+                                              "{\"framesPerSec\": > 0, \"burst\": >= 1}.");
+            return false;
+        }
     }
 
-    if (topic.trimmed().isEmpty()) {
-        sendProtocolError(socket, cid, kErrorCodeMissingTopic, kMessageMissingTopic);
-        return;
+    const QJsonValue maxPendingCommands = config.value(QStringLiteral("maxPendingCommands"));
+    if (!maxPendingCommands.isUndefined()
+        && (!maxPendingCommands.isDouble() || maxPendingCommands.toDouble() < 1.0
+            || maxPendingCommands.toDouble() != static_cast<double>(maxPendingCommands.toInt()))) {
+        if (errorString)
+            *errorString = QStringLiteral("Invalid 'maxPendingCommands' value; expected a positive integer.");
+        return false;
     }
 
-    // A connection that has not authenticated gets the handshake and the login,
-    // and nothing else. Core would refuse the rest anyway, but a socket that
-    // answers to anyone should not be able to make it do the refusing (F-42).
-    const QString requestClientId = payload.value(QStringLiteral("clientId")).toString();
-    if (!m_sessions.contains(socket) && !isPreAuthTopic(topic)) {
-        sendProtocolError(socket, cid, "unauthenticated",
-                          "Authenticate with sync.auth.login.set before sending this topic.");
-        return;
+    const QJsonValue commandTimeoutSec = config.value(QStringLiteral("commandTimeoutSec"));
+    if (!commandTimeoutSec.isUndefined() && (!commandTimeoutSec.isDouble() || commandTimeoutSec.toDouble() < 0.0)) {
+        if (errorString)
+            *errorString = QStringLiteral("Invalid 'commandTimeoutSec' value; expected 0 (off) or a positive number.");
+        return false;
     }
-    // What counts as activity is what core counts: a call it authorizes, which
-    // is where it touches the session. The pre-auth topics are not that - a
-    // heartbeat says the socket is open, not that anyone is still using it, and
-    // letting it extend the session would make the timeout decorative.
-    if (!isPreAuthTopic(topic)) {
-        if (auto session = m_sessions.find(socket); session != m_sessions.end())
-            session->lastActivityMs = QDateTime::currentMSecsSinceEpoch();
+
+    const QJsonValue eventBatch = config.value(QStringLiteral("eventBatch"));
+    if (!eventBatch.isUndefined()) {
+        const QJsonObject settings = eventBatch.toObject();
+        const int windowMs = settings.value(QStringLiteral("windowMs")).toInt(kDefaultEventBatchWindowMs);
+        const int maxEvents = settings.value(QStringLiteral("maxEvents")).toInt(kDefaultEventBatchMaxEvents);
+        const double maxBytes =
+            settings.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultEventBatchMaxBytes));
+        if (!eventBatch.isObject() || windowMs < 1 || windowMs > kMaxEventBatchWindowMs || maxEvents < 1
+            || maxBytes < 1.0) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'eventBatch' value; expected "
+                                              "{\"windowMs\": 1..%1, \"maxEvents\": >= 1, \"maxBytes\": >= 1}.")
+                                   .arg(kMaxEventBatchWindowMs);
+            return false;
+        }
     }
 
-    // Only used to remember a session the client already held when it said hello.
-    const QString requestAuthToken = payload.value(QStringLiteral("authToken")).toString().trimmed();
+    const QJsonValue eventReplay = config.value(QStringLiteral("eventReplay"));
+    if (!eventReplay.isUndefined()) {
+        const QJsonObject settings = eventReplay.toObject();
+        const double maxEvents =
+            settings.value(QStringLiteral("maxEvents")).toDouble(static_cast<double>(kDefaultReplayMaxEvents));
+        const double maxBytes =
+            settings.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultReplayMaxBytes));
+        if (!eventReplay.isObject() || maxEvents < 0.0 || maxEvents > kMaxReplayEvents
+            || maxEvents != static_cast<double>(static_cast<int>(maxEvents)) || maxBytes < 1.0) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'eventReplay' value; expected "
+                                              "{\"maxEvents\": 0..%1, \"maxBytes\": >= 1}.")
+                                   .arg(kMaxReplayEvents);
+            return false;
+        }
+    }
 
-    // The API takes the payload as text; this transport parsed the frame to read the
-    // envelope, so the sub-object is serialized once here. That extra step is the
-    // cost side of the text boundary, and it sits on the command path rather than on
-    // the event path.
-    const QByteArray payloadBytes = QJsonDocument(payload).toJson(QJsonDocument::Compact);
-    handleCommand(socket,
-                  *cid,
-                  topic,
-                  requestClientId,
-                  requestAuthToken,
-                  std::string_view(payloadBytes.constData(), static_cast<std::size_t>(payloadBytes.size())));
-}
+    const QJsonValue stateCache = config.value(QStringLiteral("stateCache"));
+    if (!stateCache.isUndefined()) {
+        const QJsonObject settings = stateCache.toObject();
+        const double maxChannels = settings.value(QStringLiteral("maxChannels"))
+                                       .toDouble(static_cast<double>(kDefaultStateCacheMaxChannels));
+        const double maxBytes =
+            settings.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultStateCacheMaxBytes));
+        if (!stateCache.isObject() || maxChannels < 0.0 || maxChannels > kMaxStateCacheChannels
+            || maxChannels != static_cast<double>(static_cast<int>(maxChannels)) || maxBytes < 1.0) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'stateCache' value; expected "
+                                              "{\"maxChannels\": 0..%1, \"maxBytes\": >= 1}.")
+                                   .arg(kMaxStateCacheChannels);
+            return false;
+        }
+    }
 
-bool WsTransport::isConfigValid(const QJsonObject &config, QString *errorString)
-{
-    const int port = static_cast<int>(portFromConfig(config));
-    if (port < 1 || port > 65535) {
+    const QJsonValue fragmentation = config.value(QStringLiteral("fragmentation"));
+    if (!fragmentation.isUndefined()) {
+        const QJsonObject settings = fragmentation.toObject();
+        const double fragmentBytes = settings.value(QStringLiteral("fragmentBytes"))
+                                         .toDouble(static_cast<double>(kDefaultFragmentBytes));
+        const double minMessageBytes = settings.value(QStringLiteral("minMessageBytes"))
+                                           .toDouble(static_cast<double>(kDefaultFragmentMinMessageBytes));
+        if (!fragmentation.isObject() || fragmentBytes != static_cast<double>(static_cast<qint64>(fragmentBytes))
+            || (fragmentBytes != 0.0 && (fragmentBytes < kMinFragmentBytes || fragmentBytes > kMaxFragmentBytes))
+            || minMessageBytes < fragmentBytes) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'fragmentation' value; expected {\"fragmentBytes\": 0 or "
+                                              "%1..%2, \"minMessageBytes\": >= fragmentBytes}.")
+                                   .arg(kMinFragmentBytes)
+                                   .arg(kMaxFragmentBytes);
+            return false;
+        }
+    }
+
+    const QJsonValue admission = config.value(QStringLiteral("admission"));
+    if (!admission.isUndefined()) {
+        const QJsonObject settings = admission.toObject();
+        const auto inRange = [&settings](const char *key, int fallback) {
+            const double value = settings.value(QLatin1String(key)).toDouble(static_cast<double>(fallback));
+            return value >= 0.0 && value <= kMaxAdmissionLimit && value == static_cast<double>(static_cast<int>(value));
+        };
+        if (!admission.isObject() || !inRange("maxConnections", kDefaultAdmissionMaxConnections)
+            || !inRange("maxPerAddress", kDefaultAdmissionMaxPerAddress)
+            || !inRange("maxHandshakes", kDefaultAdmissionMaxHandshakes)) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'admission' value; expected {\"maxConnections\": 0..%1, "
+                                              "\"maxPerAddress\": 0..%1, \"maxHandshakes\": 0..%1}.")
+                                   .arg(kMaxAdmissionLimit);
+            return false;
+        }
+    }
+
+    const QJsonValue ioThreads = config.value(QStringLiteral("ioThreads"));
+    if (!ioThreads.isUndefined()
+        && (!ioThreads.isDouble() || ioThreads.toDouble() < 0.0 || ioThreads.toDouble() > kMaxIoThreads
+            || ioThreads.toDouble() != static_cast<double>(ioThreads.toInt()))) {
         if (errorString)
-            *errorString = QStringLiteral("Invalid 'port' value; expected 1..65535.");
+            *errorString = QStringLiteral("Invalid 'ioThreads' value; expected 0..%1.").arg(kMaxIoThreads);
         return false;
     }
 
-    const QString host = hostFromConfig(config).trimmed();
-    if (host.isEmpty()) {
+    const QJsonValue syncWorkers = config.value(QStringLiteral("syncWorkers"));
+    if (!syncWorkers.isUndefined()
+        && (!syncWorkers.isDouble() || syncWorkers.toDouble() < 0.0 || syncWorkers.toDouble() > kMaxSyncWorkers
+            || syncWorkers.toDouble() != static_cast<double>(syncWorkers.toInt()))) {
         if (errorString)
-            *errorString = QStringLiteral("Invalid 'host' value.");
+            *errorString = QStringLiteral("Invalid 'syncWorkers' value; expected 0..%1.").arg(kMaxSyncWorkers);
         return false;
     }
 
-    return true;
-}
+    const QJsonValue drain = config.value(QStringLiteral("drain"));
+    if (!drain.isUndefined()) {
+        const QJsonObject settings = drain.toObject();
+        const auto inRange = [&settings](const char *key, double fallback, double max) {
+            const QJsonValue value = settings.value(QLatin1String(key));
+            return value.isUndefined()
+                || (value.isDouble() && value.toDouble(fallback) >= 0.0 && value.toDouble(fallback) <= max);
+        };
+        const QJsonValue waves = settings.value(QStringLiteral("waves"));
+        const bool wavesValid = waves.isUndefined()
+            || (waves.isDouble() && waves.toDouble() >= 1.0 && waves.toDouble() <= kMaxDrainWaves
+                && waves.toDouble() == static_cast<double>(waves.toInt()));
+        if (!drain.isObject()
+            || !inRange("reconnectWindowSec", kDefaultDrainReconnectWindowSec, kMaxDrainReconnectWindowSec)
+            || !inRange("graceSec", kDefaultDrainGraceSec, kMaxDrainWaitSec)
+            || !inRange("closeWindowSec", kDefaultDrainCloseWindowSec, kMaxDrainWaitSec) || !wavesValid) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'drain' value; expected {\"reconnectWindowSec\": 0..%1, "
+                                              "\"graceSec\": 0..%2, \"closeWindowSec\": 0..%2, \"waves\": 1..%3}.")
+                                   .arg(kMaxDrainReconnectWindowSec)
+                                   .arg(static_cast<int>(kMaxDrainWaitSec))
+                                   .arg(kMaxDrainWaves);
+            return false;
+        }
+    }
 
-std::optional<CmdId> WsTransport::readCid(const QJsonValue &value)
-{
-    if (value.isDouble())
-        return cidFromNumber(value.toDouble(-1.0));
-    if (value.isString())
-        return cidFromString(value.toString().toStdString());
-    return std::nullopt;
+    const QJsonValue metrics = config.value(QStringLiteral("metrics"));
+    if (!metrics.isUndefined()) {
+        const QJsonObject settings = metrics.toObject();
+        const QJsonValue metricsPort = settings.value(QStringLiteral("port"));
+        const QJsonValue metricsHost = settings.value(QStringLiteral("host"));
+        QHostAddress address;
+        if (!metrics.isObject() || !metricsPort.isDouble() || metricsPort.toDouble() < 1.0
+            || metricsPort.toDouble() > 65535.0 || metricsPort.toDouble() != static_cast<double>(metricsPort.toInt())
+            || (!metricsHost.isUndefined() && !metricsHost.isString())
+            || !addressFromHost(metricsHostFromConfig(config), &address)) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'metrics' value; expected "
+                                              "{\"port\": 1..65535, \"host\": address}.");
+            return false;
+        }
+    }
+
+    // Shape only; whether the files load is for start() to find out.
+    const QJsonValue tlsValue = config.value(QStringLiteral("tls"));
+#ifndef PHI_TRANSPORT_WS_WITH_TLS
+    if (!tlsValue.isUndefined()) {
+        if (errorString)
+            *errorString = QStringLiteral("'tls' is not supported: built without PHI_TRANSPORT_WS_WITH_TLS.");
+        return false;
+    }
+#endif
+    if (!tlsValue.isUndefined()) {
+        const QJsonObject settings = tlsValue.toObject();
+        const QJsonValue sessionTickets = settings.value(QStringLiteral("sessionTickets"));
+        const double cacheSize = settings.value(QStringLiteral("sessionCacheSize"))
+                                     .toDouble(static_cast<double>(kDefaultTlsSessionCacheSize));
+        const double timeoutSec = settings.value(QStringLiteral("sessionTimeoutSec"))
+                                      .toDouble(static_cast<double>(kDefaultTlsSessionTimeoutSec));
+        if (!tlsValue.isObject() || settings.value(QStringLiteral("certificate")).toString().trimmed().isEmpty()
+            || settings.value(QStringLiteral("privateKey")).toString().trimmed().isEmpty()
+            || cacheSize < 0.0 || cacheSize > kMaxTlsSessionCacheSize
+            || cacheSize != static_cast<double>(static_cast<int>(cacheSize)) || timeoutSec < 1.0
+            || timeoutSec > kMaxTlsSessionTimeoutSec
+            || (!sessionTickets.isUndefined() && !sessionTickets.isBool())) {
+            if (errorString)
+                *errorString = QStringLiteral("Invalid 'tls' value; expected {\"certificate\": path, "
+                                              "\"privateKey\": path, \"sessionCacheSize\": 0..%1, "
+                                              "\"sessionTimeoutSec\": 1..%2, \"sessionTickets\": bool}.")
+                                   .arg(kMaxTlsSessionCacheSize)
+                                   .arg(kMaxTlsSessionTimeoutSec);
+            return false;
+        }
+    }
+
+    return true;
 }
 
 QStringList WsTransport::allowedOriginsFromConfig(const QJsonObject &config)
@@ -346,92 +934,151 @@ QStringList WsTransport::allowedOriginsFromConfig(const QJsonObject &config)
     return origins;
 }
 
-bool WsTransport::isLoopbackOrigin(const QString &origin)
+CompressionSettings WsTransport::compressionFromConfig(const QJsonObject &config)
 {
-    // A UI served from the same machine keeps working out of the box, whichever
-    // port a dev server or the packaged UI happens to use. Anything else has to
-    // be named. That is the line between "the operator's own page" and
-    // "whatever site the browser happens to have open".
-    const QUrl url(origin);
-    if (!url.isValid())
-        return false;
-    const QString scheme = url.scheme().toLower();
-    if (scheme != QStringLiteral("http") && scheme != QStringLiteral("https"))
-        return false;
+    // Off unless asked for: it trades CPU on this box for bytes on the link,
+    // and only the operator knows which of the two is scarce.
+    CompressionSettings settings;
+    const QJsonObject compression = config.value(QStringLiteral("compression")).toObject();
+    settings.enabled = compression.value(QStringLiteral("enabled")).toBool(false);
+    settings.minFrameBytes =
+        compression.value(QStringLiteral("minFrameBytes")).toInt(kDefaultCompressionMinFrameBytes);
+    settings.level = compression.value(QStringLiteral("level")).toInt(kDefaultCompressionLevel);
+    return settings;
+}
 
-    const QString host = url.host().toLower();
-    if (host == QStringLiteral("localhost") || host == QStringLiteral("::1"))
-        return true;
-    const QHostAddress address(host);
-    return !address.isNull() && address.isLoopback();
+EventBatchSettings WsTransport::eventBatchFromConfig(const QJsonObject &config)
+{
+    // Always available; a connection only gets batches when its hello asks.
+    EventBatchSettings settings;
+    const QJsonObject eventBatch = config.value(QStringLiteral("eventBatch")).toObject();
+    settings.windowMs = eventBatch.value(QStringLiteral("windowMs")).toInt(kDefaultEventBatchWindowMs);
+    settings.maxEvents = eventBatch.value(QStringLiteral("maxEvents")).toInt(kDefaultEventBatchMaxEvents);
+    settings.maxBytes = static_cast<qint64>(
+        eventBatch.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultEventBatchMaxBytes)));
+    return settings;
 }
 
-bool WsTransport::isPreAuthTopic(const QString &topic)
+ReplaySettings WsTransport::replayFromConfig(const QJsonObject &config)
 {
-    // The handshake, the way in, and the way out. Core owns the authoritative
-    // table and refuses anything else anyway; this list exists so an
-    // unauthenticated flood never reaches it in the first place.
-    return topic == QLatin1String("sync.hello.get")
-        || topic == QLatin1String("sync.ping.get")
-        || topic.startsWith(QLatin1String("sync.auth."));
+    ReplaySettings settings;
+    const QJsonObject eventReplay = config.value(QStringLiteral("eventReplay")).toObject();
+    settings.maxEvents = eventReplay.value(QStringLiteral("maxEvents")).toInt(kDefaultReplayMaxEvents);
+    settings.maxBytes = static_cast<qint64>(
+        eventReplay.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultReplayMaxBytes)));
+    return settings;
 }
 
-void WsTransport::trackAuthOutcome(QWebSocket *socket,
-                                   const QString &topic,
-                                   const QString &requestClientId,
-                                   const QString &requestAuthToken,
-                                   std::string_view responsePayloadJson)
+StateCacheSettings WsTransport::stateCacheFromConfig(const QJsonObject &config)
 {
-    if (!socket)
-        return;
+    StateCacheSettings settings;
+    const QJsonValue stateCache = config.value(QStringLiteral("stateCache"));
+    if (!stateCache.isObject())
+        return settings;
+    const QJsonObject object = stateCache.toObject();
+    settings.maxChannels = object.value(QStringLiteral("maxChannels")).toInt(kDefaultStateCacheMaxChannels);
+    settings.maxBytes = static_cast<qint64>(
+        object.value(QStringLiteral("maxBytes")).toDouble(static_cast<double>(kDefaultStateCacheMaxBytes)));
+    return settings;
+}
 
-    if (topic == QLatin1String("sync.auth.logout.set")) {
-        m_sessions.remove(socket);
-        return;
-    }
+FragmentSettings WsTransport::fragmentationFromConfig(const QJsonObject &config)
+{
+    FragmentSettings settings;
+    const QJsonObject fragmentation = config.value(QStringLiteral("fragmentation")).toObject();
+    settings.fragmentBytes = static_cast<qint64>(
+        fragmentation.value(QStringLiteral("fragmentBytes")).toDouble(static_cast<double>(kDefaultFragmentBytes)));
+    settings.minMessageBytes = static_cast<qint64>(fragmentation.value(QStringLiteral("minMessageBytes"))
+                                                       .toDouble(static_cast<double>(kDefaultFragmentMinMessageBytes)));
+    return settings;
+}
 
-    const bool isLogin = topic == QLatin1String("sync.auth.login.set")
-        || topic == QLatin1String("sync.auth.bootstrap.set")
-        || topic == QLatin1String("sync.hello.get");
-    if (!isLogin)
-        return;
+AdmissionLimits WsTransport::admissionFromConfig(const QJsonObject &config)
+{
+    AdmissionLimits limits;
+    const QJsonObject admission = config.value(QStringLiteral("admission")).toObject();
+    limits.maxConnections =
+        admission.value(QStringLiteral("maxConnections")).toInt(kDefaultAdmissionMaxConnections);
+    limits.maxPerAddress = admission.value(QStringLiteral("maxPerAddress")).toInt(kDefaultAdmissionMaxPerAddress);
+    limits.maxHandshakes = admission.value(QStringLiteral("maxHandshakes")).toInt(kDefaultAdmissionMaxHandshakes);
+    return limits;
+}
 
-    // The only place this transport looks inside a payload: the session core
-    // just issued is what it has to remember, and it is in the answer.
-    const QJsonObject response =
-        QJsonDocument::fromJson(QByteArray::fromRawData(responsePayloadJson.data(),
-                                                       static_cast<qsizetype>(responsePayloadJson.size())))
-            .object();
+WsTransport::DrainPlan WsTransport::drainFromConfig(const QJsonObject &config)
+{
+    const QJsonObject drain = config.value(QStringLiteral("drain")).toObject();
+    DrainPlan plan;
+    plan.shards.reconnectWindowMs =
+        static_cast<qint64>(drain.value(QStringLiteral("reconnectWindowSec")).toDouble(kDefaultDrainReconnectWindowSec)
+                            * 1000.0);
+    plan.shards.waves = drain.value(QStringLiteral("waves")).toInt(kDefaultDrainWaves);
+    plan.graceMs =
+        static_cast<qint64>(drain.value(QStringLiteral("graceSec")).toDouble(kDefaultDrainGraceSec) * 1000.0);
+    plan.closeWindowMs = static_cast<qint64>(
+        drain.value(QStringLiteral("closeWindowSec")).toDouble(kDefaultDrainCloseWindowSec) * 1000.0);
+    return plan;
+}
 
-    // How long this session may sit idle is core's decision, and it states it in
-    // the same answer that hands out the token (F-42). 0 or absent means core
-    // does not expire sessions, so neither does this transport.
-    const qint64 idleBudgetMs =
-        static_cast<qint64>(response.value(QStringLiteral("sessionIdleSec")).toDouble(0.0)) * 1000;
-    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
-
-    const QString token = response.value(QStringLiteral("token")).toString().trimmed();
-    if (!token.isEmpty()) {
-        ClientSession session;
-        session.token = token;
-        session.clientId = requestClientId;
-        session.idleBudgetMs = idleBudgetMs;
-        session.lastActivityMs = nowMs;
-        m_sessions.insert(socket, session);
-        return;
-    }
+tls::ServerSettings WsTransport::tlsFromConfig(const QJsonObject &config)
+{
+    tls::ServerSettings settings;
+    const QJsonObject object = config.value(QStringLiteral("tls")).toObject();
+    settings.certificatePath = object.value(QStringLiteral("certificate")).toString().trimmed().toStdString();
+    settings.privateKeyPath = object.value(QStringLiteral("privateKey")).toString().trimmed().toStdString();
+    settings.sessionCacheSize = static_cast<std::size_t>(
+        std::max(0, object.value(QStringLiteral("sessionCacheSize")).toInt(kDefaultTlsSessionCacheSize)));
+    settings.sessionTimeoutSec =
+        object.value(QStringLiteral("sessionTimeoutSec")).toInt(kDefaultTlsSessionTimeoutSec);
+    settings.sessionTickets = object.value(QStringLiteral("sessionTickets")).toBool(true);
+    return settings;
+}
 
-    // hello with an authToken core accepted: the client already had a session.
-    if (topic == QLatin1String("sync.hello.get")
-        && response.value(QStringLiteral("authAccepted")).toBool(false)) {
-        ClientSession session;
-        session.token = requestAuthToken;
-        session.clientId = requestClientId;
-        session.idleBudgetMs = idleBudgetMs;
-        session.lastActivityMs = nowMs;
-        if (!session.token.isEmpty())
-            m_sessions.insert(socket, session);
-    }
+OutboundLimits WsTransport::outboundLimitsFromConfig(const QJsonObject &config)
+{
+    OutboundLimits limits;
+    limits.budgetBytes = static_cast<qint64>(
+        config.value(QStringLiteral("outboundBudgetBytes")).toDouble(static_cast<double>(kDefaultOutboundBudgetBytes)));
+    limits.maxQueuedFrames =
+        config.value(QStringLiteral("outboundMaxQueuedFrames")).toInt(kDefaultOutboundMaxQueuedFrames);
+    limits.stallTimeoutMs = static_cast<qint64>(
+        config.value(QStringLiteral("slowConsumerTimeoutSec")).toDouble(static_cast<double>(kDefaultSlowConsumerTimeoutSec)))
+        * 1000;
+    return limits;
+}
+
+InboundLimits WsTransport::inboundLimitsFromConfig(const QJsonObject &config)
+{
+    InboundLimits limits;
+    const QJsonObject inbound = config.value(QStringLiteral("inboundRateLimit")).toObject();
+    limits.framesPerSec = inbound.value(QStringLiteral("framesPerSec")).toDouble(kDefaultInboundFramesPerSec);
+    limits.burst = inbound.value(QStringLiteral("burst")).toDouble(kDefaultInboundBurst);
+    return limits;
+}
+
+int WsTransport::maxPendingCommandsFromConfig(const QJsonObject &config)
+{
+    return config.value(QStringLiteral("maxPendingCommands")).toInt(kDefaultMaxPendingCommands);
+}
+
+qint64 WsTransport::commandTimeoutMsFromConfig(const QJsonObject &config)
+{
+    // Off unless asked for: some commands (firmware updates, long exports)
+    // legitimately take minutes, and only the operator knows how many.
+    return static_cast<qint64>(config.value(QStringLiteral("commandTimeoutSec")).toDouble(0.0) * 1000.0);
+}
+
+int WsTransport::ioThreadsFromConfig(const QJsonObject &config)
+{
+    // None unless asked for: a home installation has a handful of dashboards,
+    // and the transport's own thread serves those with nothing to hand over.
+    return config.value(QStringLiteral("ioThreads")).toInt(0);
+}
+
+int WsTransport::syncWorkersFromConfig(const QJsonObject &config)
+{
+    // Inline unless asked for: core's sync handlers are lookups, and handing
+    // each one to another thread and back costs more than most of them take.
+    return config.value(QStringLiteral("syncWorkers")).toInt(0);
 }
 
 QString WsTransport::hostFromConfig(const QJsonObject &config)
@@ -442,35 +1089,60 @@ QString WsTransport::hostFromConfig(const QJsonObject &config)
     return host;
 }
 
-quint16 WsTransport::portFromConfig(const QJsonObject &config)
+quint16 WsTransport::metricsPortFromConfig(const QJsonObject &config)
 {
-    const int port = config.value(QStringLiteral("port")).toInt(static_cast<int>(kDefaultPort));
+    // Off unless asked for: a scrape answers anyone who can reach the port, and
+    // what it tells them is how busy this installation is.
+    const int port = config.value(QStringLiteral("metrics")).toObject().value(QStringLiteral("port")).toInt(0);
     if (port < 1 || port > 65535)
-        return kDefaultPort;
+        return 0;
     return static_cast<quint16>(port);
 }
 
-bool WsTransport::startServer(const QString &host, quint16 port, QString *errorString)
+QString WsTransport::metricsHostFromConfig(const QJsonObject &config)
 {
-    auto *server = new QWebSocketServer(QStringLiteral("phi-transport-ws"),
-                                        QWebSocketServer::NonSecureMode,
-                                        this);
-    // UI clients request the protocol string "phi-core-ws.v1". Without an
-    // agreed subprotocol, browser WebSocket clients reject the handshake.
-    server->setSupportedSubprotocols({ QStringLiteral("phi-core-ws.v1") });
+    const QString host =
+        config.value(QStringLiteral("metrics")).toObject().value(QStringLiteral("host")).toString().trimmed();
+    if (host.isEmpty())
+        return QString::fromLatin1(kDefaultMetricsHost);
+    return host;
+}
 
-    QHostAddress address;
+bool WsTransport::addressFromHost(const QString &host, QHostAddress *address)
+{
     const QString normalizedHost = host.trimmed().toLower();
     if (normalizedHost == QStringLiteral("*")
         || normalizedHost == QStringLiteral("any")
         || normalizedHost == QStringLiteral("0.0.0.0")) {
-        address = QHostAddress::AnyIPv4;
+        *address = QHostAddress::AnyIPv4;
     } else if (normalizedHost == QStringLiteral("::")
                || normalizedHost == QStringLiteral("anyipv6")) {
-        address = QHostAddress::AnyIPv6;
+        *address = QHostAddress::AnyIPv6;
     } else if (normalizedHost == QStringLiteral("localhost")) {
-        address = QHostAddress::LocalHost;
-    } else if (!address.setAddress(host)) {
+        *address = QHostAddress::LocalHost;
+    } else if (!address->setAddress(host)) {
+        return false;
+    }
+    return true;
+}
+
+quint16 WsTransport::portFromConfig(const QJsonObject &config)
+{
+    const int port = config.value(QStringLiteral("port")).toInt(static_cast<int>(kDefaultPort));
+    if (port < 1 || port > 65535)
+        return kDefaultPort;
+    return static_cast<quint16>(port);
+}
+
+bool WsTransport::startServer(const QString &host, quint16 port, QString *errorString)
+{
+    // Only accepts. The handshake, origin check included, runs on the shard the
+    // connection is handed to (WsShard::adoptConnection).
+    auto *server = new ConnectionListener(
+        [this](qintptr socketDescriptor) { dispatchConnection(socketDescriptor); }, this);
+
+    QHostAddress address;
+    if (!addressFromHost(host, &address)) {
         delete server;
         if (errorString)
             *errorString = QStringLiteral("Invalid host address: %1").arg(host);
@@ -485,26 +1157,531 @@ bool WsTransport::startServer(const QString &host, quint16 port, QString *errorS
         return false;
     }
 
-    // A WebSocket handshake is not subject to the same-origin policy, so any page
-    // a browser has open can connect to this port unless the server checks the
-    // Origin itself. Without this, "bound to loopback" protected nothing against
-    // a website the user happened to visit (F-42).
-    connect(server, &QWebSocketServer::originAuthenticationRequired,
-            this, [this](QWebSocketCorsAuthenticator *authenticator) {
-        if (!authenticator)
+    m_server = server;
+    return true;
+}
+
+bool WsTransport::startMetricsEndpoint(const QJsonObject &config, QString *errorString)
+{
+    const quint16 port = metricsPortFromConfig(config);
+    if (port == 0)
+        return true;
+    QHostAddress address;
+    addressFromHost(metricsHostFromConfig(config), &address);
+    // Rendered on this thread, per scrape; the shards' counters are atomics and
+    // read where they are.
+    auto *endpoint = new MetricsEndpoint([this]() { return metricsToPrometheus(metricsSnapshot()); }, this);
+    if (!endpoint->listen(address, port, errorString)) {
+        delete endpoint;
+        return false;
+    }
+    m_metricsEndpoint = endpoint;
+    return true;
+}
+
+bool WsTransport::reconfigure(const QJsonObject &config, QString *errorString)
+{
+    // What can fail goes first, and what it changed is put back if a later
+    // step fails: a config that is refused leaves the running one in force.
+    std::shared_ptr<const tls::ServerContext> tlsContext = m_tlsContext;
+    if (config.value(QStringLiteral("tls")) != m_config.value(QStringLiteral("tls"))) {
+        tlsContext.reset();
+        if (config.contains(QStringLiteral("tls"))) {
+            tlsContext = createTlsContext(tlsFromConfig(config), errorString);
+            if (!tlsContext)
+                return false;
+        }
+    }
+    const bool metricsMoved = metricsPortFromConfig(config) != metricsPortFromConfig(m_config)
+        || metricsHostFromConfig(config) != metricsHostFromConfig(m_config);
+    if (metricsMoved && !moveMetricsEndpoint(config, errorString))
+        return false;
+    const QString host = hostFromConfig(config);
+    const quint16 port = portFromConfig(config);
+    // A listener lost to a failed move is tried again even on the same endpoint.
+    const bool serverMoved =
+        host != hostFromConfig(m_config) || port != portFromConfig(m_config) || !m_server->isListening();
+    if (serverMoved && !moveServer(host, port, errorString)) {
+        if (metricsMoved) {
+            QString ignored;
+            moveMetricsEndpoint(m_config, &ignored);
+        }
+        return false;
+    }
+
+    // Nothing below can fail, and nothing below touches a connection.
+    m_tlsContext = std::move(tlsContext);
+    m_maxPendingCommands = maxPendingCommandsFromConfig(config);
+    m_commandTimeoutMs = commandTimeoutMsFromConfig(config);
+    applySyncWorkers(syncWorkersFromConfig(config));
+    // The same counts, so connections admitted under the old limits are still
+    // counted against the new ones.
+    m_admission->setLimits(admissionFromConfig(config));
+    const ShardSettings settings = shardSettings(config);
+    m_replayEnabled = settings.replay.maxEvents > 0;
+    m_stateCacheEnabled = settings.stateCache.maxChannels > 0;
+    // Queued behind whatever the shard has yet to do, and ahead of every event
+    // published from here on.
+    for (WsShard *shard : std::as_const(m_shards))
+        QMetaObject::invokeMethod(shard, [shard, settings]() { shard->applySettings(settings); });
+
+    QStringList changed;
+    QStringList keys = config.keys() + m_config.keys();
+    keys.removeDuplicates();
+    keys.sort();
+    for (const QString &key : std::as_const(keys)) {
+        if (config.value(key) != m_config.value(key))
+            changed.append(key);
+    }
+    m_config = config;
+    const std::string changedText = changed.join(QStringLiteral(", ")).toStdString();
+    std::string changedJson = "[";
+    for (const QString &key : std::as_const(changed)) {
+        if (changedJson.size() > 1)
+            changedJson += ',';
+        changedJson += jsonQuoted(key.toStdString());
+    }
+    changedJson += ']';
+    writeLog(LogLevel::Info,
+             makeCategory(LogCategory::Transport),
+             "WS transport reconfigured in place (%1); %2 connections kept",
+             {Scalar{changedText.empty() ? std::string("no changes") : changedText},
+              Scalar{static_cast<std::int64_t>(totalConnections())}},
+             "ws.reconfigure",
+             jsonObject({{"changed", changedJson},
+                         {"connections", std::to_string(totalConnections())}}));
+    return true;
+}
+
+bool WsTransport::moveServer(const QString &host, quint16 port, QString *errorString)
+{
+    // The new listener comes up before the old one goes, so there is no moment
+    // nothing accepts. Connections already accepted never depended on it.
+    QTcpServer *previous = m_server;
+    const QHostAddress previousAddress = previous->serverAddress();
+    const quint16 previousPort = previous->serverPort();
+    m_server = nullptr;
+    if (startServer(host, port, errorString)) {
+        previous->close();
+        previous->deleteLater();
+        return true;
+    }
+    // The same port on the wildcard address and on one of its own cannot be
+    // bound at once. Then the old listener goes first, and comes back if the
+    // new one still cannot bind.
+    if (port == previousPort && previous->isListening()) {
+        previous->close();
+        if (startServer(host, port, errorString)) {
+            previous->deleteLater();
+            return true;
+        }
+        if (!previous->listen(previousAddress, previousPort)) {
+            // Someone else took the port in between. Nothing accepts now; the
+            // next start() tries to listen again, whatever its config says.
+            const QString bindError = errorString ? *errorString : QString();
+            const QString restoreError = previous->errorString();
+            writeLog(LogLevel::Error,
+                     makeCategory(LogCategory::Transport),
+                     "WS transport no longer accepting: cannot bind %1:%2 (%3), nor listen on %4:%5 again (%6)",
+                     {Scalar{host.toStdString()},
+                      Scalar{static_cast<std::int64_t>(port)},
+                      Scalar{bindError.toStdString()},
+                      Scalar{previousAddress.toString().toStdString()},
+                      Scalar{static_cast<std::int64_t>(previousPort)},
+                      Scalar{restoreError.toStdString()}},
+                     "ws.listenLost",
+                     jsonObject({{"host", jsonQuoted(host.toStdString())},
+                                 {"port", std::to_string(port)},
+                                 {"error", jsonQuoted(bindError.toStdString())},
+                                 {"previousHost", jsonQuoted(previousAddress.toString().toStdString())},
+                                 {"previousPort", std::to_string(previousPort)},
+                                 {"restoreError", jsonQuoted(restoreError.toStdString())}}));
+            if (errorString) {
+                *errorString = QStringLiteral("Cannot listen on %1:%2 (%3), and listening on %4:%5 again failed "
+                                              "(%6): the transport is no longer accepting connections")
+                                   .arg(host)
+                                   .arg(port)
+                                   .arg(bindError)
+                                   .arg(previousAddress.toString())
+                                   .arg(previousPort)
+                                   .arg(restoreError);
+            }
+        }
+    }
+    m_server = previous;
+    return false;
+}
+
+bool WsTransport::moveMetricsEndpoint(const QJsonObject &config, QString *errorString)
+{
+    // A scrape missed while the endpoint moves costs nothing, so the old one
+    // simply goes first; it comes back if the new one cannot bind.
+    delete m_metricsEndpoint;
+    m_metricsEndpoint = nullptr;
+    if (startMetricsEndpoint(config, errorString))
+        return true;
+    QString ignored;
+    startMetricsEndpoint(m_config, &ignored);
+    return false;
+}
+
+void WsTransport::applySyncWorkers(int syncWorkers)
+{
+    m_syncWorkers = syncWorkers;
+    // Down to none, the pool stays until stop: a connection with commands
+    // queued runs the rest of them in order on this thread, and what is still
+    // out on a worker comes back as usual.
+    if (syncWorkers == 0)
+        return;
+    if (!m_syncPool) {
+        m_syncPool = new QThreadPool(this);
+        m_syncPool->setObjectName(QStringLiteral("phi-ws-sync"));
+        m_syncMetrics = std::make_unique<SyncDispatchMetrics>();
+    }
+    m_syncPool->setMaxThreadCount(syncWorkers);
+}
+
+ShardSettings WsTransport::shardSettings(const QJsonObject &config) const
+{
+    ShardSettings settings;
+    // UI clients request the protocol string "phi-core-ws.v1". Without an
+    // agreed subprotocol, browser WebSocket clients reject the handshake.
+    // Qt picks the first entry of this list that the client offered. CBOR comes
+    // first: a client that offers it has a decoder for it, which is more than
+    // an offer of compression says. A client offering deflate and the plain
+    // protocol gets compression when it is enabled.
+    settings.subprotocols.append(QString::fromLatin1(kSubprotocolCbor));
+    settings.compression = compressionFromConfig(config);
+    if (settings.compression.enabled)
+        settings.subprotocols.append(QString::fromLatin1(kSubprotocolDeflate));
+    settings.subprotocols.append(QString::fromLatin1(kSubprotocolJson));
+    settings.allowedOrigins = allowedOriginsFromConfig(config);
+    settings.outbound = outboundLimitsFromConfig(config);
+    settings.inbound = inboundLimitsFromConfig(config);
+    settings.eventBatch = eventBatchFromConfig(config);
+    settings.replay = replayFromConfig(config);
+    settings.stateCache = stateCacheFromConfig(config);
+    settings.fragmentation = fragmentationFromConfig(config);
+    settings.tls = m_tlsContext;
+    settings.admission = m_admission;
+    return settings;
+}
+
+void WsTransport::startShards(const QJsonObject &config)
+{
+    // New with every start, so nothing counted against the last run's sockets
+    // carries over; those are gone with their shards.
+    m_admission = std::make_shared<ConnectionAdmission>(admissionFromConfig(config));
+    const ShardSettings settings = shardSettings(config);
+    m_replayEnabled = settings.replay.maxEvents > 0;
+    m_stateCacheEnabled = settings.stateCache.maxChannels > 0;
+    m_nextEventSeq = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch() * kEventSeqPerMs);
+
+    ++m_epoch;
+    m_nextShard = 0;
+    const int ioThreads = ioThreadsFromConfig(config);
+    if (ioThreads == 0) {
+        // One shard on this thread: every call into it below is a direct call,
+        // and the transport behaves as it did before there were shards.
+        auto *shard = new WsShard(0, m_epoch, settings, this);
+        shard->open();
+        m_shards.append(shard);
+        return;
+    }
+
+    for (int i = 0; i < ioThreads; ++i) {
+        auto *thread = new QThread;
+        thread->setObjectName(QStringLiteral("phi-ws-io-%1").arg(i));
+        auto *shard = new WsShard(i, m_epoch, settings, this);
+        shard->moveToThread(thread);
+        connect(thread, &QThread::finished, shard, &QObject::deleteLater);
+        thread->start();
+        QMetaObject::invokeMethod(shard, &WsShard::open, Qt::QueuedConnection);
+        m_shards.append(shard);
+        m_shardThreads.append(thread);
+    }
+}
+
+void WsTransport::stopShards()
+{
+    for (WsShard *shard : std::as_const(m_shards)) {
+        // Blocking across threads, so no socket outlives stop(); a shard on this
+        // thread is simply called.
+        const Qt::ConnectionType type =
+            shard->thread() == thread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+        QMetaObject::invokeMethod(shard, &WsShard::closeAll, type);
+        if (m_shardThreads.isEmpty())
+            shard->deleteLater();
+    }
+    for (QThread *thread : std::as_const(m_shardThreads)) {
+        thread->quit();
+        thread->wait();
+        delete thread;
+    }
+    m_shardThreads.clear();
+    m_shards.clear();
+}
+
+void WsTransport::dispatchConnection(qintptr socketDescriptor)
+{
+    // Admitted or refused on the bare descriptor: a refused connection costs
+    // an accept, a getpeername and a close, and is reset rather than read from.
+    std::string peerKey;
+    if (!m_admission || !peerKeyOf(socketDescriptor, &peerKey)) {
+        refuseSocket(socketDescriptor);
+        return;
+    }
+    if (m_admission->admit(peerKey) != ConnectionAdmission::Verdict::Admitted) {
+        refuseSocket(socketDescriptor);
+        return;
+    }
+    countAccept();
+
+    // Fewest connections first; ties go round-robin, so a burst of connects on
+    // an idle transport still spreads across the shards.
+    WsShard *target = nullptr;
+    for (int i = 0; i < m_shards.size(); ++i) {
+        WsShard *shard = m_shards.at((m_nextShard + i) % m_shards.size());
+        if (!target || shard->connectionCount() < target->connectionCount())
+            target = shard;
+    }
+    if (!target) {
+        m_admission->finishHandshake();
+        m_admission->release(peerKey);
+        refuseSocket(socketDescriptor);
+        return;
+    }
+    m_nextShard = (target->index() + 1) % m_shards.size();
+    QMetaObject::invokeMethod(target, [target, socketDescriptor, peerKey = std::move(peerKey)]() {
+        target->adoptConnection(socketDescriptor, peerKey);
+    });
+}
+
+int WsTransport::totalConnections() const
+{
+    int total = 0;
+    for (const WsShard *shard : m_shards)
+        total += shard->connectionCount();
+    return total;
+}
+
+void WsTransport::countAccept()
+{
+    ++m_accepted;
+    // By whole second of uptime: coarse, and enough to tell a reconnect storm
+    // from reconnects spread over a drain window.
+    const qint64 second = m_uptime.elapsed() / 1000;
+    if (second != m_acceptSecond) {
+        m_acceptSecond = second;
+        m_acceptsThisSecond = 0;
+    }
+    m_acceptPeakPerSec = std::max(m_acceptPeakPerSec, ++m_acceptsThisSecond);
+}
+
+bool WsTransport::drain()
+{
+    if (!m_running || m_draining)
+        return false;
+    m_draining = true;
+    m_drainPlan = drainFromConfig(m_config);
+    m_drainPlan.shards.waves = std::max(1, m_drainPlan.shards.waves);
+    m_drainPhase = DrainPhase::Grace;
+    m_drainNextWave = 0;
+    m_drainUnanswered = 0;
+    m_drainElapsed.start();
+    m_drainPhaseClock.start();
+    // Nothing new is accepted; what is open stays until its wave.
+    if (m_server)
+        m_server->close();
+    const int connections = totalConnections();
+    for (WsShard *shard : std::as_const(m_shards)) {
+        QMetaObject::invokeMethod(shard, [shard, settings = m_drainPlan.shards]() { shard->beginDrain(settings); });
+    }
+    writeLog(LogLevel::Info,
+             makeCategory(LogCategory::Transport),
+             "WS transport draining %1 connections; reconnects spread over %2 ms",
+             {Scalar{static_cast<std::int64_t>(connections)},
+              Scalar{static_cast<std::int64_t>(m_drainPlan.shards.reconnectWindowMs)}},
+             "ws.drain",
+             jsonObject({{"connections", std::to_string(connections)},
+                         {"reconnectWindowMs", std::to_string(m_drainPlan.shards.reconnectWindowMs)},
+                         {"graceMs", std::to_string(m_drainPlan.graceMs)},
+                         {"closeWindowMs", std::to_string(m_drainPlan.closeWindowMs)},
+                         {"waves", std::to_string(m_drainPlan.shards.waves)}}));
+
+    if (!m_drainTimer) {
+        m_drainTimer = new QTimer(this);
+        m_drainTimer->setSingleShot(true);
+        connect(m_drainTimer, &QTimer::timeout, this, &WsTransport::stepDrain);
+    }
+    m_drainTimer->start(0);
+    return true;
+}
+
+void WsTransport::stepDrain()
+{
+    switch (m_drainPhase) {
+    case DrainPhase::Grace:
+        // Commands already at core get the grace period to be answered; the
+        // shards refuse anything new meanwhile.
+        if ((!m_pendingCommands.isEmpty() || !m_commandQueues.isEmpty())
+            && m_drainPhaseClock.elapsed() < m_drainPlan.graceMs) {
+            m_drainTimer->start(kDrainPollMs);
             return;
-        const QString origin = authenticator->origin().trimmed();
-        if (origin.isEmpty()) {
-            // No Origin header: not a browser. Command-line clients and services
-            // are unaffected by this check.
-            authenticator->setAllowed(true);
+        }
+        m_drainUnanswered = m_pendingCommands.size();
+        m_drainPhase = DrainPhase::Waves;
+        [[fallthrough]];
+    case DrainPhase::Waves:
+        // The waves follow the delays clients were told, shortest first, so one
+        // that ignores the notice still comes back about when it was meant to.
+        if (m_drainNextWave < m_drainPlan.shards.waves) {
+            const int wave = m_drainNextWave++;
+            for (WsShard *shard : std::as_const(m_shards))
+                QMetaObject::invokeMethod(shard, [shard, wave]() { shard->closeDrainWave(wave); });
+            m_drainTimer->start(static_cast<int>(m_drainPlan.closeWindowMs / m_drainPlan.shards.waves));
+            return;
+        }
+        m_drainPhase = DrainPhase::Flush;
+        m_drainPhaseClock.restart();
+        [[fallthrough]];
+    case DrainPhase::Flush: {
+        // Connections the waves passed over while frames were still queued
+        // for them close as those are written, up to the deadline.
+        std::int64_t open = 0;
+        for (const WsShard *shard : std::as_const(m_shards))
+            open += shard->metrics().drainOpen.load(std::memory_order_relaxed);
+        if (open > 0 && m_drainPhaseClock.elapsed() < kDrainFlushTimeoutMs) {
+            m_drainTimer->start(kDrainPollMs);
             return;
         }
-        if (isLoopbackOrigin(origin) || m_allowedOrigins.contains(origin, Qt::CaseInsensitive)) {
-            authenticator->setAllowed(true);
+        // Blocking across threads, like stopShards(), so the hard closes are
+        // all counted by the time the drain reports them.
+        for (WsShard *shard : std::as_const(m_shards)) {
+            const Qt::ConnectionType type =
+                shard->thread() == thread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+            QMetaObject::invokeMethod(shard, &WsShard::closeDrainLeftovers, type);
+        }
+        // One more poll for the close frames to go out.
+        m_drainPhase = DrainPhase::Leftovers;
+        m_drainTimer->start(kDrainPollMs);
+        return;
+    }
+    case DrainPhase::Leftovers:
+        break;
+    }
+
+    endDrain(false);
+}
+
+void WsTransport::endDrain(bool cutShort)
+{
+    // Before the grace period ran out, nothing was counted as unanswered yet.
+    if (cutShort && m_drainPhase == DrainPhase::Grace)
+        m_drainUnanswered = m_pendingCommands.size();
+    const qint64 elapsedMs = m_drainElapsed.elapsed();
+    const int connectionsLeft = totalConnections();
+    std::uint64_t hardClosed = 0;
+    for (const WsShard *shard : std::as_const(m_shards))
+        hardClosed += shard->metrics().drainHardClosed.load(std::memory_order_relaxed);
+    writeLog(cutShort ? LogLevel::Warn : LogLevel::Info,
+             makeCategory(LogCategory::Transport),
+             "WS transport drained in %1 ms%2; %3 connections left, %4 commands unanswered, %5 hard-closed",
+             {Scalar{static_cast<std::int64_t>(elapsedMs)},
+              Scalar{std::string(cutShort ? " (cut short)" : "")},
+              Scalar{static_cast<std::int64_t>(connectionsLeft)},
+              Scalar{static_cast<std::int64_t>(m_drainUnanswered)},
+              Scalar{static_cast<std::int64_t>(hardClosed)}},
+             "ws.drained",
+             jsonObject({{"elapsedMs", std::to_string(elapsedMs)},
+                         {"cutShort", cutShort ? "true" : "false"},
+                         {"connectionsLeft", std::to_string(connectionsLeft)},
+                         {"unansweredCommands", std::to_string(m_drainUnanswered)},
+                         {"hardClosed", std::to_string(hardClosed)}}));
+    shutdown();
+    emit drained();
+}
+
+void WsTransport::submitCommand(ShardCommand command)
+{
+    QMetaObject::invokeMethod(this, [this, command = std::move(command)]() {
+        if (command.epoch != m_epoch)
+            return;
+        if (!m_syncPool) {
+            handleCommand(command);
+            return;
+        }
+        std::vector<ShardCommand> commands;
+        commands.push_back(command);
+        queueCommands(0, std::move(commands));
+    });
+}
+
+void WsTransport::submitBatch(quint64 batchId, std::vector<ShardCommand> commands)
+{
+    QMetaObject::invokeMethod(this, [this, batchId, commands = std::move(commands)]() mutable {
+        if (commands.empty() || commands.front().epoch != m_epoch)
+            return;
+        if (!m_syncPool) {
+            handleBatch(batchId, commands);
             return;
         }
-        authenticator->setAllowed(false);
+        queueCommands(batchId, std::move(commands));
+    });
+}
+
+void WsTransport::connectionClosed(int shard, quint64 epoch, quint64 connectionId)
+{
+    QMetaObject::invokeMethod(this, [this, shard, epoch, connectionId]() {
+        if (epoch != m_epoch)
+            return;
+        const QSet<CmdId> pending = m_pendingByConnection.take(ConnectionKey(shard, connectionId));
+        for (const CmdId cmdId : pending)
+            m_pendingCommands.remove(cmdId);
+        // A command still on a worker comes back to no queue and is dropped.
+        m_commandQueues.remove(ConnectionKey(shard, connectionId));
+    });
+}
+
+void WsTransport::logClientConnected(const QString &peerAddress, int peerPort)
+{
+    QMetaObject::invokeMethod(this, [this, peerAddress, peerPort]() {
+        const std::string peerText = peerAddress.toStdString();
+        const int clientCount = totalConnections();
+        writeLog(LogLevel::Info,
+                 makeCategory(LogCategory::Transport),
+                 "WS client connected: %1:%2 total=%3",
+                 {Scalar{peerText},
+                  Scalar{static_cast<std::int64_t>(peerPort)},
+                  Scalar{static_cast<std::int64_t>(clientCount)}},
+                 "ws.clientConnected",
+                 jsonObject({{"peerAddress", jsonQuoted(peerText)},
+                             {"peerPort", std::to_string(peerPort)},
+                             {"clientCount", std::to_string(clientCount)}}));
+    });
+}
+
+void WsTransport::logClientDisconnected(const QString &peerAddress, int peerPort)
+{
+    QMetaObject::invokeMethod(this, [this, peerAddress, peerPort]() {
+        const std::string peerText = peerAddress.toStdString();
+        const int clientCount = totalConnections();
+        writeLog(LogLevel::Info,
+                 makeCategory(LogCategory::Transport),
+                 "WS client disconnected: %1:%2 total=%3",
+                 {Scalar{peerText},
+                  Scalar{static_cast<std::int64_t>(peerPort)},
+                  Scalar{static_cast<std::int64_t>(clientCount)}},
+                 "ws.clientDisconnected",
+                 jsonObject({{"peerAddress", jsonQuoted(peerText)},
+                             {"peerPort", std::to_string(peerPort)},
+                             {"clientCount", std::to_string(clientCount)}}));
+    });
+}
+
+void WsTransport::logOriginRefused(const QString &origin)
+{
+    QMetaObject::invokeMethod(this, [this, origin]() {
         const std::string originText = origin.toStdString();
         writeLog(LogLevel::Warn,
                  makeCategory(LogCategory::Security, true),
@@ -513,158 +1690,360 @@ bool WsTransport::startServer(const QString &host, quint16 port, QString *errorS
                  "ws.originRefused",
                  jsonObject({{"origin", jsonQuoted(originText)}}));
     });
-
-    connect(server, &QWebSocketServer::newConnection,
-            this, &WsTransport::onNewConnection);
-
-    m_server = server;
-    return true;
 }
 
-void WsTransport::dropIdleSessions()
+void WsTransport::logIdleTimeout(const QString &clientId, qint64 idleSec)
 {
-    const qint64 nowMs = QDateTime::currentMSecsSinceEpoch();
-    QList<QWebSocket *> expired;
-    for (auto it = m_sessions.constBegin(); it != m_sessions.constEnd(); ++it) {
-        if (it->idleBudgetMs <= 0)
-            continue;
-        if (nowMs - it->lastActivityMs > it->idleBudgetMs)
-            expired.append(it.key());
-    }
-
-    for (QWebSocket *socket : expired) {
-        const ClientSession session = m_sessions.take(socket);
-        if (!socket)
-            continue;
-        const std::string clientIdText = session.clientId.toStdString();
-        const std::int64_t idleSec = (nowMs - session.lastActivityMs) / 1000;
+    QMetaObject::invokeMethod(this, [this, clientId, idleSec]() {
+        const std::string clientIdText = clientId.toStdString();
         writeLog(LogLevel::Info,
                  makeCategory(LogCategory::Security),
                  "Closing an idle connection after %1 s without a call (client '%2')",
-                 {Scalar{idleSec}, Scalar{clientIdText}},
+                 {Scalar{static_cast<std::int64_t>(idleSec)}, Scalar{clientIdText}},
                  "ws.idleTimeout",
                  jsonObject({{"idleSec", std::to_string(idleSec)},
                              {"clientId", jsonQuoted(clientIdText)}}));
-        // Core drops the token on the same clock; this closes the pipe that
-        // would otherwise keep pushing events at a session nobody is watching.
-        socket->close(QWebSocketProtocol::CloseCodeNormal,
-                      QStringLiteral("Session idle timeout"));
-    }
+    });
 }
 
-void WsTransport::closeAllClients()
+void WsTransport::logSlowConsumer(const QString &peerAddress,
+                                  qint64 backlogBytes,
+                                  qint64 queuedFrames,
+                                  quint64 coalescedFrames)
 {
-    const QList<QWebSocket *> clients = m_clients.values();
-    for (QWebSocket *client : clients) {
-        if (!client)
-            continue;
-        client->close();
-        client->deleteLater();
-    }
-    m_clients.clear();
+    QMetaObject::invokeMethod(this, [this, peerAddress, backlogBytes, queuedFrames, coalescedFrames]() {
+        const std::string peerText = peerAddress.toStdString();
+        writeLog(LogLevel::Warn,
+                 makeCategory(LogCategory::Transport),
+                 "Dropping slow WS client %1: %2 bytes in %3 frames not written",
+                 {Scalar{peerText},
+                  Scalar{static_cast<std::int64_t>(backlogBytes)},
+                  Scalar{static_cast<std::int64_t>(queuedFrames)}},
+                 "ws.slowConsumer",
+                 jsonObject({{"peerAddress", jsonQuoted(peerText)},
+                             {"backlogBytes", std::to_string(backlogBytes)},
+                             {"queuedFrames", std::to_string(queuedFrames)},
+                             {"coalescedFrames", std::to_string(coalescedFrames)}}));
+    });
 }
 
-void WsTransport::send(QWebSocket *socket,
-                       std::string_view type,
-                       std::string_view topic,
-                       std::optional<CmdId> cid,
-                       std::string_view payloadJson) const
+WsTransport::RoutedCommand WsTransport::routeCommand(const std::string &topic,
+                                                     std::string_view payloadJson,
+                                                     const CallerIdentity &caller)
 {
-    if (!socket || socket->state() != QAbstractSocket::ConnectedState)
+    // Routing is the protocol's decision, made once in TransportPluginBase, and
+    // so is the envelope each outcome is answered with.
+    //
+    // With syncWorkers this runs on pool threads, several at once, for
+    // different connections. dispatchCommand keeps nothing of its own between
+    // calls and hands sync topics to callCoreSync. That is safe because core
+    // accepts callCoreSync from any thread, which is what syncWorkers requires
+    // of it (README). Only sync topics get here off the transport thread:
+    // cmd.* calls and callCoreAsync stay on it.
+    const CommandOutcome outcome = dispatchCommand(topic, payloadJson, caller);
+    RoutedCommand routed;
+    const auto [type, envelopeTopic] = envelopeFor(outcome.kind);
+    routed.envelopeType.assign(type);
+    routed.envelopeTopic.assign(envelopeTopic);
+    routed.payloadJson = outcome.payloadJson;
+    routed.asyncCmdId = outcome.cmdId;
+    return routed;
+}
+
+void WsTransport::handleCommand(const ShardCommand &command)
+{
+    ShardCommandResult result = runCommand(command);
+    if (command.shard < 0 || command.shard >= m_shards.size())
         return;
+    WsShard *shard = m_shards.at(command.shard);
+    QMetaObject::invokeMethod(shard, [shard, result = std::move(result)]() {
+        shard->completeCommand(result);
+    });
+}
 
-    // The envelope shape comes from the shared header; the payload is spliced as
-    // text, so an event that core serialized once travels straight to the wire.
-    const JsonText out = makeEnvelope(type, topic, cid, payloadJson);
-    socket->sendTextMessage(QString::fromUtf8(out.data(), static_cast<qsizetype>(out.size())));
+void WsTransport::handleBatch(quint64 batchId, const std::vector<ShardCommand> &commands)
+{
+    // One pass, one hop back: the shard answers the whole batch in one frame
+    // anyway, so nothing is gained by sending the answers back one at a time.
+    const ShardCommand &first = commands.front();
+    std::vector<ShardCommandResult> results;
+    results.reserve(commands.size());
+    for (const ShardCommand &command : commands)
+        results.push_back(runCommand(command));
+    if (first.shard < 0 || first.shard >= m_shards.size())
+        return;
+    WsShard *shard = m_shards.at(first.shard);
+    QMetaObject::invokeMethod(shard, [shard, connectionId = first.connectionId, batchId, results = std::move(results)]() {
+        shard->completeBatch(connectionId, batchId, results);
+    });
 }
 
-void WsTransport::sendProtocolError(QWebSocket *socket,
-                                    std::optional<CmdId> cid,
-                                    std::string_view code,
-                                    std::string_view message) const
+ShardCommandResult WsTransport::runCommand(const ShardCommand &command)
 {
-    send(socket, kEnvelopeTypeError, kTopicProtocolError, cid, makeProtocolErrorPayload(code, message));
+    ShardCommandResult result;
+    if (answerCommand(command, &result))
+        return result;
+    return finishCommand(command,
+                         routeCommand(command.topic.toUtf8().toStdString(), command.payloadJson, callerOf(command)));
 }
 
-void WsTransport::sendCmdResponse(QWebSocket *socket,
-                                  CmdId cid,
-                                  const QString &cmdTopic,
-                                  std::string_view payloadJson) const
+ShardCommandResult WsTransport::resultFor(const ShardCommand &command)
 {
-    // The only outbound path that parses: it adds `error: null` *if absent*, and
-    // deciding that from raw text would be a substring guess. Command responses are
-    // user-driven, so one parse here is the cheap side of the trade.
-    QJsonObject out =
-        QJsonDocument::fromJson(QByteArray::fromRawData(payloadJson.data(),
-                                                       static_cast<qsizetype>(payloadJson.size())))
-            .object();
-    out.insert(QStringLiteral("cmd"), cmdTopic);
-    if (!out.contains(QStringLiteral("error")))
-        out.insert(QStringLiteral("error"), QJsonValue::Null);
-    const QByteArray bytes = QJsonDocument(out).toJson(QJsonDocument::Compact);
-    send(socket,
-         kEnvelopeTypeResponse,
-         kTopicCmdResponse,
-         cid,
-         std::string_view(bytes.constData(), static_cast<std::size_t>(bytes.size())));
+    ShardCommandResult result;
+    result.connectionId = command.connectionId;
+    result.cid = command.cid;
+    result.topic = command.topic;
+    result.requestClientId = command.requestClientId;
+    result.requestAuthToken = command.requestAuthToken;
+    result.receivedNs = command.receivedNs;
+    return result;
 }
 
-void WsTransport::broadcastEvent(std::string_view topic, std::string_view payloadJson) const
+bool WsTransport::answerCommand(const ShardCommand &command, ShardCommandResult *result)
 {
-    // No cid on events; otherwise the same envelope as everything else.
-    //
-    // Events carry live state - channel values, adapter status - so they go only
-    // to sockets that logged in. Otherwise anything that can open a connection
-    // would read the house without ever authenticating, which is the same leak
-    // the command gate closes (F-42).
-    for (QWebSocket *client : m_clients) {
-        if (m_sessions.value(client).token.isEmpty())
-            continue;
-        send(client, kEnvelopeTypeEvent, topic, std::nullopt, payloadJson);
+    *result = resultFor(command);
+
+    // Answered here from the counters. Behind the session gate like any other
+    // non-handshake topic: the shard only lets it through once the connection
+    // has logged in.
+    if (command.topic == kTopicTransportStats) {
+        result->envelopeType.assign(kEnvelopeTypeResponse);
+        result->envelopeTopic.assign(kTopicSyncResponse);
+        result->payloadJson = metricsToJson(metricsSnapshot());
+        ++m_syncCommands;
+        return true;
+    }
+
+    // Every command core takes asynchronously is held here until it answers,
+    // so a connection may only have so many out at once. Refused before core
+    // sees it: whether it would have gone async is only known afterwards.
+    if (command.topic.startsWith(QLatin1String("cmd."))) {
+        const auto pending = m_pendingByConnection.constFind(ConnectionKey(command.shard, command.connectionId));
+        if (pending != m_pendingByConnection.constEnd() && pending->size() >= m_maxPendingCommands) {
+            result->errorCode.assign(kErrorCodeTooManyPending);
+            result->errorMessage = "Too many commands waiting for an answer; wait for one to finish.";
+            return true;
+        }
     }
+    return false;
 }
 
-void WsTransport::handleCommand(QWebSocket *socket,
-                                CmdId cid,
-                                const QString &topic,
-                                const QString &requestClientId,
-                                const QString &requestAuthToken,
-                                std::string_view payloadJson)
+CallerIdentity WsTransport::callerOf(const ShardCommand &command)
 {
-    // Routing is the protocol's decision, made once in TransportPluginBase. What
-    // is left here is what only this transport knows: which client asked, and how
-    // to frame the answer.
-    //
-    // The identity comes from the connection, not from the frame: a client cannot
-    // hand itself a session by putting a token in a payload (F-42, F-60).
-    const ClientSession session = m_sessions.value(socket);
-    const std::string sessionToken = session.token.toStdString();
-    const std::string sessionClientId = session.clientId.toStdString();
+    // What is left here is what only this transport knows: which client asked,
+    // and where the answer goes. The shard already read the caller off the
+    // connection.
     CallerIdentity caller;
-    if (!sessionToken.empty()) {
+    if (!command.sessionToken.empty()) {
         caller.kind = CallerIdentity::Kind::Session;
-        caller.sessionToken = sessionToken;
-        caller.clientId = sessionClientId;
+        caller.sessionToken = command.sessionToken;
+        caller.clientId = command.sessionClientId;
     }
-    const CommandOutcome outcome = dispatchCommand(topic.toUtf8().toStdString(), payloadJson, caller);
-
-    // A login, a bootstrap or a hello that core accepted establishes the session
-    // this connection speaks with from now on.
-    trackAuthOutcome(socket, topic, requestClientId, requestAuthToken, outcome.payloadJson);
+    return caller;
+}
 
-    if (outcome.cmdId > 0) {
+ShardCommandResult WsTransport::finishCommand(const ShardCommand &command, RoutedCommand routed)
+{
+    if (routed.asyncCmdId > 0) {
         // Core took the command and answers later; the client waits under that id
         // until onCoreAsyncResult arrives.
         PendingCommand pending;
-        pending.socket = socket;
-        pending.cid = cid;
-        pending.cmdTopic = topic;
-        m_pendingCommands.insert(outcome.cmdId, pending);
+        pending.shard = command.shard;
+        pending.epoch = command.epoch;
+        pending.connectionId = command.connectionId;
+        pending.cid = command.cid;
+        pending.cmdTopic = command.topic;
+        pending.receivedNs = command.receivedNs;
+        pending.ticket = m_nextPendingTicket++;
+        m_pendingCommands.insert(routed.asyncCmdId, pending);
+        m_pendingByConnection[ConnectionKey(command.shard, command.connectionId)].insert(routed.asyncCmdId);
+        if (m_commandTimeoutMs > 0) {
+            m_commandDeadlines.schedule(routed.asyncCmdId,
+                                        pending.ticket,
+                                        command.receivedNs / 1000000 + m_commandTimeoutMs);
+            if (!m_commandTimer->isActive())
+                m_commandTimer->start();
+        }
+        ++m_asyncCommands;
+    } else {
+        ++m_syncCommands;
     }
 
-    const auto [type, envelopeTopic] = envelopeFor(outcome.kind);
-    send(socket, type, envelopeTopic, cid, outcome.payloadJson);
+    ShardCommandResult result = resultFor(command);
+    result.envelopeType = std::move(routed.envelopeType);
+    result.envelopeTopic = std::move(routed.envelopeTopic);
+    result.payloadJson = std::move(routed.payloadJson);
+    return result;
+}
+
+void WsTransport::queueCommands(quint64 batchId, std::vector<ShardCommand> commands)
+{
+    const ShardCommand &first = commands.front();
+    const ConnectionKey connection(first.shard, first.connectionId);
+    // Nothing to wait for and nothing for a worker: answered as without them.
+    if (!m_commandQueues.contains(connection)
+        && (m_syncWorkers == 0 || std::none_of(commands.begin(), commands.end(), [](const ShardCommand &command) {
+               return runsOnWorker(command.topic);
+           }))) {
+        if (batchId == 0)
+            handleCommand(first);
+        else
+            handleBatch(batchId, commands);
+        return;
+    }
+    CommandQueue &queue = m_commandQueues[connection];
+    CommandJob job;
+    job.batchId = batchId;
+    // Refused in place rather than answered now, so the refusal still comes
+    // after the answers to what the connection sent before.
+    job.refused = queue.queuedCommands + commands.size() > kMaxQueuedCommands;
+    if (job.refused) {
+        for (ShardCommand &command : commands) {
+            command.payloadJson = {};
+            command.frame.clear();
+        }
+    } else {
+        queue.queuedCommands += commands.size();
+    }
+    job.commands = std::move(commands);
+    queue.jobs.push_back(std::move(job));
+    if (queue.jobs.size() == 1)
+        pumpCommands(connection);
+}
+
+void WsTransport::pumpCommands(const ConnectionKey &connection)
+{
+    // Strictly one command at a time per connection, in the order it sent
+    // them: the shard applies every answer as it arrives (a login, a logout),
+    // and a later command may depend on what an earlier one did in core.
+    // Only sync topics go to a worker; the rest are quick and are answered here.
+    const auto queueIt = m_commandQueues.find(connection);
+    while (queueIt != m_commandQueues.end()) {
+        CommandQueue &queue = *queueIt;
+        CommandJob &job = queue.jobs.front();
+        while (job.results.size() < job.commands.size()) {
+            const ShardCommand &command = job.commands[job.results.size()];
+            ShardCommandResult result;
+            if (job.refused) {
+                result = resultFor(command);
+                result.errorCode.assign(kErrorCodeTooManyPending);
+                result.errorMessage = "Too many commands waiting to run; wait for the answers.";
+            } else if (!answerCommand(command, &result)) {
+                if (m_syncWorkers > 0 && runsOnWorker(command.topic)) {
+                    runOnWorker(connection, command);
+                    return;
+                }
+                result = finishCommand(command, routeCommand(command.topic.toUtf8().toStdString(),
+                                                             command.payloadJson,
+                                                             callerOf(command)));
+            }
+            job.results.push_back(std::move(result));
+        }
+        CommandJob done = std::move(job);
+        queue.jobs.pop_front();
+        if (!done.refused)
+            queue.queuedCommands -= done.commands.size();
+        if (queue.jobs.empty()) {
+            m_commandQueues.erase(queueIt);
+            deliverCommands(done);
+            return;
+        }
+        deliverCommands(done);
+    }
+}
+
+void WsTransport::runOnWorker(const ConnectionKey &connection, const ShardCommand &command)
+{
+    const quint64 ticket = m_nextWorkerTicket++;
+    m_commandQueues[connection].workerTicket = ticket;
+    const qint64 queuedNs = steadyNowNs();
+    m_syncPool->start([this, connection, ticket, command, queuedNs]() {
+        const qint64 startedNs = steadyNowNs();
+        m_syncMetrics->queueWait.record((startedNs - queuedNs) / 1000);
+        RoutedCommand routed =
+            routeCommand(command.topic.toUtf8().toStdString(), command.payloadJson, callerOf(command));
+        m_syncMetrics->run.record((steadyNowNs() - startedNs) / 1000);
+        QMetaObject::invokeMethod(this, [this, connection, ticket, routed = std::move(routed)]() mutable {
+            const auto queue = m_commandQueues.find(connection);
+            if (queue == m_commandQueues.end() || queue->workerTicket != ticket)
+                return;
+            queue->workerTicket = 0;
+            CommandJob &job = queue->jobs.front();
+            job.results.push_back(finishCommand(job.commands[job.results.size()], std::move(routed)));
+            pumpCommands(connection);
+        });
+    });
+}
+
+void WsTransport::deliverCommands(CommandJob &job)
+{
+    const ShardCommand &first = job.commands.front();
+    if (first.epoch != m_epoch || first.shard < 0 || first.shard >= m_shards.size())
+        return;
+    WsShard *shard = m_shards.at(first.shard);
+    if (job.batchId == 0) {
+        QMetaObject::invokeMethod(shard, [shard, result = std::move(job.results.front())]() {
+            shard->completeCommand(result);
+        });
+        return;
+    }
+    QMetaObject::invokeMethod(shard,
+                              [shard, connectionId = first.connectionId, batchId = job.batchId,
+                               results = std::move(job.results)]() {
+                                  shard->completeBatch(connectionId, batchId, results);
+                              });
+}
+
+WsTransport::PendingCommand WsTransport::takePendingCommand(QHash<CmdId, PendingCommand>::iterator it)
+{
+    const CmdId cmdId = it.key();
+    const PendingCommand pending = it.value();
+    m_pendingCommands.erase(it);
+    const auto index = m_pendingByConnection.find(ConnectionKey(pending.shard, pending.connectionId));
+    if (index != m_pendingByConnection.end()) {
+        index->remove(cmdId);
+        if (index->isEmpty())
+            m_pendingByConnection.erase(index);
+    }
+    return pending;
+}
+
+void WsTransport::expireCommands()
+{
+    // The same steady clock the shards stamp frames with.
+    const qint64 nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count();
+    QList<PendingCommand> expired;
+    m_commandDeadlines.advance(nowMs, [&](quint64 cmdId, quint64 ticket) -> qint64 {
+        const auto it = m_pendingCommands.find(cmdId);
+        if (it == m_pendingCommands.end() || it->ticket != ticket)
+            return 0;
+        // Reconfigured to wait indefinitely since this deadline was set.
+        if (m_commandTimeoutMs <= 0)
+            return 0;
+        const qint64 deadlineMs = it->receivedNs / 1000000 + m_commandTimeoutMs;
+        if (deadlineMs > nowMs)
+            return deadlineMs;
+        expired.append(takePendingCommand(it));
+        return 0;
+    });
+    if (m_commandDeadlines.isEmpty())
+        m_commandTimer->stop();
+
+    // Core may still answer; onCoreAsyncResult no longer knows the id and drops
+    // it, so the client hears exactly once either way.
+    for (const PendingCommand &pending : std::as_const(expired)) {
+        if (pending.epoch != m_epoch || pending.shard < 0 || pending.shard >= m_shards.size())
+            continue;
+        WsShard *shard = m_shards.at(pending.shard);
+        QMetaObject::invokeMethod(shard, [shard, pending]() {
+            shard->failCommand(pending.connectionId,
+                               pending.cid,
+                               std::string(kErrorCodeCommandTimeout),
+                               "Core did not answer this command in time.");
+        });
+    }
 }
 
 } // namespace phicore::transport::ws
@@ -1,127 +1,347 @@
 #pragma once
 
+#include <QElapsedTimer>
 #include <QJsonObject>
 #include <QHash>
+#include <QList>
 #include <QObject>
-#include <QPointer>
-#include <QSet>
 #include <QString>
-#include <QTimer>
 #include <QStringList>
-#include <QJsonValue>
 
+#include <QSet>
+
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include <transportinterface.h>
 
+#include "admission.h"
+#include "idlewheel.h"
+#include "mpscqueue.h"
+#include "wsshard.h"
+
 class QHostAddress;
-class QWebSocket;
-class QWebSocketServer;
+class QThread;
+class QThreadPool;
+class QTcpServer;
+class QTimer;
 
 namespace phicore::transport::ws {
 
+class MetricsEndpoint;
+
 // QObject first, as Qt requires for multiple inheritance. The transport
 // contract itself is Qt-free; this plugin uses Qt for its own I/O, which is its
 // business rather than the contract's.
-class WsTransport final : public QObject, public TransportPluginBase
+//
+// The transport owns what is shared: the listening socket, the link to core and
+// the commands core still owes an answer. Connections themselves live in shards
+// (wsshard.h), each on its own I/O thread when `ioThreads` asks for them.
+//
+// Not final: bench_transport stands in for core by overriding routeCommand().
+class WsTransport : public QObject, public TransportPluginBase, private ShardHost
 {
     Q_OBJECT
 
 public:
     explicit WsTransport(QObject *parent = nullptr);
+    ~WsTransport() override;
 
     std::string pluginType() const override;
     std::string displayName() const override;
     std::string description() const override;
 
     bool start(std::string_view configJson, std::string *errorString) override;
+    /// With a drain object in the config, starts drain() and returns at once;
+    /// the transport finishes stopping on its thread's event loop. Otherwise,
+    /// and on a second stop() while it drains, closes every connection at once.
     void stop() override;
+    /// Stops accepting, tells every client when to reconnect, gives pending
+    /// commands the grace period and closes connections in waves, on timers;
+    /// then stops the transport and emits drained(). Returns at once, false
+    /// when not running or already draining. The config's drain object sets
+    /// the timings; without one the defaults apply.
+    Q_INVOKABLE bool drain();
+
+signals:
+    /// The drain is over and the transport stopped: run to its end, or cut
+    /// short by stop() or start(). Not emitted when the transport is
+    /// destroyed mid-drain.
+    void drained();
 
 protected:
+    // A command as the transport hands it back to its connection: the answer
+    // to frame, and the id core answers under later if it took the command
+    // asynchronously (0 if not).
+    struct RoutedCommand {
+        std::string envelopeType;
+        std::string envelopeTopic;
+        std::string payloadJson;
+        CmdId asyncCmdId = 0;
+    };
+
+    // Any thread: both copy what core hands over onto the ingress queue and
+    // return; the transport's thread takes it from there.
     void onCoreAsyncResult(CmdId cmdId, std::string_view payloadJson) override;
     void onCoreEvent(std::string_view topic, std::string_view payloadJson) override;
-
-private slots:
-    void onNewConnection();
-    void onSocketDisconnected();
-    void onTextMessageReceived(const QString &message);
+    /// Hands one command to core. Called on the transport's thread, or for
+    /// sync topics on a worker when `syncWorkers` is set - then from several
+    /// pool threads at once, so an override must be thread-safe.
+    virtual RoutedCommand routeCommand(const std::string &topic,
+                                       std::string_view payloadJson,
+                                       const CallerIdentity &caller);
 
 private:
     struct PendingCommand {
-        QPointer<QWebSocket> socket;
-        quint64 cid = 0;
+        int shard = 0;
+        quint64 epoch = 0;
+        quint64 connectionId = 0;
+        CmdId cid = 0;
         QString cmdTopic;
+        qint64 receivedNs = 0;
+        // Tells this command's entry in m_commandDeadlines from a stale one.
+        quint64 ticket = 0;
+    };
+    // A connection, as the transport can name it: the shard it lives on and its
+    // id there.
+    using ConnectionKey = std::pair<int, quint64>;
+    // A command, or a batch of them (batchId), waiting its turn on a connection
+    // while sync dispatch runs on workers. Answered back as one once every
+    // command has its result.
+    struct CommandJob {
+        quint64 batchId = 0;
+        std::vector<ShardCommand> commands;
+        std::vector<ShardCommandResult> results;
+        // Over the connection's queue limit: every command is answered
+        // too_many_pending, in its turn.
+        bool refused = false;
+    };
+    // An event or an async result (cmdId set) on its way from core's thread.
+    struct CoreIngress {
+        CmdId cmdId = 0;
+        std::string topic;
+        std::string payloadJson;
+        qint64 producedNs = 0;
+    };
+    struct IngressMetrics {
+        // Handed over to taken off the queue.
+        LatencyHistogram wait;
+        std::int64_t maxDepth = 0;
+    };
+    // Where a sync command's time went: waiting for a worker, then in core.
+    struct SyncDispatchMetrics {
+        LatencyHistogram queueWait;
+        LatencyHistogram run;
+    };
+    // What drain() does before it closes everything.
+    struct DrainPlan {
+        DrainSettings shards;
+        // How long commands already at core get to be answered.
+        qint64 graceMs = 0;
+        // Over how long the close waves go out.
+        qint64 closeWindowMs = 0;
+    };
+    // One connection's jobs, the front one running.
+    struct CommandQueue {
+        std::deque<CommandJob> jobs;
+        std::size_t queuedCommands = 0;
+        // Of the command out on a worker, 0 when none is; what comes back
+        // under any other ticket is for a queue that has gone since.
+        quint64 workerTicket = 0;
     };
 
     static bool isConfigValid(const QJsonObject &config, QString *errorString);
+    static OutboundLimits outboundLimitsFromConfig(const QJsonObject &config);
+    static InboundLimits inboundLimitsFromConfig(const QJsonObject &config);
+    static int maxPendingCommandsFromConfig(const QJsonObject &config);
+    /// 0 when commands wait for core indefinitely.
+    static qint64 commandTimeoutMsFromConfig(const QJsonObject &config);
+    static CompressionSettings compressionFromConfig(const QJsonObject &config);
+    static EventBatchSettings eventBatchFromConfig(const QJsonObject &config);
+    static ReplaySettings replayFromConfig(const QJsonObject &config);
+    /// Disabled (maxChannels 0) unless the config has a stateCache object.
+    static StateCacheSettings stateCacheFromConfig(const QJsonObject &config);
+    static FragmentSettings fragmentationFromConfig(const QJsonObject &config);
+    static AdmissionLimits admissionFromConfig(const QJsonObject &config);
+    /// The drain object's timings; the defaults where it has none.
+    static DrainPlan drainFromConfig(const QJsonObject &config);
+    /// The tls object's settings; meaningful only when the config has one.
+    static tls::ServerSettings tlsFromConfig(const QJsonObject &config);
+    static int ioThreadsFromConfig(const QJsonObject &config);
+    /// 0 when sync commands are dispatched on the transport's thread.
+    static int syncWorkersFromConfig(const QJsonObject &config);
     static QString hostFromConfig(const QJsonObject &config);
     static quint16 portFromConfig(const QJsonObject &config);
-    // Which JSON shapes a cid may arrive in; what counts as a valid one is the
-    // protocol's answer and lives in the shared header.
-    static std::optional<CmdId> readCid(const QJsonValue &value);
-
     static QStringList allowedOriginsFromConfig(const QJsonObject &config);
-    static bool isLoopbackOrigin(const QString &origin);
-    /// True when a socket that has not authenticated may send this topic.
-    static bool isPreAuthTopic(const QString &topic);
-    /// Closes the connections whose session has sat idle past its budget.
-    void dropIdleSessions();
-    /// Reads a session out of an auth response and remembers or forgets it.
-    void trackAuthOutcome(QWebSocket *socket,
-                          const QString &topic,
-                          const QString &requestClientId,
-                          const QString &requestAuthToken,
-                          std::string_view responsePayloadJson);
+    /// 0 when the Prometheus endpoint is off.
+    static quint16 metricsPortFromConfig(const QJsonObject &config);
+    static QString metricsHostFromConfig(const QJsonObject &config);
+    static bool addressFromHost(const QString &host, QHostAddress *address);
 
     bool startServer(const QString &host, quint16 port, QString *errorString);
-    void closeAllClients();
-    // The one outbound primitive. Envelope and payload shapes come from
-    // envelope.h, so this only puts assembled text on a socket.
-    void send(QWebSocket *socket,
-              std::string_view type,
-              std::string_view topic,
-              std::optional<CmdId> cid,
-              std::string_view payloadJson) const;
-    void sendProtocolError(QWebSocket *socket,
-                           std::optional<CmdId> cid,
-                           std::string_view code,
-                           std::string_view message) const;
-    void sendCmdResponse(QWebSocket *socket,
-                         CmdId cid,
-                         const QString &cmdTopic,
-                         std::string_view payloadJson) const;
-    void broadcastEvent(std::string_view topic, std::string_view payloadJson) const;
-    void handleCommand(QWebSocket *socket,
-                       CmdId cid,
-                       const QString &topic,
-                       const QString &requestClientId,
-                       const QString &requestAuthToken,
-                       std::string_view payloadJson);
-
-    // What one connection has established. A socket starts unauthenticated and
-    // may only reach the pre-auth topics until it logs in (F-42); after that the
-    // identity comes from here rather than from whatever a frame claims.
-    struct ClientSession {
-        QString token;
-        QString clientId;
-        // The clock this connection is judged by: core states the budget when it
-        // hands out the session, and every frame the client sends resets it.
-        // Server pushes do not count - they say nothing about whoever logged in
-        // still being there.
-        qint64 idleBudgetMs = 0;
-        qint64 lastActivityMs = 0;
-    };
-    QHash<QWebSocket *, ClientSession> m_sessions;
-    QTimer *m_idleSweep = nullptr;
-    QStringList m_allowedOrigins;
+    bool startMetricsEndpoint(const QJsonObject &config, QString *errorString);
+    /// start() on a running transport with the same ioThreads: everything else
+    /// applied without closing a connection. False leaves the running config
+    /// in force.
+    bool reconfigure(const QJsonObject &config, QString *errorString);
+    /// Listens on the new endpoint before closing the old one where both can
+    /// be bound at once. False leaves the old one listening, except where it
+    /// had to be closed first and could not listen again: that is logged as
+    /// ws.listenLost, the error says the transport no longer accepts, and the
+    /// next start() tries to listen again.
+    bool moveServer(const QString &host, quint16 port, QString *errorString);
+    bool moveMetricsEndpoint(const QJsonObject &config, QString *errorString);
+    void applySyncWorkers(int syncWorkers);
+    /// Reads the shards' settings out of the config; TLS and admission are the
+    /// transport's current ones.
+    ShardSettings shardSettings(const QJsonObject &config) const;
+    void startShards(const QJsonObject &config);
+    void stopShards();
+    /// One step of drain(), on m_drainTimer: polls the grace period, sends a
+    /// close wave, polls the flush, or closes what is left and shuts down.
+    void stepDrain();
+    /// Logs ws.drained, shuts down and emits drained(); `cutShort` when the
+    /// drain did not get to its end.
+    void endDrain(bool cutShort);
+    /// Closes everything at once; what stop(), a restart and the end of a
+    /// drain come down to, and all the destructor does.
+    void shutdown();
+    /// Admits an accepted socket (ConnectionAdmission) and hands it to the
+    /// shard with the fewest connections, or refuses it.
+    void dispatchConnection(qintptr socketDescriptor);
+    int totalConnections() const;
+    void countAccept();
+
+    // ShardHost. Shards call these on their own threads; each one hops to this
+    // object's thread before touching anything here.
+    void submitCommand(ShardCommand command) override;
+    void submitBatch(quint64 batchId, std::vector<ShardCommand> commands) override;
+    void connectionClosed(int shard, quint64 epoch, quint64 connectionId) override;
+    void logClientConnected(const QString &peerAddress, int peerPort) override;
+    void logClientDisconnected(const QString &peerAddress, int peerPort) override;
+    void logOriginRefused(const QString &origin) override;
+    void logIdleTimeout(const QString &clientId, qint64 idleSec) override;
+    void logSlowConsumer(const QString &peerAddress,
+                         qint64 backlogBytes,
+                         qint64 queuedFrames,
+                         quint64 coalescedFrames) override;
+
+    void handleCommand(const ShardCommand &command);
+    void handleBatch(quint64 batchId, const std::vector<ShardCommand> &commands);
+    /// Runs one command to the answer the shard sends for it: a response, an
+    /// ack of an async command, or an error code.
+    ShardCommandResult runCommand(const ShardCommand &command);
+    static ShardCommandResult resultFor(const ShardCommand &command);
+    /// Answers what needs no core: sync.transport.stats.get, and a command
+    /// refused as too_many_pending. False when core has to be asked.
+    bool answerCommand(const ShardCommand &command, ShardCommandResult *result);
+    static CallerIdentity callerOf(const ShardCommand &command);
+    /// Records core's answer (an async command becomes pending) and turns it
+    /// into the shard's result.
+    ShardCommandResult finishCommand(const ShardCommand &command, RoutedCommand routed);
+    // With syncWorkers: commands wait per connection and run in order.
+    void queueCommands(quint64 batchId, std::vector<ShardCommand> commands);
+    void pumpCommands(const ConnectionKey &connection);
+    void runOnWorker(const ConnectionKey &connection, const ShardCommand &command);
+    void deliverCommands(CommandJob &job);
+    /// Forgets a pending command, index entry included.
+    PendingCommand takePendingCommand(QHash<CmdId, PendingCommand>::iterator it);
+    void expireCommands();
+
+    void pushIngress(CoreIngress item);
+    /// Takes what core handed over, a batch at a time.
+    void drainIngress();
+    void handleCoreAsyncResult(CmdId cmdId, std::string payloadJson);
+    void handleCoreEvent(std::string topic, std::string payloadJson, qint64 producedNs);
+
+    void countEvent(std::string_view topic);
+    /// Everything counted so far, shards included.
+    MetricsSnapshot metricsSnapshot() const;
+    void logBroadcastStats();
+    /// One line for whatever admission refused since the last one.
+    void logAdmissionRefusals();
 
     bool m_running = false;
+    bool m_draining = false;
+    // Where drain() has got to. Grace waits for pending commands, Waves closes
+    // one wave per step, Flush waits for connections a wave passed over with
+    // frames still queued, and Leftovers gives the last closes a moment.
+    enum class DrainPhase { Grace, Waves, Flush, Leftovers };
+    DrainPlan m_drainPlan;
+    DrainPhase m_drainPhase = DrainPhase::Grace;
+    QTimer *m_drainTimer = nullptr;
+    // Since drain(), and since the current phase began.
+    QElapsedTimer m_drainElapsed;
+    QElapsedTimer m_drainPhaseClock;
+    int m_drainNextWave = 0;
+    qsizetype m_drainUnanswered = 0;
     QJsonObject m_config;
-    QWebSocketServer *m_server = nullptr;
-    QSet<QWebSocket *> m_clients;
+    QTcpServer *m_server = nullptr;
+    // Bumped on every start, so an answer addressed to a shard of an earlier run
+    // is recognised and dropped instead of reaching whatever took its index.
+    quint64 m_epoch = 0;
+    QList<WsShard *> m_shards;
+    QList<QThread *> m_shardThreads;
+    int m_nextShard = 0;
+    bool m_replayEnabled = false;
+    bool m_stateCacheEnabled = false;
+    // Set while serving wss://; the shards share it.
+    std::shared_ptr<const tls::ServerContext> m_tlsContext;
+    // What the shards count admitted connections against; replaced on start.
+    std::shared_ptr<ConnectionAdmission> m_admission;
+    quint64 m_nextEventSeq = 0;
     QHash<CmdId, PendingCommand> m_pendingCommands;
+    // The same commands by connection, so a connection's share can be counted
+    // and a closed connection's dropped without looking at anyone else's.
+    QHash<ConnectionKey, QSet<CmdId>> m_pendingByConnection;
+    int m_maxPendingCommands = 0;
+    qint64 m_commandTimeoutMs = 0;
+    IdleWheel m_commandDeadlines;
+    QTimer *m_commandTimer = nullptr;
+    quint64 m_nextPendingTicket = 1;
+    // Set once sync dispatch has run on workers (syncWorkers); kept until stop
+    // when reconfigured down to none.
+    QThreadPool *m_syncPool = nullptr;
+    int m_syncWorkers = 0;
+    QHash<ConnectionKey, CommandQueue> m_commandQueues;
+    quint64 m_nextWorkerTicket = 1;
+    // Recorded on the workers; new with every start, as the other counters
+    // start from zero.
+    std::unique_ptr<SyncDispatchMetrics> m_syncMetrics;
+
+    // Filled on core's threads, drained on this one.
+    MpscQueue<CoreIngress> m_ingress;
+    std::atomic<std::int64_t> m_ingressDepth{0};
+    // Set while a drain is posted and not yet started.
+    std::atomic<bool> m_ingressDrainPosted{false};
+    std::unique_ptr<IngressMetrics> m_ingressMetrics = std::make_unique<IngressMetrics>();
+
+    // Counted here, on the transport's thread; what happens on the sockets is
+    // counted by the shards (ShardMetrics) and summed on the way out.
+    QElapsedTimer m_uptime;
+    quint64 m_events = 0;
+    quint64 m_channelEvents = 0;
+    std::vector<std::pair<std::string, quint64>> m_eventFamilies;
+    quint64 m_syncCommands = 0;
+    quint64 m_asyncCommands = 0;
+    // Where the last ws.broadcastStats line left off, so it reports deltas.
+    quint64 m_eventsAtLastLog = 0;
+    quint64 m_channelEventsAtLastLog = 0;
+    // Refusals as of the last ws.admissionRefused line.
+    quint64 m_refusedAtLastLog = 0;
+    // Admitted connections, and per second of uptime for the peak.
+    quint64 m_accepted = 0;
+    qint64 m_acceptSecond = -1;
+    std::int64_t m_acceptsThisSecond = 0;
+    std::int64_t m_acceptPeakPerSec = 0;
+    QTimer *m_statsTimer = nullptr;
+    MetricsEndpoint *m_metricsEndpoint = nullptr;
 };
 
 } // namespace phicore::transport::ws
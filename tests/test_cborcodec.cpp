@@ -0,0 +1,148 @@
+// The CBOR transcoder (cborcodec.h) against Qt's own CBOR implementation, on
+// generated documents: whatever cbor::fromJson writes must decode through
+// QCborValue to the document the JSON parsed to, and what QCborValue writes for
+// a document must come back through cbor::toJson as that document. Exits
+// non-zero on the first disagreement.
+
+#include "cborcodec.h"
+
+#include <QByteArray>
+#include <QCborValue>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonValue>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr int kFuzzCases = 100000;
+
+class Generator
+{
+public:
+    explicit Generator(unsigned seed)
+        : m_random(seed)
+    {
+    }
+
+    int below(int n) { return std::uniform_int_distribution<int>(0, n - 1)(m_random); }
+
+    std::string document()
+    {
+        std::string out;
+        value(&out, 1);
+        return out;
+    }
+
+private:
+    void value(std::string *out, int depth)
+    {
+        const int kind = depth > 5 ? 2 + below(4) : below(6);
+        switch (kind) {
+        case 0: {
+            *out += '{';
+            // Enough members now and then to need a longer head.
+            const int members = below(8) == 0 ? 30 : below(4);
+            for (int i = 0; i < members; ++i) {
+                if (i > 0)
+                    *out += ',';
+                *out += "\"k" + std::to_string(i) + "\":";
+                value(out, depth + 1);
+            }
+            *out += '}';
+            break;
+        }
+        case 1: {
+            *out += '[';
+            const int elements = below(8) == 0 ? 300 : below(5);
+            for (int i = 0; i < elements; ++i) {
+                if (i > 0)
+                    *out += ',';
+                value(out, depth + 2);
+            }
+            *out += ']';
+            break;
+        }
+        case 2: {
+            static constexpr std::string_view kNumbers[] = {
+                "0", "-0", "17", "-3", "23", "24", "-25", "255", "256", "65536", "-4294967297",
+                "1.5", "0.1", "2.5e-3", "1E+10", "1e308", "4.9e-324", "-1e-400",
+            };
+            *out += kNumbers[below(18)];
+            break;
+        }
+        case 3: {
+            static constexpr std::string_view kStrings[] = {
+                R"("")", R"("plain")", R"("quote \" and \\ slash \/")", R"("\n\t\b\f\r")",
+                R"("é中")", R"("😀")", "\"caf\xC3\xA9\"",
+                R"("a string long enough to need a length byte of its own")",
+            };
+            *out += kStrings[below(8)];
+            break;
+        }
+        case 4:
+            *out += below(2) ? "true" : "false";
+            break;
+        default:
+            *out += "null";
+            break;
+        }
+    }
+
+    std::mt19937 m_random;
+};
+
+QJsonValue parsedJson(std::string_view text)
+{
+    // Wrapped, so scalars parse too.
+    const QByteArray wrapped = "[" + QByteArray(text.data(), static_cast<qsizetype>(text.size())) + "]";
+    return QJsonDocument::fromJson(wrapped).array().at(0);
+}
+
+bool checkEquivalence(unsigned seed)
+{
+    Generator generator(seed);
+    for (int i = 0; i < kFuzzCases; ++i) {
+        const std::string input = generator.document();
+        const QJsonValue expected = parsedJson(input);
+
+        std::string encoded;
+        if (!cbor::fromJson(input, &encoded)) {
+            std::fprintf(stderr, "case %d: valid JSON refused:\n%s\n", i, input.c_str());
+            return false;
+        }
+        const QJsonValue viaQt =
+            QCborValue::fromCbor(QByteArray::fromStdString(encoded)).toJsonValue();
+        if (viaQt != expected) {
+            std::fprintf(stderr, "case %d: QCborValue reads our CBOR differently:\n%s\n", i, input.c_str());
+            return false;
+        }
+
+        const QByteArray qtEncoded = QCborValue::fromJsonValue(expected).toCbor();
+        std::string decoded;
+        if (!cbor::toJson(std::string_view(qtEncoded.constData(), static_cast<std::size_t>(qtEncoded.size())),
+                          &decoded)
+            || parsedJson(decoded) != expected) {
+            std::fprintf(stderr, "case %d: QCborValue's CBOR reads back differently:\n%s\n%s\n",
+                         i, input.c_str(), decoded.c_str());
+            return false;
+        }
+    }
+    std::printf("equivalence: %d cases, all matching (seed %u)\n", kFuzzCases, seed);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const unsigned seed = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 1u;
+    return checkEquivalence(seed) ? 0 : 1;
+}
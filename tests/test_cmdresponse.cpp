@@ -0,0 +1,221 @@
+// The spliced cmd.response payload (cmdresponse.h) against the QJsonObject
+// round trip sendCmdResponse used to make for every result.
+//
+// A fuzz run feeds both generated results and mutilated ones - truncated, bytes
+// flipped, bytes inserted - to both. Wherever the splice answers, its output
+// must parse to the object the old code built; where it declines, the shard
+// still runs the old code, so there is nothing to compare. Generated results
+// that are well-formed must never be declined. Exits non-zero on the first
+// disagreement.
+
+#include "cmdresponse.h"
+
+#include <QByteArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QString>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::string_view kCmdTopic = "cmd.history.query";
+constexpr int kFuzzCases = 200000;
+
+// sendCmdResponse as it was, minus the send. Compared as objects, not as
+// text: key order and number spelling were the old code's, not the protocol's.
+QJsonObject referenceObject(std::string_view payloadJson, const QString &cmdTopic)
+{
+    QJsonObject out =
+        QJsonDocument::fromJson(QByteArray::fromRawData(payloadJson.data(),
+                                                       static_cast<qsizetype>(payloadJson.size())))
+            .object();
+    out.insert(QStringLiteral("cmd"), cmdTopic);
+    if (!out.contains(QStringLiteral("error")))
+        out.insert(QStringLiteral("error"), QJsonValue::Null);
+    return out;
+}
+
+class Generator
+{
+public:
+    explicit Generator(unsigned seed)
+        : m_random(seed)
+    {
+    }
+
+    int below(int n) { return std::uniform_int_distribution<int>(0, n - 1)(m_random); }
+
+    // A result object as core might return one. No top-level `cmd`: that is
+    // the one well-formed shape the splice hands back on purpose.
+    std::string result()
+    {
+        std::string out;
+        out += space();
+        out += '{';
+        const int members = below(5);
+        for (int i = 0; i < members; ++i) {
+            if (i > 0)
+                out += ',';
+            static constexpr std::string_view kKeys[] = {"error", "items", "total", "next", "x", "\\u00fc"};
+            out += space();
+            out += '"';
+            out += kKeys[below(6)];
+            out += '"';
+            out += space();
+            out += ':';
+            out += space();
+            value(&out, 2);
+        }
+        out += space();
+        out += '}';
+        out += space();
+        return out;
+    }
+
+    // Breaks a document the way a truncated or corrupted result would be broken.
+    std::string mutate(std::string text)
+    {
+        if (text.empty())
+            return text;
+        const std::size_t at = static_cast<std::size_t>(below(static_cast<int>(text.size())));
+        switch (below(5)) {
+        case 0:
+            text.resize(at);
+            break;
+        case 1:
+            text[at] = static_cast<char>(below(256));
+            break;
+        case 2: {
+            static constexpr std::string_view kNoise = " \t,:{}[]\"\\e-0.\x80\xC3\xED\xF4";
+            text.insert(at, 1, kNoise[static_cast<std::size_t>(below(static_cast<int>(kNoise.size())))]);
+            break;
+        }
+        case 3:
+            text = "[" + text + "]";
+            break;
+        default:
+            text.insert(text.find('{') + 1, R"("cmd":"spoofed",)");
+            break;
+        }
+        return text;
+    }
+
+private:
+    std::string space()
+    {
+        static constexpr std::string_view kSpaces[] = {"", "", "", " ", "\n  ", "\t"};
+        return std::string(kSpaces[below(6)]);
+    }
+
+    void value(std::string *out, int depth)
+    {
+        const int kind = depth > 5 ? 2 + below(4) : below(6);
+        switch (kind) {
+        case 0: {
+            *out += '{';
+            const int members = below(4);
+            for (int i = 0; i < members; ++i) {
+                if (i > 0)
+                    *out += ',';
+                static constexpr std::string_view kKeys[] = {"error", "cmd", "id", "value", "ts"};
+                *out += '"';
+                *out += kKeys[below(5)];
+                *out += "\":";
+                value(out, depth + 1);
+            }
+            *out += '}';
+            break;
+        }
+        case 1: {
+            *out += '[';
+            const int elements = below(5);
+            for (int i = 0; i < elements; ++i) {
+                if (i > 0)
+                    *out += ',';
+                value(out, depth + 1);
+            }
+            *out += ']';
+            break;
+        }
+        case 2: {
+            static constexpr std::string_view kNumbers[] = {
+                "0", "-0", "17", "-3", "1.5", "2.5e-3", "1E+10", "12345678901234567890",
+                "1e308", "1e309", "4.9e-324", "1e-400", "0e-400", "0.000",
+            };
+            *out += kNumbers[below(14)];
+            break;
+        }
+        case 3: {
+            static constexpr std::string_view kStrings[] = {
+                R"("")", R"("plain")", R"("quote \" and \\ slash \/")", R"("\n\t\b\f\r")",
+                R"("\u00e9\u4e2d")", R"("\ud83d\ude00")", R"("\ud800 lone")", "\"caf\xC3\xA9\"",
+                "\"\xF0\x9F\x98\x80\"",
+            };
+            *out += kStrings[below(9)];
+            break;
+        }
+        case 4:
+            *out += below(2) ? "true" : "false";
+            break;
+        default:
+            *out += "null";
+            break;
+        }
+    }
+
+    std::mt19937 m_random;
+};
+
+bool checkEquivalence(unsigned seed)
+{
+    Generator generator(seed);
+    const QString cmdTopic = QString::fromUtf8(kCmdTopic.data(), static_cast<qsizetype>(kCmdTopic.size()));
+    int spliced = 0;
+    for (int i = 0; i < kFuzzCases; ++i) {
+        const bool wellFormed = generator.below(3) > 0;
+        const std::string input = wellFormed ? generator.result() : generator.mutate(generator.result());
+
+        std::string out;
+        if (!spliceCmdResponsePayload(input, kCmdTopic, &out)) {
+            // Declined inputs take the old path in the shard. A generated result
+            // only lands here when it carries a number QJsonDocument may refuse.
+            if (wellFormed && input.find("e309") == std::string::npos && input.find("e-400") == std::string::npos) {
+                std::fprintf(stderr, "case %d: well-formed result declined:\n%s\n", i, input.c_str());
+                return false;
+            }
+            continue;
+        }
+        ++spliced;
+
+        QJsonParseError error;
+        const QJsonDocument actual = QJsonDocument::fromJson(QByteArray::fromStdString(out), &error);
+        const QJsonObject expected = referenceObject(input, cmdTopic);
+        if (error.error != QJsonParseError::NoError || !actual.isObject() || actual.object() != expected) {
+            std::fprintf(stderr,
+                         "case %d: outputs differ\ninput:    %s\nspliced:  %s\nexpected: %s\n",
+                         i,
+                         input.c_str(),
+                         out.c_str(),
+                         QJsonDocument(expected).toJson(QJsonDocument::Compact).constData());
+            return false;
+        }
+    }
+    std::printf("equivalence: %d cases, %d spliced, all matching (seed %u)\n", kFuzzCases, spliced, seed);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const unsigned seed = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 1u;
+    return checkEquivalence(seed) ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+// A drain as one shard carries it out: every client is told when to reconnect,
+// then closed going away (1001) in the wave its delay falls in, shortest delays
+// first; whatever the waves leave is closed by closeDrainLeftovers().
+//
+// One shard on this thread and a few clients. The waves are called one at a
+// time, as the transport's drain timer calls them; after each, exactly the
+// clients whose delay falls in it or an earlier one must be gone. The last
+// wave is never called, so its clients are left for closeDrainLeftovers().
+
+#include "wsshard.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QString>
+#include <QTcpServer>
+#include <QUrl>
+#include <QWebSocket>
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr int kClients = 8;
+constexpr qint64 kReconnectWindowMs = 10000;
+constexpr int kWaves = 4;
+// Long enough for a close that was not going to come to show up anyway.
+constexpr qint64 kSettleMs = 200;
+
+// Nothing reaches core in this test.
+class TestHost final : public ShardHost
+{
+public:
+    void submitCommand(ShardCommand) override {}
+    void submitBatch(quint64, std::vector<ShardCommand>) override {}
+    void connectionClosed(int, quint64, quint64) override {}
+    void logClientConnected(const QString &, int) override {}
+    void logClientDisconnected(const QString &, int) override {}
+    void logOriginRefused(const QString &) override {}
+    void logIdleTimeout(const QString &, qint64) override {}
+    void logSlowConsumer(const QString &, qint64, qint64, quint64) override {}
+};
+
+class Listener final : public QTcpServer
+{
+public:
+    WsShard *shard = nullptr;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override { shard->adoptConnection(socketDescriptor, {}); }
+};
+
+struct Client {
+    QWebSocket socket;
+    bool connected = false;
+    bool disconnected = false;
+    // -1 until the notice arrives.
+    qint64 reconnectAfterMs = -1;
+    // The wave its delay falls in, as the shard draws it.
+    int wave() const { return static_cast<int>(reconnectAfterMs * kWaves / kReconnectWindowMs); }
+};
+
+bool waitFor(const std::function<bool()> &done, qint64 timeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!done()) {
+        if (timer.elapsed() > timeoutMs)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 5);
+    }
+    return true;
+}
+
+void settle()
+{
+    waitFor([]() { return false; }, kSettleMs);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    TestHost host;
+    ShardSettings settings;
+    settings.subprotocols = {QString(kSubprotocolJson)};
+    auto *shard = new WsShard(0, 1, settings, &host);
+    shard->open();
+
+    Listener listener;
+    listener.shard = shard;
+    if (!listener.listen(QHostAddress::LocalHost, 0)) {
+        std::fprintf(stderr, "listen failed: %s\n", qPrintable(listener.errorString()));
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Client>> clients;
+    for (int i = 0; i < kClients; ++i) {
+        auto client = std::make_unique<Client>();
+        Client *raw = client.get();
+        QObject::connect(&raw->socket, &QWebSocket::connected, &raw->socket, [raw]() { raw->connected = true; });
+        QObject::connect(&raw->socket, &QWebSocket::disconnected, &raw->socket, [raw]() {
+            raw->disconnected = true;
+        });
+        QObject::connect(&raw->socket, &QWebSocket::textMessageReceived, &raw->socket, [raw](const QString &text) {
+            const QJsonObject envelope = QJsonDocument::fromJson(text.toUtf8()).object();
+            if (envelope.value(QStringLiteral("topic")).toString() != QLatin1String("event.transport.drain"))
+                return;
+            const QJsonObject payload = envelope.value(QStringLiteral("payload")).toObject();
+            raw->reconnectAfterMs =
+                static_cast<qint64>(payload.value(QStringLiteral("reconnectAfterMs")).toDouble(-1));
+        });
+        raw->socket.open(QUrl(QStringLiteral("ws://127.0.0.1:%1").arg(listener.serverPort())));
+        clients.push_back(std::move(client));
+    }
+
+    int failures = 0;
+    const auto fail = [&failures](const char *what) {
+        std::fprintf(stderr, "%s\n", what);
+        ++failures;
+    };
+    const auto allClients = [&](const std::function<bool(const Client &)> &test) {
+        for (const auto &client : clients) {
+            if (!test(*client))
+                return false;
+        }
+        return true;
+    };
+
+    if (!waitFor([&]() { return allClients([](const Client &c) { return c.connected; })
+                                && shard->connectionCount() == kClients; },
+                 10000)) {
+        fail("the clients did not all connect");
+    } else {
+        DrainSettings drain;
+        drain.reconnectWindowMs = kReconnectWindowMs;
+        drain.waves = kWaves;
+        shard->beginDrain(drain);
+        if (!waitFor([&]() { return allClients([](const Client &c) { return c.reconnectAfterMs >= 0; }); }, 5000))
+            fail("not every client got the drain notice");
+        if (!allClients([](const Client &c) { return c.reconnectAfterMs < kReconnectWindowMs; }))
+            fail("a reconnect delay lies outside the window");
+        if (shard->metrics().drainOpen.load() != kClients)
+            fail("the notified connections are not all counted open");
+
+        // Every wave but the last, in order; each closes its own clients and
+        // nobody else's.
+        for (int wave = 0; wave < kWaves - 1 && failures == 0; ++wave) {
+            shard->closeDrainWave(wave);
+            const auto closedByNow = [wave](const Client &c) { return c.wave() <= wave; };
+            waitFor([&]() { return allClients([&](const Client &c) { return c.disconnected || !closedByNow(c); }); },
+                    5000);
+            settle();
+            if (!allClients([&](const Client &c) { return c.disconnected == closedByNow(c); })) {
+                std::fprintf(stderr, "after wave %d the closed clients are not those of waves 0..%d\n", wave, wave);
+                ++failures;
+            }
+        }
+
+        // The last wave's clients are what the deadline closes.
+        shard->closeDrainLeftovers();
+        if (!waitFor([&]() { return allClients([](const Client &c) { return c.disconnected; }); }, 5000))
+            fail("closeDrainLeftovers left a client open");
+
+        if (!allClients([](const Client &c) {
+                return c.socket.closeCode() == QWebSocketProtocol::CloseCodeGoingAway;
+            })) {
+            fail("a client was not closed going away (1001)");
+        }
+
+        const ShardMetrics &metrics = shard->metrics();
+        const auto clientCount = static_cast<std::uint64_t>(kClients);
+        if (metrics.drainNotices.load() != clientCount || metrics.drainClosed.load() != clientCount)
+            fail("the drain counters do not match the clients");
+        if (metrics.drainOpen.load() != 0)
+            fail("connections are still counted open after the drain");
+        if (metrics.drainHardClosed.load() != 0)
+            fail("a connection with nothing queued was counted as hard-closed");
+    }
+
+    for (const auto &client : clients)
+        client->socket.abort();
+    listener.close();
+    shard->closeAll();
+    delete shard;
+    QCoreApplication::processEvents();
+    if (failures == 0)
+        std::printf("drain notice, then 1001 closes in wave order\n");
+    return failures == 0 ? 0 : 1;
+}
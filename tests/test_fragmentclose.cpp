@@ -0,0 +1,175 @@
+// A connection closed while a message is going out in fragments: the client
+// must get that message whole, then the close frame, rather than a close in
+// the middle of a message QWebSocket never knew was open.
+//
+// One shard on this thread, fragments of 1 KiB taken one at a time (the
+// outbound budget is smaller than a fragment), and an inbound rate limit the
+// client trips on purpose right after the large event goes out: the shard
+// closes it for that while most of the event is still to be written.
+
+#include "wsshard.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QString>
+#include <QTcpServer>
+#include <QUrl>
+#include <QWebSocket>
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::string_view kTopic = "event.test.large";
+constexpr int kBlobBytes = 1024 * 1024;
+constexpr qint64 kFragmentBytes = 1024;
+
+// Logs the client in and answers nothing else.
+class TestHost final : public ShardHost
+{
+public:
+    WsShard *shard = nullptr;
+
+    void submitCommand(ShardCommand command) override
+    {
+        ShardCommandResult result;
+        result.connectionId = command.connectionId;
+        result.cid = command.cid;
+        result.topic = command.topic;
+        result.requestClientId = command.requestClientId;
+        result.envelopeType.assign(kEnvelopeTypeResponse);
+        result.envelopeTopic = "sync.response";
+        result.payloadJson = R"({"token":"test-token","sessionIdleSec":0})";
+        shard->completeCommand(result);
+    }
+    void submitBatch(quint64, std::vector<ShardCommand>) override {}
+    void connectionClosed(int, quint64, quint64) override {}
+    void logClientConnected(const QString &, int) override {}
+    void logClientDisconnected(const QString &, int) override {}
+    void logOriginRefused(const QString &) override {}
+    void logIdleTimeout(const QString &, qint64) override {}
+    void logSlowConsumer(const QString &, qint64, qint64, quint64) override {}
+};
+
+class Listener final : public QTcpServer
+{
+public:
+    WsShard *shard = nullptr;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override { shard->adoptConnection(socketDescriptor, {}); }
+};
+
+bool waitFor(const std::function<bool()> &done, qint64 timeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (!done()) {
+        if (timer.elapsed() > timeoutMs)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 5);
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    TestHost host;
+    ShardSettings settings;
+    settings.subprotocols = {QStringLiteral("phi-core-ws.v1")};
+    settings.outbound.budgetBytes = kFragmentBytes / 2;
+    settings.outbound.maxQueuedFrames = 1000;
+    settings.outbound.stallTimeoutMs = 60000;
+    // The login takes the one token; the second frame refused after it closes
+    // the connection.
+    settings.inbound.framesPerSec = 0.001;
+    settings.inbound.burst = 1.0;
+    settings.fragmentation.minMessageBytes = 4 * kFragmentBytes;
+    settings.fragmentation.fragmentBytes = kFragmentBytes;
+    auto *shard = new WsShard(0, 1, settings, &host);
+    host.shard = shard;
+    shard->open();
+
+    Listener listener;
+    listener.shard = shard;
+    if (!listener.listen(QHostAddress::LocalHost, 0)) {
+        std::fprintf(stderr, "listen failed: %s\n", qPrintable(listener.errorString()));
+        return 1;
+    }
+
+    auto event = std::make_shared<SharedEvent>();
+    event->topic.assign(kTopic);
+    event->payloadJson = R"({"blob":")" + std::string(kBlobBytes, 'x') + R"("})";
+    event->envelopeJson = makeEnvelope(kEnvelopeTypeEvent, kTopic, std::nullopt, event->payloadJson);
+    const std::shared_ptr<const SharedEvent> shared = event;
+
+    QWebSocket client;
+    bool loggedIn = false;
+    bool disconnected = false;
+    qsizetype largest = 0;
+    QObject::connect(&client, &QWebSocket::connected, &client, [&client]() {
+        client.sendTextMessage(
+            QStringLiteral(R"({"type":"cmd","topic":"sync.auth.login.set","cid":1,"payload":{}})"));
+    });
+    QObject::connect(&client, &QWebSocket::textMessageReceived, &client, [&](const QString &message) {
+        largest = std::max(largest, message.size());
+        if (loggedIn)
+            return;
+        loggedIn = true;
+        shard->publishEvent(shared);
+        for (int cid = 2; cid <= 3; ++cid) {
+            client.sendTextMessage(
+                QStringLiteral(R"({"type":"cmd","topic":"sync.ping.get","cid":%1,"payload":{}})").arg(cid));
+        }
+    });
+    QObject::connect(&client, &QWebSocket::disconnected, &client, [&disconnected]() { disconnected = true; });
+    client.open(QUrl(QStringLiteral("ws://127.0.0.1:%1").arg(listener.serverPort())));
+
+    int failures = 0;
+    if (!waitFor([&]() { return disconnected; }, 20000)) {
+        std::fprintf(stderr, "the client was never closed (logged in: %s)\n", loggedIn ? "yes" : "no");
+        ++failures;
+    } else {
+        const qsizetype expected = static_cast<qsizetype>(event->envelopeJson.size());
+        const std::uint64_t fragments = shard->metrics().fragmentsOut.load();
+        // Written a fragment at a time to the end, the message would take one
+        // per KiB; fewer means the close came in the middle of it.
+        if (fragments >= static_cast<std::uint64_t>(expected / kFragmentBytes)) {
+            std::fprintf(stderr, "the close did not come mid-message (%llu fragments)\n",
+                         static_cast<unsigned long long>(fragments));
+            ++failures;
+        }
+        if (largest != expected) {
+            std::fprintf(stderr, "large message: got %lld bytes, expected %lld\n",
+                         static_cast<long long>(largest), static_cast<long long>(expected));
+            ++failures;
+        }
+        if (client.closeCode() != QWebSocketProtocol::CloseCodePolicyViolated) {
+            std::fprintf(stderr, "close code %d, expected %d\n", static_cast<int>(client.closeCode()),
+                         static_cast<int>(QWebSocketProtocol::CloseCodePolicyViolated));
+            ++failures;
+        }
+    }
+
+    client.abort();
+    listener.close();
+    shard->closeAll();
+    delete shard;
+    QCoreApplication::processEvents();
+    if (failures == 0)
+        std::printf("fragmented message finished before the close\n");
+    return failures == 0 ? 0 : 1;
+}
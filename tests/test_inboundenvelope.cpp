@@ -0,0 +1,379 @@
+// The single-pass envelope scan (inboundenvelope.h) against the QJsonDocument
+// flow onTextMessageReceived used before it.
+//
+// Both sides run the same ladder of checks the shard runs on a frame -
+// invalid_json, missing_cid, invalid_type, missing_topic, unauthenticated - and
+// must stop at the same rung with the same cid. A frame that gets past all of
+// them must hand over the same topic, clientId, authToken and payload; the
+// payload is compared as an object, since the old code reserialized it and the
+// scan hands over the bytes the client sent.
+//
+// Frames are generated from envelope members in any order, with unknown and
+// duplicate keys, payloads that are missing or not objects, and cids past what
+// a CmdId holds, as numbers and as strings; a third are then mutilated. Exits
+// non-zero on the first disagreement.
+
+#include "inboundenvelope.h"
+
+#include <QByteArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QJsonValue>
+#include <QString>
+
+#include <transportinterface.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+
+using namespace phicore::transport;
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr int kFuzzCases = 200000;
+
+// Where a frame ended up: refused with `code`, or handed over (code empty).
+struct Outcome {
+    std::string code;
+    std::optional<CmdId> cid;
+    QString topic;
+    QString clientId;
+    QString authToken;
+    QJsonObject payload;
+};
+
+// The list the transport checked before the scan, unchanged since.
+bool isPreAuthTopic(const QString &topic)
+{
+    return topic == QLatin1String("sync.hello.get")
+        || topic == QLatin1String("sync.ping.get")
+        || topic.startsWith(QLatin1String("sync.auth."));
+}
+
+// onTextMessageReceived as it was, minus the sends.
+Outcome referenceOutcome(const QByteArray &frame, bool authenticated)
+{
+    Outcome out;
+    QJsonParseError parseError;
+    const QJsonDocument doc = QJsonDocument::fromJson(frame, &parseError);
+    if (parseError.error != QJsonParseError::NoError || !doc.isObject()) {
+        out.code = kErrorCodeInvalidJson;
+        return out;
+    }
+
+    const QJsonObject obj = doc.object();
+    const QString type = obj.value(QStringLiteral("type")).toString();
+    const QString topic = obj.value(QStringLiteral("topic")).toString();
+    const QJsonObject payload = obj.value(QStringLiteral("payload")).toObject();
+
+    const QJsonValue cidValue = obj.value(QStringLiteral("cid"));
+    if (cidValue.isDouble())
+        out.cid = cidFromNumber(cidValue.toDouble(-1.0));
+    else if (cidValue.isString())
+        out.cid = cidFromString(cidValue.toString().toStdString());
+    if (!out.cid.has_value()) {
+        out.code = kErrorCodeMissingCid;
+        return out;
+    }
+    if (type.toStdString() != kEnvelopeTypeCmd) {
+        out.code = kErrorCodeInvalidType;
+        return out;
+    }
+    if (topic.trimmed().isEmpty()) {
+        out.code = kErrorCodeMissingTopic;
+        return out;
+    }
+    if (!authenticated && !isPreAuthTopic(topic)) {
+        out.code = "unauthenticated";
+        return out;
+    }
+    out.topic = topic;
+    out.clientId = payload.value(QStringLiteral("clientId")).toString();
+    out.authToken = payload.value(QStringLiteral("authToken")).toString().trimmed();
+    out.payload = payload;
+    return out;
+}
+
+QString fromUtf8(std::string_view text)
+{
+    return QString::fromUtf8(text.data(), static_cast<qsizetype>(text.size()));
+}
+
+// WsShard::handleFrame and handleEnvelope, minus the sends and the checks that
+// came with later features (draining, batches, rate limits).
+Outcome scannedOutcome(const QByteArray &frame, bool authenticated)
+{
+    Outcome out;
+    InboundEnvelope envelope;
+    if (!scanInboundEnvelope(std::string_view(frame.constData(), static_cast<std::size_t>(frame.size())),
+                             &envelope)) {
+        out.code = kErrorCodeInvalidJson;
+        return out;
+    }
+
+    // WsShard::readCid.
+    if (envelope.cidKind == InboundEnvelope::CidKind::Number)
+        out.cid = cidFromNumber(envelope.cidNumber);
+    else if (envelope.cidKind == InboundEnvelope::CidKind::String)
+        out.cid = cidFromString(envelope.cidText);
+    if (!out.cid.has_value()) {
+        out.code = kErrorCodeMissingCid;
+        return out;
+    }
+    if (envelope.type != kEnvelopeTypeCmd) {
+        out.code = kErrorCodeInvalidType;
+        return out;
+    }
+    const QString topic = fromUtf8(envelope.topic);
+    if (topic.trimmed().isEmpty()) {
+        out.code = kErrorCodeMissingTopic;
+        return out;
+    }
+    if (!authenticated && !isPreAuthTopic(topic)) {
+        out.code = "unauthenticated";
+        return out;
+    }
+    out.topic = topic;
+    out.clientId = fromUtf8(envelope.clientId);
+    out.authToken = fromUtf8(envelope.authToken).trimmed();
+    // The slice must be the payload object on its own, parseable as such.
+    QJsonParseError parseError;
+    const QJsonDocument payload = QJsonDocument::fromJson(
+        QByteArray(envelope.payload.data(), static_cast<qsizetype>(envelope.payload.size())), &parseError);
+    if (parseError.error != QJsonParseError::NoError || !payload.isObject()) {
+        out.code = "payload slice is not an object";
+        return out;
+    }
+    out.payload = payload.object();
+    return out;
+}
+
+class Generator
+{
+public:
+    explicit Generator(unsigned seed)
+        : m_random(seed)
+    {
+    }
+
+    int below(int n) { return std::uniform_int_distribution<int>(0, n - 1)(m_random); }
+
+    // An envelope as a client might send one: the members in any order, any
+    // of them missing, some repeated, some of the wrong kind.
+    std::string frame()
+    {
+        std::string members[8];
+        int count = 0;
+        if (below(8) > 0)
+            members[count++] = member("type", pick(kTypes));
+        if (below(8) > 0)
+            members[count++] = member("cid", pick(kCids));
+        if (below(8) > 0)
+            members[count++] = member("topic", pick(kTopics));
+        if (below(6) > 0)
+            members[count++] = member("payload", payload());
+        if (below(4) == 0)
+            members[count++] = member(pick(kUnknownKeys), pick(kScalars));
+        // A repeated key: the last occurrence is the one that counts.
+        if (count > 0 && below(4) == 0) {
+            static constexpr std::string_view kRepeatable[] = {"type", "cid", "topic", "payload"};
+            const std::string_view key = pick(kRepeatable);
+            if (key == "payload")
+                members[count++] = member(key, payload());
+            else if (key == "cid")
+                members[count++] = member(key, pick(kCids));
+            else
+                members[count++] = member(key, key == "type" ? pick(kTypes) : pick(kTopics));
+        }
+        for (int i = count - 1; i > 0; --i)
+            std::swap(members[i], members[below(i + 1)]);
+
+        std::string out = space() + "{";
+        for (int i = 0; i < count; ++i) {
+            if (i > 0)
+                out += ',';
+            out += members[i];
+        }
+        out += space() + "}" + space();
+        return out;
+    }
+
+    // Breaks a frame the way a buggy or hostile client would.
+    std::string mutate(std::string text)
+    {
+        if (text.empty())
+            return text;
+        const std::size_t at = static_cast<std::size_t>(below(static_cast<int>(text.size())));
+        switch (below(5)) {
+        case 0:
+            text.resize(at);
+            break;
+        case 1:
+            text[at] = static_cast<char>(below(256));
+            break;
+        case 2: {
+            static constexpr std::string_view kNoise = " \t,:{}[]\"\\e-0.\x80\xC3";
+            text.insert(at, 1, kNoise[static_cast<std::size_t>(below(static_cast<int>(kNoise.size())))]);
+            break;
+        }
+        case 3:
+            text = "[" + text + "]";
+            break;
+        default:
+            text += below(2) ? "{}" : ",";
+            break;
+        }
+        return text;
+    }
+
+private:
+    static constexpr std::string_view kTypes[] = {
+        R"("cmd")", R"("cmd")", R"("cmd")", R"("event")", R"("CMD")", R"("")", R"("\u0063md")", "7", "null", "{}",
+    };
+    // In range, past 2^53, past 2^64, negative, fractional; as numbers and
+    // as strings.
+    static constexpr std::string_view kCids[] = {
+        "0", "1", "42", "-0", "-1", "1.5", "1e3", "9007199254740991", "9007199254740993",
+        "18446744073709551615", "18446744073709551616", "1e20", "1e-5",
+        R"("7")", R"("0")", R"("-1")", R"("abc")", R"("")", R"(" 5")", R"("1.5")", R"("\u0035")",
+        R"("9007199254740993")", R"("18446744073709551615")", R"("18446744073709551616")",
+        R"("99999999999999999999999999")", "null", "true", "[]", "{}",
+    };
+    static constexpr std::string_view kTopics[] = {
+        R"("sync.ping.get")", R"("sync.hello.get")", R"("sync.auth.login.set")", R"("sync.auth.")",
+        R"("cmd.channel.set")", R"("event.x")", R"("")", R"("   ")", R"("\t\n")", R"("\u0073ync.ping.get")",
+        R"("sync.ping.get ")", "5", "null", "[]",
+    };
+    static constexpr std::string_view kUnknownKeys[] = {"x", "Type", "cid ", "\\u0074ype", ""};
+    static constexpr std::string_view kScalars[] = {
+        R"("s")", "1", "-2.5e2", "true", "false", "null", R"("caf\u00e9")", R"("\ud800 lone")",
+    };
+    static constexpr std::string_view kStrings[] = {
+        R"("")", R"("abc")", R"("  padded  ")", R"("\u00e9\u4e2d")", R"("\ud83d\ude00")", R"("\ud800 lone")",
+        "\"caf\xC3\xA9\"", R"("quote \" and \\")",
+    };
+
+    template <std::size_t N>
+    std::string_view pick(const std::string_view (&values)[N])
+    {
+        return values[static_cast<std::size_t>(below(static_cast<int>(N)))];
+    }
+
+    std::string space()
+    {
+        static constexpr std::string_view kSpaces[] = {"", "", "", " ", "\n  ", "\t"};
+        return std::string(pick(kSpaces));
+    }
+
+    std::string member(std::string_view key, std::string_view value)
+    {
+        return space() + "\"" + std::string(key) + "\"" + space() + ":" + space() + std::string(value);
+    }
+
+    // An object with clientId and authToken, either or both, and whatever
+    // else; or not an object at all.
+    std::string payload()
+    {
+        switch (below(8)) {
+        case 0:
+            return "[]";
+        case 1:
+            return R"("payload")";
+        case 2:
+            return "null";
+        case 3:
+            return "17";
+        default:
+            break;
+        }
+        std::string out = "{";
+        const int members = below(5);
+        for (int i = 0; i < members; ++i) {
+            if (i > 0)
+                out += ',';
+            switch (below(5)) {
+            case 0:
+                out += member("clientId", below(4) ? pick(kStrings) : pick(kScalars));
+                break;
+            case 1:
+                out += member("authToken", below(4) ? pick(kStrings) : pick(kScalars));
+                break;
+            case 2:
+                out += member("nested", R"({"clientId":"inner","list":[1,{"a":null}]})");
+                break;
+            default:
+                out += member(pick(kUnknownKeys), pick(kScalars));
+                break;
+            }
+        }
+        out += "}";
+        return out;
+    }
+
+    std::mt19937 m_random;
+};
+
+// Strings as the UTF-8 they go on to core as: a lone surrogate QJsonValue kept
+// became U+FFFD there, which is what the scan makes of it straight away.
+bool sameOutcome(const Outcome &a, const Outcome &b)
+{
+    return a.code == b.code && a.cid == b.cid && a.topic.toUtf8() == b.topic.toUtf8()
+        && a.clientId.toUtf8() == b.clientId.toUtf8() && a.authToken.toUtf8() == b.authToken.toUtf8()
+        && a.payload == b.payload;
+}
+
+void printOutcome(const char *label, const Outcome &outcome)
+{
+    std::fprintf(stderr,
+                 "%s code=%s cid=%s topic=%s clientId=%s authToken=%s payload=%s\n",
+                 label,
+                 outcome.code.empty() ? "(handed over)" : outcome.code.c_str(),
+                 outcome.cid ? std::to_string(*outcome.cid).c_str() : "(none)",
+                 qPrintable(outcome.topic),
+                 qPrintable(outcome.clientId),
+                 qPrintable(outcome.authToken),
+                 QJsonDocument(outcome.payload).toJson(QJsonDocument::Compact).constData());
+}
+
+bool checkEquivalence(unsigned seed)
+{
+    Generator generator(seed);
+    int handedOver = 0;
+    for (int i = 0; i < kFuzzCases; ++i) {
+        const std::string generated =
+            generator.below(3) > 0 ? generator.frame() : generator.mutate(generator.frame());
+        // A text frame reaches the shard as a QString and goes back to UTF-8;
+        // whatever was not UTF-8 is replaced on the way.
+        const QByteArray frame = fromUtf8(generated).toUtf8();
+        const bool authenticated = generator.below(2) == 0;
+
+        const Outcome expected = referenceOutcome(frame, authenticated);
+        const Outcome actual = scannedOutcome(frame, authenticated);
+        if (!sameOutcome(expected, actual)) {
+            std::fprintf(stderr, "case %d (%s): outcomes differ\nframe: %s\n", i,
+                         authenticated ? "authenticated" : "unauthenticated", frame.constData());
+            printOutcome("expected:", expected);
+            printOutcome("scanned: ", actual);
+            return false;
+        }
+        if (expected.code.empty())
+            ++handedOver;
+    }
+    std::printf("equivalence: %d frames, %d handed over, all matching (seed %u)\n", kFuzzCases, handedOver, seed);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const unsigned seed = argc > 1 ? static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10)) : 1u;
+    return checkEquivalence(seed) ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+// The replay ring across a stretch with replay turned off in place.
+//
+// The transport keeps numbering events while replay is off, and the ring forgets
+// where it stood when it is turned off. A client that last saw an event from
+// before the stretch must be refused - and get event.transport.resync - rather
+// than be replayed the events after it with the stretch silently missing. Exits
+// non-zero on the first failure.
+
+#include "replayring.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+using namespace phicore::transport::ws;
+
+namespace {
+
+constexpr std::size_t kMaxEntries = 16;
+constexpr std::size_t kMaxBytes = 1 << 20;
+
+int failures = 0;
+
+void expect(bool condition, const char *what)
+{
+    if (!condition) {
+        std::fprintf(stderr, "failed: %s\n", what);
+        ++failures;
+    }
+}
+
+// What replaying after `afterSeq` hands out, or nothing with `held` false.
+std::vector<std::uint64_t> replay(const ReplayRing<int> &ring, std::uint64_t afterSeq, bool *held)
+{
+    std::vector<std::uint64_t> seqs;
+    *held = ring.replayAfter(afterSeq, [&seqs](std::uint64_t seq, int) { seqs.push_back(seq); });
+    return seqs;
+}
+
+} // namespace
+
+int main()
+{
+    ReplayRing<int> ring(kMaxEntries, kMaxBytes);
+    // handleCoreEvent's counter: it moves on every event, replay on or off.
+    std::uint64_t nextSeq = 1000;
+    const auto publish = [&]() {
+        const std::uint64_t seq = nextSeq++;
+        ring.push(seq, 1, 0);
+        return seq;
+    };
+
+    for (int i = 0; i < 5; ++i)
+        publish();
+    bool held = false;
+    expect(replay(ring, 1001, &held) == std::vector<std::uint64_t>{1002, 1003, 1004} && held,
+           "a contiguous run is replayed");
+    const std::uint64_t seenBeforeOff = ring.lastSeq();
+
+    // Off: the events still take numbers, and the ring sees none of them.
+    ring.setLimits(0, kMaxBytes);
+    for (int i = 0; i < 3; ++i)
+        publish();
+    expect(ring.size() == 0, "turning replay off empties the ring");
+
+    // On again, before anything new: nothing from before can be vouched for.
+    ring.setLimits(kMaxEntries, kMaxBytes);
+    replay(ring, seenBeforeOff, &held);
+    expect(!held, "a resume from before the off stretch is refused before the next event");
+
+    // And after it: the numbers skipped over the stretch, so that is a gap.
+    const std::uint64_t first = publish();
+    expect(first == seenBeforeOff + 4, "the stretch used up numbers");
+    replay(ring, seenBeforeOff, &held);
+    expect(!held, "a resume from before the off stretch is refused after the next event");
+
+    // From within the new run, replay works as before.
+    publish();
+    expect(replay(ring, first, &held) == std::vector<std::uint64_t>{first + 1} && held,
+           "a resume from after the stretch is replayed");
+
+    if (failures == 0)
+        std::printf("replay refused across a stretch with replay off\n");
+    return failures == 0 ? 0 : 1;
+}